@@ -93,10 +93,18 @@ void runBenchmark(int id, pthread_barrier_t *barrier)
 }
 
 int main(int argc, char** argv) {
-    // Optional: Set the output location for the NanoLog system. By default
-    // the log will be output to /tmp/compressedLog
-    // NanoLog::setLogFile("/tmp/logFile");
-    NanoLog::setLogFile(BENCHMARK_OUTPUT_FILE);
+    // Optional: Set the output location and buffer sizes for the NanoLog
+    // system. By default the log will be output to ./compressedLog with the
+    // sizes in Config.h.
+    NanoLog::Config config;
+    config.logFile = BENCHMARK_OUTPUT_FILE;
+    config.stagingBufferSize = BENCHMARK_STAGING_BUFFER_SIZE;
+    config.initialStagingBufferSize = BENCHMARK_STAGING_BUFFER_SIZE;
+    config.outputBufferSize = BENCHMARK_OUTPUT_BUFFER_SIZE;
+    config.releaseThreshold = BENCHMARK_RELEASE_THRESHOLD;
+    config.pollIntervalNoWorkUs = BENCHMARK_POLL_INTERVAL_NO_WORK_US;
+    config.pollIntervalDuringIoUs = BENCHMARK_POLL_INTERVAL_DURING_IO_US;
+    NanoLog::init(config);
 
     printf("BENCH_OP = %s\r\n", BENCH_OPS_AS_A_STR);
 
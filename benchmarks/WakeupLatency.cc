@@ -0,0 +1,144 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * This file measures what the WakeupPolicies of the NanoLog background
+ * thread cost while the application doesn't log (CPU time and wakeups) and
+ * how long the background thread takes to pick up a log message after an
+ * idle period. Like Benchmark.cc, it breaks abstractions to get at hidden
+ * metrics.
+ */
+
+#define EXPOSE_PRIVATES
+
+#include <algorithm>
+#include <vector>
+
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Cycles.h"
+
+#ifdef PREPROCESSOR_NANOLOG
+#include "NanoLog.h"
+#else
+#include "NanoLogCpp17.h"
+#endif
+
+using namespace NanoLog::LogLevels;
+
+// How long the application idles while the idle costs are measured
+static const uint32_t IDLE_SECONDS = 2;
+
+// Idle periods before the log messages whose pickup latency is measured,
+// and the number of log messages measured after each
+static const uint32_t IDLE_GAPS_US[] = {10, 1000, 10000, 100000};
+static const int SAMPLES_PER_GAP = 50;
+
+/**
+ * Returns the CPU time that the process used so far in seconds.
+ */
+static double
+getCpuSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/**
+ * Returns the number of context switches of the process so far.
+ */
+static long
+getContextSwitches() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+int main(int argc, char** argv) {
+    NanoLog::Config config;
+    config.logFile = "/tmp/logFile";
+    config.durabilityMode = NanoLog::PAGE_CACHE;
+
+    const char *policy = (argc >= 2) ? argv[1] : "POLL";
+    if (strcmp(policy, "POLL") == 0) {
+        config.wakeupPolicy = NanoLog::POLL;
+    } else if (strcmp(policy, "ADAPTIVE_BACKOFF") == 0) {
+        config.wakeupPolicy = NanoLog::ADAPTIVE_BACKOFF;
+    } else if (strcmp(policy, "BUSY_POLL") == 0) {
+        config.wakeupPolicy = NanoLog::BUSY_POLL;
+    } else {
+        printf("Usage: %s [POLL|ADAPTIVE_BACKOFF|BUSY_POLL] "
+               "[compressionThreadCore]\r\n", argv[0]);
+        return 1;
+    }
+
+    if (argc >= 3)
+        config.compressionThreadCore = atoi(argv[2]);
+
+    NanoLog::init(config);
+    NanoLog::preallocate();
+    NANO_LOG(NOTICE, "Warming up");
+    NanoLog::sync();
+
+    // Updated by the background thread without synchronization, hence the
+    // volatile reads in the spin loop below.
+    volatile uint64_t *logsProcessed = &NanoLogInternal::RuntimeLogger::
+                                            nanoLogSingleton.logsProcessed;
+
+    // The logging thread sleeps, so nearly all the CPU time and context
+    // switches are the background thread's.
+    double cpuStart = getCpuSeconds();
+    long switchesStart = getContextSwitches();
+    sleep(IDLE_SECONDS);
+    double idleCpu = (getCpuSeconds() - cpuStart)/IDLE_SECONDS;
+    double idleSwitches = static_cast<double>(getContextSwitches()
+                                            - switchesStart)/IDLE_SECONDS;
+
+    printf("# Wakeup policy: %s\r\n", policy);
+    printf("# Idle CPU use: %0.2lf%% of a core, %0.0lf context switches/s"
+           "\r\n", 100*idleCpu, idleSwitches);
+    printf("# %10s %10s %10s %10s %10s\r\n",
+           "Idle(us)", "Min(us)", "Median(us)", "99th(us)", "Max(us)");
+
+    for (uint32_t gapUs : IDLE_GAPS_US) {
+        std::vector<double> latencies;
+        for (int i = 0; i < SAMPLES_PER_GAP; ++i) {
+            usleep(gapUs);
+
+            uint64_t logsBefore = *logsProcessed;
+            uint64_t start = PerfUtils::Cycles::rdtsc();
+            NANO_LOG(NOTICE, "Wakeup sample %d after %u us", i, gapUs);
+            // Yield rather than spin so that the wait doesn't take the core
+            // away from the background thread on machines with few cores.
+            while (*logsProcessed == logsBefore)
+                sched_yield();
+            latencies.push_back(1e6*PerfUtils::Cycles::toSeconds(
+                                    PerfUtils::Cycles::rdtsc() - start));
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        printf("%12u %10.2lf %10.2lf %10.2lf %10.2lf\r\n", gapUs,
+               latencies.front(), latencies[latencies.size()/2],
+               latencies[latencies.size()*99/100], latencies.back());
+    }
+
+    NanoLog::sync();
+    printf("%s", NanoLog::getStats().c_str());
+    return 0;
+}
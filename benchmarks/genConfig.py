@@ -89,7 +89,7 @@ clientConfigTemplate = """
 static constexpr const char BENCHMARK_OUTPUT_FILE[] = "%s";
 static const bool BENCHMARK_DISABLE_COMPACTION      = %s;
 
-// See documentation in NANO_LOG.h
+// Passed to NanoLog::init() (see NanoLog::Config in NanoLog.h)
 static const uint32_t BENCHMARK_STAGING_BUFFER_SIZE = 1<<%d;
 static const uint32_t BENCHMARK_OUTPUT_BUFFER_SIZE  = 1<<%d;
 static const uint32_t BENCHMARK_RELEASE_THRESHOLD   = 1<<%d;
@@ -147,7 +147,7 @@ libraryConfigTemplate = """
 
 namespace NanoLogConfig {
     // Controls in what mode the compressed log file will be opened
-    static const int FILE_PARAMS = O_APPEND|O_RDWR|O_CREAT|O_DSYNC;
+    static const int FILE_PARAMS = O_APPEND|O_RDWR|O_CREAT;
 
     // Location of the initial log file
     static constexpr const char* DEFAULT_LOG_FILE = BENCHMARK_OUTPUT_FILE;
@@ -157,6 +157,14 @@ namespace NanoLogConfig {
     // thread. This value should be large enough to handle bursts of activity.
     static const uint32_t STAGING_BUFFER_SIZE = BENCHMARK_STAGING_BUFFER_SIZE;
 
+    // StagingBuffers start out at their full size in the benchmarks so that
+    // growing them doesn't skew the measurements (see
+    // INITIAL_STAGING_BUFFER_SIZE in the default Config.h).
+    static const uint32_t INITIAL_STAGING_BUFFER_SIZE = STAGING_BUFFER_SIZE;
+
+    // How long a StagingBuffer must be idle before it's shrunk
+    static const uint32_t STAGING_BUFFER_SHRINK_IDLE_US = 1000000;
+
     // Determines the size of the output buffer used to store compressed log
     // messages. It should be at least 8MB large to amortize disk seeks and
     // shall not be smaller than STAGING_BUFFER_SIZE.
@@ -168,6 +176,14 @@ namespace NanoLogConfig {
         "OUTPUT_BUFFER_SIZE must be greater than or "
             "equal to the STAGING_BUFFER_SIZE");
 
+    // Number of OUTPUT_BUFFER_SIZE buffers that the compressed log is staged
+    // in. They're used as a ring: while one is being filled, up to all of the
+    // others can be in flight to the disk.
+    static const uint32_t NUM_OUTPUT_BUFFERS = 2;
+
+    static_assert(NUM_OUTPUT_BUFFERS >= 2,
+        "NUM_OUTPUT_BUFFERS must be at least 2");
+
     // The threshold at which the consumer should release space back to the
     // producer in the thread-local StagingBuffer. Due to the blocking nature
     // of the producer when it runs out of space, a low value will incur more
@@ -175,6 +191,68 @@ namespace NanoLogConfig {
     // the opposite effect.
     static const uint32_t RELEASE_THRESHOLD = BENCHMARK_RELEASE_THRESHOLD;
 
+    // Determines the byte size of the overflow segments that a logging thread
+    // spills its log messages into when its StagingBuffer is full. The
+    // segments are chained after the StagingBuffer and drained in order by
+    // the background thread. It may not be larger than STAGING_BUFFER_SIZE.
+    static const uint32_t SPILL_SEGMENT_SIZE =
+                            (STAGING_BUFFER_SIZE < (1<<18)) ? STAGING_BUFFER_SIZE
+                                                            : (1<<18);
+
+    // Upper bound on the memory used for overflow segments across all threads.
+    // Once it's reached, logging threads with a full StagingBuffer fall back
+    // to the OverflowPolicy (i.e. they block or drop). A value of 0 disables
+    // spilling altogether.
+    static const uint32_t SPILL_MEMORY_LIMIT = 1<<25;
+
+    // Upper bound on the byte size of the scratch space that a logging thread
+    // compresses its own backlog into when it would otherwise wait on the
+    // background thread to free up space in its StagingBuffer. It's sized
+    // after the StagingBuffer. A value of 0 disables producer-assisted
+    // compression.
+    static const uint32_t ASSIST_BUFFER_SIZE = STAGING_BUFFER_SIZE;
+
+    // Number of additional background threads that compress log messages in
+    // parallel with the main background thread. This requires a non-zero
+    // ASSIST_BUFFER_SIZE and is the default of
+    // NanoLog::Config::numCompressionWorkers.
+    static const uint32_t NUM_COMPRESSION_WORKERS = 0;
+
+    // Number of distinct log invocation sites for which a StagingBuffer keeps
+    // individual drop counts when log messages are dropped due to a full
+    // buffer (see NanoLog::DROP_ON_FULL).
+    static const uint32_t MAX_DROPPED_LOG_SITES = 8;
+
+    // How the output buffers and StagingBuffers are backed (see the
+    // corresponding options in the default Config.h)
+    static const bool USE_HUGE_PAGES = false;
+    static const bool PREFAULT_BUFFERS = false;
+    static const bool LOCK_BUFFERS = false;
+    static const bool NUMA_LOCAL_STAGING_BUFFERS = true;
+
+    // Maximum number of StagingBuffers of exited threads kept for reuse
+    // (see STAGING_BUFFER_POOL_SIZE in the default Config.h).
+    static const uint32_t STAGING_BUFFER_POOL_SIZE = 16;
+
+    // Shares one StagingBuffer among the logging threads on each CPU
+    // (see PER_CPU_STAGING_BUFFERS in the default Config.h).
+    static const bool PER_CPU_STAGING_BUFFERS = false;
+
+    // Backs the buffers with files that outlive a crash (see
+    // CRASH_RECOVERY_BUFFERS in the default Config.h).
+    static const bool CRASH_RECOVERY_BUFFERS = false;
+    static constexpr const char* CRASH_RECOVERY_DIR = "/dev/shm/nanolog";
+
+    // Leaves the compression and I/O to a separate nanologd process (see
+    // COMPRESSION_DAEMON in the default Config.h).
+    static const bool COMPRESSION_DAEMON = false;
+    static const uint32_t DAEMON_EXIT_TIMEOUT_MS = 1000;
+
+    // How often the background compression thread should check the
+    // StagingBuffers that it considers idle for log messages it may have
+    // missed (see IDLE_BUFFER_SCAN_INTERVAL_US in the default Config.h).
+    static const uint32_t IDLE_BUFFER_SCAN_INTERVAL_US = 100000;
+
     // How often should the background compression thread wake up to check
     // for more log messages in the StagingBuffers to compress and output.
     // Due to overheads in the kernel, this number will a lower bound and
@@ -188,6 +266,32 @@ namespace NanoLogConfig {
     // be a lower bound and the actual time spent sleeping may be higher.
     static const uint32_t POLL_INTERVAL_DURING_IO_US =
                                     BENCHMARK_POLL_INTERVAL_DURING_IO_US;
+
+    // Spin, PAUSE and sleep limits of the ADAPTIVE_BACKOFF wakeup policy
+    // (see the default Config.h)
+    static const uint32_t BACKOFF_SPIN_US = 50;
+    static const uint32_t BACKOFF_PAUSE_US = 200;
+    static const uint32_t BACKOFF_MAX_PAUSES = 1024;
+    static const uint32_t BACKOFF_MAX_SLEEP_US = 10000;
+
+    // The background compression thread batches its output until it holds
+    // FLUSH_MIN_BYTES or has waited FLUSH_MAX_DELAY_US (see the default
+    // Config.h), or FLUSH_LOG_LEVEL_MAX_DELAY_US for severe log messages.
+    static const uint32_t FLUSH_MIN_BYTES = 1<<20;
+    static const uint32_t FLUSH_MAX_DELAY_US = 5000;
+    static const uint32_t FLUSH_LOG_LEVEL_MAX_DELAY_US = 0;
+
+    // Sync interval of the PERIODIC_* durability modes and fallocate() chunk
+    // size (see the default Config.h).
+    static const uint32_t SYNC_INTERVAL_MS = 100;
+    static const uint32_t SYNC_INTERVAL_BYTES = 1<<24;
+    static const uint32_t FALLOCATE_CHUNK_SIZE = 0;
+
+    // Log rotation triggers and number of rotated files kept (see the
+    // default Config.h); the benchmarks don't rotate.
+    static const uint64_t ROTATE_MAX_BYTES = 0;
+    static const uint32_t ROTATE_MAX_AGE_SEC = 0;
+    static const uint32_t ROTATE_KEEP = 4;
 }
 
 #endif /* CONFIG_H */
@@ -0,0 +1,32 @@
+#! /bin/bash
+
+#####
+# Measures the idle CPU use of the NanoLog background thread and how long it
+# takes to pick up a log message after an idle period under each of the
+# WakeupPolicies. The benchmark runs with the defaults of ../runtime/Config.h,
+# so it's built without Benchmark.cc and genConfig.py.
+####
+declare -a POLICIES=(
+                "POLL"
+                "ADAPTIVE_BACKOFF"
+                "BUSY_POLL"
+                )
+
+# Optional core to pin the background thread to (e.g. for BUSY_POLL)
+CORE="$1"
+
+LOG_FILE="results/$(date +%Y%m%d%H%M%S)_wakeupLatency.txt"
+mkdir -p results
+
+make clean-all > /dev/null
+make -j10 wakeupLatency > /dev/null
+
+for POLICY in "${POLICIES[@]}"
+do
+    echo "Running WakeupPolicy=${POLICY}"
+    ./wakeupLatency $POLICY $CORE | tee -a $LOG_FILE
+    echo "" | tee -a $LOG_FILE
+done
+
+echo "# Done"
+date
@@ -468,7 +468,9 @@ inline {function_declaration} {{
     uint64_t timestamp = PerfUtils::Cycles::rdtsc();
     {strlen_declaration};
     size_t allocSize = {primitive_size_sum} {strlen_sum} sizeof({entry});
-    {entry} *re = reinterpret_cast<{entry}*>({alloc_fn}(allocSize));
+    {entry} *re = reinterpret_cast<{entry}*>({alloc_fn}(allocSize, {idVariableName}));
+    if (re == nullptr)
+        return;
 
     re->fmtId = {idVariableName};
     re->timestamp = timestamp;
@@ -483,7 +485,7 @@ inline {function_declaration} {{
     {recordStringsArgsCode}
 
     // Make the entry visible
-    {finishAlloc_fn}(allocSize);
+    {finishAlloc_fn}(allocSize, level);
 }}
 """.format(function_declaration = recordDeclaration,
        getLogLevelFn=LOG_LEVEL_GET_FN,
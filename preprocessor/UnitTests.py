@@ -557,7 +557,9 @@ inline void __syang0__fl{logId}(NanoLog::LogLevel level, const char* fmtStr ) {{
     uint64_t timestamp = PerfUtils::Cycles::rdtsc();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
-    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
+    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize, __fmtId{logId}));
+    if (re == nullptr)
+        return;
 
     re->fmtId = __fmtId{logId};
     re->timestamp = timestamp;
@@ -572,7 +574,7 @@ inline void __syang0__fl{logId}(NanoLog::LogLevel level, const char* fmtStr ) {{
     %s
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }}
 """ % ("", "")
         fg = FunctionGenerator()
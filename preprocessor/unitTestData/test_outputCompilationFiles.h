@@ -40,7 +40,9 @@ inline void __syang0__fl__A__mar46cc__293__(NanoLog::LogLevel level, const char*
     uint64_t timestamp = PerfUtils::Cycles::rdtsc();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
-    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
+    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize, __fmtId__A__mar46cc__293__));
+    if (re == nullptr)
+        return;
 
     re->fmtId = __fmtId__A__mar46cc__293__;
     re->timestamp = timestamp;
@@ -55,7 +57,7 @@ inline void __syang0__fl__A__mar46cc__293__(NanoLog::LogLevel level, const char*
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -125,7 +127,9 @@ inline void __syang0__fl__A__mar46h__1__(NanoLog::LogLevel level, const char* fm
     uint64_t timestamp = PerfUtils::Cycles::rdtsc();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
-    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
+    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize, __fmtId__A__mar46h__1__));
+    if (re == nullptr)
+        return;
 
     re->fmtId = __fmtId__A__mar46h__1__;
     re->timestamp = timestamp;
@@ -140,7 +144,7 @@ inline void __syang0__fl__A__mar46h__1__(NanoLog::LogLevel level, const char* fm
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -210,7 +214,9 @@ inline void __syang0__fl__B__mar46cc__294__(NanoLog::LogLevel level, const char*
     uint64_t timestamp = PerfUtils::Cycles::rdtsc();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
-    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
+    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize, __fmtId__B__mar46cc__294__));
+    if (re == nullptr)
+        return;
 
     re->fmtId = __fmtId__B__mar46cc__294__;
     re->timestamp = timestamp;
@@ -225,7 +231,7 @@ inline void __syang0__fl__B__mar46cc__294__(NanoLog::LogLevel level, const char*
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -295,7 +301,9 @@ inline void __syang0__fl__C__mar46cc__200__(NanoLog::LogLevel level, const char*
     uint64_t timestamp = PerfUtils::Cycles::rdtsc();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
-    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
+    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize, __fmtId__C__mar46cc__200__));
+    if (re == nullptr)
+        return;
 
     re->fmtId = __fmtId__C__mar46cc__200__;
     re->timestamp = timestamp;
@@ -310,7 +318,7 @@ inline void __syang0__fl__C__mar46cc__200__(NanoLog::LogLevel level, const char*
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -380,7 +388,9 @@ inline void __syang0__fl__D3237d__s46cc__100__(NanoLog::LogLevel level, const ch
     uint64_t timestamp = PerfUtils::Cycles::rdtsc();
     ;
     size_t allocSize = sizeof(arg0) +   sizeof(NanoLogInternal::Log::UncompressedEntry);
-    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
+    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize, __fmtId__D3237d__s46cc__100__));
+    if (re == nullptr)
+        return;
 
     re->fmtId = __fmtId__D3237d__s46cc__100__;
     re->timestamp = timestamp;
@@ -396,7 +406,7 @@ inline void __syang0__fl__D3237d__s46cc__100__(NanoLog::LogLevel level, const ch
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -469,7 +479,9 @@ inline void __syang0__fl__E32374s3237424642lf__s46cc__100__(NanoLog::LogLevel le
     uint64_t timestamp = PerfUtils::Cycles::rdtsc();
     size_t str0Len = 1 + strlen(arg0);;
     size_t allocSize = sizeof(arg1) + sizeof(arg2) + sizeof(arg3) +  str0Len +  sizeof(NanoLogInternal::Log::UncompressedEntry);
-    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
+    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize, __fmtId__E32374s3237424642lf__s46cc__100__));
+    if (re == nullptr)
+        return;
 
     re->fmtId = __fmtId__E32374s3237424642lf__s46cc__100__;
     re->timestamp = timestamp;
@@ -487,7 +499,7 @@ inline void __syang0__fl__E32374s3237424642lf__s46cc__100__(NanoLog::LogLevel le
     memcpy(buffer, arg0, str0Len); buffer += str0Len;*(reinterpret_cast<std::remove_const<typename std::remove_pointer<decltype(arg0)>::type>::type*>(buffer) - 1) = L'\0';
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -569,7 +581,9 @@ inline void __syang0__fl__E__del46cc__199__(NanoLog::LogLevel level, const char*
     uint64_t timestamp = PerfUtils::Cycles::rdtsc();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
-    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
+    NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize, __fmtId__E__del46cc__199__));
+    if (re == nullptr)
+        return;
 
     re->fmtId = __fmtId__E__del46cc__199__;
     re->timestamp = timestamp;
@@ -584,7 +598,7 @@ inline void __syang0__fl__E__del46cc__199__(NanoLog::LogLevel level, const char*
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -20,12 +20,17 @@
 #include <cstdint>
 
 /**
- * This file centralizes the Configuration Options that can be made to NanoLog
+ * This file centralizes the Configuration Options that can be made to NanoLog.
+ * The buffer sizes, poll intervals, number of compression workers and file
+ * flags are only the defaults of the corresponding NanoLog::Config settings,
+ * which can be changed at runtime with NanoLog::init(); the other options are
+ * fixed at compile time.
  */
 
 namespace NanoLogConfig {
-    // Controls in what mode the compressed log file will be opened
-    static const int FILE_PARAMS = O_APPEND|O_RDWR|O_CREAT|O_NOATIME|O_DSYNC;
+    // Controls in what mode the compressed log file will be opened. The
+    // flags of the NanoLog::Config::durabilityMode (e.g. O_DSYNC) are added.
+    static const int FILE_PARAMS = O_APPEND|O_RDWR|O_CREAT|O_NOATIME;
 
     // Location of the initial log file
     static const char DEFAULT_LOG_FILE[] = "./compressedLog";
@@ -35,6 +40,21 @@ namespace NanoLogConfig {
     // thread. This value should be large enough to handle bursts of activity.
     static const uint32_t STAGING_BUFFER_SIZE = 1<<20;
 
+    // Byte size that a thread's StagingBuffer starts out with. It's doubled
+    // (up to STAGING_BUFFER_SIZE) whenever the logging thread runs out of
+    // space, so threads that rarely log don't pay for a full-sized buffer.
+    // Threads known to log heavily can skip the growth steps by reserving a
+    // larger buffer up front with NanoLog::preallocate(size_t).
+    static const uint32_t INITIAL_STAGING_BUFFER_SIZE = 1<<14;
+
+    static_assert(INITIAL_STAGING_BUFFER_SIZE <= STAGING_BUFFER_SIZE,
+        "INITIAL_STAGING_BUFFER_SIZE may not exceed STAGING_BUFFER_SIZE");
+
+    // A StagingBuffer that has been idle for at least this long is halved in
+    // size (down to INITIAL_STAGING_BUFFER_SIZE or what was requested via
+    // NanoLog::preallocate(size_t)) when its thread next logs.
+    static const uint32_t STAGING_BUFFER_SHRINK_IDLE_US = 1000000;
+
     // Determines the size of the output buffer used to store compressed log
     // messages. It should be at least 8MB large to amortize disk seeks and
     // shall not be smaller than STAGING_BUFFER_SIZE.
@@ -46,6 +66,16 @@ namespace NanoLogConfig {
         "OUTPUT_BUFFER_SIZE must be greater than or "
             "equal to the STAGING_BUFFER_SIZE");
 
+    // Number of OUTPUT_BUFFER_SIZE buffers that the compressed log is staged
+    // in. They're used as a ring: while one is being filled, up to all of the
+    // others can be in flight to the disk. More buffers absorb more storage
+    // latency jitter before the background thread has to stop compressing
+    // and wait on the disk.
+    static const uint32_t NUM_OUTPUT_BUFFERS = 2;
+
+    static_assert(NUM_OUTPUT_BUFFERS >= 2,
+        "NUM_OUTPUT_BUFFERS must be at least 2");
+
     // The threshold at which the consumer should release space back to the
     // producer in the thread-local StagingBuffer. Due to the blocking nature
     // of the producer when it runs out of space, a low value will incur more
@@ -53,6 +83,141 @@ namespace NanoLogConfig {
     // the opposite effect.
     static const uint32_t RELEASE_THRESHOLD = STAGING_BUFFER_SIZE>>1;
 
+    // Determines the byte size of the overflow segments that a logging thread
+    // spills its log messages into when its StagingBuffer is full. The
+    // segments are chained after the StagingBuffer and drained in order by
+    // the background thread. It may not be larger than STAGING_BUFFER_SIZE.
+    static const uint32_t SPILL_SEGMENT_SIZE = 1<<18;
+
+    static_assert(SPILL_SEGMENT_SIZE <= STAGING_BUFFER_SIZE,
+        "SPILL_SEGMENT_SIZE must be less than or "
+            "equal to the STAGING_BUFFER_SIZE");
+
+    // Upper bound on the memory used for overflow segments across all threads.
+    // Once it's reached, logging threads with a full StagingBuffer fall back
+    // to the OverflowPolicy (i.e. they block or drop). This allows the
+    // StagingBuffers to be sized for the common case rather than the worst
+    // burst. A value of 0 disables spilling altogether.
+    static const uint32_t SPILL_MEMORY_LIMIT = 1<<25;
+
+    // Upper bound on the byte size of the scratch space that a logging thread
+    // compresses its own backlog into when it would otherwise wait on the
+    // background thread to free up space in its StagingBuffer. The background
+    // thread appends the compressed data to its output on its next visit to
+    // the StagingBuffer. The space is only allocated for threads that have
+    // blocked and is sized after their StagingBuffers, so it shrinks along
+    // with them. A value of 0 disables producer-assisted compression.
+    static const uint32_t ASSIST_BUFFER_SIZE = 1<<20;
+
+    static_assert(ASSIST_BUFFER_SIZE <= OUTPUT_BUFFER_SIZE,
+        "ASSIST_BUFFER_SIZE must be less than or "
+            "equal to the OUTPUT_BUFFER_SIZE");
+
+    // Number of additional background threads that compress log messages in
+    // parallel with the main background thread, which remains the only one
+    // that outputs to the log file. Each worker owns the shard of
+    // StagingBuffers whose id maps to it and steals from the other shards
+    // when its own is idle. The workers hand their compressed output to the
+    // main background thread via the StagingBuffers' assist space, so this
+    // requires a non-zero ASSIST_BUFFER_SIZE. This is the default of
+    // NanoLog::Config::numCompressionWorkers.
+    static const uint32_t NUM_COMPRESSION_WORKERS = 0;
+
+    static_assert(NUM_COMPRESSION_WORKERS == 0 || ASSIST_BUFFER_SIZE > 0,
+        "NUM_COMPRESSION_WORKERS requires a non-zero ASSIST_BUFFER_SIZE");
+
+    // Number of distinct log invocation sites for which a StagingBuffer keeps
+    // individual drop counts when log messages are dropped due to a full
+    // buffer (see NanoLog::DROP_ON_FULL). Drops at additional sites are only
+    // reflected in the total.
+    static const uint32_t MAX_DROPPED_LOG_SITES = 8;
+
+    // Backs the output buffers and StagingBuffers with 2 MB huge pages to cut
+    // down on TLB misses. Explicit huge pages (MAP_HUGETLB) are used for
+    // buffers of at least 2 MB when the system has some reserved (see
+    // /proc/sys/vm/nr_hugepages); otherwise transparent huge pages are
+    // requested with madvise().
+    static const bool USE_HUGE_PAGES = false;
+
+    // Faults in the pages of the output buffers and StagingBuffers when
+    // they're allocated rather than on first use. Together with
+    // NanoLog::preallocate(), this keeps page faults off of a thread's
+    // logging path (at least until its StagingBuffer grows).
+    static const bool PREFAULT_BUFFERS = false;
+
+    // Locks the output buffers and StagingBuffers in memory (mlock) so that
+    // they're never paged out. This is best effort and subject to the
+    // RLIMIT_MEMLOCK of the process.
+    static const bool LOCK_BUFFERS = false;
+
+    // Places the pages of each StagingBuffer on the NUMA node that its
+    // thread was running on when the StagingBuffer was allocated, rather
+    // than on the node of whichever thread touches them first (e.g. the
+    // compression thread for recycled StagingBuffers).
+    static const bool NUMA_LOCAL_STAGING_BUFFERS = true;
+
+    // Maximum number of StagingBuffers of exited threads that are kept for
+    // reuse by new threads rather than freed. Their storage is faulted in
+    // ahead of time, which spares applications that spawn short-lived
+    // logging threads (e.g. one per request) from allocating and faulting in
+    // a new StagingBuffer for each one. A value of 0 disables the reuse.
+    static const uint32_t STAGING_BUFFER_POOL_SIZE = 16;
+
+    // Replaces the per-thread StagingBuffers with one StagingBuffer per CPU
+    // that's shared by the logging threads running on it, so that memory use
+    // scales with the number of cores rather than the number of threads. This
+    // suits applications with thousands of threads that rarely log, at the
+    // cost of an atomic operation per log message. Each per-CPU buffer is
+    // STAGING_BUFFER_SIZE bytes and is allocated when a thread first logs on
+    // its CPU. They don't spill and are only compressed by the background
+    // compression thread. A thread that's preempted in the middle of a log
+    // statement holds up the compression of the buffer of its CPU until it
+    // runs again, so the other threads on that CPU may block or drop their
+    // log messages in the meantime.
+    static const bool PER_CPU_STAGING_BUFFERS = false;
+
+    // Backs the StagingBuffers and output buffers with files in a directory
+    // under CRASH_RECOVERY_DIR (which should be a tmpfs), whose headers track
+    // how far the buffers were filled and drained. If the process crashes,
+    // the log messages it left in them can then be written to its log file
+    // with "decompressor recover <directory>". This covers process crashes,
+    // not power loss, so the log file needs no O_DSYNC (see the PAGE_CACHE
+    // durability mode). The StagingBuffers are always STAGING_BUFFER_SIZE
+    // large; log messages in SpillSegments or in the assistBuffers of
+    // StagingBuffers, and C++17 NanoLog messages not yet compressed, can't be
+    // recovered.
+    static const bool CRASH_RECOVERY_BUFFERS = false;
+    static const char CRASH_RECOVERY_DIR[] = "/dev/shm/nanolog";
+    static_assert(!CRASH_RECOVERY_BUFFERS || !PER_CPU_STAGING_BUFFERS,
+            "The per-CPU StagingBuffers don't support crash recovery");
+
+    // Leaves the compression and I/O to a separate nanologd process, which
+    // serves all the processes on the host that run with this option. The
+    // StagingBuffers are the crash recovery buffers, which the nanologd maps
+    // to compress them into each process's log file, so the process neither
+    // runs a compression thread nor allocates output buffers. Only the
+    // preprocessor version of NanoLog can be compressed outside of the
+    // process, and the nanologd must be built with the same generated code.
+    // Since the nanologd can't reach the SpillSegments, logging threads block
+    // (or drop, see OverflowPolicy) when their StagingBuffer is full. At
+    // exit, the process waits up to DAEMON_EXIT_TIMEOUT_MS for the nanologd
+    // to drain its StagingBuffers and otherwise leaves them for it to drain.
+    static const bool COMPRESSION_DAEMON = false;
+    static const uint32_t DAEMON_EXIT_TIMEOUT_MS = 1000;
+    static_assert(!COMPRESSION_DAEMON || CRASH_RECOVERY_BUFFERS,
+            "COMPRESSION_DAEMON requires CRASH_RECOVERY_BUFFERS");
+    static_assert(!COMPRESSION_DAEMON || NUM_COMPRESSION_WORKERS == 0,
+            "The compression workers don't apply to COMPRESSION_DAEMON");
+
+    // How often the background compression thread should check the
+    // StagingBuffers that it considers idle for log messages it may have
+    // missed. In the common case, a logging thread notifies the background
+    // thread when it logs to an idle StagingBuffer, so this only bounds how
+    // long a message that raced with the buffer being marked idle can go
+    // unnoticed. The background thread always checks all StagingBuffers
+    // during a sync().
+    static const uint32_t IDLE_BUFFER_SCAN_INTERVAL_US = 100000;
+
     // How often should the background compression thread wake up to check
     // for more log messages in the StagingBuffers to compress and output.
     // Due to overheads in the kernel, this number will a lower bound and
@@ -64,6 +229,50 @@ namespace NanoLogConfig {
     // to complete. Due to overheads in the kernel, this number will
     // be a lower bound and the actual time spent sleeping may be higher.
     static const uint32_t POLL_INTERVAL_DURING_IO_US = 1;
+
+    // With the ADAPTIVE_BACKOFF wakeup policy, the background compression
+    // thread keeps checking for log messages for BACKOFF_SPIN_US after it
+    // last found some, then for BACKOFF_PAUSE_US more with exponentially
+    // more PAUSE instructions (up to BACKOFF_MAX_PAUSES) between the checks.
+    // After that it sleeps until a logging thread rings its doorbell by
+    // logging to an idle StagingBuffer, or BACKOFF_MAX_SLEEP_US have passed,
+    // which bounds how late its periodic work (see above) can be.
+    static const uint32_t BACKOFF_SPIN_US = 50;
+    static const uint32_t BACKOFF_PAUSE_US = 200;
+    static const uint32_t BACKOFF_MAX_PAUSES = 1024;
+    static const uint32_t BACKOFF_MAX_SLEEP_US = 10000;
+
+    // The background compression thread coalesces its output into fewer,
+    // larger writes: it only hands off an output buffer once it holds at
+    // least FLUSH_MIN_BYTES or the oldest compressed log message in it has
+    // waited FLUSH_MAX_DELAY_US, whichever comes first. A sync() or a full
+    // output buffer flush right away. Setting either value to 0 outputs every
+    // pass through the StagingBuffers as soon as possible.
+    static const uint32_t FLUSH_MIN_BYTES = 1<<20;
+    static const uint32_t FLUSH_MAX_DELAY_US = 5000;
+
+    // Output holding a log message at Config::flushLogLevel (ERROR by
+    // default) or a more severe one is flushed once it has waited
+    // FLUSH_LOG_LEVEL_MAX_DELAY_US instead, and the logging thread wakes up
+    // the background compression thread for it.
+    static const uint32_t FLUSH_LOG_LEVEL_MAX_DELAY_US = 0;
+
+    // The PERIODIC_* durability modes sync the log file every
+    // SYNC_INTERVAL_MS or SYNC_INTERVAL_BYTES written, whichever comes first.
+    static const uint32_t SYNC_INTERVAL_MS = 100;
+    static const uint32_t SYNC_INTERVAL_BYTES = 1<<24;
+
+    // Space for the log file is reserved with fallocate() in chunks of this
+    // many bytes ahead of the writes (e.g. 1<<26); 0 disables it. The space
+    // past the end of the log file is released when it's closed.
+    static const uint32_t FALLOCATE_CHUNK_SIZE = 0;
+
+    // The log file is rotated once it holds ROTATE_MAX_BYTES or has been
+    // open for ROTATE_MAX_AGE_SEC, keeping the ROTATE_KEEP most recent
+    // rotated files; a value of 0 disables the respective trigger.
+    static const uint64_t ROTATE_MAX_BYTES = 0;
+    static const uint32_t ROTATE_MAX_AGE_SEC = 0;
+    static const uint32_t ROTATE_KEEP = 4;
 }
 
 #endif /* CONFIG_H */
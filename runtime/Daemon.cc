@@ -0,0 +1,495 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
+
+#include "Daemon.h"
+#include "Fence.h"
+
+namespace NanoLogInternal {
+
+// Smallest size of the output buffer shared by the Clients; it's grown to
+// hold the largest StagingBuffer if necessary.
+static const size_t MIN_OUTPUT_BUFFER_SIZE = 1 << 22;
+
+/**
+ * Constructs a CompressionDaemon. The processes are found by scan().
+ *
+ * \param directory
+ *      Directory that the processes keep their buffers in (see
+ *      NanoLogConfig::CRASH_RECOVERY_DIR)
+ */
+CompressionDaemon::CompressionDaemon(const char *directory)
+    : directory(directory)
+    , clients()
+    , output(MIN_OUTPUT_BUFFER_SIZE)
+    , numClientsExited(0)
+    , logsProcessed(0)
+    , bytesWritten(0)
+    , bytesLost(0)
+{
+}
+
+CompressionDaemon::~CompressionDaemon()
+{
+    for (auto &entry : clients)
+        delete entry.second;
+    clients.clear();
+}
+
+/**
+ * Constructs a Client, whose buffers and log file are picked up later.
+ *
+ * \param directory
+ *      Directory that the process keeps its buffers in
+ * \param pid
+ *      Process id of the process
+ * \param startTime
+ *      When the process started (see Recovery::getProcessStartTime())
+ */
+CompressionDaemon::Client::Client(const std::string &directory, pid_t pid,
+                                  uint64_t startTime)
+    : directory(directory)
+    , pid(pid)
+    , startTime(startTime)
+    , exited(false)
+    , buffers()
+    , logFileRecordInode(0)
+    , logFileName()
+    , fd(-1)
+    , encoder(nullptr)
+    , pending()
+{
+}
+
+CompressionDaemon::Client::~Client()
+{
+    for (auto &entry : buffers)
+        munmap(entry.second, Recovery::HEADER_SIZE + entry.second->capacity);
+    buffers.clear();
+
+    delete encoder;
+    if (fd >= 0)
+        close(fd);
+}
+
+/**
+ * Looks for processes that started or exited and for StagingBuffers that
+ * were created or deleted since the last invocation. This reads the
+ * directories, so it should be invoked periodically rather than before
+ * every poll().
+ */
+void
+CompressionDaemon::scan()
+{
+    DIR *d = opendir(directory.c_str());
+    if (d != nullptr) {
+        while (struct dirent *entry = readdir(d)) {
+            std::string name = entry->d_name;
+            if (clients.find(name) != clients.end())
+                continue;
+
+            // Only the processes running with COMPRESSION_DAEMON register;
+            // the others' directories are left for "decompressor recover".
+            std::string clientDir = directory + "/" + name;
+            std::string registration = clientDir + "/" +
+                                       Recovery::DAEMON_CLIENT_FILE_NAME;
+            pid_t pid = static_cast<pid_t>(strtol(name.c_str(), nullptr, 10));
+            FILE *file = (pid > 0) ? fopen(registration.c_str(), "r")
+                                   : nullptr;
+            if (file == nullptr)
+                continue;
+
+            unsigned long long startTime = 0;
+            int numRead = fscanf(file, "%llu", &startTime);
+            fclose(file);
+            if (numRead != 1)
+                continue;
+
+            clients[name] = new Client(clientDir, pid, startTime);
+        }
+
+        closedir(d);
+    }
+
+    for (auto it = clients.begin(); it != clients.end(); ) {
+        Client *client = it->second;
+
+        // The process deletes its directory when it exits after all its
+        // log messages were compressed.
+        if (access(client->directory.c_str(), F_OK) != 0) {
+            delete client;
+            it = clients.erase(it);
+            continue;
+        }
+
+        // The buffers are mapped afterwards so that the final poll() of an
+        // exited process sees all of them. A process whose id was reused
+        // by another one has a different start time.
+        if (Recovery::getProcessStartTime(client->pid) != client->startTime)
+            client->exited = true;
+
+        mapBuffers(client);
+        ++it;
+    }
+}
+
+/**
+ * Maps the buffer files of a process that weren't mapped yet and unmaps the
+ * ones whose files were deleted.
+ *
+ * \param client
+ *      Process to map the buffers of
+ */
+void
+CompressionDaemon::mapBuffers(Client *client)
+{
+    DIR *d = opendir(client->directory.c_str());
+    if (d == nullptr)
+        return;
+
+    std::set<uint32_t> fileIndexes;
+    const size_t prefixLength = strlen(Recovery::BUFFER_FILE_PREFIX);
+    while (struct dirent *entry = readdir(d)) {
+        if (strncmp(entry->d_name, Recovery::BUFFER_FILE_PREFIX,
+                    prefixLength) != 0)
+            continue;
+
+        uint32_t fileIndex = static_cast<uint32_t>(
+                            strtoul(entry->d_name + prefixLength, nullptr, 10));
+        fileIndexes.insert(fileIndex);
+        if (client->buffers.find(fileIndex) != client->buffers.end())
+            continue;
+
+        // A buffer that's still being created is picked up by the next scan
+        Recovery::BufferHeader *header = Recovery::mapBufferFile(
+                        client->directory + "/" + entry->d_name, true);
+        if (header != nullptr)
+            client->buffers[fileIndex] = header;
+    }
+
+    closedir(d);
+
+    for (auto it = client->buffers.begin(); it != client->buffers.end(); ) {
+        if (fileIndexes.count(it->first) > 0) {
+            ++it;
+            continue;
+        }
+
+        munmap(it->second, Recovery::HEADER_SIZE + it->second->capacity);
+        it = client->buffers.erase(it);
+    }
+}
+
+/**
+ * Picks up the log file that a process recorded (see Recovery::recordLogFile)
+ * when it's first seen and whenever it switches log files.
+ *
+ * \param client
+ *      Process to check
+ *
+ * \return
+ *      False if the process has yet to record a log file
+ */
+bool
+CompressionDaemon::checkLogFile(Client *client)
+{
+    // The record is replaced by a rename, which gives it a new inode
+    std::string recordFile = client->directory + "/" +
+                             Recovery::LOG_FILE_NAME;
+    struct stat st;
+    if (stat(recordFile.c_str(), &st) != 0 ||
+            st.st_ino == client->logFileRecordInode)
+        return !client->logFileName.empty();
+
+    FILE *file = fopen(recordFile.c_str(), "r");
+    char path[PATH_MAX] = {};
+    if (file == nullptr || fgets(path, sizeof(path), file) == nullptr) {
+        if (file != nullptr)
+            fclose(file);
+        return !client->logFileName.empty();
+    }
+
+    fclose(file);
+    client->logFileRecordInode = st.st_ino;
+    if (client->logFileName == path)
+        return true;
+
+    // The log messages from now on go to the new file, which is opened
+    // (with a new Checkpoint) once there's something to write to it.
+    delete client->encoder;
+    client->encoder = nullptr;
+    if (client->fd >= 0)
+        close(client->fd);
+    client->fd = -1;
+    client->logFileName = path;
+    return true;
+}
+
+/**
+ * Writes what was encoded for a process to its log file and then releases
+ * the log messages it was encoded from in the StagingBuffers. Output that
+ * can't be written is reported and discarded, so that the process doesn't
+ * block forever on a broken log file.
+ *
+ * \param client
+ *      Process whose output to write
+ *
+ * \return
+ *      False if the output couldn't be written
+ */
+bool
+CompressionDaemon::flush(Client *client)
+{
+    bool success = true;
+    size_t nbytes = 0;
+    if (client->encoder != nullptr) {
+        nbytes = client->encoder->getEncodedBytes();
+        client->encoder->swapBuffer(output.data(), output.size());
+    }
+
+    const char *buffer = output.data();
+    while (nbytes > 0) {
+        ssize_t ret = write(client->fd, buffer, nbytes);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            fprintf(stderr, "nanologd could not write to %s: %s\r\n",
+                    client->logFileName.c_str(), strerror(errno));
+            bytesLost += nbytes;
+            success = false;
+            break;
+        }
+
+        buffer += ret;
+        nbytes -= static_cast<size_t>(ret);
+        bytesWritten += static_cast<uint64_t>(ret);
+    }
+
+    // Make sure the reads of the log messages finish before their release
+    Fence::lfence();
+    for (auto &release : client->pending)
+        release.first->consumerOffset = release.second;
+    client->pending.clear();
+
+    return success;
+}
+
+/**
+ * Compresses the log messages in all the StagingBuffers of a process into its
+ * log file.
+ *
+ * \param client
+ *      Process to compress the StagingBuffers of
+ *
+ * \return
+ *      Number of bytes consumed from the StagingBuffers
+ */
+uint64_t
+CompressionDaemon::compressClient(Client *client)
+{
+    if (!checkLogFile(client))
+        return 0;
+
+    // The output buffer must hold the largest log message, like the one of
+    // the compression thread.
+    uint64_t maxCapacity = 0;
+    for (auto &entry : client->buffers)
+        maxCapacity = std::max<uint64_t>(maxCapacity, entry.second->capacity);
+    if (output.size() < maxCapacity)
+        output.resize(maxCapacity);
+
+    if (client->encoder != nullptr)
+        client->encoder->swapBuffer(output.data(), output.size());
+
+    // Every pass through the StagingBuffers starts a new round for the
+    // decompressor to sort the log messages in.
+    bool wrapAround = true;
+    uint64_t bytesConsumed = 0;
+    for (auto &entry : client->buffers)
+        bytesConsumed += compressStagingBuffer(client, entry.second,
+                                               &wrapAround);
+
+    flush(client);
+    return bytesConsumed;
+}
+
+/**
+ * Compresses the log messages in a StagingBuffer of a process. The space is
+ * released by the flush() of the output they were encoded into.
+ *
+ * \param client
+ *      Process that the StagingBuffer belongs to
+ * \param header
+ *      Header of the StagingBuffer, which is followed by its storage
+ * \param[in/out] wrapAround
+ *      True means that the next log messages encoded start a new pass
+ *      through the StagingBuffers (see Log::Encoder::encodeLogMsgs())
+ *
+ * \return
+ *      Number of bytes consumed from the StagingBuffer
+ */
+uint64_t
+CompressionDaemon::compressStagingBuffer(Client *client,
+                                         Recovery::BufferHeader *header,
+                                         bool *wrapAround)
+{
+    // Take a consistent snapshot of the header, which may be reset for a
+    // new thread underneath us (see Recovery::BufferHeader::version). The
+    // producer publishes endOffset before it wraps around.
+    uint32_t version = header->version;
+    Fence::lfence();
+    if ((version & 1) != 0 || header->type != Recovery::STAGING_BUFFER)
+        return 0;
+
+    uint32_t bufferId = header->bufferId;
+    uint64_t capacity = header->capacity;
+    uint64_t consumer = header->consumerOffset;
+    uint64_t producer = header->producerOffset;
+    Fence::lfence();
+    uint64_t end = header->endOffset;
+    Fence::lfence();
+    if (header->version != version)
+        return 0;
+
+    producer = std::min(producer, capacity);
+    consumer = std::min(consumer, capacity);
+    end = std::min(end, capacity);
+    if (producer == consumer)
+        return 0;
+
+    if (client->encoder == nullptr) {
+        client->fd = open(client->logFileName.c_str(),
+                          O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+        if (client->fd < 0) {
+            fprintf(stderr, "nanologd could not open the log file %s: %s\r\n",
+                    client->logFileName.c_str(), strerror(errno));
+        } else {
+            client->encoder = new Log::Encoder(output.data(), output.size(),
+                                        false, false,
+                                        static_cast<uint32_t>(capacity/2));
+        }
+    }
+
+    // The log messages run from the consumer to the producer, wrapping
+    // around at the end of the recorded space if the producer already did.
+    char *storage = reinterpret_cast<char*>(header) + Recovery::HEADER_SIZE;
+    bool wrapped = (producer < consumer);
+    uint64_t pos = consumer;
+    uint64_t limit = wrapped ? std::max(end, consumer) : producer;
+    uint64_t bytesConsumed = 0;
+    client->pending.emplace_back(header, consumer);
+
+    while (true) {
+        if (pos == limit) {
+            if (!wrapped || limit == producer)
+                break;
+
+            // Roll over like StagingBuffer::peek()
+            pos = 0;
+            limit = producer;
+            client->pending.back().second = 0;
+            continue;
+        }
+
+        long bytesRead = 0;
+#ifdef PREPROCESSOR_NANOLOG
+        if (client->encoder != nullptr)
+            bytesRead = client->encoder->encodeLogMsgs(storage + pos,
+                                                       limit - pos,
+                                                       bufferId,
+                                                       *wrapAround,
+                                                       &logsProcessed);
+#else
+        // Only the process itself can compress C++17 NanoLog messages
+        (void)storage;
+        (void)bufferId;
+#endif // PREPROCESSOR_NANOLOG
+
+        if (bytesRead > 0) {
+            *wrapAround = false;
+            pos += static_cast<uint64_t>(bytesRead);
+            bytesConsumed += static_cast<uint64_t>(bytesRead);
+            client->pending.back().second = pos;
+            continue;
+        }
+
+        // The output buffer is full; write it out and continue from there
+        if (client->encoder != nullptr &&
+                client->encoder->getEncodedBytes() > 0) {
+            flush(client);
+            client->pending.emplace_back(header, pos);
+            continue;
+        }
+
+        // The rest can't be compressed (or there's no log file to write it
+        // to), so it's discarded.
+        bytesLost += limit - pos;
+        bytesConsumed += limit - pos;
+        pos = limit;
+        client->pending.back().second = pos;
+    }
+
+    return bytesConsumed;
+}
+
+/**
+ * Compresses the log messages in the StagingBuffers of all the processes
+ * into their log files. The processes that exited are drained one last time
+ * and forgotten along with their directories.
+ *
+ * \return
+ *      Number of bytes consumed from the StagingBuffers; 0 means there was
+ *      no work.
+ */
+uint64_t
+CompressionDaemon::poll()
+{
+    uint64_t bytesConsumed = 0;
+    for (auto it = clients.begin(); it != clients.end(); ) {
+        Client *client = it->second;
+        bytesConsumed += compressClient(client);
+        if (!client->exited) {
+            ++it;
+            continue;
+        }
+
+        // Without a log file, the buffers are left for "decompressor recover"
+        if (!client->logFileName.empty()) {
+            Recovery::removeDirectory(client->directory);
+            ++numClientsExited;
+        }
+
+        delete client;
+        it = clients.erase(it);
+    }
+
+    return bytesConsumed;
+}
+
+}; // namespace NanoLogInternal
@@ -0,0 +1,169 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef NANOLOG_DAEMON_H
+#define NANOLOG_DAEMON_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "Log.h"
+#include "Recovery.h"
+
+namespace NanoLogInternal {
+
+/**
+ * The CompressionDaemon does the work of the compression thread for the
+ * processes that run with NanoLogConfig::COMPRESSION_DAEMON, i.e. it's the
+ * heart of the nanologd. It finds the processes by the directories that hold
+ * their crash recovery buffers, maps their StagingBuffers and compresses the
+ * log messages in them into each process's log file. The progress is
+ * published back in the headers of the StagingBuffers, which frees up the
+ * space for the logging threads.
+ *
+ * Each process gets a log file of its own, which starts a new Checkpoint
+ * whenever the CompressionDaemon (re)opens it. After a process has exited,
+ * its StagingBuffers are drained one last time and its directory is deleted.
+ *
+ * The CompressionDaemon is not thread-safe.
+ */
+class CompressionDaemon {
+  public:
+    explicit CompressionDaemon(const char *directory);
+    ~CompressionDaemon();
+
+    void scan();
+    uint64_t poll();
+
+    /**
+     * Returns the number of processes whose StagingBuffers are compressed
+     */
+    size_t
+    getNumClients() {
+        return clients.size();
+    }
+
+    /**
+     * Returns the number of processes that exited and were drained
+     */
+    uint64_t
+    getNumClientsExited() {
+        return numClientsExited;
+    }
+
+    /**
+     * Returns the number of log messages compressed
+     */
+    uint64_t
+    getLogsProcessed() {
+        return logsProcessed;
+    }
+
+    /**
+     * Returns the number of bytes written to the log files
+     */
+    uint64_t
+    getBytesWritten() {
+        return bytesWritten;
+    }
+
+    /**
+     * Returns the number of bytes in the StagingBuffers that were discarded
+     * since they couldn't be compressed or written
+     */
+    uint64_t
+    getBytesLost() {
+        return bytesLost;
+    }
+
+  PRIVATE:
+    /**
+     * A process whose StagingBuffers are compressed
+     */
+    class Client {
+      public:
+        Client(const std::string &directory, pid_t pid, uint64_t startTime);
+        ~Client();
+
+        // Directory of the process under the CompressionDaemon's directory
+        std::string directory;
+
+        // Process id and start time (see Recovery::getProcessStartTime()),
+        // which are used to tell whether the process exited
+        pid_t pid;
+        uint64_t startTime;
+
+        // Set once the process exited
+        bool exited;
+
+        // Headers of the mapped StagingBuffers by their fileIndex; each is
+        // followed by its storage and mapped HEADER_SIZE + capacity bytes
+        std::map<uint32_t, Recovery::BufferHeader*> buffers;
+
+        // Inode of the file that the log file was last read from, which
+        // changes when the process switches log files
+        ino_t logFileRecordInode;
+
+        // Log file that the process logs to and its descriptor; -1 until
+        // there's something to write
+        std::string logFileName;
+        int fd;
+
+        // Encodes the log messages of the process; it's created along with
+        // the fd so that each log file starts with a Checkpoint.
+        Log::Encoder *encoder;
+
+        // StagingBuffers whose consumerOffset is to be advanced once the
+        // output encoded from them is written, and the offsets
+        std::vector<std::pair<Recovery::BufferHeader*, uint64_t>> pending;
+
+        DISALLOW_COPY_AND_ASSIGN(Client);
+    };
+
+    void mapBuffers(Client *client);
+    bool checkLogFile(Client *client);
+    bool flush(Client *client);
+    uint64_t compressClient(Client *client);
+    uint64_t compressStagingBuffer(Client *client,
+                                   Recovery::BufferHeader *header,
+                                   bool *wrapAround);
+
+    // Directory that holds the directories of the processes
+    std::string directory;
+
+    // Processes known by their directory names
+    std::map<std::string, Client*> clients;
+
+    // Output buffer that the Encoders of all the Clients encode into; it's
+    // written to the log file of a Client before moving on to the next.
+    std::vector<char> output;
+
+    // Metrics (see getters)
+    uint64_t numClientsExited;
+    uint64_t logsProcessed;
+    uint64_t bytesWritten;
+    uint64_t bytesLost;
+
+    DISALLOW_COPY_AND_ASSIGN(CompressionDaemon);
+};
+
+}; // namespace NanoLogInternal
+
+#endif // NANOLOG_DAEMON_H
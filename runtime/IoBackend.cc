@@ -0,0 +1,432 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <linux/io_uring.h>
+
+#include "IoBackend.h"
+
+namespace NanoLogInternal {
+
+/**
+ * Constructs a PosixAioBackend.
+ *
+ * \param maxOutstanding
+ *      Maximum number of writes that may be in flight at the same time
+ */
+PosixAioBackend::PosixAioBackend(uint32_t maxOutstanding)
+    : IoBackend(maxOutstanding)
+    , requests(maxOutstanding)
+{
+}
+
+/**
+ * Destructor; waits for the outstanding writes since the POSIX AIO library
+ * still references their control blocks.
+ */
+PosixAioBackend::~PosixAioBackend()
+{
+    while (numOutstanding > 0)
+        waitForWrite();
+}
+
+bool
+PosixAioBackend::submitWrite(int fd, const char *buffer, size_t nbytes,
+                             off_t offset, bool datasync)
+{
+    if (numOutstanding == maxOutstanding) {
+        errno = EBUSY;
+        return false;
+    }
+
+    Request &request = requests[nextSlot()];
+    memset(&request.write, 0, sizeof(request.write));
+    request.write.aio_fildes = fd;
+    request.write.aio_buf = const_cast<char*>(buffer);
+    request.write.aio_nbytes = nbytes;
+    request.write.aio_offset = offset;
+    if (aio_write(&request.write) == -1)
+        return false;
+
+    // The POSIX AIO library queues the writes and syncs of a file descriptor
+    // in order, so the sync covers the write above.
+    request.datasync = false;
+    request.syncSubmitError = 0;
+    if (datasync) {
+        memset(&request.sync, 0, sizeof(request.sync));
+        request.sync.aio_fildes = fd;
+        if (aio_fsync(O_DSYNC, &request.sync) == -1)
+            request.syncSubmitError = errno;
+        else
+            request.datasync = true;
+    }
+
+    ++numOutstanding;
+    return true;
+}
+
+bool
+PosixAioBackend::isWriteComplete()
+{
+    if (numOutstanding == 0)
+        return false;
+
+    Request &request = requests[oldest];
+    if (aio_error(&request.write) == EINPROGRESS)
+        return false;
+
+    return !request.datasync || aio_error(&request.sync) != EINPROGRESS;
+}
+
+ssize_t
+PosixAioBackend::waitForWrite()
+{
+    Request &request = requests[oldest];
+    while (!isWriteComplete()) {
+        const struct aiocb *list[2];
+        int n = 0;
+        if (aio_error(&request.write) == EINPROGRESS)
+            list[n++] = &request.write;
+        if (request.datasync && aio_error(&request.sync) == EINPROGRESS)
+            list[n++] = &request.sync;
+
+        if (aio_suspend(list, n, NULL) != 0 && errno != EINTR) {
+            perror("LogCompressor's Posix AIO suspend operation failed");
+            break;
+        }
+    }
+
+    int err = aio_error(&request.write);
+    ssize_t result = aio_return(&request.write);
+    if (err != 0)
+        result = -err;
+
+    if (request.datasync) {
+        err = aio_error(&request.sync);
+        aio_return(&request.sync);
+        if (err != 0 && result >= 0)
+            result = -err;
+    } else if (request.syncSubmitError != 0 && result >= 0) {
+        result = -request.syncSubmitError;
+    }
+
+    oldest = (oldest + 1) % maxOutstanding;
+    --numOutstanding;
+    return result;
+}
+
+/**
+ * Constructs an IoUringBackend; use create() so that a failure to set up the
+ * io_uring instance can be handled.
+ *
+ * \param maxOutstanding
+ *      Maximum number of writes that may be in flight at the same time
+ */
+IoUringBackend::IoUringBackend(uint32_t maxOutstanding)
+    : IoBackend(maxOutstanding)
+    , requests(maxOutstanding)
+    , ringFd(-1)
+    , sqRing(MAP_FAILED)
+    , cqRing(MAP_FAILED)
+    , sqes(static_cast<io_uring_sqe*>(MAP_FAILED))
+    , sqRingBytes(0)
+    , cqRingBytes(0)
+    , sqesBytes(0)
+    , sqTail(nullptr)
+    , sqMask(nullptr)
+    , sqArray(nullptr)
+    , cqHead(nullptr)
+    , cqTail(nullptr)
+    , cqMask(nullptr)
+    , cqes(nullptr)
+    , enterFailed(false)
+{
+}
+
+/**
+ * Creates an IoUringBackend.
+ *
+ * \param maxOutstanding
+ *      Maximum number of writes that may be in flight at the same time
+ *
+ * \return
+ *      The new IoUringBackend, or nullptr if io_uring is not available
+ *      (i.e. it's not supported by the kernel or disabled by a seccomp
+ *      filter or sysctl), in which case the caller should fall back to
+ *      another IoBackend.
+ */
+IoUringBackend *
+IoUringBackend::create(uint32_t maxOutstanding)
+{
+    IoUringBackend *backend = new IoUringBackend(maxOutstanding);
+    if (!backend->setup()) {
+        delete backend;
+        return nullptr;
+    }
+
+    return backend;
+}
+
+/**
+ * Destructor; waits for the outstanding writes before tearing down the
+ * io_uring instance, since the kernel still references their buffers.
+ */
+IoUringBackend::~IoUringBackend()
+{
+    if (cqes != nullptr) {
+        while (numOutstanding > 0)
+            waitForWrite();
+    }
+
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqesBytes);
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+        munmap(cqRing, cqRingBytes);
+    if (sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingBytes);
+    if (ringFd >= 0)
+        close(ringFd);
+}
+
+/**
+ * Creates the io_uring instance and maps its rings into memory.
+ *
+ * \return
+ *      True on success, false if io_uring is not available
+ */
+bool
+IoUringBackend::setup()
+{
+#ifdef __NR_io_uring_setup
+    // Each write may need a second entry for its fdatasync
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = static_cast<int>(syscall(__NR_io_uring_setup,
+                                      2*maxOutstanding, &params));
+    if (ringFd < 0)
+        return false;
+
+    sqRingBytes = params.sq_off.array + params.sq_entries*sizeof(uint32_t);
+    cqRingBytes = params.cq_off.cqes +
+                                params.cq_entries*sizeof(io_uring_cqe);
+    bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if (singleMmap) {
+        sqRingBytes = std::max(sqRingBytes, cqRingBytes);
+        cqRingBytes = sqRingBytes;
+    }
+
+    sqRing = mmap(NULL, sqRingBytes, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+        return false;
+
+    if (singleMmap) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(NULL, cqRingBytes, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+            return false;
+    }
+
+    sqesBytes = params.sq_entries*sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(mmap(NULL, sqesBytes,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                IORING_OFF_SQES));
+    if (sqes == MAP_FAILED)
+        return false;
+
+    char *sq = static_cast<char*>(sqRing);
+    sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char*>(cqRing);
+    cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool
+IoUringBackend::submitWrite(int fd, const char *buffer, size_t nbytes,
+                            off_t offset, bool datasync)
+{
+    if (numOutstanding == maxOutstanding) {
+        errno = EBUSY;
+        return false;
+    }
+
+    uint32_t slot = nextSlot();
+    Request &request = requests[slot];
+    request.iov.iov_base = const_cast<char*>(buffer);
+    request.iov.iov_len = nbytes;
+    request.writeResult = 0;
+    request.syncResult = 0;
+    request.pendingCompletions = (datasync) ? 2 : 1;
+
+    // Only this thread produces submission queue entries, so the tail can
+    // be read without synchronization. Since at most 2*maxOutstanding
+    // entries are ever in flight, there's always room for them.
+    uint32_t tail = *sqTail;
+    uint32_t index = tail & *sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&request.iov);
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = 2*slot;
+    sqArray[index] = index;
+    ++tail;
+
+    // The link makes the kernel start the fdatasync only after the write
+    // completed (and cancel it if the write failed).
+    if (datasync) {
+        sqe->flags |= IOSQE_IO_LINK;
+        index = tail & *sqMask;
+        sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = 2*slot + 1;
+        sqArray[index] = index;
+        ++tail;
+    }
+
+    uint32_t numEntries = request.pendingCompletions;
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+    while (numEntries > 0) {
+        long ret = syscall(__NR_io_uring_enter, ringFd, numEntries, 0, 0,
+                           NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                // The kernel is short on resources; reaping completions
+                // frees some up.
+                reapCompletions();
+                sched_yield();
+                continue;
+            }
+
+            // Take back the entries that the kernel hasn't consumed; if it
+            // did take the write, it's outstanding but its sync failed.
+            int err = errno;
+            __atomic_store_n(sqTail, tail - numEntries, __ATOMIC_RELEASE);
+            if (numEntries == request.pendingCompletions) {
+                errno = err;
+                return false;
+            }
+
+            request.pendingCompletions -= numEntries;
+            request.syncResult = -err;
+            break;
+        }
+
+        numEntries -= static_cast<uint32_t>(ret);
+    }
+
+    ++numOutstanding;
+    return true;
+}
+
+/**
+ * Consumes the entries in the completion queue, recording their results
+ * in the corresponding Requests. Doesn't enter the kernel.
+ */
+void
+IoUringBackend::reapCompletions()
+{
+    uint32_t head = *cqHead;
+    uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return;
+
+    for (; head != tail; ++head) {
+        io_uring_cqe *cqe = &cqes[head & *cqMask];
+        Request &request = requests[cqe->user_data/2];
+        if (cqe->user_data % 2 == 0)
+            request.writeResult = cqe->res;
+        else
+            request.syncResult = cqe->res;
+        --request.pendingCompletions;
+    }
+
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+bool
+IoUringBackend::isWriteComplete()
+{
+    if (numOutstanding == 0)
+        return false;
+
+    reapCompletions();
+    return requests[oldest].pendingCompletions == 0;
+}
+
+ssize_t
+IoUringBackend::waitForWrite()
+{
+    Request &request = requests[oldest];
+    reapCompletions();
+    while (request.pendingCompletions > 0) {
+        if (enterFailed) {
+            usleep(POLL_INTERVAL_US);
+            reapCompletions();
+            continue;
+        }
+
+        long ret = syscall(__NR_io_uring_enter, ringFd, 0, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // The kernel completes the operations regardless, and the slot
+            // can't be reused until their results have been reaped.
+            perror("LogCompressor's io_uring wait failed; polling for "
+                   "completions instead");
+            enterFailed = true;
+        } else if (ret < 0 && errno != EINTR) {
+            sched_yield();
+        }
+
+        reapCompletions();
+    }
+
+    ssize_t result = request.writeResult;
+    if (request.syncResult < 0 && result >= 0)
+        result = request.syncResult;
+
+    oldest = (oldest + 1) % maxOutstanding;
+    --numOutstanding;
+    return result;
+}
+
+}; // namespace NanoLogInternal
@@ -0,0 +1,261 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef NANOLOG_IOBACKEND_H
+#define NANOLOG_IOBACKEND_H
+
+#include <aio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+#include "Common.h"
+
+// Defined in <linux/io_uring.h>, which is only needed by IoBackend.cc
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace NanoLogInternal {
+
+/**
+ * An IoBackend performs the asynchronous writes with which the background
+ * thread outputs the compressed log, so that it can keep compressing while
+ * the disk is busy. Up to maxOutstanding writes may be in flight at once and
+ * they are retired in the order that they were submitted.
+ *
+ * IoBackends are not thread-safe; only the thread that submits the writes
+ * should wait on them.
+ */
+class IoBackend {
+  public:
+    virtual ~IoBackend() {}
+
+    /**
+     * Starts writing a buffer to a file in the background. The buffer must
+     * not be modified until the write has been retired by waitForWrite().
+     *
+     * \param fd
+     *      File descriptor to write to
+     * \param buffer
+     *      Data to write
+     * \param nbytes
+     *      Number of bytes to write
+     * \param offset
+     *      Byte offset in the file to write at (ignored by files opened with
+     *      O_APPEND)
+     * \param datasync
+     *      True means the write isn't complete until the data has also been
+     *      flushed to disk with the equivalent of fdatasync()
+     *
+     * \return
+     *      True if the write was started; false means it wasn't, either
+     *      because maxOutstanding writes are already in flight or because
+     *      the operating system rejected it (see errno).
+     */
+    virtual bool submitWrite(int fd, const char *buffer, size_t nbytes,
+                             off_t offset, bool datasync) = 0;
+
+    /**
+     * Returns true if the oldest outstanding write has completed, i.e. if
+     * waitForWrite() would return without blocking. Never blocks.
+     */
+    virtual bool isWriteComplete() = 0;
+
+    /**
+     * Waits for the oldest outstanding write to complete and retires it.
+     * There must be at least one outstanding write.
+     *
+     * \return
+     *      The number of bytes written, or a negative errno value if the
+     *      write (or the fdatasync() requested with it) failed.
+     */
+    virtual ssize_t waitForWrite() = 0;
+
+    /**
+     * Returns a human readable name of the mechanism used for the writes
+     */
+    virtual const char *getName() = 0;
+
+    /**
+     * Returns the number of writes that were submitted but not yet retired
+     */
+    uint32_t
+    getNumOutstanding() {
+        return numOutstanding;
+    }
+
+    /**
+     * Returns the number of writes that may be in flight at the same time
+     */
+    uint32_t
+    getMaxOutstanding() {
+        return maxOutstanding;
+    }
+
+  PROTECTED:
+    explicit IoBackend(uint32_t maxOutstanding)
+        : maxOutstanding(maxOutstanding)
+        , numOutstanding(0)
+        , oldest(0)
+    {}
+
+    // Returns the index of the slot used by the next write submitted
+    uint32_t
+    nextSlot() {
+        return (oldest + numOutstanding) % maxOutstanding;
+    }
+
+    // Maximum number of writes that can be in flight
+    const uint32_t maxOutstanding;
+
+    // Number of writes that were submitted but not yet retired
+    uint32_t numOutstanding;
+
+    // Index of the slot holding the oldest outstanding write; the
+    // subclasses keep their per-write state in arrays of maxOutstanding
+    // slots that are used in a circular fashion.
+    uint32_t oldest;
+
+    DISALLOW_COPY_AND_ASSIGN(IoBackend);
+};
+
+/**
+ * IoBackend based on the POSIX AIO library. glibc implements it with helper
+ * threads that perform blocking write() and fdatasync() calls, so it works
+ * everywhere but costs a thread handoff per write.
+ */
+class PosixAioBackend : public IoBackend {
+  public:
+    explicit PosixAioBackend(uint32_t maxOutstanding);
+    ~PosixAioBackend();
+
+    bool submitWrite(int fd, const char *buffer, size_t nbytes,
+                     off_t offset, bool datasync);
+    bool isWriteComplete();
+    ssize_t waitForWrite();
+
+    const char *
+    getName() {
+        return "POSIX AIO";
+    }
+
+  PRIVATE:
+    // State of one outstanding write
+    struct Request {
+        // Control block of the write
+        struct aiocb write;
+
+        // Control block of the aio_fsync() following the write (if any)
+        struct aiocb sync;
+
+        // True if sync was submitted
+        bool datasync;
+
+        // Error returned by aio_fsync() if it could not be submitted
+        int syncSubmitError;
+    };
+
+    // Outstanding writes (see IoBackend::oldest)
+    std::vector<Request> requests;
+
+    DISALLOW_COPY_AND_ASSIGN(PosixAioBackend);
+};
+
+/**
+ * IoBackend based on Linux's io_uring interface, used through the raw system
+ * calls. Writes (each optionally linked to an fdatasync) are placed in the
+ * submission queue shared with the kernel and submitted with a single
+ * io_uring_enter() call. Their completions are reaped straight from the
+ * shared completion queue, so checking on a write never enters the kernel;
+ * only waitForWrite() does when the write is still in progress.
+ */
+class IoUringBackend : public IoBackend {
+  public:
+    static IoUringBackend *create(uint32_t maxOutstanding);
+    ~IoUringBackend();
+
+    bool submitWrite(int fd, const char *buffer, size_t nbytes,
+                     off_t offset, bool datasync);
+    bool isWriteComplete();
+    ssize_t waitForWrite();
+
+    const char *
+    getName() {
+        return "io_uring";
+    }
+
+  PRIVATE:
+    explicit IoUringBackend(uint32_t maxOutstanding);
+
+    bool setup();
+
+    void reapCompletions();
+
+    // State of one outstanding write
+    struct Request {
+        // Describes the buffer written by the IORING_OP_WRITEV operation
+        struct iovec iov;
+
+        // Result of the write operation
+        ssize_t writeResult;
+
+        // Result of the linked fdatasync (0 if there's none)
+        int syncResult;
+
+        // Number of operations (write and sync) that haven't completed
+        uint32_t pendingCompletions;
+    };
+
+    // Outstanding writes (see IoBackend::oldest)
+    std::vector<Request> requests;
+
+    // File descriptor of the io_uring instance
+    int ringFd;
+
+    // Memory mappings of the submission queue ring, the completion queue
+    // ring (the same as sqRing on kernels with IORING_FEAT_SINGLE_MMAP) and
+    // the submission queue entries, and their sizes.
+    void *sqRing;
+    void *cqRing;
+    struct io_uring_sqe *sqes;
+    size_t sqRingBytes;
+    size_t cqRingBytes;
+    size_t sqesBytes;
+
+    // Pointers to the fields of the submission queue ring
+    uint32_t *sqTail;
+    uint32_t *sqMask;
+    uint32_t *sqArray;
+
+    // Pointers to the fields of the completion queue ring
+    uint32_t *cqHead;
+    uint32_t *cqTail;
+    uint32_t *cqMask;
+    struct io_uring_cqe *cqes;
+
+    // Set once io_uring_enter() failed to wait for completions, after which
+    // waitForWrite() polls the completion queue every POLL_INTERVAL_US
+    // instead.
+    bool enterFailed;
+    static const uint32_t POLL_INTERVAL_US = 100;
+
+    DISALLOW_COPY_AND_ASSIGN(IoUringBackend);
+};
+
+}; // namespace NanoLogInternal
+
+#endif // NANOLOG_IOBACKEND_H
@@ -90,16 +90,25 @@ Log::insertCheckpoint(char **out, char *outLimit, bool writeDictionary) {
  *      Optional parameter to skip embedding metadata information at the
  *      beginning of the buffer. This parameter should never bet set except
  *      in unit tests.
+ * \param forceDictionaryOutput
+ *      Embed the dictionary in the checkpoint even when it would otherwise be
+ *      output incrementally
+ * \param maxEntrySize
+ *      Largest log message that can be encoded, which is half the size of the
+ *      StagingBuffers (see NanoLog::Config::stagingBufferSize)
  */
 Log::Encoder::Encoder(char *buffer,
                                 size_t bufferSize,
                                 bool skipCheckpoint,
-                                bool forceDictionaryOutput)
+                                bool forceDictionaryOutput,
+                                uint32_t maxEntrySize)
     : backing_buffer(buffer)
     , writePos(buffer)
     , endOfBuffer(buffer + bufferSize)
     , lastBufferIdEncoded(-1)
     , currentExtentSize(nullptr)
+    , maxEntrySize(maxEntrySize)
+    , mostSevereLogLevel(NanoLog::NUM_LOG_LEVELS)
     , encodeMissDueToMetadata(0)
     , consecutiveEncodeMissesDueToMetadata(0)
 {
@@ -139,7 +148,7 @@ Log::Encoder::Encoder(char *buffer,
  */
 uint32_t
 Log::Encoder::encodeNewDictionaryEntries(uint32_t& currentPosition,
-                                        std::vector<StaticLogInfo> allMetadata)
+                                const std::vector<StaticLogInfo> &allMetadata)
 {
     char *bufferStart = writePos;
 
@@ -152,7 +161,7 @@ Log::Encoder::encodeNewDictionaryEntries(uint32_t& currentPosition,
     df->entryType = EntryType::LOG_MSGS_OR_DIC;
 
     while (currentPosition < allMetadata.size()) {
-        StaticLogInfo &curr = allMetadata.at(currentPosition);
+        const StaticLogInfo &curr = allMetadata.at(currentPosition);
         size_t filenameLength = strlen(curr.filename) + 1;
         size_t formatLength = strlen(curr.formatString) + 1;
         size_t nextDictSize = sizeof(CompressedLogInfo)
@@ -226,8 +235,19 @@ Log::Encoder::encodeLogMsgs(char *from,
     while (remaining > 0) {
         auto *entry = reinterpret_cast<UncompressedEntry*>(from);
 
+        if (entry->fmtId == DROPPED_LOGS_ID) {
+            if (entry->entrySize > remaining ||
+                    !encodeDroppedLogs(entry, lastTimestamp))
+                break;
+
+            lastTimestamp = entry->timestamp;
+            remaining -= entry->entrySize;
+            from += entry->entrySize;
+            continue;
+        }
+
         if (entry->entrySize > remaining) {
-            if (entry->entrySize < (NanoLogConfig::STAGING_BUFFER_SIZE/2))
+            if (entry->entrySize < maxEntrySize)
                 break;
 
             GeneratedFunctions::LogMetadata &lm
@@ -236,7 +256,7 @@ Log::Encoder::encodeLogMsgs(char *from,
                             "bytes while the maximum allowable size is %u.\r\n"
                             "This occurs for the log message %s:%u '%s'\r\n",
                             entry->entrySize,
-                            NanoLogConfig::STAGING_BUFFER_SIZE/2,
+                            maxEntrySize,
                             lm.fileName, lm.lineNumber, lm.fmtString);
         }
 
@@ -251,6 +271,11 @@ Log::Encoder::encodeLogMsgs(char *from,
         compressLogHeader(entry, &writePos, lastTimestamp);
         lastTimestamp = entry->timestamp;
 
+        uint8_t logLevel = static_cast<uint8_t>(
+                    GeneratedFunctions::logId2Metadata[entry->fmtId].logLevel);
+        if (logLevel < mostSevereLogLevel)
+            mostSevereLogLevel = logLevel;
+
         size_t argBytesWritten =
             GeneratedFunctions::compressFnArray[entry->fmtId](entry, writePos);
         writePos += argBytesWritten;
@@ -308,7 +333,7 @@ Log::Encoder::encodeLogMsgs(char *from,
                             uint64_t nbytes,
                             uint32_t bufferId,
                             bool newPass,
-                            std::vector<StaticLogInfo> dictionary,
+                            const std::vector<StaticLogInfo> &dictionary,
                             uint64_t *numEventsCompressed)
 {
     if (!encodeBufferExtentStart(bufferId, newPass))
@@ -322,6 +347,18 @@ Log::Encoder::encodeLogMsgs(char *from,
     while (remaining > 0) {
         auto *entry = reinterpret_cast<UncompressedEntry*>(from);
 
+        // Inserted by the runtime; there's no dictionary entry for these
+        if (entry->fmtId == DROPPED_LOGS_ID) {
+            if (entry->entrySize > remaining ||
+                    !encodeDroppedLogs(entry, lastTimestamp))
+                break;
+
+            lastTimestamp = entry->timestamp;
+            remaining -= entry->entrySize;
+            from += entry->entrySize;
+            continue;
+        }
+
         // New log entry that we have not observed yet
         if (dictionary.size() <= entry->fmtId) {
             ++encodeMissDueToMetadata;
@@ -350,16 +387,16 @@ Log::Encoder::encodeLogMsgs(char *from,
 #endif
 
         if (entry->entrySize > remaining) {
-            if (entry->entrySize < (NanoLogConfig::STAGING_BUFFER_SIZE/2))
+            if (entry->entrySize < maxEntrySize)
                 break;
 
-            StaticLogInfo &info = dictionary.at(entry->fmtId);
+            const StaticLogInfo &info = dictionary.at(entry->fmtId);
             fprintf(stderr, "NanoLog ERROR: Attempting to log a message that "
                             "is %u bytes while the maximum allowable size is "
                             "%u.\r\n This occurs for the log message %s:%u '%s'"
                             "\r\n",
                             entry->entrySize,
-                            NanoLogConfig::STAGING_BUFFER_SIZE/2,
+                            maxEntrySize,
                             info.filename, info.lineNum, info.formatString);
         }
 
@@ -374,7 +411,10 @@ Log::Encoder::encodeLogMsgs(char *from,
         compressLogHeader(entry, &writePos, lastTimestamp);
         lastTimestamp = entry->timestamp;
 
-        StaticLogInfo &info = dictionary.at(entry->fmtId);
+        const StaticLogInfo &info = dictionary.at(entry->fmtId);
+        if (info.severity < mostSevereLogLevel)
+            mostSevereLogLevel = info.severity;
+
 #ifdef ENABLE_DEBUG_PRINTING
         printf("\r\nCompressing \'%s\' with info.id=%d\r\n",
                 info.formatString, entry->fmtId);
@@ -447,6 +487,91 @@ Log::Encoder::encodeBufferExtentStart(uint32_t bufferId, bool newPass)
     return true;
 }
 
+/**
+ * Internal function that copies a record of dropped log messages (i.e. an
+ * UncompressedEntry with the DROPPED_LOGS_ID inserted by the runtime) into
+ * the compressed log. The record receives the same header as a regular log
+ * message, but the DroppedLogs arguments after it are copied verbatim since
+ * there is no dictionary entry/compression function associated with them.
+ *
+ * \param entry
+ *      DROPPED_LOGS_ID entry to encode
+ * \param lastTimestamp
+ *      The timestamp of the last entry encoded in the current BufferExtent
+ * \return
+ *      Whether the operation completed successfully (true) or failed due to
+ *      lack of space in the internal buffer (false)
+ */
+bool
+Log::Encoder::encodeDroppedLogs(const UncompressedEntry *entry,
+                                uint64_t lastTimestamp)
+{
+    assert(entry->fmtId == DROPPED_LOGS_ID);
+    size_t argBytes = entry->entrySize - sizeof(UncompressedEntry);
+
+    // The compressed header is never larger than the uncompressed one
+    if (entry->entrySize > static_cast<size_t>(endOfBuffer - writePos))
+        return false;
+
+    compressLogHeader(entry, &writePos, lastTimestamp);
+    memcpy(writePos, entry->argData, argBytes);
+    writePos += argBytes;
+
+    return true;
+}
+
+/**
+ * Copies BufferExtents that were encoded by another Encoder (constructed with
+ * skipCheckpoint) into the internal buffer. This allows log messages to be
+ * compressed elsewhere (i.e. by a logging thread assisting the background
+ * thread) and later be spliced into the output in the right place.
+ *
+ * \param extents
+ *      Encoded BufferExtents to copy
+ * \param nbytes
+ *      Number of bytes to copy from *extents
+ *
+ * \return
+ *      Whether the operation completed successfully (true) or failed due to
+ *      lack of space in the internal buffer (false)
+ */
+bool
+Log::Encoder::appendExtents(const char *extents, size_t nbytes)
+{
+    if (nbytes > static_cast<size_t>(endOfBuffer - writePos))
+        return false;
+
+    memcpy(writePos, extents, nbytes);
+    writePos += nbytes;
+
+    // Subsequent log messages must go into a new BufferExtent
+    endExtent();
+    return true;
+}
+
+/**
+ * Closes the current BufferExtent, so that the next log message encoded
+ * starts a new one even if it comes from the same bufferId. The decompressor
+ * sorts log messages across BufferExtents by timestamp, but assumes that the
+ * log messages within one are already in order.
+ */
+void
+Log::Encoder::endExtent() {
+    lastBufferIdEncoded = -1;
+    currentExtentSize = nullptr;
+}
+
+/**
+ * Returns the most severe (i.e. numerically lowest) LogLevel among the log
+ * messages encoded since the Encoder was constructed or its buffer was last
+ * swapped, or NUM_LOG_LEVELS if there were none. The background thread uses
+ * this to flush urgent log messages right away.
+ */
+uint8_t
+Log::Encoder::getMostSevereLogLevel() {
+    return mostSevereLogLevel;
+}
+
 /**
  * Retrieve the number of bytes encoded in the internal buffer
  *
@@ -483,6 +608,7 @@ Log::Encoder::swapBuffer(char *inBuffer, size_t inSize, char **outBuffer,
     endOfBuffer = inBuffer + inSize;
     lastBufferIdEncoded = -1;
     currentExtentSize = nullptr;
+    mostSevereLogLevel = NanoLog::NUM_LOG_LEVELS;
 
     if (outBuffer)
         *outBuffer = ret;
@@ -1153,7 +1279,9 @@ Log::Decoder::freeBufferFragment(BufferFragment *bf)
 
 // BufferFragment constructor
 Log::Decoder::BufferFragment::BufferFragment()
-    : storage()
+    : storage(nullptr)
+    , capacity(NanoLogConfig::STAGING_BUFFER_SIZE
+                                    + BufferExtent::maxSizeOfHeader())
     , validBytes(0)
     , runtimeId(-1)
     , readPos(nullptr)
@@ -1162,6 +1290,18 @@ Log::Decoder::BufferFragment::BufferFragment()
     , nextLogId(-1)
     , nextLogTimestamp(0)
 {
+    storage = static_cast<char*>(malloc(capacity));
+    if (storage == nullptr) {
+        fprintf(stderr, "Could not allocate a BufferFragment\r\n");
+        exit(-1);
+    }
+}
+
+// BufferFragment destructor
+Log::Decoder::BufferFragment::~BufferFragment()
+{
+    free(storage);
+    storage = nullptr;
 }
 
 /**
@@ -1196,12 +1336,25 @@ Log::Decoder::BufferFragment::readBufferExtent(FILE *fd, bool *wrapAround) {
 
     if (be->entryType != EntryType::BUFFER_EXTENT ||
             validBytes < sizeof(BufferExtent) ||
-            be->length > sizeof(storage)) {
+            be->length < validBytes) {
         reset();
         return false;
     }
 
-    assert(be->length >= validBytes);
+    // The log may come from a runtime with larger StagingBuffers
+    if (be->length > capacity) {
+        uint32_t length = be->length;
+        char *newStorage = static_cast<char*>(realloc(storage, length));
+        if (newStorage == nullptr) {
+            reset();
+            return false;
+        }
+
+        storage = newStorage;
+        capacity = length;
+        be = reinterpret_cast<BufferExtent*>(storage);
+    }
+
     uint64_t remaining = be->length - validBytes;
     validBytes += fread(storage + validBytes, 1, remaining, fd);
 
@@ -1366,6 +1519,20 @@ Log::Decoder::BufferFragment::decompressNextLogStatement(FILE *outputFd,
         strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", tm);
     }
 
+    // Records of dropped log messages are reported, but they are not log
+    // messages themselves and hence do not count towards logMsgsProcessed.
+    if (nextLogId == DROPPED_LOGS_ID) {
+        decompressDroppedLogs(outputFd, timeString, nanos, fmtId2metadata);
+        logArgs.reset(nullptr, nextLogId, nextLogTimestamp);
+
+        if (readPos >= endOfBuffer)
+            hasMoreLogs = false;
+        else
+            hasMoreLogs = decompressLogHeader(&readPos, nextLogTimestamp,
+                                              nextLogId, nextLogTimestamp);
+        return true;
+    }
+
 #ifdef PREPROCESSOR_NANOLOG
     if (fmtId2metadata.empty() || aggregationFn != nullptr) {
         // Output the context
@@ -1679,6 +1846,76 @@ Log::Decoder::BufferFragment::decompressNextLogStatement(FILE *outputFd,
     return true;
 }
 
+/**
+ * Helper to decompressNextLogStatement that reads a record of dropped log
+ * messages (DroppedLogs) at the current read position and prints it along
+ * with the per-invocation site breakdown.
+ *
+ * \param outputFd
+ *      File descriptor to print the record to (nullptr to only consume it)
+ * \param timeString
+ *      Formatted wall time (up to the second) of the record
+ * \param nanos
+ *      Nanoseconds portion of the record's wall time
+ * \param fmtId2metadata
+ *      Mapping of log identifiers to FormatMetadata used to name the sites
+ */
+void
+Log::Decoder::BufferFragment::decompressDroppedLogs(FILE *outputFd,
+                                        const char *timeString,
+                                        double nanos,
+                                        std::vector<void*>& fmtId2metadata)
+{
+    DroppedLogs droppedLogs;
+    memcpy(&droppedLogs, readPos, sizeof(DroppedLogs));
+    readPos += sizeof(DroppedLogs);
+
+    if (outputFd) {
+        fprintf(outputFd, "%s.%09.0lf NanoLog %s[%u]: %u log messages were "
+                          "dropped here because the StagingBuffer was full\r\n"
+                , timeString
+                , nanos
+                , logLevelNames[WARNING]
+                , runtimeId
+                , droppedLogs.numDropped);
+    }
+
+    uint32_t droppedAtListedSites = 0;
+    for (uint32_t i = 0; i < droppedLogs.numSites; ++i) {
+        DroppedLogSite site;
+        memcpy(&site, readPos, sizeof(DroppedLogSite));
+        readPos += sizeof(DroppedLogSite);
+        droppedAtListedSites += site.count;
+
+        if (!outputFd)
+            continue;
+
+        const char *filename = "(unknown)";
+        uint32_t lineNumber = 0;
+        if (site.logId < fmtId2metadata.size()) {
+            auto *metadata = reinterpret_cast<FormatMetadata*>(
+                                                fmtId2metadata.at(site.logId));
+            filename = metadata->filename;
+            lineNumber = metadata->lineNumber;
+        }
+#ifdef PREPROCESSOR_NANOLOG
+        else if (site.logId < GeneratedFunctions::numLogIds) {
+            filename = GeneratedFunctions::logId2Metadata[site.logId].fileName;
+            lineNumber =
+                    GeneratedFunctions::logId2Metadata[site.logId].lineNumber;
+        }
+#endif // PREPROCESSOR_NANOLOG
+
+        fprintf(outputFd, "\t%u dropped at %s:%u\r\n",
+                site.count, filename, lineNumber);
+    }
+
+    if (outputFd && droppedAtListedSites < droppedLogs.numDropped) {
+        fprintf(outputFd, "\t%u dropped at other sites\r\n",
+                droppedLogs.numDropped - droppedAtListedSites);
+    }
+}
+
 /**
  * Whether one can invoke decompressNextLogStatement or not
  */
@@ -1988,6 +2225,7 @@ bool
 Log::Decoder::getNextLogStatement(LogMessage &logMsg,
                                   FILE *outputFd) {
     if (bufferFragment->hasNext()) {
+        logMsg.reset();
         bufferFragment->decompressNextLogStatement(outputFd,
                                                         logMsgsPrinted,
                                                         logMsg,
@@ -1995,6 +2233,11 @@ Log::Decoder::getNextLogStatement(LogMessage &logMsg,
                                                         fmtId2metadata,
                                                         -1,
                                                         nullptr);
+
+        // Records of dropped log messages are printed, but not returned
+        if (logMsg.getLogId() == DROPPED_LOGS_ID)
+            return getNextLogStatement(logMsg, outputFd);
+
         return true;
     }
 
@@ -2047,13 +2290,18 @@ Log::Decoder::getNextLogStatement(LogMessage &logMsg,
         }
     }
 
-    return bufferFragment->decompressNextLogStatement(outputFd,
+    bool success = bufferFragment->decompressNextLogStatement(outputFd,
                                                             logMsgsPrinted,
                                                             logMsg,
                                                             checkpoint,
                                                             fmtId2metadata,
                                                             -1,
                                                             nullptr);
+
+    if (success && logMsg.getLogId() == DROPPED_LOGS_ID)
+        return getNextLogStatement(logMsg, outputFd);
+
+    return success;
 }
 
 /**
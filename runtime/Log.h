@@ -114,6 +114,10 @@ enum ParamType : int32_t {
 // invocation sites.
 static constexpr int UNASSIGNED_LOGID = -1;
 
+// Value of a log identifier while its log invocation site is being registered
+// by another thread (see RuntimeLogger::registerInvocationSite).
+static constexpr int PENDING_LOGID = -2;
+
 /**
  * Stores the static log information associated with a log invocation site
  * (i.e. filename/line/fmtString combination).
@@ -195,6 +199,48 @@ namespace Log {
         char argData[0];
     };
 
+    /**
+     * Reserved fmtId for UncompressedEntry's that the runtime (rather than a
+     * log statement) inserts into a StagingBuffer to report log messages that
+     * were dropped due to lack of space. The arguments of such an entry are
+     * a DroppedLogs structure and they are passed through to the compressed
+     * log as-is. No log invocation site is ever assigned this identifier.
+     */
+    static constexpr uint32_t DROPPED_LOGS_ID = 0xFFFFFFFE;
+
+    /**
+     * Number of log messages dropped at a single log invocation site.
+     */
+    NANOLOG_PACK_PUSH
+    struct DroppedLogSite {
+        // Log identifier of the invocation site
+        uint32_t logId;
+
+        // Number of messages from this site that were dropped
+        uint32_t count;
+    };
+    NANOLOG_PACK_POP
+
+    /**
+     * Arguments of a DROPPED_LOGS_ID entry. It reports the number of log
+     * messages a thread had to drop since it last logged successfully
+     * (starting at the entry's timestamp) and is followed by numSites
+     * DroppedLogSite's that break the count down per invocation site. Drops
+     * at sites beyond the ones listed are included only in numDropped.
+     */
+    NANOLOG_PACK_PUSH
+    struct DroppedLogs {
+        // Total number of log messages dropped
+        uint32_t numDropped;
+
+        // Number of DroppedLogSite's following this structure
+        uint32_t numSites;
+
+        // Per invocation site breakdown of numDropped
+        DroppedLogSite sites[0];
+    };
+    NANOLOG_PACK_POP
+
     /**
      * 2-bit enum that differentiates entries in the compressed log. These
      * two bits **MUST** be at the beginning of each entry in the log
@@ -653,7 +699,8 @@ namespace Log {
     PUBLIC:
         Encoder(char *buffer, size_t bufferSize,
                 bool skipCheckpoint=false,
-                bool forceDictionaryOutput=false);
+                bool forceDictionaryOutput=false,
+                uint32_t maxEntrySize=NanoLogConfig::STAGING_BUFFER_SIZE/2);
 
 #ifdef PREPROCESSOR_NANOLOG
         long encodeLogMsgs(char *from, uint64_t nbytes,
@@ -663,20 +710,25 @@ namespace Log {
 #endif // PREPROCESSOR_NANOLOG
 
         long encodeLogMsgs(char *from, uint64_t nbytes,
-                                    uint32_t bufferId,
-                                    bool wrapAround,
-                                    std::vector<StaticLogInfo> dictionary,
-                                    uint64_t *numEventsCompressed);
+                           uint32_t bufferId,
+                           bool wrapAround,
+                           const std::vector<StaticLogInfo> &dictionary,
+                           uint64_t *numEventsCompressed);
         uint32_t encodeNewDictionaryEntries(uint32_t& currentPosition,
-                                            std::vector<StaticLogInfo> allMetadata);
+                                const std::vector<StaticLogInfo> &allMetadata);
+        bool appendExtents(const char *extents, size_t nbytes);
+        void endExtent();
 
         size_t getEncodedBytes();
+        uint8_t getMostSevereLogLevel();
         void swapBuffer(char *inBuffer, size_t inSize,
                         char **outBuffer=nullptr, size_t *outLength=nullptr,
                         size_t *outSize=nullptr);
 
     PRIVATE:
         bool encodeBufferExtentStart(uint32_t bufferId, bool wrapAround);
+        bool encodeDroppedLogs(const UncompressedEntry *entry,
+                               uint64_t lastTimestamp);
 
         // Used to store the compressed log messages and related metadata
         char *backing_buffer;
@@ -696,6 +748,16 @@ namespace Log {
         // the value as the user performs more encodeLogMsgs with the same id.
         void *currentExtentSize;
 
+        // Largest log message that the StagingBuffers being encoded can hold.
+        // Incomplete messages smaller than this are assumed to be still in
+        // the process of being copied in rather than oversized.
+        uint32_t maxEntrySize;
+
+        // Most severe (i.e. numerically lowest) LogLevel of the log messages
+        // encoded since the last swapBuffer(); NUM_LOG_LEVELS if there were
+        // none.
+        uint8_t mostSevereLogLevel;
+
         // Metric: Total number of encode failures due to missing metadata. This
         // is typically due to a benign race condition, but could indicate an
         // error if it happens repeatedly.
@@ -880,12 +942,14 @@ namespace Log {
          * extent.
          */
         struct BufferFragment {
-            // Stores the bytes in a compressed log BufferExtent. The size is
-            // chosen to be a little bigger than the size of a runtime
-            // StagingBuffer to account for any other entries that may be
-            // inserted at runtime.
-            char storage[NanoLogConfig::STAGING_BUFFER_SIZE
-                                             + BufferExtent::maxSizeOfHeader()];
+            // Stores the bytes in a compressed log BufferExtent. It starts
+            // out a little bigger than the default size of a runtime
+            // StagingBuffer and grows to fit larger BufferExtents, since the
+            // runtime may have been configured with larger StagingBuffers.
+            char *storage;
+
+            // Number of bytes allocated for storage
+            uint64_t capacity;
 
             // Number of valid bytes in storage.
             uint64_t validBytes;
@@ -909,6 +973,7 @@ namespace Log {
             uint64_t nextLogTimestamp;
 
             BufferFragment();
+            ~BufferFragment();
             void reset();
             bool hasNext();
             bool readBufferExtent(FILE *fd, bool *wrapAround=nullptr);
@@ -919,7 +984,13 @@ namespace Log {
                                  std::vector<void*>& fmtId2metadata,
                                  long aggregationFilterId=-1,
                                  void (*aggregationFn)(const char*, ...)=NULL);
+            void decompressDroppedLogs(FILE *outputFd,
+                                       const char *timeString,
+                                       double nanos,
+                                       std::vector<void*>& fmtId2metadata);
             uint64_t getNextLogTimestamp() const;
+
+            DISALLOW_COPY_AND_ASSIGN(BufferFragment);
         };
 
         static bool compareBufferFragments(const BufferFragment *a,
@@ -0,0 +1,124 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Config.h"
+#include "Cycles.h"
+#include "Daemon.h"
+
+// File generated by the NanoLog preprocessor that contains all the
+// compression and decompression functions.
+#include "GeneratedCode.h"
+
+// How often the directories are scanned for processes and StagingBuffers
+// that came and went
+static const uint32_t SCAN_INTERVAL_US = 100000;
+
+// Longest time to sleep between polls while there are no log messages. The
+// sleep starts at POLL_INTERVAL_NO_WORK_US and doubles with every poll that
+// comes up empty, so that an idle nanologd doesn't keep a core busy.
+static const uint32_t MAX_IDLE_SLEEP_US = 4000;
+
+// Set by the signal handler to stop the main loop
+static volatile sig_atomic_t shouldExit = 0;
+
+static void
+handleExitSignal(int)
+{
+    shouldExit = 1;
+}
+
+/**
+ * Prints the usage information to stdout.
+ *
+ * \param exe
+ *      Name of the executable
+ */
+static void
+printHelp(const char *exe)
+{
+    printf("Compresses the log messages of the processes that run NanoLog "
+           "with\r\nCOMPRESSION_DAEMON into their log files until it's "
+           "interrupted:\r\n");
+    printf("\t%s [directory]\r\n\r\n", exe);
+    printf("The directory defaults to NanoLogConfig::CRASH_RECOVERY_DIR "
+           "(%s).\r\n", NanoLogConfig::CRASH_RECOVERY_DIR);
+}
+
+/**
+ * The nanologd, which compresses the log messages of the processes that run
+ * NanoLog with COMPRESSION_DAEMON. Like the decompressor, it must be compiled
+ * with the GeneratedCode.h of the processes it serves.
+ */
+int main(int argc, char** argv) {
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        printHelp(argv[0]);
+        return 1;
+    }
+
+    const char *directory = (argc == 2) ? argv[1]
+                                        : NanoLogConfig::CRASH_RECOVERY_DIR;
+    if (mkdir(directory, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create %s: %s\r\n", directory,
+                strerror(errno));
+        return 1;
+    }
+
+    signal(SIGINT, handleExitSignal);
+    signal(SIGTERM, handleExitSignal);
+
+    NanoLogInternal::CompressionDaemon daemon(directory);
+    uint64_t scanIntervalCycles = PerfUtils::Cycles::fromNanoseconds(
+                                                    1000UL*SCAN_INTERVAL_US);
+    uint64_t lastScan = 0;
+    uint32_t idleSleepUs = NanoLogConfig::POLL_INTERVAL_NO_WORK_US;
+    while (!shouldExit) {
+        uint64_t now = PerfUtils::Cycles::rdtsc();
+        if (now - lastScan >= scanIntervalCycles) {
+            daemon.scan();
+            lastScan = now;
+        }
+
+        if (daemon.poll() > 0) {
+            idleSleepUs = NanoLogConfig::POLL_INTERVAL_NO_WORK_US;
+            continue;
+        }
+
+        usleep(idleSleepUs);
+        idleSleepUs = std::min(std::max(2*idleSleepUs, 1U),
+                               MAX_IDLE_SLEEP_US);
+    }
+
+    // The processes still running keep their StagingBuffers; the next
+    // nanologd continues where this one left off.
+    printf("Compressed %lu log messages into %lu bytes for %zu running and "
+           "%lu exited processes\r\n", daemon.getLogsProcessed(),
+           daemon.getBytesWritten(), daemon.getNumClients(),
+           daemon.getNumClientsExited());
+
+    if (daemon.getBytesLost() > 0)
+        printf("%lu bytes of log messages could not be compressed or "
+               "written\r\n", daemon.getBytesLost());
+
+    return 0;
+}
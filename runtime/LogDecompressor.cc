@@ -23,6 +23,7 @@
 
 #include "Log.h"
 #include "Cycles.h"
+#include "Recovery.h"
 
 // File generated by the NanoLog preprocessor that contains all the
 // compression and decompression functions.
@@ -133,6 +134,11 @@ void printHelp(const char *exe) {
     printf("when there is one runtime logging thread:\r\n");
     printf("\t%s rcdfTime <logFile>\r\n\r\n", exe);
 
+    printf("Write the log messages that a crashed process left in its crash\r\n"
+           "recovery buffers (e.g. /dev/shm/nanolog/<pid>) to its log file\r\n"
+           "or the one given:\r\n");
+    printf("\t%s recover <directory> [logFile]\r\n\r\n", exe);
+
 #ifdef PREPROCESSOR_NANOLOG
     printf("== Note ==\r\n");
     printf("The following 2 commands only work with logs produced by the\r\n");
@@ -162,6 +168,27 @@ int main(int argc, char** argv) {
 
     const char *command = argv[1];
     const char *logFileName = argv[2];
+
+    if (strcmp(command, "recover") == 0) {
+        NanoLogInternal::Recovery::RecoveryStats stats;
+        if (!NanoLogInternal::Recovery::recover(argv[2],
+                                    (argc > 3) ? argv[3] : nullptr, &stats))
+            exit(1);
+
+        printf("Restored %u output buffers (%lu bytes) and %lu log messages "
+               "from %u StagingBuffers (%lu bytes)\r\n",
+               stats.outputBuffersRestored, stats.outputBytesRestored,
+               stats.logsRecovered, stats.stagingBuffersRecovered,
+               stats.stagingBytesWritten);
+
+        if (stats.stagingBytesLost > 0) {
+            printf("%lu bytes of the StagingBuffers could not be recovered: "
+                   "they hold incomplete log messages or ones of C++17 "
+                   "NanoLog, which only the process itself can "
+                   "compress\r\n", stats.stagingBytesLost);
+        }
+        return 0;
+    }
     bool find = false;
     bool sorted = false;
     bool doRCDF = false;
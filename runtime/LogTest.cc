@@ -46,6 +46,9 @@ using namespace NanoLogInternal;
 using namespace Log;
 
 void stopCompressionThread() {
+    // The compression thread is only started on first use
+    RuntimeLogger::nanoLogSingleton.ensureInitialized();
+
     {
         std::lock_guard<std::mutex> lock(
                 RuntimeLogger::nanoLogSingleton.condMutex);
@@ -732,6 +735,24 @@ TEST_F(LogTest, encodeLogMsgs_logTooBig) {
                  "for the log message testHelper/client.cc:21 "
                  "'This is a string %s'\r\n",
                     testing::internal::GetCapturedStderr().c_str());
+
+    // The limit follows the StagingBuffer size the runtime is configured with
+    ue->entrySize = sizeof(UncompressedEntry) + 1000;
+    Encoder e2(outputBuffer1, 1000, false, false, 512);
+
+    testing::internal::CaptureStderr();
+    bytesRead = e2.encodeLogMsgs(inputBuffer,
+                                 2*sizeof(UncompressedEntry),
+                                 5,
+                                 true,
+                                 &compressedLogs);
+
+    EXPECT_EQ(0, compressedLogs);
+    EXPECT_STREQ("ERROR: Attempting to log a message that is 1016 bytes "
+                 "while the maximum allowable size is 512.\r\nThis occurs "
+                 "for the log message testHelper/client.cc:21 "
+                 "'This is a string %s'\r\n",
+                    testing::internal::GetCapturedStderr().c_str());
 }
 
 TEST_F(LogTest, encodeBufferExtentStart) {
@@ -785,6 +806,38 @@ TEST_F(LogTest, encodeBufferExtentStart_outtaSpace) {
     EXPECT_EQ(nullptr, encoder.currentExtentSize);
 }
 
+TEST_F(LogTest, appendExtents) {
+    char inputBuffer[100], extentBuffer[1000], outputBuffer[1000];
+
+    UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(inputBuffer);
+    ue->timestamp = 100;
+    ue->fmtId = noParamsId;
+    ue->entrySize = sizeof(UncompressedEntry);
+
+    uint64_t compressedLogs = 0;
+    Encoder extents(extentBuffer, 1000, true);
+    EXPECT_EQ(sizeof(UncompressedEntry),
+              extents.encodeLogMsgs(inputBuffer, sizeof(UncompressedEntry),
+                                    5, false, &compressedLogs));
+    size_t extentBytes = extents.getEncodedBytes();
+
+    Encoder encoder(outputBuffer, 1000, true);
+    ASSERT_TRUE(encoder.encodeBufferExtentStart(3, false));
+    size_t startBytes = encoder.getEncodedBytes();
+
+    EXPECT_TRUE(encoder.appendExtents(extentBuffer, extentBytes));
+    EXPECT_EQ(startBytes + extentBytes, encoder.getEncodedBytes());
+    EXPECT_EQ(0, memcmp(extentBuffer, outputBuffer + startBytes,
+                        extentBytes));
+    EXPECT_EQ(uint32_t(-1), encoder.lastBufferIdEncoded);
+    EXPECT_EQ(nullptr, encoder.currentExtentSize);
+
+    // Not enough space
+    Encoder smallEncoder(outputBuffer, extentBytes - 1, true);
+    EXPECT_FALSE(smallEncoder.appendExtents(extentBuffer, extentBytes));
+    EXPECT_EQ(0U, smallEncoder.getEncodedBytes());
+}
+
 TEST_F(LogTest, swapBuffer) {
     char buffer1[1000], buffer2[100];
     Encoder encoder(buffer1, 1000, false, true);
@@ -1345,11 +1398,11 @@ TEST_F(LogTest, Decoder_readBufferExtent_notEnoughSpace) {
     ASSERT_FALSE(bf->readBufferExtent(in));
     fclose(in);
 
-    // Test a BufferExtent that's waaaaayyy too large to fit.
+    // Test a BufferExtent that's larger than the rest of the file
     BufferExtent *be = reinterpret_cast<BufferExtent*>(badBuffer);
     be->entryType = EntryType::BUFFER_EXTENT;
     be->isShort = true;
-    be->length = sizeof(bf->storage) + 1;
+    be->length = downCast<uint32_t>(bf->capacity + 1);
     be->threadIdOrPackNibble = 1;
     be->wrapAround = false;
 
@@ -1374,7 +1427,7 @@ TEST_F(LogTest, Decoder_readBufferExtent_notEnoughSpace) {
     be = reinterpret_cast<BufferExtent*>(badBuffer);
     be->entryType = EntryType::BUFFER_EXTENT;
     be->isShort = true;
-    be->length = sizeof(bf->storage) + 1;
+    be->length = downCast<uint32_t>(bf->capacity + 1);
     be->threadIdOrPackNibble = 1;
     be->wrapAround = false;
     ++be;
@@ -1392,6 +1445,49 @@ TEST_F(LogTest, Decoder_readBufferExtent_notEnoughSpace) {
     std::remove(testFile);
 }
 
+TEST_F(LogTest, Decoder_readBufferExtent_largerThanStagingBuffer) {
+    const char *testFile = "/tmp/testFile";
+    char inputBuffer[100], goodBuffer[1000];
+
+    UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(inputBuffer);
+    ue->timestamp = 100;
+    ue->fmtId = noParamsId;
+    ue->entrySize = sizeof(UncompressedEntry);
+
+    uint64_t compressedLogs = 0;
+    Encoder e(goodBuffer, 1000, true);
+    e.encodeLogMsgs(inputBuffer, sizeof(UncompressedEntry), 5, false,
+                    &compressedLogs);
+    EXPECT_EQ(1U, compressedLogs);
+
+    // Pad the extent out beyond the default StagingBuffer size, as a runtime
+    // configured with larger StagingBuffers might produce.
+    Decoder::BufferFragment *bf = new Decoder::BufferFragment();
+    uint64_t defaultCapacity = bf->capacity;
+    std::vector<char> extent(defaultCapacity + 100, 0);
+    memcpy(extent.data(), goodBuffer, e.getEncodedBytes());
+    BufferExtent *be = reinterpret_cast<BufferExtent*>(extent.data());
+    be->length = downCast<uint32_t>(extent.size());
+
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(extent.data(), extent.size());
+    oFile.close();
+
+    FILE *in = fopen(testFile, "rb");
+    ASSERT_TRUE(in);
+    ASSERT_TRUE(bf->readBufferExtent(in));
+    EXPECT_EQ(extent.size(), bf->validBytes);
+    EXPECT_EQ(extent.size(), bf->capacity);
+    EXPECT_EQ(5U, bf->runtimeId);
+    EXPECT_EQ(100UL, bf->nextLogTimestamp);
+    EXPECT_EQ(noParamsId, bf->nextLogId);
+    fclose(in);
+
+    delete bf;
+    std::remove(testFile);
+}
+
 int numAggregationsRun = 0;
 void aggregation(const char*, ...) {
    ++numAggregationsRun;
@@ -2328,6 +2424,104 @@ TEST_F(LogTest, Decoder_getNextLogStatement) {
     std::remove(decomp);
 }
 
+TEST_F(LogTest, Decoder_getNextLogStatement_droppedLogs) {
+    const char *testFile = "/tmp/testFile";
+    const char *decomp = "/tmp/testFile2";
+    char inputBuffer[1000], buffer[1000];
+    Encoder encoder(buffer, 1000, false, true);
+
+    // Hack to load fake Checkpoint values to get a consistent time output
+    Checkpoint *checkpoint = (Checkpoint *) encoder.backing_buffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = 0;
+    checkpoint->unixTime = 1;
+
+    char *writePos = inputBuffer;
+    UncompressedEntry *ue = reinterpret_cast<UncompressedEntry *>(writePos);
+    ue->timestamp = 10;
+    ue->fmtId = integerParamId;
+    ue->entrySize = sizeof(UncompressedEntry) + sizeof(int);
+    writePos += ue->entrySize;
+    *((int*)(ue->argData)) = 1;
+
+    // 3 drops, but only 2 of them are attributed to a site
+    ue = reinterpret_cast<UncompressedEntry *>(writePos);
+    ue->timestamp = 15;
+    ue->fmtId = DROPPED_LOGS_ID;
+    ue->entrySize = sizeof(UncompressedEntry) + sizeof(DroppedLogs)
+                                              + sizeof(DroppedLogSite);
+    writePos += ue->entrySize;
+    DroppedLogs *dl = reinterpret_cast<DroppedLogs*>(ue->argData);
+    dl->numDropped = 3;
+    dl->numSites = 1;
+    dl->sites[0].logId = integerParamId;
+    dl->sites[0].count = 2;
+
+    ue = reinterpret_cast<UncompressedEntry *>(writePos);
+    ue->timestamp = 20;
+    ue->fmtId = doubleParamId;
+    ue->entrySize = sizeof(UncompressedEntry) + sizeof(double);
+    writePos += ue->entrySize;
+    *((double*)(ue->argData)) = 4.0;
+
+    uint64_t compressedLogs = 0;
+    long bytesRead = encoder.encodeLogMsgs(inputBuffer,
+                                           writePos - inputBuffer,
+                                           1,
+                                           false,
+                                           &compressedLogs);
+    EXPECT_EQ(2, compressedLogs);
+    EXPECT_EQ(writePos - inputBuffer, bytesRead);
+
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(buffer, encoder.getEncodedBytes());
+    oFile.close();
+
+    const char* expectedLines[] = {
+            "1969-12-31 16:00:01.000000010 testHelper/client.cc:28 NOTICE[1]: I have an integer 1\r",
+            "1969-12-31 16:00:01.000000015 NanoLog WARNING[1]: 3 log messages were dropped here because the StagingBuffer was full\r",
+            "\t2 dropped at testHelper/client.cc:28\r",
+            "\t1 dropped at other sites\r",
+            "1969-12-31 16:00:01.000000020 testHelper/client.cc:30 NOTICE[1]: I have a double 4.000000\r"
+    };
+
+    LogMessage logMsg;
+    Decoder dc;
+
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    ASSERT_TRUE(dc.open(testFile));
+    while (dc.getNextLogStatement(logMsg, outputFd));
+    EXPECT_EQ(2, dc.logMsgsPrinted);
+    fclose(outputFd);
+
+    std::string iLine;
+    std::ifstream iFile;
+    iFile.open(decomp);
+    for (const char *line : expectedLines) {
+        ASSERT_TRUE(iFile.good());
+        std::getline(iFile, iLine);
+        if (line[0] == '\t')
+            EXPECT_STREQ(line, iLine.c_str());
+        else if (iLine.size() >= 14)
+            EXPECT_STREQ(line + 14, iLine.c_str() + 14);// +14 skips date + hour
+    }
+    iFile.close();
+
+    // The drop record itself should never be returned as a log message
+    dc.open(testFile);
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    EXPECT_EQ(integerParamId, logMsg.getLogId());
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    EXPECT_EQ(doubleParamId, logMsg.getLogId());
+    EXPECT_EQ(20, logMsg.getTimestamp());
+    EXPECT_FALSE(dc.getNextLogStatement(logMsg));
+
+    std::remove(testFile);
+    std::remove(decomp);
+}
+
 // Static helper functions to test when aggregation is run.
 static int numInvocations = 0;
 
@@ -2665,6 +2859,45 @@ TEST_F(LogTest, encodeLogMsgs_cpp17) {
     EXPECT_EQ(0, encoder.consecutiveEncodeMissesDueToMetadata);
 }
 
+TEST_F(LogTest, encodeLogMsgs_mostSevereLogLevel) {
+    char inBuffer[1024];
+    char outBuffer[1024], outBuffer2[1024];
+    char *in = inBuffer;
+
+    uint64_t numEventsCompressed = 0;
+    std::vector<StaticLogInfo> dictionary;
+    NanoLogInternal::ParamType paramTypes[10];
+    dictionary.emplace_back(&compressHelper0, "File", 1, NOTICE, "Notice",
+                            0, 0, paramTypes);
+    dictionary.emplace_back(&compressHelper0, "File", 2, ERROR, "Error",
+                            0, 0, paramTypes);
+
+    UncompressedEntry *ue = push<UncompressedEntry>(in);
+    ue->entrySize = sizeof(UncompressedEntry);
+    ue->timestamp = 0;
+    ue->fmtId = 0;
+
+    ue = push<UncompressedEntry>(in);
+    ue->entrySize = sizeof(UncompressedEntry);
+    ue->timestamp = 1;
+    ue->fmtId = 1;
+
+    Encoder encoder(outBuffer, sizeof(outBuffer), true);
+    EXPECT_EQ(NUM_LOG_LEVELS, encoder.getMostSevereLogLevel());
+
+    encoder.encodeLogMsgs(inBuffer, sizeof(UncompressedEntry), 0, false,
+                          dictionary, &numEventsCompressed);
+    EXPECT_EQ(NOTICE, encoder.getMostSevereLogLevel());
+
+    encoder.encodeLogMsgs(inBuffer, 2*sizeof(UncompressedEntry), 0, false,
+                          dictionary, &numEventsCompressed);
+    EXPECT_EQ(ERROR, encoder.getMostSevereLogLevel());
+
+    // Swapping out the buffer starts over
+    encoder.swapBuffer(outBuffer2, sizeof(outBuffer2));
+    EXPECT_EQ(NUM_LOG_LEVELS, encoder.getMostSevereLogLevel());
+}
+
 TEST_F(LogTest, createMicroCode) {
     using namespace NanoLogInternal::Log;
     char backing_buffer[1024];
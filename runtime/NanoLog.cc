@@ -14,22 +14,74 @@ namespace NanoLog {
     void printConfig() {
         printf("==== NanoLog Configuration ====\r\n");
 
+        const Config &config = RuntimeLogger::getConfig();
+        uint32_t releaseThreshold = (config.releaseThreshold > 0)
+                                            ? config.releaseThreshold
+                                            : config.stagingBufferSize/2;
         printf("StagingBuffer size: %u MB\r\n",
-               NanoLogConfig::STAGING_BUFFER_SIZE / 1000000);
-        printf("Output Buffer size: %u MB\r\n",
-               NanoLogConfig::OUTPUT_BUFFER_SIZE / 1000000);
+               config.stagingBufferSize / 1000000);
+        printf("Initial StagingBuffer size: %u KB\r\n",
+               config.initialStagingBufferSize / 1000);
+        printf("Output Buffer size: %u MB x %u\r\n",
+               config.outputBufferSize / 1000000, config.numOutputBuffers);
         printf("Release Threshold : %u MB\r\n",
-               NanoLogConfig::RELEASE_THRESHOLD / 1000000);
+               releaseThreshold / 1000000);
         printf("Idle Poll Interval: %u µs\r\n",
-               NanoLogConfig::POLL_INTERVAL_NO_WORK_US);
+               config.pollIntervalNoWorkUs);
         printf("IO Poll Interval  : %u µs\r\n",
-               NanoLogConfig::POLL_INTERVAL_DURING_IO_US);
+               config.pollIntervalDuringIoUs);
+        printf("Wakeup Policy     : %s, spins %u µs and backs off %u µs, "
+               "core %d\r\n",
+               RuntimeLogger::getWakeupPolicyName(config.wakeupPolicy),
+               config.backoffSpinUs, config.backoffPauseUs,
+               config.compressionThreadCore);
+        printf("Flush Policy      : %u KB or %u µs; %u µs at LogLevel "
+               "<= %d\r\n",
+               config.flushMinBytes / 1000, config.flushMaxDelayUs,
+               config.flushLogLevelMaxDelayUs,
+               static_cast<int>(config.flushLogLevel));
+        printf("Compression Workers: %u\r\n",
+               config.numCompressionWorkers);
+        printf("Buffer Memory     : huge pages=%s, prefault=%s, mlock=%s, "
+               "NUMA-local=%s\r\n",
+               NanoLogConfig::USE_HUGE_PAGES ? "yes" : "no",
+               NanoLogConfig::PREFAULT_BUFFERS ? "yes" : "no",
+               NanoLogConfig::LOCK_BUFFERS ? "yes" : "no",
+               NanoLogConfig::NUMA_LOCAL_STAGING_BUFFERS ? "yes" : "no");
+        printf("Per-CPU Buffers   : %s\r\n",
+               NanoLogConfig::PER_CPU_STAGING_BUFFERS ? "yes" : "no");
+        printf("Crash Recovery    : %s\r\n",
+               NanoLogConfig::CRASH_RECOVERY_BUFFERS
+                        ? NanoLogConfig::CRASH_RECOVERY_DIR : "no");
+        printf("Compression Daemon: %s\r\n",
+               NanoLogConfig::COMPRESSION_DAEMON ? "yes" : "no");
+        printf("IO Backend        : %s\r\n",
+               (config.ioBackend == IO_URING)
+                        ? "io_uring (falls back to POSIX AIO)" : "POSIX AIO");
+        printf("Durability        : %s, syncs every %u ms or %u MB in the "
+               "PERIODIC_* modes, fallocate() chunks of %u MB\r\n",
+               RuntimeLogger::getDurabilityModeName(config.durabilityMode),
+               config.syncIntervalMs, config.syncIntervalBytes / 1000000,
+               config.fallocateChunkSize / 1000000);
+        printf("Log Rotation      : at %lu MB or %u s, keeping %u files\r\n",
+               config.rotateMaxBytes / 1000000, config.rotateMaxAgeSec,
+               config.rotateKeep);
+        printf("Output Sink       : %s\r\n",
+               (config.outputSink != nullptr) ? "yes" : "none");
+    }
+
+    void init(const Config &config) {
+        RuntimeLogger::init(config);
     }
 
     void preallocate() {
         RuntimeLogger::preallocate();
     }
 
+    void preallocate(size_t bytes) {
+        RuntimeLogger::preallocate(bytes);
+    }
+
     void setLogFile(const char *filename) {
         RuntimeLogger::setLogFile(filename);
     }
@@ -42,10 +94,30 @@ namespace NanoLog {
         RuntimeLogger::setLogLevel(logLevel);
     }
 
+    OverflowPolicy getOverflowPolicy() {
+        return RuntimeLogger::getOverflowPolicy();
+    }
+
+    void setOverflowPolicy(OverflowPolicy policy) {
+        RuntimeLogger::setOverflowPolicy(policy);
+    }
+
     void sync() {
         RuntimeLogger::sync();
     }
 
+    bool syncFor(uint32_t timeoutMs) {
+        return RuntimeLogger::syncFor(timeoutMs);
+    }
+
+    void syncAsync(std::function<void()> callback) {
+        RuntimeLogger::syncAsync(std::move(callback));
+    }
+
+    std::future<void> syncAsync() {
+        return RuntimeLogger::syncAsync();
+    }
+
     int getCoreIdOfBackgroundThread() {
         return RuntimeLogger::getCoreIdOfBackgroundThread();
     }
@@ -16,8 +16,14 @@
 #ifndef NANOLOG_H
 #define NANOLOG_H
 
+#include <stdint.h>
+
+#include <functional>
+#include <future>
 #include <string>
 
+#include "Config.h"
+
 /**
  * This header serves as the application and generated code interface into
  * the NanoLog Runtime system. This should be included where-ever the NANO_LOG
@@ -60,8 +66,327 @@ namespace LogLevels {
 };
 using namespace LogLevels;
 
+/**
+ * Determines what a logging thread does when it invokes NANO_LOG, but its
+ * StagingBuffer does not have enough free space for the log message (i.e. the
+ * background thread has fallen behind).
+ */
+enum OverflowPolicy {
+    /**
+     * Wait for the background thread to free up space. No log messages are
+     * lost, but the logging thread may stall for an unbounded amount of time.
+     */
+    BLOCK_ON_FULL = 0,
+
+    /**
+     * Drop the log message and return immediately. The number of messages
+     * dropped (and at which NANO_LOG sites) is recorded in the log before the
+     * next message from the same thread that does fit.
+     */
+    DROP_ON_FULL
+};
+
+/**
+ * Selects the mechanism that the background thread uses to write the
+ * compressed log to the log file asynchronously.
+ */
+enum IoBackendType {
+    /**
+     * Linux io_uring: writes are submitted with one system call and their
+     * completions are reaped from shared memory without any. Falls back to
+     * POSIX_AIO when the kernel doesn't support io_uring (or forbids it).
+     */
+    IO_URING = 0,
+
+    /**
+     * POSIX AIO (aio_write), which glibc implements with a helper thread
+     * doing blocking writes.
+     */
+    POSIX_AIO
+};
+
+/**
+ * Selects what it takes for the log messages written to the log file to
+ * survive an operating system crash or a power failure, at the cost of
+ * device flushes.
+ */
+enum DurabilityMode {
+    /**
+     * The writes only reach the page cache and the kernel writes them back
+     * at its own pace.
+     */
+    PAGE_CACHE = 0,
+
+    /**
+     * Like PAGE_CACHE, but the log file is fdatasync()-ed every
+     * Config::syncIntervalMs or Config::syncIntervalBytes, whichever comes
+     * first.
+     */
+    PERIODIC_FDATASYNC,
+
+    /**
+     * Like PERIODIC_FDATASYNC, but with sync_file_range(), which only starts
+     * the writeback of the newly written part of the log file. It bounds the
+     * amount of dirty data without waiting on the device, but doesn't
+     * guarantee durability.
+     */
+    PERIODIC_SYNC_FILE_RANGE,
+
+    /**
+     * Every write is durable once it completes (O_DSYNC).
+     */
+    DSYNC,
+
+    /**
+     * Like DSYNC, but the writes also bypass the page cache (O_DIRECT). They
+     * are padded to multiples of 512 bytes, which the decompressor skips.
+     */
+    DIRECT_IO
+};
+
+/**
+ * Selects how the background thread waits for log messages when it has
+ * nothing to do.
+ */
+enum WakeupPolicy {
+    /**
+     * Sleep for Config::pollIntervalNoWorkUs at a time and check again.
+     */
+    POLL = 0,
+
+    /**
+     * Keep checking for Config::backoffSpinUs, then back off exponentially
+     * with PAUSE instructions for Config::backoffPauseUs, then sleep on a
+     * futex until a logging thread logs to an idle StagingBuffer. Idles
+     * without CPU use or timer wakeups, yet wakes up quickly.
+     */
+    ADAPTIVE_BACKOFF,
+
+    /**
+     * Never sleep, for the lowest latency at the cost of a busy core. The
+     * background thread should get a core of its own with
+     * Config::compressionThreadCore.
+     */
+    BUSY_POLL
+};
+
+// Defined in OutputSink.h
+class OutputSink;
+
+/**
+ * Settings accepted by NanoLog::init().
+ */
+struct Config {
+    /**
+     * Where to place the log file; nullptr means
+     * NanoLogConfig::DEFAULT_LOG_FILE.
+     */
+    const char *logFile = nullptr;
+
+    /**
+     * Minimum severity of the messages that are logged (see setLogLevel())
+     */
+    LogLevel logLevel = NOTICE;
+
+    /**
+     * What logging threads do when their StagingBuffer is full (see
+     * setOverflowPolicy())
+     */
+    OverflowPolicy overflowPolicy = BLOCK_ON_FULL;
+
+    // The settings below are fixed once NanoLog is initialized. Their
+    // defaults come from Config.h, where they're documented.
+
+    /**
+     * Maximum byte size of a thread's StagingBuffer; a power of 2 that's at
+     * least NanoLogConfig::SPILL_SEGMENT_SIZE if spilling is enabled.
+     */
+    uint32_t stagingBufferSize = NanoLogConfig::STAGING_BUFFER_SIZE;
+
+    /**
+     * Byte size that a thread's StagingBuffer starts out with; no larger
+     * than stagingBufferSize.
+     */
+    uint32_t initialStagingBufferSize =
+                                NanoLogConfig::INITIAL_STAGING_BUFFER_SIZE;
+
+    /**
+     * Byte size of each of the output buffers that the compressed log is
+     * staged in; at least stagingBufferSize and
+     * NanoLogConfig::ASSIST_BUFFER_SIZE.
+     */
+    uint32_t outputBufferSize = NanoLogConfig::OUTPUT_BUFFER_SIZE;
+
+    /**
+     * Number of output buffers; at least 2. Up to numOutputBuffers - 1 of
+     * them can be written to the log file at once.
+     */
+    uint32_t numOutputBuffers = NanoLogConfig::NUM_OUTPUT_BUFFERS;
+
+    /**
+     * Number of bytes the background thread consumes from a StagingBuffer
+     * before releasing them to the producer; 0 means half of
+     * stagingBufferSize.
+     */
+    uint32_t releaseThreshold = 0;
+
+    /**
+     * How long (in microseconds) the background thread sleeps when there's
+     * nothing to compress
+     */
+    uint32_t pollIntervalNoWorkUs = NanoLogConfig::POLL_INTERVAL_NO_WORK_US;
+
+    /**
+     * How long (in microseconds) the background thread sleeps when it's
+     * waiting on an IO to complete
+     */
+    uint32_t pollIntervalDuringIoUs =
+                                NanoLogConfig::POLL_INTERVAL_DURING_IO_US;
+
+    /**
+     * How the background thread and compression workers wait for log
+     * messages (see WakeupPolicy)
+     */
+    WakeupPolicy wakeupPolicy = POLL;
+
+    /**
+     * How long (in microseconds) the background thread spins and then backs
+     * off with PAUSE instructions before it sleeps with ADAPTIVE_BACKOFF
+     */
+    uint32_t backoffSpinUs = NanoLogConfig::BACKOFF_SPIN_US;
+    uint32_t backoffPauseUs = NanoLogConfig::BACKOFF_PAUSE_US;
+
+    /**
+     * Core to pin the background thread to; -1 leaves it to the scheduler.
+     */
+    int compressionThreadCore = -1;
+
+    /**
+     * Number of compression workers that compress log messages in parallel
+     * with the background thread; less than CPU_SETSIZE. They require a
+     * non-zero NanoLogConfig::ASSIST_BUFFER_SIZE and don't apply to the
+     * COMPRESSION_DAEMON.
+     */
+    uint32_t numCompressionWorkers = NanoLogConfig::NUM_COMPRESSION_WORKERS;
+
+    /**
+     * Number of compressed bytes that are batched up before they're written
+     * to the log file
+     */
+    uint32_t flushMinBytes = NanoLogConfig::FLUSH_MIN_BYTES;
+
+    /**
+     * Maximum time (in microseconds) that a compressed log message waits to
+     * be batched with others before it's written to the log file
+     */
+    uint32_t flushMaxDelayUs = NanoLogConfig::FLUSH_MAX_DELAY_US;
+
+    /**
+     * Log messages at this LogLevel or a more severe one are written to the
+     * log file within flushLogLevelMaxDelayUs (in microseconds) of being
+     * compressed, regardless of the two settings above, and their logging
+     * threads wake up the background thread for them. With the
+     * PERIODIC_FDATASYNC durability mode, that write is also fdatasync()-ed.
+     * SILENT_LOG_LEVEL batches all log messages alike.
+     */
+    LogLevel flushLogLevel = ERROR;
+    uint32_t flushLogLevelMaxDelayUs =
+                                NanoLogConfig::FLUSH_LOG_LEVEL_MAX_DELAY_US;
+
+    /**
+     * Flags that the log files are opened with (see open(2)); they must
+     * allow writing.
+     */
+    int fileFlags = NanoLogConfig::FILE_PARAMS;
+
+    /**
+     * How the log file is written to (see IoBackendType)
+     */
+    IoBackendType ioBackend = IO_URING;
+
+    /**
+     * How durable the writes to the log file are (see DurabilityMode); the
+     * flags the mode needs are added to fileFlags.
+     */
+    DurabilityMode durabilityMode = DSYNC;
+
+    /**
+     * Maximum time (in milliseconds) between two syncs of the log file in
+     * the PERIODIC_* durability modes
+     */
+    uint32_t syncIntervalMs = NanoLogConfig::SYNC_INTERVAL_MS;
+
+    /**
+     * Number of bytes written to the log file after which the PERIODIC_*
+     * durability modes sync it, regardless of syncIntervalMs
+     */
+    uint32_t syncIntervalBytes = NanoLogConfig::SYNC_INTERVAL_BYTES;
+
+    /**
+     * Size of the chunks in which space is reserved for the log file ahead
+     * of the writes with fallocate(), so that extending it doesn't allocate
+     * blocks on every write; 0 (the default) disables it. The space past
+     * the end of the log file is released when NanoLog closes it.
+     */
+    uint32_t fallocateChunkSize = NanoLogConfig::FALLOCATE_CHUNK_SIZE;
+
+    /**
+     * Size (in bytes) at which the log file is rotated; 0 disables it. The
+     * log file is only rotated between writes, so it may exceed this by up
+     * to an output buffer.
+     */
+    uint64_t rotateMaxBytes = NanoLogConfig::ROTATE_MAX_BYTES;
+
+    /**
+     * Time (in seconds) after which the log file is rotated; 0 disables it.
+     * Log files that no log messages were written to are not rotated.
+     */
+    uint32_t rotateMaxAgeSec = NanoLogConfig::ROTATE_MAX_AGE_SEC;
+
+    /**
+     * Number of rotated log files that are kept, named after the log file
+     * with the suffixes .1 (the most recent) through .<rotateKeep>; at least
+     * 1 if the log file is rotated.
+     */
+    uint32_t rotateKeep = NanoLogConfig::ROTATE_KEEP;
+
+    /**
+     * Invoked by the background thread with the name that the log file was
+     * just rotated to (i.e. with the .1 suffix), e.g. to hand it to a log
+     * shipper; nullptr for none. It should return quickly and must not log.
+     */
+    void (*rotatedCallback)(const char *rotatedFile) = nullptr;
+
+    /**
+     * Receives the compressed log in addition to the log file (see
+     * OutputSink); use a TeeSink to send it to several. nullptr for none.
+     * It's not taken over and must outlive NanoLog.
+     */
+    OutputSink *outputSink = nullptr;
+};
+
 // User API
 
+/**
+ * Initializes the NanoLog system: opens the log file, allocates the output
+ * buffers and starts the background compression thread. Nothing is set up
+ * before then, so programs that never log don't pay for it. Invoking this is
+ * optional; NanoLog initializes itself with the default Config when the
+ * first log message is logged or setLogFile() is invoked. Invoking it again
+ * afterwards applies the log file, log level and overflow policy like the
+ * individual setters do, but the other settings can no longer change.
+ *
+ * An std::invalid_argument exception will be thrown if the Config is invalid
+ * or the buffer sizes, poll intervals, wakeup policy, flush policy, file
+ * flags, I/O backend, durability, rotation or output sink settings differ
+ * from the ones NanoLog was already initialized with, and an
+ * std::ios_base::failure if the log file cannot be opened/created
+ *
+ * \param config
+ *      Settings to initialize NanoLog with
+ */
+void init(const Config &config = Config());
+
 /**
  * Preallocate the thread-local data structures needed by the
  * NanoLog system for the current thread. Although optional, it is
@@ -70,6 +395,20 @@ using namespace LogLevels;
  */
 void preallocate();
 
+/**
+ * Preallocate the thread-local data structures needed by the NanoLog system
+ * for the current thread with a StagingBuffer that holds at least the given
+ * number of bytes. StagingBuffers normally start out small and grow when
+ * their thread runs out of space, so threads that are known to log heavily
+ * can use this to avoid the growth steps. The StagingBuffer won't shrink
+ * below this size when it's idle.
+ *
+ * \param bytes
+ *      Number of bytes of staging space to reserve; rounded up and capped
+ *      at Config::stagingBufferSize.
+ */
+void preallocate(size_t bytes);
+
 /**
  * Sets the file location for the NanoLog output. All NANO_LOG statements
  * invoked after this function returns are guaranteed to be in the new file
@@ -96,14 +435,64 @@ void setLogLevel(LogLevel logLevel);
  */
 LogLevel getLogLevel();
 
+/**
+ * Sets what logging threads should do when their StagingBuffer is full.
+ * The default is BLOCK_ON_FULL.
+ *
+ * \param policy
+ *      New overflow policy to set
+ */
+void setOverflowPolicy(OverflowPolicy policy);
+
+/**
+ * Returns the current overflow policy enforced by NanoLog
+ */
+OverflowPolicy getOverflowPolicy();
+
 /**
  * Waits until all pending log statements are persisted to disk. Note that if
  * there is another logging thread continually adding new pending log
  * statements, this function may not return until all threads stop logging and
  * all the new log statements are also persisted.
+ *
+ * With NanoLogConfig::COMPRESSION_DAEMON, this waits for the nanologd to
+ * write out the log statements, for as long as it takes it to start.
  */
 void sync();
 
+/**
+ * Like sync(), but waits for at most the given time. The pending log
+ * statements are still persisted after it gives up.
+ *
+ * \param timeoutMs
+ *      Maximum time to wait for in milliseconds
+ *
+ * \return
+ *      True if the log statements were persisted; false if the time ran out
+ */
+bool syncFor(uint32_t timeoutMs);
+
+/**
+ * Requests that the pending log statements are persisted to disk like
+ * sync() does, but returns right away. The callback is invoked once they
+ * are; concurrent requests are batched together into one flush.
+ *
+ * The callback is invoked by the background thread (or, with
+ * NanoLogConfig::COMPRESSION_DAEMON, by a thread started to wait for the
+ * nanologd), so it should return quickly and must not invoke sync() or
+ * syncFor(). It's invoked right away if nothing was logged yet.
+ *
+ * \param callback
+ *      Invoked once the log statements are persisted
+ */
+void syncAsync(std::function<void()> callback);
+
+/**
+ * Like syncAsync(callback), but returns a future that becomes ready once
+ * the pending log statements are persisted.
+ */
+std::future<void> syncAsync();
+
 // Debugging API
 
 /**
@@ -132,6 +521,7 @@ int getCoreIdOfBackgroundThread();
 // included here so that the user of the NanoLog system only has to
 // #include one file.
 #include <cstring>         /* strlen + memcpy */
+#include "OutputSink.h"
 #include "RuntimeLogger.h"
 
 #endif // NANOLOG_H
@@ -19,6 +19,7 @@
 #include <cstring>
 
 #include <algorithm>
+#include <array>
 #include <iostream>
 #include <utility>
 
@@ -955,12 +956,33 @@ compress(int numNibbles, const ParamType *paramTypes, char **input, char **outpu
     *output = out;
 }
 
+/**
+ * Resolves to the compression function for a set of log arguments as the
+ * value member of the return type of getCompressionFunction(). This allows
+ * NANO_LOG() to name the function in a constant expression without evaluating
+ * its arguments.
+ *
+ * \tparam Ts
+ *      Types of the arguments passed in for the log
+ */
+template<typename... Ts>
+struct CompressionFunction {
+    static constexpr StaticLogInfo::CompressionFn value = &compress<Ts...>;
+};
+
+/**
+ * Declared for use in unevaluated contexts only (see CompressionFunction).
+ * The argument types are deduced the same way as in log().
+ */
+template<typename... Ts>
+CompressionFunction<Ts...> getCompressionFunction(Ts... args);
+
 /**
  * Logs a log message in the NanoLog system given all the static and dynamic
  * information associated with the log message. This function is meant to work
  * in conjunction with the #define-d NANO_LOG() and expects the caller to
  * maintain a permanent mapping of logId to static information once it's
- * assigned by this function.
+ * assigned by the RuntimeLogger.
  *
  * \tparam N
  *      length of the format string (automatically deduced)
@@ -971,8 +993,10 @@ compress(int numNibbles, const ParamType *paramTypes, char **input, char **outpu
  *
  * \param logId[in/out]
  *      LogId that should be permanently associated with the static information.
- *      An input value of -1 indicates that NanoLog should persist the static
- *      log information and assign a new, globally unique identifier.
+ *      It's normally assigned at startup for sites linked with
+ *      NANOLOG_LINK_INVOCATION_SITE. An input value of -1 indicates that
+ *      NanoLog should persist the static log information and assign a new,
+ *      globally unique identifier.
  * \param filename
  *      Name of the file containing the log invocation
  * \param linenum
@@ -1005,7 +1029,7 @@ log(int &logId,
     using namespace NanoLogInternal::Log;
     assert(N == static_cast<uint32_t>(sizeof...(Ts)));
 
-    if (logId == UNASSIGNED_LOGID) {
+    if (logId == UNASSIGNED_LOGID || logId == PENDING_LOGID) {
         const ParamType *array = paramTypes.data();
         StaticLogInfo info(&compress<Ts...>,
                         filename,
@@ -1025,7 +1049,11 @@ log(int &logId,
     size_t allocSize = getArgSizes(paramTypes, previousPrecision,
                             stringSizes, args...) + sizeof(UncompressedEntry);
 
-    char *writePos = NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize);
+    char *writePos = NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize,
+                                                    static_cast<uint32_t>(logId));
+    if (writePos == nullptr)
+        return;
+
     auto originalWritePos = writePos;
 
     UncompressedEntry *ue = new(writePos) UncompressedEntry();
@@ -1039,11 +1067,11 @@ log(int &logId,
 
 #ifdef ENABLE_DEBUG_PRINTING
     printf("\r\nRecording %d:'%s' of size %u\r\n",
-                        logId, info.formatString, ue->entrySize);
+                        logId, format, ue->entrySize);
 #endif
 
     assert(allocSize == downCast<uint32_t>((writePos - originalWritePos)));
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, severity);
 }
 
 /**
@@ -1079,10 +1107,17 @@ checkFormat(NANOLOG_PRINTF_FORMAT const char *, ...) {}
      * The static logId is used to forever associate this local scope (tied
      * to an expansion of #NANO_LOG) with an id and the paramTypes array is
      * used by the compression function, which is invoked in another thread
-     * at a much later time. */ \
+     * at a much later time. Both are linked into the nanolog_sites section
+     * along with the rest of the static information so that the id can be
+     * assigned at startup. */ \
     static constexpr std::array<NanoLogInternal::ParamType, nParams> paramTypes = \
                                 NanoLogInternal::analyzeFormatString<nParams>(format); \
+    static constexpr NanoLogInternal::StaticLogInfo logSite( \
+            decltype(NanoLogInternal::getCompressionFunction(__VA_ARGS__))::value, \
+            __FILE__, __LINE__, NanoLog::severity, format, nParams, numNibbles, \
+            paramTypes.data()); \
     static int logId = NanoLogInternal::UNASSIGNED_LOGID; \
+    NANOLOG_LINK_INVOCATION_SITE(logSite, logId); \
     \
     if (NanoLog::severity > NanoLog::getLogLevel()) \
         break; \
@@ -36,7 +36,8 @@ class NanoLogCpp17Test : public ::testing::Test {
     NanoLogCpp17Test()
     : bufferSize(NanoLogConfig::STAGING_BUFFER_SIZE)
     , halfSize(bufferSize/2)
-    , sb(new RuntimeLogger::StagingBuffer(0))
+    , sb(new RuntimeLogger::StagingBuffer(0,
+                                    NanoLogConfig::STAGING_BUFFER_SIZE))
   {
       static_assert(1024 <= NanoLogConfig::STAGING_BUFFER_SIZE,
                                 "Test requires at least 1KB of buffer space");
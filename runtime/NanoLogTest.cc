@@ -13,16 +13,290 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <deque>
+#include <limits>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
 #include "gtest/gtest.h"
 
 #include "TestUtil.h"
 
+#include "Daemon.h"
+#include "GeneratedCode.h"
+#include "IoBackend.h"
+#include "OutputSink.h"
+#include "Recovery.h"
 #include "RuntimeLogger.h"
 
 namespace {
 using namespace NanoLogInternal;
 using namespace PerfUtils;
 
+// Returns the number of pages of a buffer that are resident in memory
+size_t countResidentPages(void *buffer, size_t bytes) {
+    std::vector<unsigned char> residency((bytes + 4095)/4096);
+    if (mincore(buffer, bytes, residency.data()) != 0)
+        return 0;
+
+    size_t resident = 0;
+    for (unsigned char page : residency)
+        resident += (page & 1);
+    return resident;
+}
+
+void stopCompressionThread() {
+    // The compression thread is only started on first use
+    RuntimeLogger::nanoLogSingleton.ensureInitialized();
+
+    {
+        std::lock_guard<std::mutex> lock(
+                RuntimeLogger::nanoLogSingleton.condMutex);
+        RuntimeLogger::nanoLogSingleton.compressionThreadShouldExit = true;
+        RuntimeLogger::nanoLogSingleton.workAdded.notify_all();
+    }
+
+    if (RuntimeLogger::nanoLogSingleton.compressionThread.joinable()) {
+        RuntimeLogger::nanoLogSingleton.compressionThread.join();
+    }
+}
+
+void restartCompressionThread() {
+    stopCompressionThread();
+
+    RuntimeLogger::nanoLogSingleton.compressionThreadShouldExit = false;
+    RuntimeLogger::nanoLogSingleton.compressionThread =
+            std::thread(&RuntimeLogger::compressionThreadMain,
+                        &RuntimeLogger::nanoLogSingleton);
+}
+
+// Places a DroppedLogs record (which can be compressed without a dictionary)
+// into a StagingBuffer and returns its size.
+size_t stageDroppedLogsRecord(RuntimeLogger::StagingBuffer *sb,
+                              uint64_t timestamp) {
+    size_t recordBytes = sizeof(Log::UncompressedEntry)
+                            + sizeof(Log::DroppedLogs);
+    auto *entry = reinterpret_cast<Log::UncompressedEntry*>(
+                                    sb->reserveProducerSpace(recordBytes));
+    entry->fmtId = Log::DROPPED_LOGS_ID;
+    entry->entrySize = downCast<uint32_t>(recordBytes);
+    entry->timestamp = timestamp;
+
+    auto *droppedLogs = reinterpret_cast<Log::DroppedLogs*>(entry->argData);
+    droppedLogs->numDropped = 1;
+    droppedLogs->numSites = 0;
+    sb->finishReservation(recordBytes);
+    return recordBytes;
+}
+
+// Places a log message without arguments from testHelper/client.cc with the
+// given LogLevel into a StagingBuffer
+void stageLogMessage(RuntimeLogger::StagingBuffer *sb, LogLevel level) {
+    uint32_t fmtId = 0;
+    while (GeneratedFunctions::logId2Metadata[fmtId].logLevel != level ||
+            strchr(GeneratedFunctions::logId2Metadata[fmtId].fmtString, '%'))
+        ++fmtId;
+    ASSERT_LT(fmtId, GeneratedFunctions::numLogIds);
+
+    size_t recordBytes = sizeof(Log::UncompressedEntry);
+    auto *entry = reinterpret_cast<Log::UncompressedEntry*>(
+                                    sb->reserveProducerSpace(recordBytes));
+    entry->fmtId = fmtId;
+    entry->entrySize = downCast<uint32_t>(recordBytes);
+    entry->timestamp = Cycles::rdtsc();
+    sb->finishReservation(recordBytes);
+}
+
+// Places a DroppedLogs record from a thread into a per-CPU StagingBuffer and
+// returns the record reserved for it, committing it if requested.
+char *stageDroppedLogsRecord(RuntimeLogger::CpuStagingBuffer *cb,
+                             uint32_t threadId, uint64_t timestamp,
+                             bool commit = true) {
+    size_t recordBytes = sizeof(Log::UncompressedEntry)
+                            + sizeof(Log::DroppedLogs);
+    char *reservation = nullptr;
+    auto *entry = reinterpret_cast<Log::UncompressedEntry*>(
+            cb->reserveProducerSpace(recordBytes, threadId, &reservation));
+    entry->fmtId = Log::DROPPED_LOGS_ID;
+    entry->entrySize = downCast<uint32_t>(recordBytes);
+    entry->timestamp = timestamp;
+
+    auto *droppedLogs = reinterpret_cast<Log::DroppedLogs*>(entry->argData);
+    droppedLogs->numDropped = 1;
+    droppedLogs->numSites = 0;
+    if (commit)
+        RuntimeLogger::CpuStagingBuffer::finishReservation(reservation,
+                                                           recordBytes);
+    return reservation;
+}
+
+// Pushes a StagingBuffer on the front of the RuntimeLogger's threadBuffers
+// without handing it to the compression thread.
+void pushThreadBuffer(RuntimeLogger::StagingBuffer *sb) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    sb->nextThreadBuffer = logger.threadBuffers.load();
+    logger.threadBuffers = sb;
+}
+
+// Removes the StagingBuffer at the front of the RuntimeLogger's threadBuffers.
+void popThreadBuffer() {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    logger.threadBuffers = logger.threadBuffers.load()->nextThreadBuffer.load();
+}
+
+// Names passed to the rotatedCallback (see recordRotatedFile())
+std::vector<std::string> rotatedFiles;
+
+void recordRotatedFile(const char *rotatedFile) {
+    rotatedFiles.push_back(rotatedFile);
+}
+
+// IoBackend whose writes reach the file right away, but only complete once
+// the test releases them. Each write also checks that its buffer isn't
+// modified while it's in flight.
+class HeldIoBackend : public IoBackend {
+  public:
+    explicit HeldIoBackend(uint32_t maxOutstanding)
+        : IoBackend(maxOutstanding)
+        , mutex()
+        , writes()
+        , holdWrites(true)
+        , numRetired(0)
+        , numOverwritten(0)
+        , savedBackend(nullptr)
+        , savedBufferIndex(0)
+    {}
+
+    bool
+    submitWrite(int fd, const char *buffer, size_t nbytes, off_t offset,
+                bool datasync) {
+        (void)datasync;
+        if (numOutstanding == maxOutstanding) {
+            errno = EBUSY;
+            return false;
+        }
+
+        if (pwrite(fd, buffer, nbytes, offset) != static_cast<ssize_t>(nbytes))
+            return false;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        writes.push_back({buffer, std::string(buffer, nbytes), !holdWrites});
+        ++numOutstanding;
+        return true;
+    }
+
+    bool
+    isWriteComplete() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return numOutstanding > 0 && writes[numRetired].released;
+    }
+
+    ssize_t
+    waitForWrite() {
+        while (!isWriteComplete())
+            std::this_thread::yield();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Write &write = writes[numRetired++];
+        if (write.contents.compare(0, std::string::npos, write.buffer,
+                                   write.contents.size()) != 0)
+            ++numOverwritten;
+        --numOutstanding;
+        return static_cast<ssize_t>(write.contents.size());
+    }
+
+    const char *
+    getName() {
+        return "held";
+    }
+
+    // Lets the index-th write submitted complete
+    void
+    release(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        writes.at(index).released = true;
+    }
+
+    // Lets all the writes complete, including the ones submitted later
+    void
+    releaseAll() {
+        std::lock_guard<std::mutex> lock(mutex);
+        holdWrites = false;
+        for (Write &write : writes)
+            write.released = true;
+    }
+
+    size_t
+    getNumSubmitted() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return writes.size();
+    }
+
+    size_t
+    getWriteBytes(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return writes.at(index).contents.size();
+    }
+
+    const char *
+    getWriteBuffer(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return writes.at(index).buffer;
+    }
+
+    // A write that was submitted, and what its buffer held at the time
+    struct Write {
+        const char *buffer;
+        std::string contents;
+        bool released;
+    };
+
+    std::mutex mutex;
+    std::deque<Write> writes;
+    bool holdWrites;
+    size_t numRetired;
+    uint32_t numOverwritten;
+
+    // State of the RuntimeLogger replaced by holdOutputWrites()
+    IoBackend *savedBackend;
+    uint32_t savedBufferIndex;
+};
+
+// Makes the stopped compression thread output through a HeldIoBackend and a
+// ring of 3 output buffers, so that up to 2 writes can be held in flight.
+HeldIoBackend *holdOutputWrites() {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    HeldIoBackend *backend = new HeldIoBackend(2);
+    backend->savedBackend = logger.ioBackend;
+    backend->savedBufferIndex = logger.compressingBufferIndex;
+    logger.ioBackend = backend;
+    logger.outputBuffers.push_back(logger.allocBuffer(
+                                        logger.config.outputBufferSize));
+    if (NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+        Recovery::getHeader(logger.outputBuffers.back())->type =
+                                                    Recovery::OUTPUT_BUFFER;
+    logger.config.numOutputBuffers = 3;
+    return backend;
+}
+
+// Undoes holdOutputWrites() once the compression thread is stopped again and
+// its config restored.
+void restoreOutputWrites(HeldIoBackend *backend) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    logger.ioBackend = backend->savedBackend;
+    logger.freeBuffer(logger.outputBuffers.back(),
+                      logger.config.outputBufferSize);
+    logger.outputBuffers.pop_back();
+    logger.compressingBufferIndex = backend->savedBufferIndex;
+    logger.compressingBuffer = logger.outputBuffers[backend->savedBufferIndex];
+    delete backend;
+}
+
 // The fixture for testing class Foo.
 class NanoLogTest : public ::testing::Test {
  protected:
@@ -32,16 +306,27 @@ class NanoLogTest : public ::testing::Test {
   uint32_t halfSize;
   RuntimeLogger::StagingBuffer *sb;
 
+  // Saved state of the SpillSegment pool (see disableSpilling())
+  uint32_t savedNumSpillSegments;
+  uint64_t savedSpillFreeList;
+
   NanoLogTest()
     : bufferSize(NanoLogConfig::STAGING_BUFFER_SIZE)
     , halfSize(bufferSize/2)
-    , sb(new RuntimeLogger::StagingBuffer(0))
+    , sb(new RuntimeLogger::StagingBuffer(0,
+                                    NanoLogConfig::STAGING_BUFFER_SIZE))
+    , savedNumSpillSegments(
+                    RuntimeLogger::nanoLogSingleton.numSpillSegments.load())
+    , savedSpillFreeList(RuntimeLogger::nanoLogSingleton.spillFreeList.load())
   {
       static_assert(1024 <= NanoLogConfig::STAGING_BUFFER_SIZE,
                                 "Test requires at least 1KB of buffer space");
   }
 
   virtual ~NanoLogTest() {
+    RuntimeLogger::nanoLogSingleton.numSpillSegments = savedNumSpillSegments;
+    RuntimeLogger::nanoLogSingleton.spillFreeList = savedSpillFreeList;
+
     if (sb) {
         // Since the tests screw with internal state, it's best to
         // reset them before exiting
@@ -66,6 +351,14 @@ class NanoLogTest : public ::testing::Test {
     // before the destructor).
   }
 
+  // Makes the SpillSegment pool appear exhausted so that a full
+  // StagingBuffer blocks (or fails) rather than spills.
+  void disableSpilling() {
+    RuntimeLogger::nanoLogSingleton.numSpillSegments =
+                                    RuntimeLogger::MAX_SPILL_SEGMENTS;
+    RuntimeLogger::nanoLogSingleton.spillFreeList = 0;
+  }
+
   // Objects declared here can be used by all tests in the test case for Foo.
 };
 
@@ -86,6 +379,8 @@ TEST_F(NanoLogTest, StagingBuffer_reserveProducerSpace)
 
 TEST_F(NanoLogTest, StagingBuffer_reserveSpaceInternal)
 {
+    disableSpilling();
+
     // Case 1: Empty buffer
     EXPECT_EQ(bufferSize, sb->minFreeSpace);
     EXPECT_EQ(sb->storage, sb->reserveSpaceInternal(100));
@@ -138,6 +433,8 @@ TEST_F(NanoLogTest, StagingBuffer_reserveSpaceInternal)
 
 TEST_F(NanoLogTest, StagingBuffer_reserveSpaceInternal_rollover_prevention)
 {
+    disableSpilling();
+
     // Setup the situation where the consumer is at position 0 and the producer
     // needs to roll over. When this situation occurs, the producer should
     // NOT roll over, otherwise the two positions overlap, which we have defined
@@ -153,6 +450,2256 @@ TEST_F(NanoLogTest, StagingBuffer_reserveSpaceInternal_rollover_prevention)
     EXPECT_EQ(nullptr, sb->reserveSpaceInternal(1, false));
 }
 
+TEST_F(NanoLogTest, StagingBuffer_recordDroppedLog) {
+    sb->recordDroppedLog(5);
+    EXPECT_EQ(0U, sb->minFreeSpace);
+    EXPECT_LT(0U, sb->firstDropTimestamp);
+    uint64_t firstDropTimestamp = sb->firstDropTimestamp;
+
+    sb->recordDroppedLog(7);
+    sb->recordDroppedLog(5);
+    EXPECT_EQ(firstDropTimestamp, sb->firstDropTimestamp);
+    EXPECT_EQ(3U, sb->numDroppedPending);
+    EXPECT_EQ(3U, sb->numLogsDropped);
+    ASSERT_EQ(2U, sb->numDroppedSites);
+    EXPECT_EQ(5U, sb->droppedSites[0].logId);
+    EXPECT_EQ(2U, sb->droppedSites[0].count);
+    EXPECT_EQ(7U, sb->droppedSites[1].logId);
+    EXPECT_EQ(1U, sb->droppedSites[1].count);
+
+    // Sites past the maximum are only counted in the total
+    for (uint32_t i = 0; i < NanoLogConfig::MAX_DROPPED_LOG_SITES; ++i)
+        sb->recordDroppedLog(100 + i);
+
+    EXPECT_EQ(NanoLogConfig::MAX_DROPPED_LOG_SITES, sb->numDroppedSites);
+    EXPECT_EQ(3U + NanoLogConfig::MAX_DROPPED_LOG_SITES, sb->numDroppedPending);
+    EXPECT_EQ(3U + NanoLogConfig::MAX_DROPPED_LOG_SITES, sb->numLogsDropped);
+}
+
+TEST_F(NanoLogTest, StagingBuffer_reserveSpaceAfterDroppedLogs) {
+    disableSpilling();
+    RuntimeLogger::nanoLogSingleton.overflowPolicy = DROP_ON_FULL;
+    size_t recordBytes = sizeof(Log::UncompressedEntry)
+                            + sizeof(Log::DroppedLogs)
+                            + sizeof(Log::DroppedLogSite);
+
+    // Case 1: Full buffer drops the log message
+    char *start = sb->storage + halfSize;
+    sb->minFreeSpace = 0;
+    sb->producerPos = start;
+    sb->consumerPos = start + 50;
+    EXPECT_EQ(nullptr, sb->reserveProducerSpace(100));
+    sb->recordDroppedLog(3);
+
+    // Case 2: Enough space for the record, but not the log message after it
+    sb->consumerPos = start + recordBytes + 50;
+    EXPECT_EQ(nullptr, sb->reserveProducerSpace(100));
+    EXPECT_EQ(start, sb->producerPos);
+    EXPECT_EQ(1U, sb->numDroppedPending);
+
+    // Case 3: Enough space for both
+    sb->consumerPos = start + recordBytes + 101;
+    EXPECT_EQ(start + recordBytes, sb->reserveProducerSpace(100));
+    EXPECT_EQ(start + recordBytes, sb->producerPos);
+    EXPECT_EQ(0U, sb->numDroppedPending);
+    EXPECT_EQ(101U, sb->minFreeSpace);
+
+    auto *entry = reinterpret_cast<Log::UncompressedEntry*>(start);
+    EXPECT_EQ(Log::DROPPED_LOGS_ID, entry->fmtId);
+    EXPECT_EQ(recordBytes, entry->entrySize);
+    EXPECT_EQ(sb->firstDropTimestamp, entry->timestamp);
+
+    auto *droppedLogs = reinterpret_cast<Log::DroppedLogs*>(entry->argData);
+    EXPECT_EQ(1U, droppedLogs->numDropped);
+    ASSERT_EQ(1U, droppedLogs->numSites);
+    EXPECT_EQ(3U, droppedLogs->sites[0].logId);
+    EXPECT_EQ(1U, droppedLogs->sites[0].count);
+
+    // Case 4: Without drops, the fast path is used again
+    sb->finishReservation(100);
+    EXPECT_EQ(start + recordBytes + 100, sb->reserveProducerSpace(0));
+
+    RuntimeLogger::nanoLogSingleton.overflowPolicy = BLOCK_ON_FULL;
+}
+
+TEST_F(NanoLogTest, StagingBuffer_spill) {
+    uint64_t bytesAvailable = 0;
+    uint32_t segmentSize = NanoLogConfig::SPILL_SEGMENT_SIZE;
+
+    // Fill storage[] to the brim
+    sb->reserveProducerSpace(bufferSize - 100);
+    sb->finishReservation(bufferSize - 100);
+    sb->peek(&bytesAvailable);
+    sb->consume(100);
+
+    // Case 1: Out of space in storage[] (even after rolling over); move to
+    // a SpillSegment
+    char *ringEnd = sb->storage;
+    char *writePos = sb->reserveProducerSpace(200);
+    ASSERT_NE(nullptr, sb->spillTail);
+    EXPECT_EQ(sb->spillTail->storage, writePos);
+    EXPECT_EQ(sb->spillTail, sb->spillHead);
+    EXPECT_EQ(ringEnd, sb->spillRingEnd);
+    EXPECT_EQ(1U, sb->numTimesSpilled);
+    sb->finishReservation(200);
+
+    // Case 2: Out of space in the SpillSegment, but storage[] was not
+    // drained yet, so the producer should chain another segment
+    RuntimeLogger::SpillSegment *first = sb->spillTail;
+    sb->reserveProducerSpace(segmentSize - 300);
+    sb->finishReservation(segmentSize - 300);
+    writePos = sb->reserveProducerSpace(200);
+    RuntimeLogger::SpillSegment *second = sb->spillTail;
+    ASSERT_NE(first, second);
+    EXPECT_EQ(second->storage, writePos);
+    EXPECT_EQ(second, first->next);
+    EXPECT_EQ(first->storage + segmentSize - 100, first->end);
+    sb->finishReservation(200);
+
+    // The consumer should drain storage[] before the segments.
+    sb->peek(&bytesAvailable);
+    EXPECT_EQ(bufferSize - 200, bytesAvailable);
+    sb->consume(bytesAvailable);
+    EXPECT_EQ(first->storage, sb->peek(&bytesAvailable));
+    EXPECT_EQ(sb->spillRingEnd, sb->consumerPos);
+    EXPECT_EQ(segmentSize - 100, bytesAvailable);
+    EXPECT_EQ(first, sb->consumerSegment);
+    EXPECT_EQ(nullptr, sb->spillHead);
+    sb->consume(bytesAvailable);
+
+    EXPECT_EQ(second->storage, sb->peek(&bytesAvailable));
+    EXPECT_EQ(200U, bytesAvailable);
+    EXPECT_EQ(second, sb->consumerSegment);
+
+    // Case 3: storage[] was drained, so the producer returns to it even
+    // though the segment is not fully consumed yet.
+    sb->reserveProducerSpace(segmentSize - 300);
+    sb->finishReservation(segmentSize - 300);
+    writePos = sb->reserveProducerSpace(200);
+    EXPECT_EQ(ringEnd, writePos);
+    EXPECT_EQ(nullptr, sb->spillTail);
+    EXPECT_EQ(nullptr, second->next);
+    sb->finishReservation(200);
+
+    sb->peek(&bytesAvailable);
+    EXPECT_EQ(segmentSize - 100, bytesAvailable);
+    sb->consume(bytesAvailable);
+    EXPECT_EQ(ringEnd, sb->peek(&bytesAvailable));
+    EXPECT_EQ(200U, bytesAvailable);
+    EXPECT_EQ(nullptr, sb->consumerSegment);
+    sb->consume(bytesAvailable);
+
+    // Both segments should be back in the pool
+    RuntimeLogger::SpillSegment *segment =
+                            RuntimeLogger::nanoLogSingleton.allocSpillSegment();
+    EXPECT_TRUE(segment == first || segment == second);
+    RuntimeLogger::nanoLogSingleton.freeSpillSegment(segment);
+}
+
+TEST_F(NanoLogTest, StagingBuffer_grow) {
+    static_assert(NanoLogConfig::INITIAL_STAGING_BUFFER_SIZE*4 <=
+                        NanoLogConfig::STAGING_BUFFER_SIZE,
+                  "Test requires StagingBuffers that can grow twice");
+    uint32_t initialSize = NanoLogConfig::INITIAL_STAGING_BUFFER_SIZE;
+    uint64_t bytesAvailable = 0;
+
+    delete sb;
+    sb = new RuntimeLogger::StagingBuffer(0);
+    EXPECT_EQ(initialSize, sb->capacity);
+    EXPECT_EQ(initialSize, sb->minFreeSpace);
+
+    // Case 1: Out of space in storage[]; move to one twice as large
+    char *oldStorage = sb->storage;
+    sb->reserveProducerSpace(initialSize - 100);
+    sb->finishReservation(initialSize - 100);
+    char *ringEnd = sb->producerPos;
+    char *writePos = sb->reserveProducerSpace(200);
+    ASSERT_NE(nullptr, sb->resizedStorage);
+    EXPECT_EQ(sb->resizedStorage, writePos);
+    EXPECT_EQ(2*initialSize, sb->resizedCapacity);
+    EXPECT_EQ(ringEnd, sb->resizeRingEnd);
+    EXPECT_EQ(oldStorage, sb->storage);
+    EXPECT_EQ(initialSize, sb->capacity);
+    EXPECT_EQ(1U, sb->numTimesResized);
+    sb->finishReservation(200);
+
+    // Case 2: The producer can't wrap around in the new storage[] until the
+    // consumer has moved onto it
+    sb->reserveProducerSpace(2*initialSize - 300);
+    sb->finishReservation(2*initialSize - 300);
+    EXPECT_EQ(nullptr, sb->reserveSpaceInternal(200, false));
+
+    // The consumer should drain the old storage[] before the new one
+    EXPECT_EQ(oldStorage, sb->peek(&bytesAvailable));
+    EXPECT_EQ(initialSize - 100, bytesAvailable);
+    sb->consume(bytesAvailable);
+
+    char *newStorage = sb->resizedStorage;
+    EXPECT_EQ(newStorage, sb->peek(&bytesAvailable));
+    EXPECT_EQ(2*initialSize - 100, bytesAvailable);
+    EXPECT_EQ(newStorage, sb->storage);
+    EXPECT_EQ(2*initialSize, sb->capacity);
+    EXPECT_EQ(nullptr, sb->resizedStorage);
+    sb->consume(1000);
+
+    // Case 3: Back to the usual wrap around
+    EXPECT_EQ(newStorage, sb->reserveSpaceInternal(200, false));
+    EXPECT_EQ(newStorage + 2*initialSize - 100, sb->endOfRecordedSpace);
+    EXPECT_EQ(1U, sb->numTimesResized);
+
+    // Case 4: Allocations larger than twice the size grow it further
+    sb->finishReservation(200);
+    sb->peek(&bytesAvailable);
+    sb->consume(bytesAvailable);
+    sb->peek(&bytesAvailable);
+    sb->consume(bytesAvailable);
+    EXPECT_EQ(sb->storage + 200, sb->consumerPos);
+    writePos = sb->reserveSpaceInternal(3*initialSize, false);
+    ASSERT_NE(nullptr, sb->resizedStorage);
+    EXPECT_EQ(sb->resizedStorage, writePos);
+    EXPECT_EQ(4*initialSize, sb->resizedCapacity);
+    EXPECT_EQ(4*initialSize, sb->minFreeSpace);
+}
+
+TEST_F(NanoLogTest, StagingBuffer_shrinkWhenIdle) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    stopCompressionThread();
+    RuntimeLogger::StagingBuffer *savedReadyBuffers = logger.readyBuffers;
+    uint32_t initialSize = NanoLogConfig::INITIAL_STAGING_BUFFER_SIZE;
+    uint64_t idleCycles = PerfUtils::Cycles::fromNanoseconds(
+                    1000UL*NanoLogConfig::STAGING_BUFFER_SHRINK_IDLE_US);
+    uint64_t bytesAvailable = 0;
+
+    delete sb;
+    sb = new RuntimeLogger::StagingBuffer(0, 4*initialSize);
+    sb->minCapacity = initialSize;
+
+    // Case 1: Recently idle buffers are left as they are
+    sb->active = false;
+    sb->idleSince = PerfUtils::Cycles::rdtsc();
+    stageDroppedLogsRecord(sb, 100);
+    EXPECT_EQ(nullptr, sb->resizedStorage);
+
+    // Case 2: Buffers idle for long are halved on the next log message
+    sb->active = false;
+    sb->idleSince = PerfUtils::Cycles::rdtsc() - idleCycles;
+    size_t recordBytes = stageDroppedLogsRecord(sb, 200);
+    ASSERT_NE(nullptr, sb->resizedStorage);
+    EXPECT_EQ(2*initialSize, sb->resizedCapacity);
+    EXPECT_EQ(sb->storage + 2*recordBytes, sb->resizeRingEnd);
+
+    sb->peek(&bytesAvailable);
+    EXPECT_EQ(2*recordBytes, bytesAvailable);
+    sb->consume(bytesAvailable);
+    sb->peek(&bytesAvailable);
+    EXPECT_EQ(2*initialSize, sb->capacity);
+
+    // Case 3: But not below the size requested via preallocate()
+    sb->minCapacity = 2*initialSize;
+    sb->active = false;
+    sb->idleSince = 0;
+    stageDroppedLogsRecord(sb, 300);
+    EXPECT_EQ(nullptr, sb->resizedStorage);
+    EXPECT_TRUE(sb->active);
+
+    logger.readyBuffers = savedReadyBuffers;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, initialize) {
+    // Nothing is opened, allocated or started at construction
+    RuntimeLogger *logger = new RuntimeLogger();
+    EXPECT_FALSE(logger->initialized);
+    EXPECT_EQ(-1, logger->outputFd);
+    EXPECT_EQ(nullptr, logger->compressingBuffer);
+    EXPECT_TRUE(logger->outputBuffers.empty());
+    EXPECT_FALSE(logger->compressionThread.joinable());
+    EXPECT_TRUE(logger->compressionWorkers.empty());
+    delete logger;
+
+    // Initialization happens once; later calls leave the file to the caller
+    RuntimeLogger::init();
+    RuntimeLogger &singleton = RuntimeLogger::nanoLogSingleton;
+    EXPECT_TRUE(singleton.initialized);
+    EXPECT_LT(0, singleton.outputFd);
+    EXPECT_NE(nullptr, singleton.compressingBuffer);
+    EXPECT_EQ(singleton.config.numOutputBuffers,
+              singleton.outputBuffers.size());
+    EXPECT_EQ(singleton.config.numOutputBuffers - 1,
+              singleton.ioBackend->getMaxOutstanding());
+    EXPECT_TRUE(singleton.compressionThread.joinable());
+
+    int outputFd = singleton.outputFd;
+    EXPECT_FALSE(singleton.initialize());
+    EXPECT_EQ(outputFd, singleton.outputFd);
+}
+
+TEST_F(NanoLogTest, init_config) {
+    NanoLog::Config config;
+    EXPECT_EQ(nullptr, RuntimeLogger::checkConfig(config));
+
+    config.stagingBufferSize = 3 << 20;
+    EXPECT_STREQ("stagingBufferSize must be a power of 2",
+                 RuntimeLogger::checkConfig(config));
+
+    config = NanoLog::Config();
+    config.initialStagingBufferSize = 2*config.stagingBufferSize;
+    EXPECT_NE(nullptr, RuntimeLogger::checkConfig(config));
+
+    config = NanoLog::Config();
+    config.stagingBufferSize = NanoLogConfig::SPILL_SEGMENT_SIZE/2;
+    config.initialStagingBufferSize = config.stagingBufferSize;
+    EXPECT_NE(nullptr, RuntimeLogger::checkConfig(config));
+
+    config = NanoLog::Config();
+    config.outputBufferSize = config.stagingBufferSize/2;
+    EXPECT_NE(nullptr, RuntimeLogger::checkConfig(config));
+
+    config = NanoLog::Config();
+    config.numOutputBuffers = 1;
+    EXPECT_NE(nullptr, RuntimeLogger::checkConfig(config));
+
+    config = NanoLog::Config();
+    config.releaseThreshold = config.stagingBufferSize + 1;
+    EXPECT_NE(nullptr, RuntimeLogger::checkConfig(config));
+
+    config = NanoLog::Config();
+    config.numCompressionWorkers = 4;
+    EXPECT_EQ(nullptr, RuntimeLogger::checkConfig(config));
+    config.numCompressionWorkers = CPU_SETSIZE;
+    EXPECT_STREQ("numCompressionWorkers exceeds CPU_SETSIZE",
+                 RuntimeLogger::checkConfig(config));
+
+    config = NanoLog::Config();
+    config.fileFlags = O_RDONLY|O_CREAT;
+    EXPECT_NE(nullptr, RuntimeLogger::checkConfig(config));
+
+    config = NanoLog::Config();
+    config.durabilityMode = NanoLog::DIRECT_IO;
+    EXPECT_EQ(nullptr, RuntimeLogger::checkConfig(config));
+    config.outputBufferSize += 100;
+    EXPECT_NE(nullptr, RuntimeLogger::checkConfig(config));
+
+    config = NanoLog::Config();
+    config.rotateKeep = 0;
+    EXPECT_EQ(nullptr, RuntimeLogger::checkConfig(config));
+    config.rotateMaxAgeSec = 60;
+    EXPECT_NE(nullptr, RuntimeLogger::checkConfig(config));
+
+    config = NanoLog::Config();
+    config.stagingBufferSize = 1 << 22;
+    config.outputBufferSize = 1 << 27;
+    EXPECT_EQ(nullptr, RuntimeLogger::checkConfig(config));
+
+    // Invalid Configs and ones that would resize the buffers of a running
+    // NanoLog are rejected, but the other settings still apply.
+    RuntimeLogger::init();
+    EXPECT_THROW(NanoLog::init(config), std::invalid_argument);
+
+    config = NanoLog::Config();
+    config.stagingBufferSize = 0;
+    EXPECT_THROW(NanoLog::init(config), std::invalid_argument);
+
+    config = NanoLog::Config();
+    config.logLevel = DEBUG;
+    config.overflowPolicy = DROP_ON_FULL;
+    NanoLog::init(config);
+    EXPECT_EQ(DEBUG, NanoLog::getLogLevel());
+    EXPECT_EQ(DROP_ON_FULL, NanoLog::getOverflowPolicy());
+
+    NanoLog::setLogLevel(NOTICE);
+    NanoLog::setOverflowPolicy(BLOCK_ON_FULL);
+}
+
+TEST_F(NanoLogTest, StagingBuffer_configuredSizes) {
+    NanoLog::Config &config = RuntimeLogger::nanoLogSingleton.config;
+    NanoLog::Config savedConfig = config;
+
+    config.initialStagingBufferSize = 1 << 12;
+    config.stagingBufferSize = 1 << 16;
+    EXPECT_EQ(1U << 12, RuntimeLogger::StagingBuffer::roundUpCapacity(0));
+    EXPECT_EQ(1U << 14, RuntimeLogger::StagingBuffer::roundUpCapacity(9000));
+    EXPECT_EQ(1U << 16,
+              RuntimeLogger::StagingBuffer::roundUpCapacity(1 << 20));
+
+    RuntimeLogger::StagingBuffer *small = new RuntimeLogger::StagingBuffer(1);
+    EXPECT_EQ(1U << 12, small->capacity);
+    delete small;
+
+    config = savedConfig;
+}
+
+TEST_F(NanoLogTest, preallocate_size) {
+    uint32_t initialSize = NanoLogConfig::INITIAL_STAGING_BUFFER_SIZE;
+
+    std::thread([initialSize]() {
+        RuntimeLogger::preallocate(3*initialSize);
+        RuntimeLogger::StagingBuffer *threadBuffer =
+                                            RuntimeLogger::stagingBuffer;
+        ASSERT_NE(nullptr, threadBuffer);
+        EXPECT_EQ(4*initialSize, threadBuffer->capacity);
+        EXPECT_EQ(4*initialSize, threadBuffer->minCapacity);
+
+        // Smaller requests leave the buffer as it is
+        RuntimeLogger::preallocate(initialSize);
+        EXPECT_EQ(nullptr, threadBuffer->resizedStorage);
+        EXPECT_EQ(4*initialSize, threadBuffer->minCapacity);
+
+        // Larger ones resize it, up to STAGING_BUFFER_SIZE
+        RuntimeLogger::preallocate(NanoLogConfig::STAGING_BUFFER_SIZE + 1);
+        EXPECT_EQ(NanoLogConfig::STAGING_BUFFER_SIZE,
+                  threadBuffer->resizedCapacity);
+        EXPECT_EQ(NanoLogConfig::STAGING_BUFFER_SIZE,
+                  threadBuffer->minCapacity);
+        EXPECT_EQ(threadBuffer->resizedStorage, threadBuffer->producerPos);
+    }).join();
+}
+
+TEST_F(NanoLogTest, recycleStagingBuffer) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    stopCompressionThread();
+    RuntimeLogger::StagingBuffer *savedBufferPool = logger.bufferPool;
+    uint32_t savedNumPooledBuffers = logger.numPooledBuffers;
+    uint64_t poolHits = logger.bufferPoolHits;
+    uint64_t poolMisses = logger.bufferPoolMisses;
+    logger.bufferPool = nullptr;
+    logger.numPooledBuffers = 0;
+
+    // Case 1: Drained StagingBuffers of exited threads are reset and pooled
+    uint64_t bytesAvailable = 0;
+    stageDroppedLogsRecord(sb, 100);
+    sb->peek(&bytesAvailable);
+    sb->consume(bytesAvailable);
+    ASSERT_TRUE(sb->allocAssistBuffer());
+    sb->active = false;
+    sb->shouldDeallocate = true;
+    sb->retired = true;
+
+    logger.recycleStagingBuffer(sb);
+    EXPECT_EQ(sb, logger.bufferPool.load());
+    EXPECT_EQ(1U, logger.numPooledBuffers);
+    EXPECT_EQ(sb->storage, sb->prefaultedStorage);
+    EXPECT_EQ(nullptr, sb->assistBuffer);
+    EXPECT_EQ(sb->storage, sb->producerPos);
+    EXPECT_EQ(sb->storage, sb->consumerPos);
+    EXPECT_EQ(bufferSize, sb->minFreeSpace);
+    EXPECT_EQ(0U, sb->numAllocations);
+    EXPECT_TRUE(sb->active);
+    EXPECT_FALSE(sb->shouldDeallocate);
+    EXPECT_FALSE(sb->retired);
+
+    // Case 2: New threads take them from the pool under a new id
+    uint32_t nextBufferId = logger.nextBufferId;
+    EXPECT_EQ(sb, logger.allocStagingBuffer());
+    EXPECT_EQ(nextBufferId, sb->getId());
+    EXPECT_EQ(nullptr, logger.bufferPool.load());
+    EXPECT_EQ(0U, logger.numPooledBuffers);
+    EXPECT_EQ(poolHits + 1, logger.bufferPoolHits);
+
+    // Case 3: ... or allocate new ones when it's empty
+    RuntimeLogger::StagingBuffer *other = logger.allocStagingBuffer();
+    EXPECT_NE(nullptr, other);
+    EXPECT_EQ(NanoLogConfig::INITIAL_STAGING_BUFFER_SIZE, other->capacity);
+    EXPECT_EQ(poolMisses + 1, logger.bufferPoolMisses);
+
+    // Case 4: StagingBuffers that don't fit in the pool are deleted
+    logger.numPooledBuffers = NanoLogConfig::STAGING_BUFFER_POOL_SIZE;
+    logger.recycleStagingBuffer(other);
+    EXPECT_EQ(nullptr, logger.bufferPool.load());
+
+    logger.bufferPool = savedBufferPool;
+    logger.numPooledBuffers = savedNumPooledBuffers;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, allocBuffer) {
+    size_t bytes = 3*Util::HUGE_PAGE_SIZE/2;
+
+    // Case 1: Pages are faulted in on first touch by default
+    char *buffer = static_cast<char*>(Util::allocBuffer(bytes));
+    ASSERT_NE(nullptr, buffer);
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(buffer) % 4096);
+    EXPECT_EQ(0U, countResidentPages(buffer, bytes));
+    buffer[0] = 1;
+    EXPECT_EQ(1U, countResidentPages(buffer, bytes));
+    Util::freeBuffer(buffer, bytes);
+
+    // Case 2: ... or all at once when prefaulting
+    buffer = static_cast<char*>(Util::allocBuffer(bytes, false, true));
+    ASSERT_NE(nullptr, buffer);
+    EXPECT_EQ(bytes/4096, countResidentPages(buffer, bytes));
+    EXPECT_EQ(0, buffer[bytes - 1]);
+    Util::freeBuffer(buffer, bytes);
+
+    // Case 3: Huge page buffers are rounded up to whole huge pages
+    buffer = static_cast<char*>(Util::allocBuffer(bytes, true, true));
+    ASSERT_NE(nullptr, buffer);
+    EXPECT_EQ(2*Util::HUGE_PAGE_SIZE/4096,
+              countResidentPages(buffer, 2*Util::HUGE_PAGE_SIZE));
+    Util::freeBuffer(buffer, bytes, true);
+
+    // StagingBuffers are placed on the node of the allocating thread
+    if (NanoLogConfig::NUMA_LOCAL_STAGING_BUFFERS)
+        EXPECT_EQ(Util::getNumaNode(), sb->numaNode);
+}
+
+TEST_F(NanoLogTest, IoBackend_write) {
+    const char *testFile = "/tmp/testFile";
+    IoBackend *backends[] = {new PosixAioBackend(2),
+                             IoUringBackend::create(2)};
+
+    for (IoBackend *backend : backends) {
+        // io_uring may be disabled in the test environment
+        if (backend == nullptr)
+            continue;
+
+        SCOPED_TRACE(backend->getName());
+        int fd = open(testFile, O_CREAT | O_TRUNC | O_RDWR, 0666);
+        ASSERT_LE(0, fd);
+
+        char first[4096], second[100];
+        memset(first, 'a', sizeof(first));
+        memset(second, 'b', sizeof(second));
+
+        EXPECT_EQ(2U, backend->getMaxOutstanding());
+        EXPECT_FALSE(backend->isWriteComplete());
+        EXPECT_TRUE(backend->submitWrite(fd, first, sizeof(first), 0, false));
+        EXPECT_TRUE(backend->submitWrite(fd, second, sizeof(second),
+                                         sizeof(first), true));
+        EXPECT_EQ(2U, backend->getNumOutstanding());
+
+        // Only maxOutstanding writes can be in flight
+        EXPECT_FALSE(backend->submitWrite(fd, second, 1, 0, false));
+        EXPECT_EQ(EBUSY, errno);
+
+        EXPECT_EQ(4096, backend->waitForWrite());
+        EXPECT_EQ(100, backend->waitForWrite());
+        EXPECT_EQ(0U, backend->getNumOutstanding());
+
+        char contents[sizeof(first) + sizeof(second) + 1];
+        EXPECT_EQ(4196, pread(fd, contents, sizeof(contents), 0));
+        EXPECT_EQ(0, memcmp(first, contents, sizeof(first)));
+        EXPECT_EQ(0, memcmp(second, contents + sizeof(first),
+                            sizeof(second)));
+
+        // Slots are reused once the writes are retired
+        EXPECT_TRUE(backend->submitWrite(fd, second, 10, 1, false));
+        while (!backend->isWriteComplete());
+        EXPECT_EQ(10, backend->waitForWrite());
+        EXPECT_EQ(4196, pread(fd, contents, sizeof(contents), 0));
+        EXPECT_EQ('b', contents[1]);
+        EXPECT_EQ('a', contents[11]);
+        close(fd);
+
+        // Failed writes report their errno
+        fd = open(testFile, O_RDONLY);
+        ASSERT_LE(0, fd);
+        if (backend->submitWrite(fd, first, sizeof(first), 0, false))
+            EXPECT_EQ(-EBADF, backend->waitForWrite());
+        close(fd);
+
+        delete backend;
+    }
+
+    std::remove(testFile);
+}
+
+TEST_F(NanoLogTest, IoUringBackend_waitForWrite_enterFailed) {
+    IoUringBackend *backend = IoUringBackend::create(1);
+    if (backend == nullptr)
+        return;
+
+    // Fill up a pipe so that the write stays in flight until it's drained
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    char byte = 'a';
+    while (write(fds[1], &byte, 1) == 1);
+    fcntl(fds[1], F_SETFL, 0);
+
+    char buffer[100];
+    memset(buffer, 'b', sizeof(buffer));
+    ASSERT_TRUE(backend->submitWrite(fds[1], buffer, sizeof(buffer), 0,
+                                     false));
+    std::thread reader([&fds]() {
+        usleep(50000);
+        char contents[4096];
+        while (read(fds[0], contents, sizeof(contents)) == sizeof(contents));
+    });
+
+    // Without io_uring_enter(), it polls for the completion instead of
+    // retiring the write early
+    int ringFd = backend->ringFd;
+    backend->ringFd = -1;
+    EXPECT_EQ(100, backend->waitForWrite());
+    EXPECT_TRUE(backend->enterFailed);
+    EXPECT_EQ(0U, backend->getNumOutstanding());
+    backend->ringFd = ringFd;
+
+    reader.join();
+    close(fds[0]);
+    close(fds[1]);
+    delete backend;
+}
+
+TEST_F(NanoLogTest, IoBackend_selection) {
+    RuntimeLogger::nanoLogSingleton.ensureInitialized();
+    IoBackend *backend = RuntimeLogger::nanoLogSingleton.ioBackend;
+    ASSERT_NE(nullptr, backend);
+
+    // The default is io_uring, unless the kernel doesn't support it
+    IoUringBackend *ioUring = IoUringBackend::create(1);
+    if (ioUring != nullptr)
+        EXPECT_STREQ("io_uring", backend->getName());
+    else
+        EXPECT_STREQ("POSIX AIO", backend->getName());
+    delete ioUring;
+
+    // The backend can't change once NanoLog is running
+    NanoLog::Config config;
+    config.ioBackend = NanoLog::POSIX_AIO;
+    if (ioUring != nullptr)
+        EXPECT_THROW(NanoLog::init(config), std::invalid_argument);
+}
+
+TEST_F(NanoLogTest, compressionThreadMain_outputBufferRing) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::sync();
+    stopCompressionThread();
+    NanoLog::Config savedConfig = logger.config;
+
+    // A ring of 3 small output buffers, so that full ones are easy to come by
+    HeldIoBackend *backend = holdOutputWrites();
+    logger.config.outputBufferSize = 1 << 16;
+    logger.config.flushMinBytes = 1 << 30;
+    logger.config.flushMaxDelayUs = 10000000;
+    restartCompressionThread();
+    logger.registerStagingBuffer(sb);
+
+    uint64_t timestamp = 0;
+    auto fillBuffers = [&](size_t numSubmitted) {
+        uint64_t start = Cycles::rdtsc();
+        while (backend->getNumSubmitted() < numSubmitted &&
+                Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0) {
+            for (int i = 0; i < 100; ++i)
+                stageDroppedLogsRecord(sb, ++timestamp);
+            std::this_thread::yield();
+        }
+    };
+
+    // The next full buffer is submitted while the write before it is held...
+    uint32_t numAioWritesCompleted = logger.numAioWritesCompleted;
+    off_t completedFileOffset = logger.completedFileOffset;
+    fillBuffers(1);
+    EXPECT_EQ(1U, backend->getNumSubmitted());
+    fillBuffers(2);
+    EXPECT_EQ(2U, backend->getNumSubmitted());
+    EXPECT_EQ(numAioWritesCompleted, logger.numAioWritesCompleted);
+
+    // ... and the writes retire in the order they were submitted, even if
+    // a later one completes first.
+    backend->release(1);
+    usleep(10000);
+    EXPECT_EQ(numAioWritesCompleted, logger.numAioWritesCompleted);
+    EXPECT_EQ(completedFileOffset, logger.completedFileOffset);
+
+    backend->release(0);
+    uint64_t start = Cycles::rdtsc();
+    while (logger.numAioWritesCompleted < numAioWritesCompleted + 2 &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+        std::this_thread::yield();
+    EXPECT_EQ(numAioWritesCompleted + 2, logger.numAioWritesCompleted);
+    EXPECT_EQ(completedFileOffset + static_cast<off_t>(
+                    backend->getWriteBytes(0) + backend->getWriteBytes(1)),
+              logger.completedFileOffset);
+
+    // The freed buffers are filled and submitted again
+    fillBuffers(4);
+    EXPECT_LE(4U, backend->getNumSubmitted());
+    EXPECT_EQ(logger.outputBuffers[backend->savedBufferIndex],
+              backend->getWriteBuffer(0));
+    EXPECT_NE(backend->getWriteBuffer(0), backend->getWriteBuffer(1));
+    EXPECT_NE(backend->getWriteBuffer(1), backend->getWriteBuffer(2));
+    EXPECT_EQ(backend->getWriteBuffer(0), backend->getWriteBuffer(3));
+
+    sb->shouldDeallocate = true;
+    sb->markActive();
+    backend->releaseAll();
+    RuntimeLogger::sync();
+    sb = nullptr;
+    EXPECT_EQ(0U, backend->numOverwritten);
+
+    stopCompressionThread();
+    logger.config = savedConfig;
+    restoreOutputWrites(backend);
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, OutputSink_memoryRing) {
+    NanoLog::MemoryRingSink ring(10);
+    char out[10];
+
+    EXPECT_TRUE(ring.write("abcdef", 6));
+    EXPECT_EQ(6U, ring.getBytesAvailable());
+    EXPECT_EQ(4U, ring.read(out, 4));
+    EXPECT_EQ(0, memcmp("abcd", out, 4));
+
+    // Writes wrap around the end of the ring, and ones that don't fit are
+    // dropped as a whole.
+    EXPECT_TRUE(ring.write("ghijklmn", 8));
+    EXPECT_FALSE(ring.write("o", 1));
+    EXPECT_EQ(1U, ring.getBytesDropped());
+    EXPECT_EQ(10U, ring.read(out, sizeof(out)));
+    EXPECT_EQ(0, memcmp("efghijklmn", out, 10));
+    EXPECT_EQ(0U, ring.read(out, sizeof(out)));
+
+    // The reader learns where buffers were dropped, since read() stops there
+    EXPECT_TRUE(ring.write("pq", 2));
+    EXPECT_EQ(0U, ring.read(out, sizeof(out)));
+    EXPECT_EQ(1U, ring.skipGap());
+    EXPECT_EQ(0U, ring.skipGap());
+    EXPECT_FALSE(ring.write("0123456789", 10));
+    EXPECT_FALSE(ring.write("r", 9));
+    EXPECT_TRUE(ring.write("st", 2));
+    EXPECT_EQ(2U, ring.read(out, sizeof(out)));
+    EXPECT_EQ(0, memcmp("pq", out, 2));
+    EXPECT_EQ(19U, ring.skipGap());
+    EXPECT_EQ(2U, ring.read(out, sizeof(out)));
+    EXPECT_EQ(0, memcmp("st", out, 2));
+    EXPECT_EQ(20U, ring.getBytesDropped());
+}
+
+TEST_F(NanoLogTest, OutputSink_fdAndTee) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+
+    NanoLog::FdSink pipeSink(fds[1], true);
+    NanoLog::MemoryRingSink ring(100);
+    NanoLog::TeeSink tee;
+    tee.add(&pipeSink);
+    tee.add(&ring);
+
+    char out[10];
+    EXPECT_TRUE(tee.write("abc", 3));
+    EXPECT_EQ(3, read(fds[0], out, sizeof(out)));
+    EXPECT_EQ(0, memcmp("abc", out, 3));
+    EXPECT_EQ(3U, ring.read(out, sizeof(out)));
+    EXPECT_EQ(0, memcmp("abc", out, 3));
+
+    // Once the reader is gone, the pipe fails for good (its writer thread
+    // blocks SIGPIPE), but the other sinks still get the output.
+    close(fds[0]);
+    testing::internal::CaptureStderr();
+    EXPECT_TRUE(tee.write("def", 3));
+    uint64_t start = Cycles::rdtsc();
+    while (!pipeSink.isBroken() &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+        std::this_thread::yield();
+    EXPECT_TRUE(pipeSink.isBroken());
+    EXPECT_NE(std::string::npos,
+              testing::internal::GetCapturedStderr().find("Broken pipe"));
+    EXPECT_FALSE(tee.write("ghi", 3));
+    EXPECT_EQ(6U, ring.read(out, sizeof(out)));
+
+    const char *testFile = "/tmp/testLog_fileSink";
+    std::remove(testFile);
+    {
+        NanoLog::FileSink fileSink(testFile);
+        EXPECT_TRUE(fileSink.write("ghi", 3));
+    }
+    struct stat st;
+    ASSERT_EQ(0, stat(testFile, &st));
+    EXPECT_EQ(3, st.st_size);
+    std::remove(testFile);
+
+    EXPECT_THROW(NanoLog::FileSink("/nonexistent/dir/file"),
+                 std::ios_base::failure);
+}
+
+TEST_F(NanoLogTest, OutputSink_fdBacklog) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+
+    // Fills up the pipe so that the sink's writes block
+    auto fillPipe = [&fds]() {
+        EXPECT_EQ(0, fcntl(fds[1], F_SETFL, O_NONBLOCK));
+        char filler[4096];
+        memset(filler, 'x', sizeof(filler));
+        size_t fillerBytes = 0;
+        ssize_t ret;
+        for (size_t chunk : {sizeof(filler), size_t(1)}) {
+            while ((ret = write(fds[1], filler, chunk)) > 0)
+                fillerBytes += ret;
+        }
+        EXPECT_EQ(0, fcntl(fds[1], F_SETFL, 0));
+        return fillerBytes;
+    };
+
+    // Reads nbytes from the pipe into in
+    auto readPipe = [&fds](std::vector<char> &in) {
+        size_t bytesRead = 0;
+        while (bytesRead < in.size()) {
+            ssize_t ret = read(fds[0], &in[bytesRead], in.size() - bytesRead);
+            ASSERT_LT(0, ret);
+            bytesRead += ret;
+        }
+    };
+
+    size_t fillerBytes = fillPipe();
+    {
+        // By default, the backlog takes what the reader isn't ready for yet
+        // and the caller waits once it's full, so nothing is lost.
+        NanoLog::FdSink sink(fds[1], false, 8);
+        EXPECT_TRUE(sink.write("abcde", 5));
+
+        std::vector<char> in(fillerBytes + 16);
+        std::thread reader([&]() {
+            usleep(10000);
+            readPipe(in);
+        });
+        EXPECT_TRUE(sink.write("fghijklmnop", 11));
+        reader.join();
+        EXPECT_EQ(0, memcmp("abcdefghijklmnop", &in[fillerBytes], 16));
+        EXPECT_EQ(0U, sink.getBytesDropped());
+    }
+
+    fillerBytes = fillPipe();
+    {
+        // Otherwise, it drops what doesn't fit as a whole, without blocking
+        // the caller.
+        NanoLog::FdSink sink(fds[1], true, 8, true);
+        EXPECT_TRUE(sink.write("abcde", 5));
+        EXPECT_FALSE(sink.write("fghi", 4));
+        EXPECT_TRUE(sink.write("jkl", 3));
+        EXPECT_FALSE(sink.write("m", 1));
+        EXPECT_EQ(5U, sink.getBytesDropped());
+        EXPECT_FALSE(sink.isBroken());
+
+        // Once the reader catches up, the backlog is written
+        std::vector<char> in(fillerBytes + 8);
+        readPipe(in);
+        EXPECT_EQ(0, memcmp("abcdejkl", &in[fillerBytes], 8));
+
+        EXPECT_TRUE(sink.write("nop", 3));
+    }
+
+    // Destroying the sink waits for the backlog to be written
+    char out[10];
+    EXPECT_EQ(3, read(fds[0], out, sizeof(out)));
+    EXPECT_EQ(0, memcmp("nop", out, 3));
+    close(fds[0]);
+}
+
+TEST_F(NanoLogTest, OutputSink_unixSocket) {
+    const char *socketPath = "/tmp/testLog_unixSocket";
+    std::remove(socketPath);
+    EXPECT_THROW(NanoLog::UnixSocketSink sink(socketPath),
+                 std::ios_base::failure);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_LE(0, listenFd);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    ASSERT_EQ(0, bind(listenFd, reinterpret_cast<struct sockaddr*>(&address),
+                      sizeof(address)));
+    ASSERT_EQ(0, listen(listenFd, 1));
+
+    {
+        NanoLog::UnixSocketSink sink(socketPath);
+        int connectionFd = accept(listenFd, nullptr, nullptr);
+        ASSERT_LE(0, connectionFd);
+
+        char out[10];
+        EXPECT_TRUE(sink.write("abc", 3));
+        EXPECT_EQ(3, read(connectionFd, out, sizeof(out)));
+        EXPECT_EQ(0, memcmp("abc", out, 3));
+        close(connectionFd);
+    }
+
+    close(listenFd);
+    std::remove(socketPath);
+}
+
+TEST_F(NanoLogTest, compressionThreadMain_outputSink) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::sync();
+    stopCompressionThread();
+    NanoLog::Config savedConfig = logger.config;
+    NanoLog::MemoryRingSink ring(1 << 20);
+    logger.config.outputSink = &ring;
+    restartCompressionThread();
+    logger.registerStagingBuffer(sb);
+
+    // The sink receives exactly what's written to the log file
+    uint64_t bytesWritten = logger.totalBytesWritten;
+    uint64_t sinkBytesWritten = logger.sinkBytesWritten;
+    stageLogMessage(sb, NOTICE);
+    RuntimeLogger::sync();
+    EXPECT_LT(bytesWritten, logger.totalBytesWritten);
+    EXPECT_EQ(logger.totalBytesWritten - bytesWritten,
+              ring.getBytesAvailable());
+    EXPECT_EQ(sinkBytesWritten + ring.getBytesAvailable(),
+              logger.sinkBytesWritten);
+
+    sb->shouldDeallocate = true;
+    sb->markActive();
+    RuntimeLogger::sync();
+    sb = nullptr;
+
+    stopCompressionThread();
+    logger.config = savedConfig;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, Recovery_recover) {
+    const char *testFile = "/tmp/testLog_recover";
+    std::remove(testFile);
+
+    const size_t bufferSize = 1 << 16;
+    char *writing = Recovery::mapBuffer(bufferSize, false, false);
+    char *filling = Recovery::mapBuffer(bufferSize, false, false);
+    char *staging = Recovery::mapBuffer(bufferSize, false, false);
+    ASSERT_NE(nullptr, writing);
+    ASSERT_NE(nullptr, filling);
+    ASSERT_NE(nullptr, staging);
+    std::string dir = Recovery::getProcessDirectory();
+    Recovery::recordLogFile(testFile);
+
+    // Log messages without arguments, timestamped in the order they're logged
+    uint32_t fmtId = 0;
+    while (strchr(GeneratedFunctions::logId2Metadata[fmtId].fmtString, '%'))
+        ++fmtId;
+    const size_t recordBytes = sizeof(Log::UncompressedEntry);
+    auto stage = [&](char *pos, uint64_t timestamp) {
+        auto *entry = reinterpret_cast<Log::UncompressedEntry*>(pos);
+        entry->fmtId = fmtId;
+        entry->entrySize = downCast<uint32_t>(recordBytes);
+        entry->timestamp = timestamp;
+    };
+
+    // The process died with one output buffer in flight and one being
+    // filled, each holding one log message ...
+    uint64_t logsEncoded = 0;
+    char scratch[2*recordBytes];
+    stage(scratch, 1);
+    stage(scratch + recordBytes, 2);
+    Log::Encoder encoder(writing, bufferSize, false, false, bufferSize/2);
+    encoder.encodeLogMsgs(scratch, recordBytes, 5, false, &logsEncoded);
+    Recovery::BufferHeader *header = Recovery::getHeader(writing);
+    header->type = Recovery::OUTPUT_BUFFER;
+    header->state = Recovery::WRITING;
+    header->sequence = 7;
+    header->fileOffset = 0;
+    header->bytes = encoder.getEncodedBytes();
+    uint64_t fileOffset = header->bytes;
+
+    encoder.swapBuffer(filling, bufferSize);
+    encoder.encodeLogMsgs(scratch + recordBytes, recordBytes, 5, false,
+                          &logsEncoded);
+    header = Recovery::getHeader(filling);
+    header->type = Recovery::OUTPUT_BUFFER;
+    header->state = Recovery::FILLING;
+    header->sequence = 8;
+    header->fileOffset = fileOffset;
+    header->bytes = encoder.getEncodedBytes();
+    fileOffset += header->bytes;
+
+    // ... and three more in a StagingBuffer whose producer wrapped around
+    const uint64_t consumerOffset = bufferSize - 3*recordBytes;
+    stage(staging + consumerOffset, 3);
+    stage(staging + consumerOffset + recordBytes, 4);
+    stage(staging, 5);
+    header = Recovery::getHeader(staging);
+    header->type = Recovery::STAGING_BUFFER;
+    header->bufferId = 5;
+    header->consumerOffset = consumerOffset;
+    header->endOffset = consumerOffset + 2*recordBytes;
+    header->producerOffset = recordBytes;
+
+    Recovery::RecoveryStats stats;
+    ASSERT_TRUE(Recovery::recover(dir.c_str(), nullptr, &stats));
+    EXPECT_EQ(2U, stats.outputBuffersRestored);
+    EXPECT_EQ(fileOffset, stats.outputBytesRestored);
+    EXPECT_EQ(1U, stats.stagingBuffersRecovered);
+    EXPECT_EQ(3U, stats.logsRecovered);
+    EXPECT_LT(0U, stats.stagingBytesWritten);
+    EXPECT_EQ(0U, stats.stagingBytesLost);
+    EXPECT_NE(0, access(dir.c_str(), F_OK));
+
+    struct stat st;
+    ASSERT_EQ(0, stat(testFile, &st));
+    EXPECT_EQ(fileOffset + stats.stagingBytesWritten,
+              static_cast<uint64_t>(st.st_size));
+
+    Log::Decoder decoder;
+    Log::LogMessage msg;
+    ASSERT_TRUE(decoder.open(testFile));
+    for (uint64_t timestamp = 1; timestamp <= 5; ++timestamp) {
+        ASSERT_TRUE(decoder.getNextLogStatement(msg));
+        EXPECT_EQ(timestamp, msg.getTimestamp());
+    }
+    EXPECT_FALSE(decoder.getNextLogStatement(msg));
+
+    // Without the directory, there's nothing to recover
+    testing::internal::CaptureStderr();
+    EXPECT_FALSE(Recovery::recover(dir.c_str(), testFile, &stats));
+    testing::internal::GetCapturedStderr();
+
+    Recovery::unmapBuffer(writing, bufferSize);
+    Recovery::unmapBuffer(filling, bufferSize);
+    Recovery::unmapBuffer(staging, bufferSize);
+    std::remove(testFile);
+}
+
+TEST_F(NanoLogTest, CompressionDaemon_poll) {
+    const std::string root = "/tmp/testDaemon";
+    const char *testFile = "/tmp/testLog_daemon";
+    const char *exitedTestFile = "/tmp/testLog_daemonExited";
+    std::remove(testFile);
+    std::remove(exitedTestFile);
+    mkdir(root.c_str(), 0700);
+
+    // Lays out a client directory and its StagingBuffer like a process
+    // running with COMPRESSION_DAEMON would
+    const size_t bufferSize = 1 << 16;
+    auto createClient = [&](pid_t pid, const char *logFile,
+                            uint64_t startTime) -> char* {
+        std::string dir = root + "/" + std::to_string(pid);
+        mkdir(dir.c_str(), 0700);
+        FILE *file = fopen((dir + "/" + Recovery::LOG_FILE_NAME).c_str(), "w");
+        fputs(logFile, file);
+        fclose(file);
+        file = fopen((dir + "/" + Recovery::DAEMON_CLIENT_FILE_NAME).c_str(),
+                     "w");
+        fprintf(file, "%lu", startTime);
+        fclose(file);
+
+        std::string fileName = dir + "/" + Recovery::BUFFER_FILE_PREFIX + "0";
+        int fd = open(fileName.c_str(), O_RDWR|O_CREAT, 0600);
+        EXPECT_EQ(0, ftruncate(fd, Recovery::HEADER_SIZE + bufferSize));
+        void *map = mmap(nullptr, Recovery::HEADER_SIZE + bufferSize,
+                         PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        auto *header = static_cast<Recovery::BufferHeader*>(map);
+        header->magic = Recovery::MAGIC;
+        header->capacity = bufferSize;
+        header->type = Recovery::STAGING_BUFFER;
+        header->bufferId = 3;
+        header->endOffset = bufferSize;
+        return static_cast<char*>(map) + Recovery::HEADER_SIZE;
+    };
+
+    uint32_t fmtId = 0;
+    while (strchr(GeneratedFunctions::logId2Metadata[fmtId].fmtString, '%'))
+        ++fmtId;
+    const uint64_t recordBytes = sizeof(Log::UncompressedEntry);
+    auto stage = [&](char *pos, uint64_t timestamp) {
+        auto *entry = reinterpret_cast<Log::UncompressedEntry*>(pos);
+        entry->fmtId = fmtId;
+        entry->entrySize = downCast<uint32_t>(recordBytes);
+        entry->timestamp = timestamp;
+    };
+
+    CompressionDaemon daemon(root.c_str());
+    char *staging = createClient(getpid(), testFile,
+                                 Recovery::getProcessStartTime(getpid()));
+    Recovery::BufferHeader *header = Recovery::getHeader(staging);
+    daemon.scan();
+    EXPECT_EQ(1U, daemon.getNumClients());
+
+    // Case 1: Log messages are compressed and their space released
+    stage(staging, 1);
+    stage(staging + recordBytes, 2);
+    header->producerOffset = 2*recordBytes;
+    EXPECT_EQ(2*recordBytes, daemon.poll());
+    EXPECT_EQ(2*recordBytes, header->consumerOffset);
+    EXPECT_EQ(2U, daemon.getLogsProcessed());
+    EXPECT_EQ(0U, daemon.poll());
+
+    // Case 2: The producer wrapped around
+    stage(staging + 2*recordBytes, 3);
+    stage(staging, 4);
+    header->endOffset = 3*recordBytes;
+    header->producerOffset = recordBytes;
+    EXPECT_EQ(2*recordBytes, daemon.poll());
+    EXPECT_EQ(recordBytes, header->consumerOffset);
+
+    // Case 3: The header is being reset for a new thread
+    stage(staging + recordBytes, 5);
+    header->version = 1;
+    header->producerOffset = 2*recordBytes;
+    EXPECT_EQ(0U, daemon.poll());
+    header->version = 2;
+    EXPECT_EQ(recordBytes, daemon.poll());
+    EXPECT_EQ(5U, daemon.getLogsProcessed());
+
+    // Case 4: A process exited; it's drained and its directory deleted
+    pid_t child;
+    char trueCommand[] = "true";
+    char *argv[] = {trueCommand, nullptr};
+    ASSERT_EQ(0, posix_spawnp(&child, "true", nullptr, nullptr, argv,
+                              nullptr));
+    ASSERT_EQ(child, waitpid(child, nullptr, 0));
+    char *exited = createClient(child, exitedTestFile, 1);
+    stage(exited, 6);
+    Recovery::getHeader(exited)->producerOffset = recordBytes;
+    daemon.scan();
+    EXPECT_EQ(2U, daemon.getNumClients());
+    EXPECT_EQ(recordBytes, daemon.poll());
+    EXPECT_EQ(1U, daemon.getNumClients());
+    EXPECT_EQ(1U, daemon.getNumClientsExited());
+    EXPECT_NE(0, access((root + "/" + std::to_string(child)).c_str(), F_OK));
+    munmap(Recovery::getHeader(exited), Recovery::HEADER_SIZE + bufferSize);
+
+    // Case 4b: A process exited and its id was reused by another one
+    pid_t reused = getppid();
+    char *reusedStaging = createClient(reused, exitedTestFile,
+                                Recovery::getProcessStartTime(reused) + 1);
+    daemon.scan();
+    EXPECT_EQ(2U, daemon.getNumClients());
+    EXPECT_EQ(0U, daemon.poll());
+    EXPECT_EQ(1U, daemon.getNumClients());
+    EXPECT_EQ(2U, daemon.getNumClientsExited());
+    EXPECT_NE(0, access((root + "/" + std::to_string(reused)).c_str(),
+                        F_OK));
+    munmap(Recovery::getHeader(reusedStaging),
+           Recovery::HEADER_SIZE + bufferSize);
+
+    // Case 5: A process exited cleanly and deleted its directory
+    Recovery::removeDirectory(root + "/" + std::to_string(getpid()));
+    daemon.scan();
+    EXPECT_EQ(0U, daemon.getNumClients());
+    EXPECT_EQ(0U, daemon.getBytesLost());
+    munmap(header, Recovery::HEADER_SIZE + bufferSize);
+
+    struct stat st;
+    ASSERT_EQ(0, stat(testFile, &st));
+    uint64_t fileBytes = st.st_size;
+    ASSERT_EQ(0, stat(exitedTestFile, &st));
+    EXPECT_EQ(daemon.getBytesWritten(), fileBytes + st.st_size);
+
+    Log::Decoder decoder;
+    Log::LogMessage msg;
+    ASSERT_TRUE(decoder.open(testFile));
+    for (uint64_t timestamp = 1; timestamp <= 5; ++timestamp) {
+        ASSERT_TRUE(decoder.getNextLogStatement(msg));
+        EXPECT_EQ(timestamp, msg.getTimestamp());
+    }
+    EXPECT_FALSE(decoder.getNextLogStatement(msg));
+
+    Log::Decoder exitedDecoder;
+    ASSERT_TRUE(exitedDecoder.open(exitedTestFile));
+    ASSERT_TRUE(exitedDecoder.getNextLogStatement(msg));
+    EXPECT_EQ(6U, msg.getTimestamp());
+    EXPECT_FALSE(exitedDecoder.getNextLogStatement(msg));
+
+    rmdir(root.c_str());
+    std::remove(testFile);
+    std::remove(exitedTestFile);
+}
+
+TEST_F(NanoLogTest, StagingBuffer_compressOwnBacklog) {
+    size_t recordBytes = stageDroppedLogsRecord(sb, 100);
+    stageDroppedLogsRecord(sb, 101);
+
+    // Case 1: Background thread is working on the buffer
+    sb->consumerMutex.lock();
+    EXPECT_FALSE(sb->compressOwnBacklog());
+    EXPECT_EQ(sb->storage, sb->consumerPos);
+    EXPECT_EQ(nullptr, sb->assistEncoder);
+    sb->consumerMutex.unlock();
+
+    // Case 2: Producer compresses all of it
+    EXPECT_TRUE(sb->compressOwnBacklog());
+    EXPECT_EQ(sb->producerPos, sb->consumerPos);
+    EXPECT_EQ(2*recordBytes, sb->assistBytesPending);
+    EXPECT_EQ(0U, sb->assistLogsPending); // Records aren't log messages
+    EXPECT_EQ(1U, sb->numTimesAssisted);
+
+    ASSERT_NE(nullptr, sb->assistEncoder);
+    EXPECT_LT(0U, sb->assistEncoder->getEncodedBytes());
+    EXPECT_EQ(Log::EntryType::BUFFER_EXTENT,
+              Log::peekEntryType(sb->assistBuffer));
+    EXPECT_EQ(std::min(sb->capacity, NanoLogConfig::ASSIST_BUFFER_SIZE),
+              sb->assistBufferSize);
+
+    // Case 3: Nothing left to do
+    EXPECT_FALSE(sb->compressOwnBacklog());
+    EXPECT_EQ(1U, sb->numTimesAssisted);
+
+    // Case 4: After a shrink, the assist space is freed once it's output
+    uint32_t capacity = sb->capacity;
+    sb->capacity = capacity/2;
+    sb->trimAssistBuffer();
+    EXPECT_NE(nullptr, sb->assistBuffer);
+
+    sb->assistEncoder->swapBuffer(sb->assistBuffer, sb->assistBufferSize);
+    sb->trimAssistBuffer();
+    EXPECT_EQ(nullptr, sb->assistBuffer);
+    EXPECT_EQ(nullptr, sb->assistEncoder);
+    EXPECT_EQ(0U, sb->assistBufferSize);
+    sb->capacity = capacity;
+}
+
+TEST_F(NanoLogTest, compressShard) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    stopCompressionThread();
+    std::vector<RuntimeLogger::WorkerShard*> savedShards = logger.workerShards;
+    logger.workerShards = {new RuntimeLogger::WorkerShard(),
+                           new RuntimeLogger::WorkerShard()};
+
+    RuntimeLogger::StagingBuffer *other = new RuntimeLogger::StagingBuffer(1);
+    size_t recordBytes = stageDroppedLogsRecord(sb, 100);
+    stageDroppedLogsRecord(other, 100);
+    pushThreadBuffer(sb);
+    pushThreadBuffer(other);
+    logger.addToShard(sb);
+    logger.addToShard(other);
+    EXPECT_EQ(1U, logger.workerShards[0]->buffers.size());
+    EXPECT_EQ(1U, logger.workerShards[1]->buffers.size());
+
+    // Case 1: Worker 1 (of 2) only works on its own shard when it has work
+    EXPECT_EQ(recordBytes, logger.compressShard(1));
+    EXPECT_EQ(other->producerPos, other->consumerPos);
+    EXPECT_EQ(recordBytes, other->assistBytesPending);
+    EXPECT_EQ(sb->storage, sb->consumerPos);
+
+    // Case 2: Nothing to steal while the other buffer is being worked on
+    sb->consumerMutex.lock();
+    EXPECT_EQ(0U, logger.compressShard(1));
+    sb->consumerMutex.unlock();
+
+    // Case 3: Steals from the other shard
+    EXPECT_EQ(recordBytes, logger.compressShard(1));
+    EXPECT_EQ(sb->producerPos, sb->consumerPos);
+    EXPECT_EQ(recordBytes, sb->assistBytesPending);
+    EXPECT_EQ(0U, sb->numTimesAssisted);
+
+    // Case 4: Idle buffers are skipped
+    stageDroppedLogsRecord(sb, 200);
+    sb->active = false;
+    EXPECT_EQ(0U, logger.compressShard(0));
+    EXPECT_NE(sb->producerPos, sb->consumerPos);
+    sb->active = true;
+
+    // Case 5: Buffers removed from the shards aren't looked at at all
+    logger.removeFromShard(sb);
+    EXPECT_TRUE(logger.workerShards[0]->buffers.empty());
+    EXPECT_EQ(0U, logger.compressShard(0));
+    EXPECT_NE(sb->producerPos, sb->consumerPos);
+
+    logger.removeFromShard(other);
+    for (RuntimeLogger::WorkerShard *shard : logger.workerShards)
+        delete shard;
+    logger.workerShards = savedShards;
+    popThreadBuffer();
+    popThreadBuffer();
+    delete other;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, waitForShardWork) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    stopCompressionThread();
+    NanoLog::Config savedConfig = logger.config;
+    std::vector<RuntimeLogger::WorkerShard*> savedShards = logger.workerShards;
+    logger.workerShards = {new RuntimeLogger::WorkerShard()};
+    logger.config.wakeupPolicy = NanoLog::ADAPTIVE_BACKOFF;
+    logger.config.backoffSpinUs = 0;
+    logger.config.backoffPauseUs = 0;
+    uint32_t pauses = 1;
+
+    // Case 1: Workers sleep on the doorbell while all the shards are empty...
+    uint64_t numWorkerDoorbellSleeps = logger.numWorkerDoorbellSleeps;
+    std::thread worker([&]() { logger.waitForShardWork(0, &pauses); });
+    uint64_t start = Cycles::rdtsc();
+    while (logger.numWorkerDoorbellSleeps == numWorkerDoorbellSleeps &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+        std::this_thread::yield();
+    EXPECT_EQ(numWorkerDoorbellSleeps + 1, logger.numWorkerDoorbellSleeps);
+    EXPECT_EQ(1U, logger.numWorkersParked);
+
+    // ... until the compression thread hands them a StagingBuffer
+    logger.addToShard(sb);
+    logger.ringWorkerDoorbell();
+    worker.join();
+    EXPECT_EQ(0U, logger.numWorkersParked);
+
+    // Case 2: Not while a shard holds a StagingBuffer
+    logger.waitForShardWork(0, &pauses);
+    EXPECT_EQ(numWorkerDoorbellSleeps + 1, logger.numWorkerDoorbellSleeps);
+
+    // Case 3: BUSY_POLL never sleeps
+    logger.removeFromShard(sb);
+    logger.config.wakeupPolicy = NanoLog::BUSY_POLL;
+    logger.waitForShardWork(0, &pauses);
+    EXPECT_EQ(numWorkerDoorbellSleeps + 1, logger.numWorkerDoorbellSleeps);
+
+    delete logger.workerShards[0];
+    logger.workerShards = savedShards;
+    logger.config = savedConfig;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, StagingBuffer_markActive) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    stopCompressionThread();
+    RuntimeLogger::StagingBuffer *savedReadyBuffers = logger.readyBuffers;
+
+    // Active buffers don't notify the compression thread
+    EXPECT_TRUE(sb->active);
+    stageDroppedLogsRecord(sb, 100);
+    EXPECT_EQ(savedReadyBuffers, logger.readyBuffers.load());
+
+    // Idle ones do, but only once
+    sb->active = false;
+    stageDroppedLogsRecord(sb, 200);
+    EXPECT_TRUE(sb->active);
+    EXPECT_EQ(sb, logger.readyBuffers.load());
+    EXPECT_EQ(savedReadyBuffers, sb->nextReady);
+
+    stageDroppedLogsRecord(sb, 300);
+    EXPECT_EQ(sb, logger.readyBuffers.load());
+
+    logger.readyBuffers = savedReadyBuffers;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, compressionThreadMain_idleBuffers) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    logger.registerStagingBuffer(sb);
+
+    // An active buffer is checked until it's found empty, then marked idle
+    stageDroppedLogsRecord(sb, 100);
+    RuntimeLogger::sync();
+    EXPECT_EQ(sb->producerPos, sb->consumerPos);
+
+    uint64_t start = Cycles::rdtsc();
+    while (sb->active && Cycles::toSeconds(Cycles::rdtsc() - start) < 1.0)
+        std::this_thread::yield();
+    EXPECT_FALSE(sb->active);
+
+    // Logging to it again gets it checked again
+    stageDroppedLogsRecord(sb, 200);
+    EXPECT_TRUE(sb->active);
+    RuntimeLogger::sync();
+    EXPECT_EQ(sb->producerPos, sb->consumerPos);
+
+    // A log message that raced with it being marked idle is found by sync()
+    while (sb->active && Cycles::toSeconds(Cycles::rdtsc() - start) < 2.0)
+        std::this_thread::yield();
+    ASSERT_FALSE(sb->active);
+    sb->active = true;
+    stageDroppedLogsRecord(sb, 300);
+    sb->active = false;
+    RuntimeLogger::sync();
+    EXPECT_EQ(sb->producerPos, sb->consumerPos);
+
+    // Once its thread exits, it's retired and deleted by the compression
+    // thread.
+    sb->shouldDeallocate = true;
+    sb->markActive();
+    RuntimeLogger::sync();
+    {
+        RuntimeLogger::ThreadBuffersReader reader(logger);
+        for (RuntimeLogger::StagingBuffer *it = logger.threadBuffers.load();
+                it != nullptr; it = it->nextThreadBuffer.load())
+            EXPECT_NE(sb, it);
+    }
+    sb = nullptr;
+}
+
+TEST_F(NanoLogTest, compressionThreadMain_flushPolicy) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::sync();
+    stopCompressionThread();
+    NanoLog::Config savedConfig = logger.config;
+    logger.config.flushMinBytes = 1 << 30;
+    logger.config.flushMaxDelayUs = 200000;
+    restartCompressionThread();
+    logger.registerStagingBuffer(sb);
+    RuntimeLogger::sync();
+
+    // Small outputs are held back until they've waited flushMaxDelayUs...
+    uint64_t bytesWritten = logger.totalBytesWritten;
+    uint64_t start = Cycles::rdtsc();
+    stageLogMessage(sb, NOTICE);
+    while (sb->producerPos != sb->consumerPos &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 1.0)
+        std::this_thread::yield();
+    EXPECT_EQ(sb->producerPos, sb->consumerPos);
+    EXPECT_EQ(bytesWritten, logger.totalBytesWritten);
+
+    while (logger.totalBytesWritten == bytesWritten &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+        std::this_thread::yield();
+    EXPECT_LT(bytesWritten, logger.totalBytesWritten);
+    EXPECT_LE(0.2, Cycles::toSeconds(Cycles::rdtsc() - start));
+
+    // ... unless they contain an ERROR message
+    bytesWritten = logger.totalBytesWritten;
+    start = Cycles::rdtsc();
+    stageLogMessage(sb, ERROR);
+    while (logger.totalBytesWritten == bytesWritten &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+        std::this_thread::yield();
+    EXPECT_LT(bytesWritten, logger.totalBytesWritten);
+    EXPECT_GT(0.2, Cycles::toSeconds(Cycles::rdtsc() - start));
+
+    // ... or a sync() is waiting on them
+    bytesWritten = logger.totalBytesWritten;
+    stageLogMessage(sb, WARNING);
+    RuntimeLogger::sync();
+    EXPECT_LT(bytesWritten, logger.totalBytesWritten);
+
+    sb->shouldDeallocate = true;
+    sb->markActive();
+    RuntimeLogger::sync();
+    sb = nullptr;
+
+    stopCompressionThread();
+    logger.config = savedConfig;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, compressionThreadMain_flushLogLevel) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::sync();
+    stopCompressionThread();
+    NanoLog::Config savedConfig = logger.config;
+    logger.config.flushMinBytes = 1 << 30;
+    logger.config.flushMaxDelayUs = 10000000;
+    logger.config.pollIntervalNoWorkUs = 2000000;
+    logger.config.flushLogLevel = WARNING;
+    restartCompressionThread();
+    logger.registerStagingBuffer(sb);
+    RuntimeLogger::sync();
+
+    // A WARNING message wakes up the sleeping compression thread, which
+    // flushes it along with the NOTICE message before it.
+    uint64_t bytesWritten = logger.totalBytesWritten;
+    uint32_t numSeverityFlushes = logger.numSeverityFlushes;
+    stageLogMessage(sb, NOTICE);
+    stageLogMessage(sb, WARNING);
+    uint64_t start = Cycles::rdtsc();
+    logger.hintSevereLog();
+    while (logger.totalBytesWritten == bytesWritten &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+        std::this_thread::yield();
+    EXPECT_LT(bytesWritten, logger.totalBytesWritten);
+    EXPECT_GT(1.0, Cycles::toSeconds(Cycles::rdtsc() - start));
+    EXPECT_EQ(numSeverityFlushes + 1, logger.numSeverityFlushes);
+    EXPECT_FALSE(logger.severeLogPending);
+
+    sb->shouldDeallocate = true;
+    sb->markActive();
+    RuntimeLogger::sync();
+    sb = nullptr;
+
+    stopCompressionThread();
+    logger.config = savedConfig;
+    restartCompressionThread();
+
+    // SILENT_LOG_LEVEL turns it off, and invalid levels are rejected
+    NanoLog::Config config = savedConfig;
+    config.flushLogLevel = SILENT_LOG_LEVEL;
+    EXPECT_STREQ(nullptr, RuntimeLogger::checkConfig(config));
+    config.flushLogLevel = NUM_LOG_LEVELS;
+    EXPECT_STREQ("flushLogLevel is not a valid LogLevel",
+                 RuntimeLogger::checkConfig(config));
+}
+
+TEST_F(NanoLogTest, compressionThreadMain_flushLogLevelDuringIo) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::sync();
+    stopCompressionThread();
+    NanoLog::Config savedConfig = logger.config;
+    HeldIoBackend *backend = holdOutputWrites();
+    logger.config.flushMinBytes = 1 << 30;
+    logger.config.flushMaxDelayUs = 10000000;
+    logger.config.flushLogLevel = ERROR;
+    restartCompressionThread();
+    logger.registerStagingBuffer(sb);
+
+    auto logError = [&](size_t numSubmitted) {
+        stageLogMessage(sb, ERROR);
+        logger.hintSevereLog();
+        uint64_t start = Cycles::rdtsc();
+        while (backend->getNumSubmitted() < numSubmitted &&
+                Cycles::toSeconds(Cycles::rdtsc() - start) < 1.0)
+            std::this_thread::yield();
+    };
+
+    // ERROR messages are flushed while an earlier write is in flight...
+    uint32_t numSeverityFlushes = logger.numSeverityFlushes;
+    logError(1);
+    EXPECT_EQ(1U, backend->getNumSubmitted());
+    logError(2);
+    EXPECT_EQ(2U, backend->getNumSubmitted());
+    EXPECT_EQ(numSeverityFlushes + 2, logger.numSeverityFlushes);
+
+    // ... as long as there's an output buffer to continue in
+    logError(3);
+    EXPECT_EQ(2U, backend->getNumSubmitted());
+
+    backend->release(0);
+    uint64_t start = Cycles::rdtsc();
+    while (backend->getNumSubmitted() < 3 &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+        std::this_thread::yield();
+    EXPECT_EQ(3U, backend->getNumSubmitted());
+
+    sb->shouldDeallocate = true;
+    sb->markActive();
+    backend->releaseAll();
+    RuntimeLogger::sync();
+    sb = nullptr;
+
+    stopCompressionThread();
+    logger.config = savedConfig;
+    restoreOutputWrites(backend);
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, compressionThreadMain_wakeupPolicy) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::sync();
+    stopCompressionThread();
+    NanoLog::Config savedConfig = logger.config;
+    logger.config.wakeupPolicy = NanoLog::ADAPTIVE_BACKOFF;
+    logger.config.backoffSpinUs = 0;
+    logger.config.backoffPauseUs = 100;
+    restartCompressionThread();
+    logger.registerStagingBuffer(sb);
+    RuntimeLogger::sync();
+
+    // Once the StagingBuffers are idle, the compression thread sleeps on the
+    // doorbell...
+    uint64_t start = Cycles::rdtsc();
+    while (!logger.compressionThreadParked &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+        std::this_thread::yield();
+    EXPECT_TRUE(logger.compressionThreadParked);
+    EXPECT_LT(0U, logger.numDoorbellSleeps);
+    EXPECT_FALSE(sb->active);
+
+    // ... which the next log message rings
+    uint64_t numDoorbellRings = logger.numDoorbellRings;
+    uint64_t logsProcessed = logger.logsProcessed;
+    stageLogMessage(sb, NOTICE);
+    start = Cycles::rdtsc();
+    while (logger.logsProcessed == logsProcessed &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+        std::this_thread::yield();
+    EXPECT_EQ(logsProcessed + 1, logger.logsProcessed);
+    EXPECT_LT(numDoorbellRings, logger.numDoorbellRings);
+    RuntimeLogger::sync();
+
+    // BUSY_POLL never sleeps
+    stopCompressionThread();
+    logger.config.wakeupPolicy = NanoLog::BUSY_POLL;
+    restartCompressionThread();
+    uint64_t numDoorbellSleeps = logger.numDoorbellSleeps;
+    logsProcessed = logger.logsProcessed;
+    stageLogMessage(sb, NOTICE);
+    start = Cycles::rdtsc();
+    while (logger.logsProcessed == logsProcessed &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+        std::this_thread::yield();
+    EXPECT_EQ(logsProcessed + 1, logger.logsProcessed);
+    RuntimeLogger::sync();
+    EXPECT_EQ(numDoorbellSleeps, logger.numDoorbellSleeps);
+    EXPECT_FALSE(logger.compressionThreadParked);
+
+    sb->shouldDeallocate = true;
+    sb->markActive();
+    RuntimeLogger::sync();
+    sb = nullptr;
+
+    stopCompressionThread();
+    logger.config = savedConfig;
+    restartCompressionThread();
+
+    NanoLog::Config config = savedConfig;
+    config.wakeupPolicy = static_cast<NanoLog::WakeupPolicy>(3);
+    EXPECT_STREQ("wakeupPolicy is not a valid WakeupPolicy",
+                 RuntimeLogger::checkConfig(config));
+    config = savedConfig;
+    config.compressionThreadCore = CPU_SETSIZE;
+    EXPECT_STREQ("compressionThreadCore exceeds CPU_SETSIZE",
+                 RuntimeLogger::checkConfig(config));
+}
+
+TEST_F(NanoLogTest, syncAsync) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::sync();
+    logger.registerStagingBuffer(sb);
+
+    // The log messages are written before the future becomes ready
+    uint64_t bytesWritten = logger.totalBytesWritten;
+    stageLogMessage(sb, NOTICE);
+    std::future<void> future = RuntimeLogger::syncAsync();
+    EXPECT_EQ(std::future_status::ready,
+              future.wait_for(std::chrono::seconds(5)));
+    EXPECT_LT(bytesWritten, logger.totalBytesWritten);
+
+    // Without the compression thread, the syncs time out...
+    stopCompressionThread();
+    EXPECT_FALSE(RuntimeLogger::syncFor(10));
+
+    std::atomic<int> numCallbacks(0);
+    for (int i = 0; i < 5; ++i)
+        RuntimeLogger::syncAsync([&numCallbacks]() { ++numCallbacks; });
+    future = RuntimeLogger::syncAsync();
+    EXPECT_EQ(std::future_status::timeout,
+              future.wait_for(std::chrono::milliseconds(10)));
+    EXPECT_EQ(0, numCallbacks);
+
+    // ... and once it's back, the ones waiting are all completed together
+    uint32_t numSyncFlushes = logger.numSyncFlushes;
+    restartCompressionThread();
+    EXPECT_EQ(std::future_status::ready,
+              future.wait_for(std::chrono::seconds(5)));
+    EXPECT_EQ(5, numCallbacks);
+    EXPECT_EQ(numSyncFlushes + 1, logger.numSyncFlushes);
+    EXPECT_EQ(logger.syncRequested, logger.syncCompleted);
+    EXPECT_TRUE(RuntimeLogger::syncFor(5000));
+
+    // Concurrent callers of sync() can't miss their wakeups
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([]() {
+            for (int j = 0; j < 50; ++j)
+                RuntimeLogger::sync();
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    EXPECT_EQ(logger.syncRequested, logger.syncCompleted);
+
+    sb->shouldDeallocate = true;
+    sb->markActive();
+    RuntimeLogger::sync();
+    sb = nullptr;
+}
+
+TEST_F(NanoLogTest, durabilityMode_outputFile) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    NanoLog::Config savedConfig = logger.config;
+    int fileFlags = logger.config.fileFlags;
+
+    logger.config.durabilityMode = NanoLog::PAGE_CACHE;
+    EXPECT_EQ(fileFlags, logger.getOpenFlags());
+    logger.config.durabilityMode = NanoLog::PERIODIC_FDATASYNC;
+    EXPECT_EQ(fileFlags, logger.getOpenFlags());
+    logger.config.durabilityMode = NanoLog::PERIODIC_SYNC_FILE_RANGE;
+    EXPECT_EQ(fileFlags, logger.getOpenFlags());
+    logger.config.durabilityMode = NanoLog::DSYNC;
+    EXPECT_EQ(fileFlags | O_DSYNC, logger.getOpenFlags());
+    logger.config.durabilityMode = NanoLog::DIRECT_IO;
+    EXPECT_EQ(fileFlags | O_DSYNC | O_DIRECT, logger.getOpenFlags());
+
+    // O_DIRECT log files are padded to start the output at 512 bytes
+    const char *testFile = "/tmp/testLog_durabilityMode";
+    char data[100] = {1};
+    int fd = open(testFile, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    ASSERT_LE(0, fd);
+    EXPECT_EQ(100, write(fd, data, sizeof(data)));
+
+    uint64_t padBytesWritten = logger.padBytesWritten;
+    EXPECT_EQ(512, logger.prepareOutputFile(fd));
+    EXPECT_EQ(512, lseek(fd, 0, SEEK_END));
+    EXPECT_EQ(padBytesWritten + 412, logger.padBytesWritten);
+    logger.padBytesWritten = padBytesWritten;
+
+    // The other modes append right away
+    EXPECT_EQ(100, write(fd, data, sizeof(data)));
+    logger.config.durabilityMode = NanoLog::DSYNC;
+    EXPECT_EQ(612, logger.prepareOutputFile(fd));
+    close(fd);
+
+    std::remove(testFile);
+    logger.config = savedConfig;
+}
+
+TEST_F(NanoLogTest, reserveOutputFileSpace) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    stopCompressionThread();
+    NanoLog::Config savedConfig = logger.config;
+    int savedOutputFd = logger.outputFd;
+    uint32_t numFallocates = logger.numFallocates;
+    uint64_t bytesFallocated = logger.bytesFallocated;
+
+    const char *testFile = "/tmp/testLog_reserveOutputFileSpace";
+    logger.outputFd = open(testFile, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    ASSERT_LE(0, logger.outputFd);
+    logger.config.fallocateChunkSize = 1 << 20;
+
+    // Space is reserved in whole chunks, without growing the file
+    off_t reservedEnd = 0;
+    logger.reserveOutputFileSpace(100, &reservedEnd);
+    struct stat st;
+    ASSERT_EQ(0, fstat(logger.outputFd, &st));
+    EXPECT_EQ(0, st.st_size);
+    if (reservedEnd == std::numeric_limits<off_t>::max()) {
+        // The file system doesn't support fallocate(), so it's not retried
+        EXPECT_EQ(numFallocates, logger.numFallocates);
+    } else {
+        EXPECT_EQ(1 << 20, reservedEnd);
+        EXPECT_LE(1 << 20, st.st_blocks*512);
+        EXPECT_EQ(numFallocates + 1, logger.numFallocates);
+        EXPECT_EQ(bytesFallocated + (1 << 20), logger.bytesFallocated);
+
+        // Writes within the reserved space don't need more
+        logger.reserveOutputFileSpace(1 << 20, &reservedEnd);
+        EXPECT_EQ(numFallocates + 1, logger.numFallocates);
+
+        logger.reserveOutputFileSpace((3 << 20) + 1, &reservedEnd);
+        EXPECT_EQ(4 << 20, reservedEnd);
+        EXPECT_EQ(numFallocates + 2, logger.numFallocates);
+
+        // Closing the log file gives the reserved space back
+        char data[100] = {};
+        ASSERT_EQ(100, pwrite(logger.outputFd, data, sizeof(data), 0));
+        off_t savedOutputFileOffset = logger.outputFileOffset;
+        logger.outputFileOffset = 100;
+        logger.releaseOutputFileSpace();
+        ASSERT_EQ(0, fstat(logger.outputFd, &st));
+        EXPECT_EQ(100, st.st_size);
+        EXPECT_GT(1 << 20, st.st_blocks*512);
+        logger.outputFileOffset = savedOutputFileOffset;
+    }
+
+    // 0 disables it
+    logger.config.fallocateChunkSize = 0;
+    reservedEnd = 0;
+    logger.reserveOutputFileSpace(100, &reservedEnd);
+    EXPECT_EQ(0, reservedEnd);
+
+    close(logger.outputFd);
+    std::remove(testFile);
+    logger.outputFd = savedOutputFd;
+    logger.numFallocates = numFallocates;
+    logger.bytesFallocated = bytesFallocated;
+    logger.config = savedConfig;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, compressionThreadMain_periodicSync) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::sync();
+    NanoLog::Config savedConfig = logger.config;
+    logger.registerStagingBuffer(sb);
+
+    NanoLog::DurabilityMode modes[] = {NanoLog::PERIODIC_FDATASYNC,
+                                       NanoLog::PERIODIC_SYNC_FILE_RANGE};
+    for (NanoLog::DurabilityMode mode : modes) {
+        stopCompressionThread();
+        logger.config.durabilityMode = mode;
+        logger.config.syncIntervalMs = 20;
+        logger.config.flushMinBytes = 0;
+        restartCompressionThread();
+
+        // The log file is synced within syncIntervalMs of the write
+        uint32_t numPeriodicSyncs = logger.numPeriodicSyncs;
+        uint64_t start = Cycles::rdtsc();
+        stageLogMessage(sb, NOTICE);
+        while (logger.numPeriodicSyncs == numPeriodicSyncs &&
+                Cycles::toSeconds(Cycles::rdtsc() - start) < 5.0)
+            std::this_thread::yield();
+        EXPECT_EQ(numPeriodicSyncs + 1, logger.numPeriodicSyncs);
+
+        // But not again until there's more output
+        RuntimeLogger::sync();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        EXPECT_EQ(numPeriodicSyncs + 1, logger.numPeriodicSyncs);
+    }
+
+    sb->shouldDeallocate = true;
+    sb->markActive();
+    RuntimeLogger::sync();
+    sb = nullptr;
+
+    stopCompressionThread();
+    logger.config = savedConfig;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, compressionThreadMain_rotateLogFile) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::sync();
+    stopCompressionThread();
+    NanoLog::Config savedConfig = logger.config;
+    int savedOutputFd = logger.outputFd;
+    std::string savedOutputFileName = logger.outputFileName;
+    off_t savedOutputFileOffset = logger.outputFileOffset;
+    uint32_t numLogFileRotations = logger.numLogFileRotations;
+
+    const char *testFile = "/tmp/testLog_rotateLogFile";
+    std::string rotated[] = {std::string(testFile) + ".1",
+                             std::string(testFile) + ".2",
+                             std::string(testFile) + ".3"};
+    for (const std::string &file : rotated)
+        std::remove(file.c_str());
+
+    logger.outputFd = open(testFile, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    ASSERT_LE(0, logger.outputFd);
+    logger.outputFileName = testFile;
+    logger.outputFileOffset = logger.completedFileOffset = 0;
+    logger.config.flushMinBytes = 0;
+    logger.config.rotateMaxBytes = 1;
+    logger.config.rotateKeep = 2;
+    logger.config.rotatedCallback = recordRotatedFile;
+    rotatedFiles.clear();
+    restartCompressionThread();
+    logger.registerStagingBuffer(sb);
+
+    // Every write rotates the log file without restarting the thread, and
+    // only the rotateKeep most recent rotated files are kept.
+    for (int i = 1; i <= 3; ++i) {
+        stageLogMessage(sb, NOTICE);
+        RuntimeLogger::sync();
+        EXPECT_EQ(numLogFileRotations + i, logger.numLogFileRotations);
+        EXPECT_EQ(i, rotatedFiles.size());
+        EXPECT_EQ(rotated[0], rotatedFiles.back());
+    }
+    EXPECT_EQ(0, access(rotated[0].c_str(), F_OK));
+    EXPECT_EQ(0, access(rotated[1].c_str(), F_OK));
+    EXPECT_NE(0, access(rotated[2].c_str(), F_OK));
+    EXPECT_TRUE(logger.compressionThread.joinable());
+
+    // Each rotated file starts with a Checkpoint
+    int fd = open(rotated[0].c_str(), O_RDONLY);
+    ASSERT_LE(0, fd);
+    Log::Checkpoint checkpoint;
+    EXPECT_EQ(sizeof(checkpoint), read(fd, &checkpoint, sizeof(checkpoint)));
+    EXPECT_EQ(Log::EntryType::CHECKPOINT, checkpoint.entryType);
+    close(fd);
+
+    sb->shouldDeallocate = true;
+    sb->markActive();
+    RuntimeLogger::sync();
+    sb = nullptr;
+
+    stopCompressionThread();
+    close(logger.outputFd);
+    std::remove(testFile);
+    for (const std::string &file : rotated)
+        std::remove(file.c_str());
+    logger.outputFd = savedOutputFd;
+    logger.outputFileName = savedOutputFileName;
+    logger.outputFileOffset = logger.completedFileOffset =
+                                                    savedOutputFileOffset;
+    logger.config = savedConfig;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, unlinkRetiredBuffers) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    stopCompressionThread();
+    logger.reclaimRetiredBuffers();
+    logger.reclaimRetiredBuffers();
+    ASSERT_TRUE(logger.retiredBuffers.empty());
+    ASSERT_TRUE(logger.reclaimingBuffers.empty());
+
+    RuntimeLogger::StagingBuffer *oldHead = logger.threadBuffers;
+    RuntimeLogger::StagingBuffer *first = new RuntimeLogger::StagingBuffer(1);
+    RuntimeLogger::StagingBuffer *second = new RuntimeLogger::StagingBuffer(2);
+    RuntimeLogger::StagingBuffer *third = new RuntimeLogger::StagingBuffer(3);
+    pushThreadBuffer(first);
+    pushThreadBuffer(second);
+    pushThreadBuffer(third);
+
+    // Unlinks from the front and the middle of the list
+    third->retired = true;
+    first->retired = true;
+    first->numLogsDropped = 5;
+    uint64_t logsDroppedBefore = logger.logsDroppedByExitedThreads;
+    logger.unlinkRetiredBuffers();
+
+    EXPECT_EQ(second, logger.threadBuffers.load());
+    EXPECT_EQ(oldHead, second->nextThreadBuffer.load());
+    EXPECT_EQ(second, third->nextThreadBuffer.load());
+    EXPECT_EQ(oldHead, first->nextThreadBuffer.load());
+    EXPECT_EQ(2U, logger.retiredBuffers.size());
+    EXPECT_EQ(logsDroppedBefore + 5, logger.logsDroppedByExitedThreads);
+
+    // Retired buffers aren't deleted while readers may still access them
+    {
+        RuntimeLogger::ThreadBuffersReader reader(logger);
+        logger.reclaimRetiredBuffers();
+        EXPECT_TRUE(logger.retiredBuffers.empty());
+        EXPECT_EQ(2U, logger.reclaimingBuffers.size());
+
+        logger.reclaimRetiredBuffers();
+        EXPECT_EQ(2U, logger.reclaimingBuffers.size());
+    }
+
+    // Readers that entered after the buffers were queued don't hold them up
+    {
+        RuntimeLogger::ThreadBuffersReader reader(logger);
+        logger.reclaimRetiredBuffers();
+        EXPECT_TRUE(logger.reclaimingBuffers.empty());
+    }
+
+    popThreadBuffer();
+    delete second;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, compressionThreadMain_removeFirstBuffer) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    stopCompressionThread();
+
+    // Every pass starts at an empty buffer which is then marked idle. That
+    // must not cut the passes short.
+    std::vector<RuntimeLogger::StagingBuffer*> savedActiveBuffers;
+    savedActiveBuffers.swap(logger.activeBuffers);
+    for (uint32_t i = 1; i <= 100; ++i)
+        logger.activeBuffers.push_back(new RuntimeLogger::StagingBuffer(i));
+    std::vector<RuntimeLogger::StagingBuffer*> emptyBuffers =
+                                                        logger.activeBuffers;
+
+    RuntimeLogger::StagingBuffer *other = new RuntimeLogger::StagingBuffer(0);
+    stageDroppedLogsRecord(other, 100);
+    logger.activeBuffers.push_back(other);
+
+    restartCompressionThread();
+    RuntimeLogger::sync();
+    EXPECT_EQ(other->producerPos, other->consumerPos);
+
+    stopCompressionThread();
+    logger.activeBuffers.swap(savedActiveBuffers);
+    for (RuntimeLogger::StagingBuffer *empty : emptyBuffers)
+        delete empty;
+    delete other;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, registerInvocationSite) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    const uint32_t numSites = RuntimeLogger::INVOCATION_SITES_PER_CHUNK + 10;
+    std::vector<int> logIds(numSites, UNASSIGNED_LOGID);
+
+    uint32_t firstId = logger.numInvocationSites;
+    for (uint32_t i = 0; i < numSites; ++i) {
+        StaticLogInfo info(NULL, "file.cc", i, NOTICE, "Hello", 0, 0, NULL);
+        RuntimeLogger::registerInvocationSite(info, logIds[i]);
+        EXPECT_EQ(firstId + i, static_cast<uint32_t>(logIds[i]));
+    }
+
+    // Registering a site again is a no-op
+    StaticLogInfo info(NULL, "other.cc", 1, NOTICE, "Hello", 0, 0, NULL);
+    RuntimeLogger::registerInvocationSite(info, logIds[0]);
+    EXPECT_EQ(firstId, static_cast<uint32_t>(logIds[0]));
+    EXPECT_EQ(firstId + numSites, logger.numInvocationSites);
+
+    // A site that's being registered by another thread isn't added again;
+    // the thread waits for its logId instead
+    int pendingLogId = PENDING_LOGID;
+    std::atomic<bool> registered(false);
+    std::thread waiter([&]() {
+        RuntimeLogger::registerInvocationSite(info, pendingLogId);
+        registered = true;
+    });
+    usleep(10000);
+    EXPECT_FALSE(registered);
+    __atomic_store_n(&pendingLogId, 42, __ATOMIC_RELEASE);
+    waiter.join();
+    EXPECT_EQ(42, pendingLogId);
+    EXPECT_EQ(firstId + numSites, logger.numInvocationSites);
+
+    std::vector<StaticLogInfo> dictionary;
+    logger.copyNewInvocationSites(dictionary, UINT32_MAX);
+    ASSERT_EQ(firstId + numSites, dictionary.size());
+    for (uint32_t i = 0; i < numSites; ++i) {
+        EXPECT_STREQ("file.cc", dictionary.at(firstId + i).filename);
+        EXPECT_EQ(i, dictionary.at(firstId + i).lineNum);
+    }
+
+    // Copying stops at the limit
+    std::vector<StaticLogInfo> partial;
+    logger.copyNewInvocationSites(partial, firstId + 1);
+    EXPECT_EQ(firstId + 1, partial.size());
+
+    // and at entries that are still being registered
+    uint32_t id = logger.numInvocationSites.fetch_add(1);
+    int logId = UNASSIGNED_LOGID;
+    RuntimeLogger::registerInvocationSite(info, logId);
+    EXPECT_EQ(id + 1, static_cast<uint32_t>(logId));
+
+    logger.copyNewInvocationSites(dictionary, UINT32_MAX);
+    EXPECT_EQ(id, dictionary.size());
+
+    RuntimeLogger::InvocationSiteChunk *chunk = logger.invocationSites[
+                id/RuntimeLogger::INVOCATION_SITES_PER_CHUNK].load();
+    uint32_t slot = id%RuntimeLogger::INVOCATION_SITES_PER_CHUNK;
+    new (&chunk->sites[slot]) StaticLogInfo(info);
+    chunk->published[slot] = true;
+
+    logger.copyNewInvocationSites(dictionary, UINT32_MAX);
+    EXPECT_EQ(id + 2, dictionary.size());
+}
+
+TEST_F(NanoLogTest, registerLinkedInvocationSites) {
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    static constexpr StaticLogInfo site(NULL, "linked.cc", 1, NOTICE, "Linked",
+                                        0, 0, NULL);
+    static int logId = UNASSIGNED_LOGID;
+    NANOLOG_LINK_INVOCATION_SITE(site, logId);
+
+    // Assigned when the RuntimeLogger was constructed
+    ASSERT_NE(UNASSIGNED_LOGID, logId);
+    std::vector<StaticLogInfo> dictionary;
+    logger.copyNewInvocationSites(dictionary, UINT32_MAX);
+    ASSERT_LT(static_cast<size_t>(logId), dictionary.size());
+    EXPECT_STREQ("linked.cc", dictionary.at(logId).filename);
+    EXPECT_STREQ("Linked", dictionary.at(logId).formatString);
+
+    // Linked sites are only registered once
+    int savedLogId = logId;
+    uint32_t savedNumInvocationSites = logger.numInvocationSites;
+    logger.registerLinkedInvocationSites();
+    EXPECT_EQ(savedLogId, logId);
+    EXPECT_EQ(savedNumInvocationSites, logger.numInvocationSites);
+}
+
+TEST_F(NanoLogTest, CpuStagingBuffer_reserveProducerSpace) {
+    typedef RuntimeLogger::CpuStagingBuffer CpuStagingBuffer;
+    const size_t headerSize = sizeof(CpuStagingBuffer::RecordHeader);
+    CpuStagingBuffer *cb = new CpuStagingBuffer(0,
+                                        NanoLogConfig::STAGING_BUFFER_SIZE);
+    char *reservation = nullptr;
+
+    // Records are aligned and invisible until they're committed
+    char *writePos = cb->reserveProducerSpace(10, 5, &reservation);
+    EXPECT_EQ(cb->storage, reservation);
+    EXPECT_EQ(cb->storage + headerSize, writePos);
+    EXPECT_EQ(24U, cb->producerPos.load());
+    EXPECT_EQ(5U, cb->getRecord(0)->threadId);
+    EXPECT_EQ(0U, cb->getRecord(0)->size.load());
+
+    CpuStagingBuffer::finishReservation(reservation, 10);
+    EXPECT_EQ(24U, cb->getRecord(0)->size.load());
+
+    // Fill up the rest of the buffer
+    writePos = cb->reserveProducerSpace(bufferSize - 24 - headerSize, 6,
+                                        &reservation);
+    EXPECT_EQ(cb->storage + 24 + headerSize, writePos);
+    EXPECT_EQ(bufferSize, cb->producerPos.load());
+    EXPECT_EQ(nullptr, cb->reserveProducerSpace(1, 5, &reservation));
+    CpuStagingBuffer::finishReservation(cb->storage + 24,
+                                        bufferSize - 24 - headerSize);
+
+    // Released space is zeroed and can be reused
+    cb->release(24);
+    EXPECT_EQ(24U, cb->consumerPos.load());
+    EXPECT_EQ(0U, cb->getRecord(0)->size.load());
+    EXPECT_EQ(0U, cb->getRecord(0)->threadId);
+    EXPECT_EQ(nullptr, cb->reserveProducerSpace(20, 5, &reservation));
+
+    writePos = cb->reserveProducerSpace(10, 5, &reservation);
+    EXPECT_EQ(cb->storage + headerSize, writePos);
+    EXPECT_EQ(bufferSize + 24, cb->producerPos.load());
+    delete cb;
+
+    // A record that doesn't fit at the end is preceded by a padding record
+    cb = new CpuStagingBuffer(0, NanoLogConfig::STAGING_BUFFER_SIZE);
+    cb->reserveProducerSpace(bufferSize - 16 - headerSize, 5, &reservation);
+    CpuStagingBuffer::finishReservation(reservation,
+                                        bufferSize - 16 - headerSize);
+    cb->release(bufferSize - 16);
+
+    writePos = cb->reserveProducerSpace(20, 7, &reservation);
+    EXPECT_EQ(cb->storage, reservation);
+    EXPECT_EQ(bufferSize + 32, cb->producerPos.load());
+    EXPECT_EQ(CpuStagingBuffer::PADDING_THREAD_ID,
+              cb->getRecord(bufferSize - 16)->threadId);
+    EXPECT_EQ(16U, cb->getRecord(bufferSize - 16)->size.load());
+    EXPECT_EQ(7U, cb->getRecord(bufferSize)->threadId);
+    EXPECT_EQ(0U, cb->getRecord(bufferSize)->size.load());
+    delete cb;
+}
+
+TEST_F(NanoLogTest, compressCpuStagingBuffers) {
+    typedef RuntimeLogger::CpuStagingBuffer CpuStagingBuffer;
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    stopCompressionThread();
+
+    CpuStagingBuffer *cb = new CpuStagingBuffer(0,
+                                        NanoLogConfig::STAGING_BUFFER_SIZE);
+    logger.cpuStagingBuffers[0] = cb;
+    logger.numCpuStagingBuffers = 1;
+    logger.nextCpuStagingBuffer = 0;
+    char *oldScratch = logger.cpuStagingScratch;
+    if (oldScratch == nullptr)
+        logger.cpuStagingScratch = new char[bufferSize];
+
+    stageDroppedLogsRecord(cb, 5, 100);
+    stageDroppedLogsRecord(cb, 5, 101);
+    stageDroppedLogsRecord(cb, 7, 102);
+    char *unfinished = stageDroppedLogsRecord(cb, 7, 103, false);
+    stageDroppedLogsRecord(cb, 5, 104);
+
+    char buffer[1000];
+    Log::Encoder encoder(buffer, sizeof(buffer), true);
+    std::vector<StaticLogInfo> dictionary;
+    bool wrapAround = false;
+    bool outputBufferFull = false;
+    bool foundUnfinishedRecord = false;
+    size_t entryBytes = sizeof(Log::UncompressedEntry)
+                            + sizeof(Log::DroppedLogs);
+
+    // Stops at the record that's still being written
+    EXPECT_EQ(3*entryBytes, logger.compressCpuStagingBuffers(encoder,
+                    dictionary, &wrapAround, &outputBufferFull,
+                    &foundUnfinishedRecord));
+    EXPECT_TRUE(foundUnfinishedRecord);
+    EXPECT_FALSE(outputBufferFull);
+    EXPECT_TRUE(wrapAround);
+    EXPECT_EQ(unfinished, cb->storage + cb->consumerPos.load());
+    EXPECT_EQ(0U, cb->getRecord(0)->size.load());
+
+    // The consecutive records of a thread share a BufferExtent
+    auto *extent = reinterpret_cast<Log::BufferExtent*>(buffer);
+    EXPECT_TRUE(extent->isShort);
+    EXPECT_EQ(5U, extent->threadIdOrPackNibble);
+    EXPECT_FALSE(extent->wrapAround);
+    extent = reinterpret_cast<Log::BufferExtent*>(buffer + extent->length);
+    EXPECT_EQ(7U, extent->threadIdOrPackNibble);
+    EXPECT_FALSE(extent->wrapAround);
+    EXPECT_EQ(encoder.getEncodedBytes(),
+              reinterpret_cast<char*>(extent) + extent->length - buffer);
+
+    // Picks up where it left off once the record is committed
+    CpuStagingBuffer::finishReservation(unfinished, entryBytes);
+    wrapAround = foundUnfinishedRecord = false;
+    EXPECT_EQ(2*entryBytes, logger.compressCpuStagingBuffers(encoder,
+                    dictionary, &wrapAround, &outputBufferFull,
+                    &foundUnfinishedRecord));
+    EXPECT_FALSE(foundUnfinishedRecord);
+    EXPECT_EQ(cb->producerPos.load(), cb->consumerPos.load());
+
+    // Stops when the output is full
+    Log::Encoder smallEncoder(buffer, 40, true);
+    stageDroppedLogsRecord(cb, 5, 105);
+    stageDroppedLogsRecord(cb, 5, 106);
+    uint64_t consumerPos = cb->consumerPos;
+    EXPECT_EQ(entryBytes, logger.compressCpuStagingBuffers(smallEncoder,
+                    dictionary, &wrapAround, &outputBufferFull,
+                    &foundUnfinishedRecord));
+    EXPECT_TRUE(outputBufferFull);
+    EXPECT_EQ(consumerPos + CpuStagingBuffer::getRecordSize(entryBytes),
+              cb->consumerPos.load());
+
+    // A thread's records in different StagingBuffers get separate
+    // BufferExtents
+    CpuStagingBuffer *other = new CpuStagingBuffer(1,
+                                        NanoLogConfig::STAGING_BUFFER_SIZE);
+    logger.cpuStagingBuffers[1] = other;
+    logger.numCpuStagingBuffers = 2;
+    logger.nextCpuStagingBuffer = 0;
+    stageDroppedLogsRecord(other, 5, 107);
+    Log::Encoder otherEncoder(buffer, sizeof(buffer), true);
+    outputBufferFull = false;
+    EXPECT_EQ(2*entryBytes, logger.compressCpuStagingBuffers(otherEncoder,
+                    dictionary, &wrapAround, &outputBufferFull,
+                    &foundUnfinishedRecord));
+    EXPECT_FALSE(outputBufferFull);
+
+    extent = reinterpret_cast<Log::BufferExtent*>(buffer);
+    EXPECT_EQ(5U, extent->threadIdOrPackNibble);
+    extent = reinterpret_cast<Log::BufferExtent*>(buffer + extent->length);
+    EXPECT_EQ(5U, extent->threadIdOrPackNibble);
+    EXPECT_EQ(otherEncoder.getEncodedBytes(),
+              reinterpret_cast<char*>(extent) + extent->length - buffer);
+
+    logger.cpuStagingBuffers[0] = nullptr;
+    logger.cpuStagingBuffers[1] = nullptr;
+    logger.numCpuStagingBuffers = 0;
+    if (oldScratch == nullptr) {
+        delete[] logger.cpuStagingScratch;
+        logger.cpuStagingScratch = nullptr;
+    }
+    delete cb;
+    delete other;
+    restartCompressionThread();
+}
+
+TEST_F(NanoLogTest, reserveCpuAllocSlow_droppedLogs) {
+    typedef RuntimeLogger::CpuStagingBuffer CpuStagingBuffer;
+    const size_t headerSize = sizeof(CpuStagingBuffer::RecordHeader);
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    stopCompressionThread();
+
+    // Every CPU shares the StagingBuffer, so migrations don't matter
+    CpuStagingBuffer *cb = new CpuStagingBuffer(0,
+                                        NanoLogConfig::STAGING_BUFFER_SIZE);
+    for (auto &cpuStagingBuffer : logger.cpuStagingBuffers)
+        cpuStagingBuffer = cb;
+    uint32_t oldThreadId = RuntimeLogger::cpuThreadId;
+    char *oldReservation = RuntimeLogger::cpuReservation;
+    RuntimeLogger::cpuThreadId = 9;
+    logger.overflowPolicy = DROP_ON_FULL;
+
+    char *reservation = nullptr;
+    cb->reserveProducerSpace(bufferSize - headerSize, 9, &reservation);
+    CpuStagingBuffer::finishReservation(reservation, bufferSize - headerSize);
+
+    // Drops are tallied per invocation site
+    EXPECT_EQ(nullptr, logger.reserveCpuAllocSlow(16, 3));
+    EXPECT_EQ(nullptr, logger.reserveCpuAllocSlow(16, 4));
+    EXPECT_EQ(nullptr, logger.reserveCpuAllocSlow(16, 3));
+    EXPECT_EQ(3U, cb->numLogsDropped.load());
+    EXPECT_EQ(3U, RuntimeLogger::cpuDroppedLogs.numDropped);
+    EXPECT_EQ(2U, RuntimeLogger::cpuDroppedLogs.numSites);
+
+    // The record isn't inserted unless the log message fits after it
+    size_t recordBytes = sizeof(Log::UncompressedEntry)
+                            + sizeof(Log::DroppedLogs)
+                            + 2*sizeof(Log::DroppedLogSite);
+    cb->release(CpuStagingBuffer::getRecordSize(recordBytes));
+    EXPECT_EQ(nullptr, logger.reserveCpuAllocSlow(16, 5));
+    EXPECT_EQ(bufferSize, cb->producerPos.load());
+    EXPECT_EQ(4U, RuntimeLogger::cpuDroppedLogs.numDropped);
+    EXPECT_EQ(3U, RuntimeLogger::cpuDroppedLogs.numSites);
+
+    // Otherwise, it's inserted ahead of the next log message
+    cb->release(bufferSize);
+    char *writePos = logger.reserveCpuAllocSlow(16, 5);
+    ASSERT_NE(nullptr, writePos);
+    EXPECT_EQ(0U, RuntimeLogger::cpuDroppedLogs.numDropped);
+
+    CpuStagingBuffer::RecordHeader *header = cb->getRecord(bufferSize);
+    EXPECT_EQ(9U, header->threadId);
+    auto *entry = reinterpret_cast<Log::UncompressedEntry*>(header + 1);
+    EXPECT_EQ(Log::DROPPED_LOGS_ID, entry->fmtId);
+    EXPECT_EQ(recordBytes + sizeof(Log::DroppedLogSite), entry->entrySize);
+    EXPECT_EQ(CpuStagingBuffer::getRecordSize(entry->entrySize),
+              header->size.load());
+
+    auto *droppedLogs = reinterpret_cast<Log::DroppedLogs*>(entry->argData);
+    EXPECT_EQ(4U, droppedLogs->numDropped);
+    ASSERT_EQ(3U, droppedLogs->numSites);
+    EXPECT_EQ(3U, droppedLogs->sites[0].logId);
+    EXPECT_EQ(2U, droppedLogs->sites[0].count);
+    EXPECT_EQ(4U, droppedLogs->sites[1].logId);
+    EXPECT_EQ(5U, droppedLogs->sites[2].logId);
+    EXPECT_EQ(reinterpret_cast<char*>(header) + header->size.load()
+                                                + headerSize, writePos);
+
+    for (auto &cpuStagingBuffer : logger.cpuStagingBuffers)
+        cpuStagingBuffer = nullptr;
+    RuntimeLogger::cpuThreadId = oldThreadId;
+    RuntimeLogger::cpuReservation = oldReservation;
+    logger.overflowPolicy = BLOCK_ON_FULL;
+    delete cb;
+    restartCompressionThread();
+}
+
 TEST_F(NanoLogTest, StagingBuffer_finishReservation) {
     EXPECT_EQ(sb->storage, sb->producerPos);
     EXPECT_EQ(bufferSize, sb->minFreeSpace);
@@ -167,6 +2714,7 @@ TEST_F(NanoLogTest, StagingBuffer_finishReservation) {
 }
 
 TEST_F(NanoLogTest, StagingBuffer_finishReservation_asserts) {
+    disableSpilling();
 
     // Case 1a: Ran out of space and didn't reserve (Artificial)
     EXPECT_EQ(bufferSize, sb->minFreeSpace);
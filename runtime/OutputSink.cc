@@ -0,0 +1,369 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <ios>
+#include <string>
+
+#include "OutputSink.h"
+
+namespace NanoLog {
+
+/**
+ * Constructs an FdSink and starts its writerThread.
+ *
+ * \param fd
+ *      File descriptor to write the compressed log to
+ * \param closeOnDestruction
+ *      True means that the sink takes over fd and closes it when it's
+ *      destroyed
+ * \param backlogSize
+ *      Number of bytes of output the sink holds while its reader is behind
+ * \param dropOnFull
+ *      True means that buffers that don't fit into the backlog are dropped;
+ *      false means that write() waits for the reader to catch up
+ */
+FdSink::FdSink(int fd, bool closeOnDestruction, size_t backlogSize,
+               bool dropOnFull)
+    : fd(fd)
+    , closeOnDestruction(closeOnDestruction)
+    , dropOnFull(dropOnFull)
+    , mutex()
+    , backlogChanged()
+    , spaceFreed()
+    , backlog(backlogSize)
+    , writePos(0)
+    , bytesQueued(0)
+    , broken(false)
+    , shouldExit(false)
+    , bytesDropped(0)
+    , writerThread()
+{
+    writerThread = std::thread(&FdSink::writerMain, this);
+}
+
+FdSink::~FdSink()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shouldExit = true;
+        backlogChanged.notify_one();
+    }
+    writerThread.join();
+
+    if (closeOnDestruction && fd >= 0)
+        close(fd);
+}
+
+/**
+ * Appends a buffer to the backlog for the writerThread. If it doesn't fit,
+ * it's either dropped or written into the backlog piece by piece as the
+ * writerThread frees up space (see dropOnFull).
+ */
+bool
+FdSink::write(const char *buffer, size_t nbytes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (broken)
+        return false;
+
+    if (dropOnFull && nbytes > backlog.size() - bytesQueued) {
+        bytesDropped += nbytes;
+        return false;
+    }
+
+    while (nbytes > 0) {
+        while (bytesQueued == backlog.size() && !broken)
+            spaceFreed.wait(lock);
+
+        if (broken)
+            return false;
+
+        size_t part = std::min(nbytes, backlog.size() - bytesQueued);
+        appendToBacklog(buffer, part);
+        buffer += part;
+        nbytes -= part;
+    }
+
+    return true;
+}
+
+/**
+ * Copies output into the free space of the backlog and wakes up the
+ * writerThread. The caller must hold the mutex.
+ *
+ * \param buffer
+ *      Output to append
+ * \param nbytes
+ *      Number of bytes to append; at most the free space of the backlog
+ */
+void
+FdSink::appendToBacklog(const char *buffer, size_t nbytes)
+{
+    size_t pos = (writePos + bytesQueued) % backlog.size();
+    size_t firstPart = std::min(nbytes, backlog.size() - pos);
+    memcpy(&backlog[pos], buffer, firstPart);
+    memcpy(&backlog[0], buffer + firstPart, nbytes - firstPart);
+    bytesQueued += nbytes;
+    backlogChanged.notify_one();
+}
+
+/**
+ * Main function of the writerThread: writes the backlog to the file
+ * descriptor until the sink is destroyed and the backlog is empty. Writing
+ * to a pipe or socket whose reader went away fails with EPIPE rather than
+ * raising SIGPIPE, since this thread blocks that signal.
+ */
+void
+FdSink::writerMain()
+{
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, nullptr);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        while (bytesQueued == 0 && !shouldExit)
+            backlogChanged.wait(lock);
+
+        if (bytesQueued == 0)
+            return;
+
+        const char *data = &backlog[writePos];
+        size_t nbytes = std::min(bytesQueued, backlog.size() - writePos);
+        lock.unlock();
+        ssize_t ret = ::write(fd, data, nbytes);
+        int error = errno;
+        lock.lock();
+
+        if (ret < 0) {
+            if (error == EINTR)
+                continue;
+
+            fprintf(stderr, "NanoLog's output sink failed, discarding its "
+                    "output from now on: %s\r\n", strerror(error));
+            broken = true;
+            writePos = 0;
+            bytesQueued = 0;
+            spaceFreed.notify_one();
+            continue;
+        }
+
+        writePos = (writePos + static_cast<size_t>(ret)) % backlog.size();
+        bytesQueued -= static_cast<size_t>(ret);
+        spaceFreed.notify_one();
+    }
+}
+
+/**
+ * Constructs a FileSink.
+ *
+ * \param filename
+ *      File (or FIFO) to append the compressed log to
+ */
+FileSink::FileSink(const char *filename)
+    : FdSink(open(filename, O_WRONLY|O_CREAT|O_APPEND, 0666), true)
+{
+    if (fd < 0) {
+        std::string err = "Unable to open the output sink file '";
+        err.append(filename);
+        err.append("': ");
+        err.append(strerror(errno));
+        throw std::ios_base::failure(err);
+    }
+}
+
+/**
+ * Constructs a UnixSocketSink.
+ *
+ * \param path
+ *      Path of the socket to connect to
+ */
+UnixSocketSink::UnixSocketSink(const char *path)
+    : FdSink(socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0), true)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    std::string err;
+    if (fd < 0) {
+        err = strerror(errno);
+    } else if (strlen(path) >= sizeof(address.sun_path)) {
+        err = "path too long";
+    } else {
+        strcpy(address.sun_path, path);
+        if (connect(fd, reinterpret_cast<struct sockaddr*>(&address),
+                    sizeof(address)) != 0)
+            err = strerror(errno);
+    }
+
+    if (!err.empty()) {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+        throw std::ios_base::failure("Unable to connect to the output sink "
+                                     "socket '" + std::string(path) + "': " +
+                                     err);
+    }
+}
+
+/**
+ * Constructs a MemoryRingSink.
+ *
+ * \param capacity
+ *      Number of bytes the ring holds
+ */
+MemoryRingSink::MemoryRingSink(size_t capacity)
+    : mutex()
+    , ring(capacity)
+    , readPos(0)
+    , bytesAvailable(0)
+    , bytesDropped(0)
+    , bytesWritten(0)
+    , bytesRead(0)
+    , gaps()
+{
+}
+
+/**
+ * Appends a buffer to the ring, or drops it and records the gap if it
+ * doesn't fit.
+ */
+bool
+MemoryRingSink::write(const char *buffer, size_t nbytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (nbytes == 0)
+        return true;
+
+    if (nbytes > ring.size() - bytesAvailable) {
+        bytesDropped += nbytes;
+        if (!gaps.empty() && gaps.back().offset == bytesWritten)
+            gaps.back().bytes += nbytes;
+        else
+            gaps.push_back({bytesWritten, nbytes});
+        return false;
+    }
+
+    size_t writePos = (readPos + bytesAvailable) % ring.size();
+    size_t firstPart = std::min(nbytes, ring.size() - writePos);
+    memcpy(&ring[writePos], buffer, firstPart);
+    memcpy(&ring[0], buffer + firstPart, nbytes - firstPart);
+    bytesAvailable += nbytes;
+    bytesWritten += nbytes;
+    return true;
+}
+
+/**
+ * Removes the oldest bytes from the ring, up to the next gap (see
+ * skipGap()). Never blocks.
+ *
+ * \param[out] out
+ *      Where to copy the bytes to
+ * \param maxBytes
+ *      Maximum number of bytes to read
+ *
+ * \return
+ *      Number of bytes copied to out
+ */
+size_t
+MemoryRingSink::read(char *out, size_t maxBytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t nbytes = std::min(maxBytes, bytesAvailable);
+    if (!gaps.empty()) {
+        nbytes = static_cast<size_t>(std::min<uint64_t>(nbytes,
+                                        gaps.front().offset - bytesRead));
+    }
+    if (nbytes == 0)
+        return 0;
+
+    size_t firstPart = std::min(nbytes, ring.size() - readPos);
+    memcpy(out, &ring[readPos], firstPart);
+    memcpy(out + firstPart, &ring[0], nbytes - firstPart);
+
+    readPos = (readPos + nbytes) % ring.size();
+    bytesAvailable -= nbytes;
+    bytesRead += nbytes;
+    return nbytes;
+}
+
+/**
+ * Moves the reader past the gap that read() stopped at, if any.
+ *
+ * \return
+ *      Number of bytes that were dropped at the reader's position in the
+ *      stream; 0 if none were.
+ */
+uint64_t
+MemoryRingSink::skipGap()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (gaps.empty() || gaps.front().offset != bytesRead)
+        return 0;
+
+    uint64_t bytes = gaps.front().bytes;
+    gaps.pop_front();
+    return bytes;
+}
+
+TeeSink::TeeSink()
+    : sinks()
+{
+}
+
+/**
+ * Adds a sink to pass the output on to. This must be done before the
+ * TeeSink is handed to NanoLog.
+ *
+ * \param sink
+ *      Sink to add; it's not taken over
+ */
+void
+TeeSink::add(OutputSink *sink)
+{
+    sinks.push_back(sink);
+}
+
+/**
+ * Passes a buffer on to all the sinks.
+ *
+ * \return
+ *      False if any of the sinks lost it
+ */
+bool
+TeeSink::write(const char *buffer, size_t nbytes)
+{
+    bool success = true;
+    for (OutputSink *sink : sinks) {
+        if (!sink->write(buffer, nbytes))
+            success = false;
+    }
+
+    return success;
+}
+
+}; // namespace NanoLog
@@ -0,0 +1,281 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef NANOLOG_OUTPUTSINK_H
+#define NANOLOG_OUTPUTSINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Common.h"
+
+namespace NanoLog {
+
+/**
+ * An OutputSink receives the compressed log in addition to the log file
+ * (see Config::outputSink), e.g. so that a log shipper can consume it
+ * directly instead of reading the log file back from disk. The background
+ * thread hands it every output buffer in the order that they are written to
+ * the log file. The stream is in the log file format, so it starts with a
+ * Checkpoint and can be decompressed like a log file.
+ *
+ * The sink is invoked synchronously by the background thread, so a slow
+ * sink holds up the output and, once their StagingBuffers fill, the logging
+ * threads. The sinks below buffer the output for that reason and only wait
+ * on their reader once it's a whole buffer behind (see FdSink).
+ */
+class OutputSink {
+  public:
+    virtual ~OutputSink() {}
+
+    /**
+     * Consumes a buffer of the compressed log. Invoked by the background
+     * thread only; it must not log.
+     *
+     * \param buffer
+     *      Compressed log data; only valid until this returns
+     * \param nbytes
+     *      Number of bytes in buffer
+     *
+     * \return
+     *      True if the data was consumed; false if it was lost
+     */
+    virtual bool write(const char *buffer, size_t nbytes) = 0;
+};
+
+/**
+ * OutputSink that writes the compressed log to a file descriptor, such as
+ * one end of a pipe(), a FIFO or a socket. write() only copies the output
+ * into a bounded backlog, from where a thread of the sink writes it to the
+ * file descriptor, so a slow reader only holds up the background thread
+ * once it's a backlog behind. write() then waits for the reader to catch up,
+ * since every buffer has to arrive for the stream to be decompressible:
+ * a dropped one may hold the Checkpoint or dictionary entries that the rest
+ * of the stream relies on.
+ *
+ * Alternatively, the sink can drop the buffers that don't fit into the
+ * backlog's free space (as a whole) and count them, for readers that would
+ * rather lose the log than hold up the application. A file descriptor has
+ * no place to mark the gap, so what the reader receives after a drop may
+ * not be decompressible.
+ *
+ * The first failure of a write (e.g. the reader went away) is reported to
+ * stderr and the sink discards everything from then on. Destroying the sink
+ * waits for the backlog to be written.
+ */
+class FdSink : public OutputSink {
+  public:
+    // Default number of bytes the backlog holds
+    static const size_t DEFAULT_BACKLOG_SIZE = 8 << 20;
+
+    explicit FdSink(int fd, bool closeOnDestruction = false,
+                    size_t backlogSize = DEFAULT_BACKLOG_SIZE,
+                    bool dropOnFull = false);
+    ~FdSink();
+
+    bool write(const char *buffer, size_t nbytes);
+
+    /**
+     * Returns true if a write failed and the sink discards the output
+     */
+    bool
+    isBroken() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return broken;
+    }
+
+    /**
+     * Returns the number of bytes that were dropped because the backlog was
+     * full
+     */
+    uint64_t
+    getBytesDropped() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytesDropped;
+    }
+
+  PROTECTED:
+    void appendToBacklog(const char *buffer, size_t nbytes);
+    void writerMain();
+
+    // Where the output is written to; -1 if it couldn't be opened
+    int fd;
+
+    // True means fd is closed when the sink is destroyed
+    bool closeOnDestruction;
+
+    // True means that write() drops the buffers that don't fit into the
+    // backlog rather than waiting for the writerThread to make room
+    bool dropOnFull;
+
+    // Protects the fields below, which are shared by the background thread
+    // and the writerThread.
+    std::mutex mutex;
+
+    // Notified when output is added to the backlog or the writerThread is
+    // to exit
+    std::condition_variable backlogChanged;
+
+    // Notified when the writerThread frees up space in the backlog or the
+    // sink broke
+    std::condition_variable spaceFreed;
+
+    // Storage of the backlog, used as a ring
+    std::vector<char> backlog;
+
+    // Index in backlog of the first byte to be written
+    size_t writePos;
+
+    // Number of bytes in backlog from writePos on (wrapping around) to be
+    // written. The writerThread writes them without holding the mutex, since
+    // write() only adds to the free space after them.
+    size_t bytesQueued;
+
+    // Set once a write failed (see writerMain())
+    bool broken;
+
+    // Set by the destructor once the writerThread is to exit
+    bool shouldExit;
+
+    // Metric: Number of bytes dropped because the backlog was full
+    uint64_t bytesDropped;
+
+    // Writes the backlog to fd (see writerMain())
+    std::thread writerThread;
+
+    DISALLOW_COPY_AND_ASSIGN(FdSink);
+};
+
+/**
+ * FdSink that opens (or creates) a file by name and appends to it. Opening
+ * a FIFO blocks until its reader opened it.
+ *
+ * An std::ios_base::failure exception is thrown if the file can't be
+ * opened.
+ */
+class FileSink : public FdSink {
+  public:
+    explicit FileSink(const char *filename);
+};
+
+/**
+ * FdSink that connects to a local (AF_UNIX) stream socket, e.g. the one
+ * a log shipper listens on.
+ *
+ * An std::ios_base::failure exception is thrown if the socket can't be
+ * connected to.
+ */
+class UnixSocketSink : public FdSink {
+  public:
+    explicit UnixSocketSink(const char *path);
+};
+
+/**
+ * OutputSink that keeps the compressed log in a bounded in-memory ring, from
+ * where another thread read()s it, e.g. in tests or on embedded systems
+ * without storage. Buffers that don't fit into the free space are dropped
+ * as a whole and counted. The ring also records where in the stream they
+ * were dropped: read() stops at each such gap, and the reader has to
+ * skipGap() to read on, so that it knows that the stream has to be picked
+ * up at a buffer boundary from there.
+ */
+class MemoryRingSink : public OutputSink {
+  public:
+    explicit MemoryRingSink(size_t capacity);
+
+    bool write(const char *buffer, size_t nbytes);
+    size_t read(char *out, size_t maxBytes);
+    uint64_t skipGap();
+
+    /**
+     * Returns the number of bytes waiting to be read
+     */
+    size_t
+    getBytesAvailable() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytesAvailable;
+    }
+
+    /**
+     * Returns the number of bytes that were dropped because the ring was full
+     */
+    uint64_t
+    getBytesDropped() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytesDropped;
+    }
+
+  PRIVATE:
+    // Protects the fields below, which are shared by the background thread
+    // and the reader.
+    std::mutex mutex;
+
+    // Storage of the ring
+    std::vector<char> ring;
+
+    // Index in ring of the first byte to be read
+    size_t readPos;
+
+    // Number of bytes in ring from readPos on (wrapping around) to be read
+    size_t bytesAvailable;
+
+    // Metric: Number of bytes dropped because the ring was full
+    uint64_t bytesDropped;
+
+    // Number of bytes that were written to the ring (i.e. not dropped) and
+    // read from it since it was constructed
+    uint64_t bytesWritten;
+    uint64_t bytesRead;
+
+    // Where buffers were dropped, in the order that they were dropped
+    struct Gap {
+        // Value of bytesWritten when the buffers were dropped
+        uint64_t offset;
+
+        // Number of bytes dropped there
+        uint64_t bytes;
+    };
+    std::deque<Gap> gaps;
+
+    DISALLOW_COPY_AND_ASSIGN(MemoryRingSink);
+};
+
+/**
+ * OutputSink that passes the compressed log on to several others.
+ */
+class TeeSink : public OutputSink {
+  public:
+    TeeSink();
+
+    void add(OutputSink *sink);
+
+    bool write(const char *buffer, size_t nbytes);
+
+  PRIVATE:
+    // Sinks that the output is passed on to, in order
+    std::vector<OutputSink*> sinks;
+
+    DISALLOW_COPY_AND_ASSIGN(TeeSink);
+};
+
+}; // namespace NanoLog
+
+#endif // NANOLOG_OUTPUTSINK_H
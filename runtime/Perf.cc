@@ -30,6 +30,10 @@
 //   other tests.
 // * Create a new entry for the test in the #tests table.
 
+// Some tests manipulate the RuntimeLogger's internal state directly
+#define EXPOSE_PRIVATES
+
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <cstdio>
@@ -37,9 +41,12 @@
 #include <fstream>
 #include <map>
 #include <thread>
+#include <vector>
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <sched.h>
+#include <sys/resource.h>
 #include <stdlib.h>
 #include <syscall.h>
 #include <stdio.h>
@@ -47,10 +54,12 @@
 
 #include "Cycles.h"
 #include "Log.h"
+#include "NanoLogCpp17.h"
 #include "PerfHelper.h"
 #include "Portability.h"
 #include "Util.h"
 #include "Fence.h"
+#include "IoBackend.h"
 
 using namespace PerfUtils;
 using namespace NanoLogInternal;
@@ -1203,6 +1212,200 @@ double uncompressedLogEntryIterationWithFence() {
     return Cycles::toSeconds(stop - start)/(arraySize);
 }
 
+// Measures the end-to-end cost of a log message (i.e. logging it and having
+// the background thread output it) when only a few of the registered
+// StagingBuffers are in use, which is the case for applications with large
+// thread pools that mostly sit idle.
+double idleStagingBuffers() {
+    const int numIdleBuffers = 10000;
+    const int numActiveThreads = 10;
+    const int logsPerThread = 100000;
+
+    RuntimeLogger &logger = RuntimeLogger::nanoLogSingleton;
+    std::vector<RuntimeLogger::StagingBuffer*> idleBuffers;
+    for (int i = 0; i < numIdleBuffers; ++i) {
+        auto *sb = new RuntimeLogger::StagingBuffer(logger.nextBufferId++);
+        logger.registerStagingBuffer(sb);
+        idleBuffers.push_back(sb);
+    }
+
+    // Give the background thread a chance to find them empty
+    RuntimeLogger::sync();
+
+    std::atomic<int> threadsReady(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numActiveThreads; ++t) {
+        threads.emplace_back([&]() {
+            RuntimeLogger::preallocate();
+            ++threadsReady;
+            while (!go)
+                std::this_thread::yield();
+
+            for (int i = 0; i < logsPerThread; ++i)
+                NANO_LOG(NOTICE, "Idle StagingBuffers benchmark %d", i);
+        });
+    }
+
+    while (threadsReady < numActiveThreads)
+        std::this_thread::yield();
+
+    uint64_t start = Cycles::rdtsc();
+    go = true;
+    for (std::thread &thread : threads)
+        thread.join();
+    RuntimeLogger::sync();
+    uint64_t stop = Cycles::rdtsc();
+
+    // Retire the idle buffers as if their threads had exited
+    for (RuntimeLogger::StagingBuffer *sb : idleBuffers) {
+        sb->shouldDeallocate = true;
+        sb->markActive();
+    }
+    RuntimeLogger::sync();
+
+    return Cycles::toSeconds(stop - start)/(numActiveThreads*logsPerThread);
+}
+
+// Measures the cost of allocating and registering a StagingBuffer, which is
+// incurred by the first log message on every new thread.
+double stagingBufferRegistration() {
+    const int numThreads = 1000;
+    uint64_t totalCycles = 0;
+
+    for (int t = 0; t < numThreads; ++t) {
+        std::thread([&]() {
+            uint64_t start = Cycles::rdtsc();
+            RuntimeLogger::preallocate();
+            totalCycles += Cycles::rdtsc() - start;
+        }).join();
+    }
+
+    return Cycles::toSeconds(totalCycles)/numThreads;
+}
+
+// Measures the cost of setting up a short-lived thread and logging its first
+// messages when the StagingBuffers of the threads that exited before it have
+// been recycled (see STAGING_BUFFER_POOL_SIZE).
+double shortLivedThreads() {
+    const int numThreads = 1000;
+    const int logsPerThread = 1000;
+    uint64_t totalCycles = 0;
+
+    for (int t = 0; t < numThreads; ++t) {
+        std::thread([&]() {
+            uint64_t start = Cycles::rdtsc();
+            RuntimeLogger::preallocate();
+            for (int i = 0; i < logsPerThread; ++i)
+                NANO_LOG(NOTICE, "Short-lived thread benchmark %d", i);
+            totalCycles += Cycles::rdtsc() - start;
+        }).join();
+
+        // Let the compression thread drain and recycle the StagingBuffer
+        RuntimeLogger::sync();
+        RuntimeLogger::sync();
+    }
+
+    return Cycles::toSeconds(totalCycles)/numThreads;
+}
+
+// Measures the cost of registering a log invocation site on its first hit,
+// when several threads reach the same new sites at once.
+double invocationSiteRegistration() {
+    const int numThreads = 4;
+    const int numSites = 10000;
+    std::vector<int> logIds(numSites, UNASSIGNED_LOGID);
+    std::atomic<bool> go(false);
+    std::atomic<uint64_t> totalCycles(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&]() {
+            while (!go);
+            uint64_t start = Cycles::rdtsc();
+            for (int i = 0; i < numSites; ++i) {
+                StaticLogInfo info(NULL, __FILE__, i, NOTICE, "Hello",
+                                   0, 0, NULL);
+                RuntimeLogger::registerInvocationSite(info, logIds[i]);
+            }
+            totalCycles += Cycles::rdtsc() - start;
+        });
+    }
+
+    go = true;
+    for (std::thread &thread : threads)
+        thread.join();
+
+    return Cycles::toSeconds(totalCycles)/(numThreads*numSites);
+}
+
+// Writes 64 KB flushes to a scratch file the way the compression thread does
+// (one write in flight at a time) and returns either the wall time or the CPU
+// time consumed by the whole process (including POSIX AIO's helper thread)
+// per flush. The inverse of the former is the number of flushes per second.
+static double
+ioBackendFlush(IoBackend *backend, bool measureCpuTime)
+{
+    if (backend == nullptr) {
+        printf("io_uring is unavailable; ");
+        return 0;
+    }
+
+    const char *testFile = "/tmp/nanoLogPerfIoBackend";
+    const int count = 10000;
+    const size_t flushSize = 64*1024;
+    std::vector<char> buffer(flushSize, 'x');
+    int fd = open(testFile, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd < 0) {
+        perror("Could not open the scratch file");
+        return 0;
+    }
+
+    struct rusage usageStart, usageStop;
+    getrusage(RUSAGE_SELF, &usageStart);
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; ++i) {
+        backend->submitWrite(fd, buffer.data(), flushSize, i*flushSize, false);
+        backend->waitForWrite();
+    }
+    uint64_t stop = Cycles::rdtsc();
+    getrusage(RUSAGE_SELF, &usageStop);
+
+    delete backend;
+    close(fd);
+    std::remove(testFile);
+
+    if (!measureCpuTime)
+        return Cycles::toSeconds(stop - start)/count;
+
+    double cpuSeconds =
+        static_cast<double>(usageStop.ru_utime.tv_sec -
+                            usageStart.ru_utime.tv_sec +
+                            usageStop.ru_stime.tv_sec -
+                            usageStart.ru_stime.tv_sec) +
+        1e-6*static_cast<double>(usageStop.ru_utime.tv_usec -
+                                 usageStart.ru_utime.tv_usec +
+                                 usageStop.ru_stime.tv_usec -
+                                 usageStart.ru_stime.tv_usec);
+    return cpuSeconds/count;
+}
+
+double aioFlush() {
+    return ioBackendFlush(new PosixAioBackend(1), false);
+}
+
+double aioFlushCpu() {
+    return ioBackendFlush(new PosixAioBackend(1), true);
+}
+
+double ioUringFlush() {
+    return ioBackendFlush(IoUringBackend::create(1), false);
+}
+
+double ioUringFlushCpu() {
+    return ioBackendFlush(IoUringBackend::create(1), true);
+}
+
 // The following struct and table define each performance test in terms of
 // a string name and a function that implements the test.
 struct TestInfo {
@@ -1327,6 +1530,22 @@ TestInfo tests[] = {
       "Per element cost of iterating through log entries"},
     {"LogEntryIterationFence", uncompressedLogEntryIterationWithFence,
       "Per element cost of iterating through log entries with lfences"},
+    {"idleStagingBuffers", idleStagingBuffers,
+      "Cost per log message with 10 of 10k StagingBuffers in use"},
+    {"stagingBufferRegistration", stagingBufferRegistration,
+      "Allocate and register a new thread's StagingBuffer"},
+    {"shortLivedThreads", shortLivedThreads,
+      "Set up a new thread and log 1000 messages with recycled buffers"},
+    {"invocationSiteRegistration", invocationSiteRegistration,
+      "Register a new log site hit by 4 threads at once"},
+    {"aioFlush", aioFlush,
+      "Write a 64 KB flush with POSIX AIO"},
+    {"aioFlushCpu", aioFlushCpu,
+      "CPU time per 64 KB POSIX AIO flush"},
+    {"ioUringFlush", ioUringFlush,
+      "Write a 64 KB flush with io_uring"},
+    {"ioUringFlushCpu", ioUringFlushCpu,
+      "CPU time per 64 KB io_uring flush"},
 
 };
 
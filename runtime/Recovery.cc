@@ -0,0 +1,645 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "Config.h"
+#include "Log.h"
+#include "Recovery.h"
+
+namespace NanoLogInternal {
+namespace Recovery {
+
+/**
+ * Creates the directory that holds the buffer files of this process, which
+ * is named after its pid (plus a suffix if a dead process with the same pid
+ * left one behind).
+ *
+ * \return
+ *      Path of the directory; empty if it couldn't be created
+ */
+static std::string
+createProcessDirectory()
+{
+    if (mkdir(NanoLogConfig::CRASH_RECOVERY_DIR, 0777) != 0 &&
+            errno != EEXIST) {
+        fprintf(stderr, "Unable to create NanoLog's crash recovery directory "
+                "%s: %s\r\n", NanoLogConfig::CRASH_RECOVERY_DIR,
+                strerror(errno));
+        return "";
+    }
+
+    std::string base = std::string(NanoLogConfig::CRASH_RECOVERY_DIR) + "/" +
+                       std::to_string(getpid());
+    for (uint32_t attempt = 0; ; ++attempt) {
+        std::string dir = base;
+        if (attempt > 0)
+            dir += "." + std::to_string(attempt);
+
+        if (mkdir(dir.c_str(), 0700) == 0)
+            return dir;
+
+        if (errno != EEXIST) {
+            fprintf(stderr, "Unable to create NanoLog's crash recovery "
+                    "directory %s: %s\r\n", dir.c_str(), strerror(errno));
+            return "";
+        }
+    }
+}
+
+/**
+ * Returns the directory that holds the buffer files of this process. It's
+ * created on the first invocation; an empty path means that failed.
+ */
+const std::string &
+getProcessDirectory()
+{
+    // Never destroyed, since the RuntimeLogger needs it at exit
+    static const std::string *dir = new std::string(createProcessDirectory());
+    return *dir;
+}
+
+/**
+ * Returns the path of a buffer file
+ *
+ * \param dir
+ *      Directory of the process that mapped the buffer
+ * \param fileIndex
+ *      BufferHeader::fileIndex of the buffer
+ */
+static std::string
+getBufferFileName(const std::string &dir, uint32_t fileIndex)
+{
+    return dir + "/" + BUFFER_FILE_PREFIX + std::to_string(fileIndex);
+}
+
+/**
+ * Allocates a buffer that's mapped from a new file in the process directory,
+ * behind a BufferHeader of type UNUSED. Like Util::allocBuffer(), the buffer
+ * is page aligned and zero-filled.
+ *
+ * \param bytes
+ *      Size of the buffer
+ * \param prefault
+ *      True means that the pages of the buffer are faulted in right away
+ * \param lock
+ *      True means that the buffer is locked in memory (best effort)
+ *
+ * \return
+ *      The buffer, to be released with unmapBuffer(); nullptr if the file
+ *      couldn't be created or mapped (see errno).
+ */
+char *
+mapBuffer(size_t bytes, bool prefault, bool lock)
+{
+    static std::atomic<uint32_t> nextFileIndex(0);
+
+    const std::string &dir = getProcessDirectory();
+    if (dir.empty())
+        return nullptr;
+
+    uint32_t fileIndex = nextFileIndex++;
+    std::string fileName = getBufferFileName(dir, fileIndex);
+    int fd = open(fileName.c_str(), O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    if (fd < 0)
+        return nullptr;
+
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(HEADER_SIZE + bytes)) == 0) {
+        map = mmap(nullptr, HEADER_SIZE + bytes, PROT_READ|PROT_WRITE,
+                   MAP_SHARED | (prefault ? MAP_POPULATE : 0), fd, 0);
+    }
+
+    int err = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(fileName.c_str());
+        errno = err;
+        return nullptr;
+    }
+
+    if (lock)
+        mlock(map, HEADER_SIZE + bytes);
+
+    BufferHeader *header = static_cast<BufferHeader*>(map);
+    header->magic = MAGIC;
+    header->fileIndex = fileIndex;
+    header->capacity = bytes;
+    header->type = UNUSED;
+    return static_cast<char*>(map) + HEADER_SIZE;
+}
+
+/**
+ * Releases a buffer allocated with mapBuffer() and deletes its file.
+ *
+ * \param buffer
+ *      Buffer to release; nullptr is ignored
+ * \param bytes
+ *      Size the buffer was allocated with
+ */
+void
+unmapBuffer(char *buffer, size_t bytes)
+{
+    if (buffer == nullptr)
+        return;
+
+    BufferHeader *header = getHeader(buffer);
+    unlink(getBufferFileName(getProcessDirectory(),
+                             header->fileIndex).c_str());
+    munmap(header, HEADER_SIZE + bytes);
+}
+
+/**
+ * Records the log file that the process writes to in its directory, so that
+ * recover() knows where the buffers belong.
+ *
+ * \param filename
+ *      Log file; it's recorded as an absolute path
+ */
+void
+recordLogFile(const char *filename)
+{
+    const std::string &dir = getProcessDirectory();
+    if (dir.empty())
+        return;
+
+    char path[PATH_MAX];
+    if (realpath(filename, path) == nullptr) {
+        strncpy(path, filename, sizeof(path) - 1);
+        path[sizeof(path) - 1] = '\0';
+    }
+
+    // Replace the file atomically so that it's never seen half-written
+    std::string fileName = dir + "/" + LOG_FILE_NAME;
+    std::string tmpFileName = fileName + ".tmp";
+    FILE *file = fopen(tmpFileName.c_str(), "w");
+    if (file == nullptr) {
+        fprintf(stderr, "Unable to record NanoLog's log file in %s: %s\r\n",
+                dir.c_str(), strerror(errno));
+        return;
+    }
+
+    fputs(path, file);
+    fclose(file);
+    rename(tmpFileName.c_str(), fileName.c_str());
+}
+
+/**
+ * Marks the directory of the process for the nanologd to pick up. The marker
+ * holds the start time of the process, so that the nanologd can tell when it
+ * exited even if its process id was reused since.
+ */
+void
+registerDaemonClient()
+{
+    const std::string &dir = getProcessDirectory();
+    if (dir.empty())
+        return;
+
+    // Replace the file atomically so that it's never seen half-written
+    std::string fileName = dir + "/" + DAEMON_CLIENT_FILE_NAME;
+    std::string tmpFileName = fileName + ".tmp";
+    FILE *file = fopen(tmpFileName.c_str(), "w");
+    if (file == nullptr) {
+        fprintf(stderr, "Unable to register with the NanoLog daemon in %s: "
+                "%s\r\n", dir.c_str(), strerror(errno));
+        return;
+    }
+
+    fprintf(file, "%lu", getProcessStartTime(getpid()));
+    fclose(file);
+    rename(tmpFileName.c_str(), fileName.c_str());
+}
+
+/**
+ * Returns when a process started, in clock ticks after the system booted
+ * (see starttime in proc(5)). Unlike its process id, this isn't reused by
+ * another process after it exited.
+ *
+ * \param pid
+ *      Process id of the process
+ *
+ * \return
+ *      The start time, or 0 if there's no such process
+ */
+uint64_t
+getProcessStartTime(pid_t pid)
+{
+    std::string fileName = "/proc/" + std::to_string(pid) + "/stat";
+    FILE *file = fopen(fileName.c_str(), "r");
+    if (file == nullptr)
+        return 0;
+
+    char stat[1024];
+    size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[length] = '\0';
+
+    // The command name before the other fields is in parentheses and may
+    // contain spaces and parentheses itself, so start after the last ')'.
+    // starttime is the 22nd field and the command name the 2nd.
+    const char *fields = strrchr(stat, ')');
+    unsigned long long startTime = 0;
+    if (fields == nullptr || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d "
+                "%*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                &startTime) != 1)
+        return 0;
+
+    return startTime;
+}
+
+/**
+ * Deletes all the files in a directory and the directory itself.
+ *
+ * \param dir
+ *      Directory to delete
+ */
+void
+removeDirectory(const std::string &dir)
+{
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr)
+        return;
+
+    while (struct dirent *entry = readdir(d)) {
+        if (strcmp(entry->d_name, ".") != 0 &&
+                strcmp(entry->d_name, "..") != 0)
+            unlink((dir + "/" + entry->d_name).c_str());
+    }
+
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+/**
+ * Deletes the directory of the process once its log messages are all in the
+ * log file, i.e. at exit. The buffers that are still mapped remain usable,
+ * but are no longer backed by a file that outlives the process.
+ */
+void
+removeProcessDirectory()
+{
+    const std::string &dir = getProcessDirectory();
+    if (!dir.empty())
+        removeDirectory(dir);
+}
+
+/**
+ * Writes a buffer to a file at a given offset, retrying partial writes.
+ *
+ * \return
+ *      True if all the bytes were written
+ */
+static bool
+writeAt(int fd, const char *buffer, size_t nbytes, off_t offset)
+{
+    while (nbytes > 0) {
+        ssize_t ret = pwrite(fd, buffer, nbytes, offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        buffer += ret;
+        nbytes -= static_cast<size_t>(ret);
+        offset += ret;
+    }
+
+    return true;
+}
+
+/**
+ * Maps a buffer file that was created with mapBuffer() by another process.
+ *
+ * \param fileName
+ *      Path of the buffer file
+ * \param writable
+ *      True means the buffer is mapped for reading and writing, false for
+ *      reading only
+ *
+ * \return
+ *      The header of the buffer, which is followed by the buffer and must be
+ *      unmapped with HEADER_SIZE + capacity bytes; nullptr if the file
+ *      couldn't be mapped or doesn't hold a (fully created) buffer.
+ */
+BufferHeader *
+mapBufferFile(const std::string &fileName, bool writable)
+{
+    int fd = open(fileName.c_str(), (writable ? O_RDWR : O_RDONLY)|O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    BufferHeader header;
+    if (fstat(fd, &st) != 0 ||
+            pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            header.magic != MAGIC ||
+            header.capacity + HEADER_SIZE >
+                                    static_cast<uint64_t>(st.st_size)) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *map = mmap(nullptr, HEADER_SIZE + header.capacity,
+                     writable ? PROT_READ|PROT_WRITE : PROT_READ,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return nullptr;
+
+    return static_cast<BufferHeader*>(map);
+}
+
+/**
+ * Maps the buffer files in the directory of a dead process read-only.
+ *
+ * \param directory
+ *      Directory of the process
+ * \param[out] buffers
+ *      The headers of the valid buffers are appended here; each is followed
+ *      by its buffer and must be unmapped with HEADER_SIZE + capacity bytes.
+ *
+ * \return
+ *      False if the directory couldn't be read
+ */
+static bool
+mapBufferFiles(const char *directory, std::vector<BufferHeader*> &buffers)
+{
+    DIR *d = opendir(directory);
+    if (d == nullptr) {
+        fprintf(stderr, "Unable to open %s: %s\r\n", directory,
+                strerror(errno));
+        return false;
+    }
+
+    while (struct dirent *entry = readdir(d)) {
+        if (strncmp(entry->d_name, BUFFER_FILE_PREFIX,
+                    strlen(BUFFER_FILE_PREFIX)) != 0)
+            continue;
+
+        std::string fileName = std::string(directory) + "/" + entry->d_name;
+        BufferHeader *header = mapBufferFile(fileName, false);
+        if (header == nullptr) {
+            fprintf(stderr, "Skipping %s, which isn't a NanoLog buffer\r\n",
+                    fileName.c_str());
+            continue;
+        }
+
+        buffers.push_back(header);
+    }
+
+    closedir(d);
+    return true;
+}
+
+/**
+ * Compresses the log messages left in a StagingBuffer of a dead process and
+ * writes them to its log file. This requires the preprocessor version of
+ * NanoLog, whose compression functions are linked into the decompressor;
+ * the C++17 version's are only known to the process itself.
+ *
+ * \param header
+ *      Header of the StagingBuffer, which is followed by its storage
+ * \param fd
+ *      Log file to write the log messages to
+ * \param[in/out] fileOffset
+ *      Offset in the log file to write at; advanced past what was written
+ * \param[in/out] wrapAround
+ *      True means that the next log messages encoded start a new pass
+ *      through the StagingBuffers (see Log::Encoder::encodeLogMsgs())
+ * \param stats
+ *      Statistics to add to
+ *
+ * \return
+ *      False if the log file couldn't be written to
+ */
+static bool
+recoverStagingBuffer(BufferHeader *header, int fd, off_t *fileOffset,
+                     bool *wrapAround, RecoveryStats *stats)
+{
+    char *storage = reinterpret_cast<char*>(header) + HEADER_SIZE;
+    uint64_t capacity = header->capacity;
+    uint64_t producer = header->producerOffset;
+    uint64_t consumer = header->consumerOffset;
+    uint64_t end = header->endOffset;
+    producer = std::min(producer, capacity);
+    consumer = std::min(consumer, capacity);
+    end = std::min(end, capacity);
+
+    // The data runs from the consumer to the producer, wrapping around at
+    // the end of the recorded space if the producer already did.
+    std::vector<std::pair<char*, uint64_t>> regions;
+    if (producer >= consumer) {
+        regions.emplace_back(storage + consumer, producer - consumer);
+    } else {
+        if (end > consumer)
+            regions.emplace_back(storage + consumer, end - consumer);
+        regions.emplace_back(storage, producer);
+    }
+
+    uint64_t totalBytes = 0;
+    for (auto &region : regions)
+        totalBytes += region.second;
+    if (totalBytes == 0)
+        return true;
+
+    ++stats->stagingBuffersRecovered;
+
+#ifdef PREPROCESSOR_NANOLOG
+    std::vector<char> output(std::max<uint64_t>(capacity, 1<<16));
+    Log::Encoder encoder(output.data(), output.size(), true, false,
+                         static_cast<uint32_t>(capacity/2));
+
+    for (auto &region : regions) {
+        char *pos = region.first;
+        uint64_t remaining = region.second;
+        while (remaining > 0) {
+            long bytesRead = encoder.encodeLogMsgs(pos, remaining,
+                                                   header->bufferId,
+                                                   *wrapAround,
+                                                   &stats->logsRecovered);
+            if (bytesRead > 0) {
+                *wrapAround = false;
+                pos += bytesRead;
+                remaining -= static_cast<uint64_t>(bytesRead);
+                continue;
+            }
+
+            // Either the output is full or the rest is an incomplete log
+            // message that the process died in the middle of writing.
+            size_t encodedBytes = encoder.getEncodedBytes();
+            if (encodedBytes == 0) {
+                stats->stagingBytesLost += remaining;
+                break;
+            }
+
+            if (!writeAt(fd, output.data(), encodedBytes, *fileOffset))
+                return false;
+            *fileOffset += encodedBytes;
+            stats->stagingBytesWritten += encodedBytes;
+            encoder.swapBuffer(output.data(), output.size());
+        }
+    }
+
+    size_t encodedBytes = encoder.getEncodedBytes();
+    if (!writeAt(fd, output.data(), encodedBytes, *fileOffset))
+        return false;
+    *fileOffset += encodedBytes;
+    stats->stagingBytesWritten += encodedBytes;
+#else
+    (void)fd;
+    (void)fileOffset;
+    (void)wrapAround;
+    stats->stagingBytesLost += totalBytes;
+#endif // PREPROCESSOR_NANOLOG
+
+    return true;
+}
+
+/**
+ * Writes the log messages that a dead process left in its crash recovery
+ * buffers to its log file: first the output buffers that were pending, in
+ * the order that they were filled and at the offsets they were meant for,
+ * and then the log messages compressed from the StagingBuffers, appended
+ * after them. The directory of the process is deleted once that succeeded.
+ *
+ * Log messages may be duplicated if the process died between compressing
+ * them and releasing their space in the StagingBuffer.
+ *
+ * \param directory
+ *      Directory that the process kept its buffers in
+ * \param logFile
+ *      Log file to write to; nullptr means the one the process used
+ * \param[out] stats
+ *      Summary of what was recovered
+ *
+ * \return
+ *      True if the buffers were recovered; false if not, in which case the
+ *      reason was printed to stderr and the directory is left in place.
+ */
+bool
+recover(const char *directory, const char *logFile, RecoveryStats *stats)
+{
+    memset(stats, 0, sizeof(RecoveryStats));
+
+    std::string logFileName;
+    if (logFile != nullptr) {
+        logFileName = logFile;
+    } else {
+        std::string recordFile = std::string(directory) + "/" + LOG_FILE_NAME;
+        FILE *file = fopen(recordFile.c_str(), "r");
+        char path[PATH_MAX] = {};
+        if (file == nullptr || fgets(path, sizeof(path), file) == nullptr) {
+            fprintf(stderr, "Unable to read the log file name from %s\r\n",
+                    recordFile.c_str());
+            if (file != nullptr)
+                fclose(file);
+            return false;
+        }
+
+        fclose(file);
+        logFileName = path;
+    }
+
+    std::vector<BufferHeader*> buffers;
+    if (!mapBufferFiles(directory, buffers))
+        return false;
+
+    bool success = true;
+    int fd = open(logFileName.c_str(), O_WRONLY|O_CREAT|O_CLOEXEC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open the log file %s: %s\r\n",
+                logFileName.c_str(), strerror(errno));
+        success = false;
+    }
+
+    // Restore the output buffers in the order they were filled. The most
+    // recently filled one marks where the log file ends.
+    std::vector<BufferHeader*> outputBuffers;
+    for (BufferHeader *header : buffers) {
+        if (header->type == OUTPUT_BUFFER && header->sequence > 0)
+            outputBuffers.push_back(header);
+    }
+
+    std::sort(outputBuffers.begin(), outputBuffers.end(),
+            [](BufferHeader *a, BufferHeader *b) {
+                return a->sequence < b->sequence;
+            });
+
+    off_t fileOffset = 0;
+    for (BufferHeader *header : outputBuffers) {
+        if (!success)
+            break;
+
+        uint64_t bytes = header->bytes;
+        bytes = std::min(bytes, header->capacity);
+        if (header->state != FREE && bytes > 0) {
+            char *data = reinterpret_cast<char*>(header) + HEADER_SIZE;
+            success = writeAt(fd, data, bytes,
+                              static_cast<off_t>(header->fileOffset));
+            ++stats->outputBuffersRestored;
+            stats->outputBytesRestored += bytes;
+        }
+
+        fileOffset = static_cast<off_t>(header->fileOffset + bytes);
+    }
+
+    if (success && outputBuffers.empty())
+        fileOffset = lseek(fd, 0, SEEK_END);
+
+    // Then compress what's left in the StagingBuffers
+    bool wrapAround = true;
+    for (BufferHeader *header : buffers) {
+        if (success && header->type == STAGING_BUFFER)
+            success = recoverStagingBuffer(header, fd, &fileOffset,
+                                           &wrapAround, stats);
+    }
+
+    if (success && fdatasync(fd) != 0)
+        success = false;
+
+    if (!success && fd >= 0) {
+        fprintf(stderr, "Unable to write to the log file %s: %s\r\n",
+                logFileName.c_str(), strerror(errno));
+    }
+
+    if (fd >= 0)
+        close(fd);
+
+    for (BufferHeader *header : buffers)
+        munmap(header, HEADER_SIZE + header->capacity);
+
+    if (success)
+        removeDirectory(directory);
+
+    return success;
+}
+
+}; // namespace Recovery
+}; // namespace NanoLogInternal
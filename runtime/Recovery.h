@@ -0,0 +1,164 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef NANOLOG_RECOVERY_H
+#define NANOLOG_RECOVERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+/**
+ * The Recovery namespace implements the crash recovery buffers (see
+ * NanoLogConfig::CRASH_RECOVERY_BUFFERS). Each buffer is mapped from its own
+ * file in a directory per process, behind a header page through which the
+ * runtime publishes how far the buffer was filled and drained. After a
+ * crash, recover() reads the headers back and writes what the process left
+ * behind to its log file.
+ */
+namespace NanoLogInternal {
+namespace Recovery {
+
+// Identifies the BufferHeader of a crash recovery buffer file
+static const uint32_t MAGIC = 0x4e4c5242;
+
+// Number of bytes in front of a buffer that hold its BufferHeader; this is a
+// page, so that the buffer itself stays page aligned.
+static const size_t HEADER_SIZE = 4096;
+
+// Prefix of the names of the buffer files, which end in their fileIndex
+static const char BUFFER_FILE_PREFIX[] = "buffer.";
+
+// Name of the file in the process directory that holds the path of the log
+// file (see recordLogFile())
+static const char LOG_FILE_NAME[] = "logFile";
+
+// Name of the file that marks the directory of a process whose log messages
+// are compressed by a nanologd (see NanoLogConfig::COMPRESSION_DAEMON). It
+// holds the process's getProcessStartTime().
+static const char DAEMON_CLIENT_FILE_NAME[] = "daemonClient";
+
+/**
+ * What a buffer is used for
+ */
+enum BufferType : uint32_t {
+    UNUSED = 0,
+    STAGING_BUFFER,
+    OUTPUT_BUFFER,
+};
+
+/**
+ * Where an output buffer is in its cycle through the compression thread
+ */
+enum OutputBufferState : uint32_t {
+    // Its contents were written to the log file (or it was never used)
+    FREE = 0,
+
+    // The compression thread encodes log messages into it
+    FILLING,
+
+    // Its write to the log file was submitted, but not retired
+    WRITING,
+};
+
+/**
+ * Lives in front of each crash recovery buffer and is kept up to date by the
+ * runtime. Since the process may die at any point, the fields are published
+ * such that recovering from any state of the header at most duplicates log
+ * messages rather than losing them.
+ */
+struct BufferHeader {
+    // Always MAGIC
+    uint32_t magic;
+
+    // Distinguishes the file of the buffer from the others of the process
+    uint32_t fileIndex;
+
+    // Number of bytes in the buffer that follows the header
+    uint64_t capacity;
+
+    // One of BufferType
+    volatile uint32_t type;
+
+    // STAGING_BUFFER only: the id of the StagingBuffer and the byte offsets
+    // of its producerPos, consumerPos and endOfRecordedSpace. The bytes from
+    // the consumer to the producer, wrapping around at endOffset, are yet to
+    // be compressed. The version is incremented before and after the fields
+    // are reset for a new thread, so that a reader can tell whether they
+    // changed while it read them, like with a seqlock.
+    volatile uint32_t version;
+    volatile uint32_t bufferId;
+    volatile uint64_t producerOffset;
+    volatile uint64_t consumerOffset;
+    volatile uint64_t endOffset;
+
+    // OUTPUT_BUFFER only: one of OutputBufferState, the number of times an
+    // output buffer started FILLING when this one did (so that the buffers
+    // can be ordered), the offset in the log file that the buffer is written
+    // to and the number of valid bytes in it.
+    volatile uint32_t state;
+    volatile uint64_t sequence;
+    volatile uint64_t fileOffset;
+    volatile uint64_t bytes;
+};
+
+/**
+ * Summarizes what recover() did
+ */
+struct RecoveryStats {
+    // Number of output buffers written to the log file and their bytes
+    uint32_t outputBuffersRestored;
+    uint64_t outputBytesRestored;
+
+    // Number of StagingBuffers that held log messages, the number of log
+    // messages compressed from them and the number of bytes they took up
+    // in the log file
+    uint32_t stagingBuffersRecovered;
+    uint64_t logsRecovered;
+    uint64_t stagingBytesWritten;
+
+    // Number of bytes in the StagingBuffers that couldn't be compressed
+    uint64_t stagingBytesLost;
+};
+
+/**
+ * Returns the header of a buffer returned by mapBuffer()
+ *
+ * \param buffer
+ *      Buffer returned by mapBuffer()
+ */
+static inline BufferHeader *
+getHeader(char *buffer) {
+    return reinterpret_cast<BufferHeader*>(buffer - HEADER_SIZE);
+}
+
+char *mapBuffer(size_t bytes, bool prefault, bool lock);
+void unmapBuffer(char *buffer, size_t bytes);
+BufferHeader *mapBufferFile(const std::string &fileName, bool writable);
+const std::string &getProcessDirectory();
+void recordLogFile(const char *filename);
+void registerDaemonClient();
+uint64_t getProcessStartTime(pid_t pid);
+void removeDirectory(const std::string &dir);
+void removeProcessDirectory();
+bool recover(const char *directory, const char *logFile,
+             RecoveryStats *stats);
+
+}; // namespace Recovery
+}; // namespace NanoLogInternal
+
+#endif // NANOLOG_RECOVERY_H
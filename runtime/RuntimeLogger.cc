@@ -14,44 +14,96 @@
  */
 
 
+#include <algorithm>
+#include <climits>
 #include <fcntl.h>
 #include <iosfwd>
 #include <iostream>
+#include <limits>
 #include <locale>
+#include <signal.h>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <stdlib.h>
 #include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "Cycles.h"         /* Cycles::rdtsc() */
 #include "RuntimeLogger.h"
 #include "Config.h"
+#include "IoBackend.h"
 #include "Util.h"
 
 namespace NanoLogInternal {
 
+#ifndef PREPROCESSOR_NANOLOG
+static_assert(!NanoLogConfig::COMPRESSION_DAEMON, "Only the preprocessor "
+        "version of NanoLog can be compressed by the nanologd");
+#endif
+
 // Define the static members of RuntimeLogger here
 __thread RuntimeLogger::StagingBuffer *RuntimeLogger::stagingBuffer = nullptr;
 thread_local RuntimeLogger::StagingBufferDestroyer RuntimeLogger::sbc;
+__thread uint32_t RuntimeLogger::cpuThreadId = 0;
+__thread char *RuntimeLogger::cpuReservation = nullptr;
+__thread RuntimeLogger::CpuDroppedLogs RuntimeLogger::cpuDroppedLogs = {};
 RuntimeLogger RuntimeLogger::nanoLogSingleton;
 
 // RuntimeLogger constructor
 RuntimeLogger::RuntimeLogger()
-        : threadBuffers()
-        , nextBufferId()
-        , bufferMutex()
+        : threadBuffers(nullptr)
+        , nextBufferId(1)
+        , cpuStagingBuffers()
+        , numCpuStagingBuffers(0)
+        , nextCpuStagingBuffer(0)
+        , cpuStagingScratch(nullptr)
+        , threadBuffersEpoch(0)
+        , threadBuffersReaders()
+        , retiredBuffers()
+        , reclaimingBuffers()
+        , reclaimEpoch(0)
+        , bufferPool(nullptr)
+        , numPooledBuffers(0)
+        , bufferPoolHits(0)
+        , bufferPoolMisses(0)
+        , readyBuffers(nullptr)
+        , activeBuffers()
+        , cyclesAtLastIdleScan(0)
+        , initialized(false)
+        , config()
+        , initMutex()
         , compressionThread()
-        , hasOutstandingOperation(false)
         , compressionThreadShouldExit(false)
-        , syncStatus(SYNC_COMPLETED)
+        , compressionWorkers()
+        , compressionWorkersShouldExit(false)
+        , workerShards()
+        , workerDoorbell(0)
+        , numWorkersParked(0)
+        , syncRequested(0)
+        , syncCompleted(0)
+        , syncInProgress(0)
+        , syncPhase(SYNC_IDLE)
+        , syncCallbacks()
+        , severeLogPending(false)
+        , doorbell(0)
+        , compressionThreadParked(false)
+        , backoffPauses(1)
         , condMutex()
         , workAdded()
         , hintSyncCompleted()
         , outputFd(-1)
-        , aioCb()
+        , outputFileName()
+        , ioBackend(nullptr)
+        , outputFileOffset(0)
+        , completedFileOffset(0)
+        , outputBuffers()
+        , compressingBufferIndex(0)
         , compressingBuffer(nullptr)
-        , outputDoubleBuffer(nullptr)
+        , outputBufferSequence(0)
         , currentLogLevel(NOTICE)
+        , overflowPolicy(BLOCK_ON_FULL)
         , cycleAtThreadStart(0)
         , cyclesAtLastAIOStart(0)
         , cyclesActive(0)
@@ -63,77 +115,223 @@ RuntimeLogger::RuntimeLogger()
         , totalBytesWritten(0)
         , padBytesWritten(0)
         , logsProcessed(0)
+        , logsDroppedByExitedThreads(0)
+        , logsCompressedByProducers(0)
+        , logsCompressedByWorkers(0)
         , numAioWritesCompleted(0)
+        , numPeriodicSyncs(0)
+        , numSyncFlushes(0)
+        , numSeverityFlushes(0)
+        , numDoorbellSleeps(0)
+        , numDoorbellTimeouts(0)
+        , numDoorbellRings(0)
+        , numWorkerDoorbellSleeps(0)
+        , numFallocates(0)
+        , bytesFallocated(0)
+        , numLogFileRotations(0)
+        , sinkBytesWritten(0)
+        , numSinkWriteFailures(0)
         , coreId(-1)
-        , registrationMutex()
         , invocationSites()
+        , numInvocationSites(0)
         , nextInvocationIndexToBePersisted(0)
+        , spillSegments(MAX_SPILL_SEGMENTS, nullptr)
+        , numSpillSegments(0)
+        , spillFreeList(0)
 {
     for (size_t i = 0; i < Util::arraySize(stagingBufferPeekDist); ++i)
         stagingBufferPeekDist[i] = 0;
 
-    const char *filename = NanoLogConfig::DEFAULT_LOG_FILE;
-    outputFd = open(filename, NanoLogConfig::FILE_PARAMS, 0666);
-    if (outputFd < 0) {
-        fprintf(stderr, "NanoLog could not open the default file location "
-                "for the log file (\"%s\").\r\n Please check the permissions "
-                "or use NanoLog::setLogFile(const char* filename) to "
-                "specify a different log file.\r\n", filename);
-        std::exit(-1);
+    registerLinkedInvocationSites();
+}
+
+/**
+* Opens the log file, allocates the output buffers and starts the background
+* threads, unless that was already done. This is deferred until the first
+* StagingBuffer is allocated, the log file is set or NanoLog::init() is
+* invoked, so that programs which never log don't open files, allocate the
+* OUTPUT_BUFFER_SIZE buffers or run threads.
+*
+* \param fd
+*      Log file to output to (it was opened by the caller), or -1 to open
+*      the filename
+* \param filename
+*      Name of the log file, which the rotated log files are named after
+*
+* \return
+*      true if the RuntimeLogger was initialized by this invocation; false if
+*      it already was, in which case fd is left to the caller
+*/
+bool
+RuntimeLogger::initialize(int fd, const char *filename) {
+    std::lock_guard<std::mutex> lock(initMutex);
+    if (initialized.load(std::memory_order_relaxed))
+        return false;
+
+    if (fd < 0) {
+        fd = open(filename, getOpenFlags(), 0666);
+        if (fd < 0) {
+            fprintf(stderr, "NanoLog could not open the default file location "
+                    "for the log file (\"%s\").\r\n Please check the "
+                    "permissions or use NanoLog::setLogFile(const char* "
+                    "filename) to specify a different log file.\r\n",
+                    filename);
+            std::exit(-1);
+        }
     }
 
-    memset(&aioCb, 0, sizeof(aioCb));
+    outputFd = fd;
+    outputFileName = filename;
 
-    int err = posix_memalign(reinterpret_cast<void **>(&compressingBuffer),
-                             512, NanoLogConfig::OUTPUT_BUFFER_SIZE);
-    if (err) {
-        perror("The NanoLog system was not able to allocate enough memory "
-                       "to support its operations. Quitting...\r\n");
-        std::exit(-1);
+    // The nanologd compresses and outputs the log messages instead
+    if (NanoLogConfig::COMPRESSION_DAEMON) {
+        Recovery::recordLogFile(filename);
+        Recovery::registerDaemonClient();
+        initialized.store(true, std::memory_order_release);
+        return true;
     }
 
-    err = posix_memalign(reinterpret_cast<void **>(&outputDoubleBuffer),
-                         512, NanoLogConfig::OUTPUT_BUFFER_SIZE);
-    if (err) {
-        perror("The NanoLog system was not able to allocate enough memory "
-                       "to support its operations. Quitting...\r\n");
-        std::exit(-1);
+    outputFileOffset = completedFileOffset = prepareOutputFile(fd);
+
+    // All output buffers but the one being filled can be in flight. io_uring
+    // may be unavailable in which case POSIX AIO is used instead.
+    uint32_t maxOutstandingWrites = config.numOutputBuffers - 1;
+    if (config.ioBackend == NanoLog::IO_URING)
+        ioBackend = IoUringBackend::create(maxOutstandingWrites);
+    if (ioBackend == nullptr)
+        ioBackend = new PosixAioBackend(maxOutstandingWrites);
+
+    for (uint32_t i = 0; i < config.numOutputBuffers; ++i) {
+        outputBuffers.push_back(allocBuffer(config.outputBufferSize));
+        if (NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+            Recovery::getHeader(outputBuffers[i])->type =
+                                                    Recovery::OUTPUT_BUFFER;
     }
+    compressingBufferIndex = 0;
+    compressingBuffer = outputBuffers[0];
+
+    if (NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+        Recovery::recordLogFile(filename);
+
+    if (NanoLogConfig::PER_CPU_STAGING_BUFFERS)
+        cpuStagingScratch = new char[config.stagingBufferSize];
 
 #ifndef BENCHMARK_DISCARD_ENTRIES_AT_STAGINGBUFFER
+    for (uint32_t i = 0; i < config.numCompressionWorkers; ++i)
+        workerShards.push_back(new WorkerShard());
+
     compressionThread = std::thread(&RuntimeLogger::compressionThreadMain, this);
+
+    for (uint32_t i = 0; i < config.numCompressionWorkers; ++i) {
+        compressionWorkers.emplace_back(&RuntimeLogger::compressionWorkerMain,
+                                        this, i);
+    }
 #endif
+
+    initialized.store(true, std::memory_order_release);
+    return true;
 }
 
 // RuntimeLogger destructor
 RuntimeLogger::~RuntimeLogger() {
-    sync();
+    // Without initialize(), there are no threads to stop or logs to flush
+    bool drained = true;
+    if (initialized) {
+        if (NanoLogConfig::COMPRESSION_DAEMON)
+            drained = waitForDaemon(NanoLogConfig::DAEMON_EXIT_TIMEOUT_MS);
+        else
+            sync();
+
+        // Stop the compression workers first so that everything they
+        // compressed is output by the compression thread before it exits.
+        nanoLogSingleton.compressionWorkersShouldExit = true;
+        nanoLogSingleton.ringWorkerDoorbell();
+        for (std::thread &worker : nanoLogSingleton.compressionWorkers)
+            worker.join();
+        nanoLogSingleton.compressionWorkers.clear();
+
+        // Stop the compression thread
+        {
+            std::lock_guard<std::mutex> lock(nanoLogSingleton.condMutex);
+            nanoLogSingleton.compressionThreadShouldExit = true;
+            nanoLogSingleton.wakeCompressionThread();
+        }
 
-    // Stop the compression thread
-    {
-        std::lock_guard<std::mutex> lock(nanoLogSingleton.condMutex);
-        nanoLogSingleton.compressionThreadShouldExit = true;
-        nanoLogSingleton.workAdded.notify_all();
-    }
+        if (nanoLogSingleton.compressionThread.joinable())
+            nanoLogSingleton.compressionThread.join();
 
-    if (nanoLogSingleton.compressionThread.joinable())
-        nanoLogSingleton.compressionThread.join();
+        for (WorkerShard *shard : workerShards)
+            delete shard;
+        workerShards.clear();
+
+        // Everything was output before the compression thread exited, so
+        // the syncs requested in the meantime are complete as well.
+        std::unique_lock<std::mutex> lock(nanoLogSingleton.condMutex);
+        syncInProgress = syncRequested;
+        completeSync(lock);
+    }
 
     // Free all the data structures
-    if (compressingBuffer) {
-        free(compressingBuffer);
-        compressingBuffer = nullptr;
+    for (StagingBuffer *sb : reclaimingBuffers)
+        delete sb;
+    for (StagingBuffer *sb : retiredBuffers)
+        delete sb;
+    reclaimingBuffers.clear();
+    retiredBuffers.clear();
+
+    while (StagingBuffer *sb = bufferPool.load()) {
+        bufferPool = sb->nextPooled;
+        delete sb;
     }
+    numPooledBuffers = 0;
 
-    if (outputDoubleBuffer) {
-        free(outputDoubleBuffer);
-        outputDoubleBuffer = nullptr;
+    // The ioBackend waits for the writes still referencing output buffers
+    delete ioBackend;
+    ioBackend = nullptr;
+
+    for (char *buffer : outputBuffers)
+        freeBuffer(buffer, config.outputBufferSize);
+    outputBuffers.clear();
+    compressingBuffer = nullptr;
+
+    for (uint32_t i = 0; i < numSpillSegments; ++i) {
+        delete spillSegments[i];
+        spillSegments[i] = nullptr;
+    }
+
+    for (uint32_t i = 0; i < MAX_INVOCATION_SITE_CHUNKS; ++i) {
+        delete invocationSites[i].load();
+        invocationSites[i] = nullptr;
     }
 
-    if (outputFd > 0)
+    for (uint32_t i = 0; i < MAX_CPU_STAGING_BUFFERS; ++i) {
+        delete cpuStagingBuffers[i].load();
+        cpuStagingBuffers[i] = nullptr;
+    }
+
+    delete[] cpuStagingScratch;
+    cpuStagingScratch = nullptr;
+
+    if (outputFd > 0) {
+        if (initialized)
+            releaseOutputFileSpace();
         close(outputFd);
+    }
+
+    // Everything was output, so there's nothing left to recover. Otherwise
+    // the nanologd drains the StagingBuffers once it notices the exit.
+    if (NanoLogConfig::CRASH_RECOVERY_BUFFERS && initialized) {
+        if (drained) {
+            Recovery::removeProcessDirectory();
+        } else {
+            fprintf(stderr, "NanoLog exited before the nanologd compressed "
+                    "all its log messages; they remain in %s\r\n",
+                    Recovery::getProcessDirectory().c_str());
+        }
+    }
 
     outputFd = 0;
+    initialized = false;
 }
 
 // Documentation in NanoLog.h
@@ -172,11 +370,57 @@ RuntimeLogger::getStats() {
     out << buffer;
 
     snprintf(buffer, 1024,
-           "There were %u file flushes and the final sync time was %lf sec\r\n",
+           "There were %u file flushes via %s and the final sync time was "
+               "%lf sec\r\n",
            nanoLogSingleton.numAioWritesCompleted,
+           (nanoLogSingleton.ioBackend) ? nanoLogSingleton.ioBackend->getName()
+                                        : "no I/O backend",
            PerfUtils::Cycles::toSeconds(stop - start));
     out << buffer;
 
+    // In the DSYNC and DIRECT_IO modes every write is synchronized
+    NanoLog::DurabilityMode mode = nanoLogSingleton.config.durabilityMode;
+    snprintf(buffer, 1024,
+           "In the %s durability mode that's %u synchronized writes and %u "
+               "periodic syncs; %lu bytes were reserved by %u fallocate() "
+               "calls\r\n",
+           getDurabilityModeName(mode),
+           (mode == NanoLog::DSYNC || mode == NanoLog::DIRECT_IO)
+                    ? nanoLogSingleton.numAioWritesCompleted : 0,
+           nanoLogSingleton.numPeriodicSyncs,
+           nanoLogSingleton.bytesFallocated,
+           nanoLogSingleton.numFallocates);
+    out << buffer;
+
+    snprintf(buffer, 1024,
+           "%lu sync() operations were completed in %u flushes and %u "
+               "flushes were due to severe log messages\r\n",
+           nanoLogSingleton.syncCompleted,
+           nanoLogSingleton.numSyncFlushes,
+           nanoLogSingleton.numSeverityFlushes);
+    out << buffer;
+
+    snprintf(buffer, 1024,
+           "The compression thread slept on its doorbell %lu times (%lu "
+               "timed out) and it was rung %lu times during them\r\n",
+           nanoLogSingleton.numDoorbellSleeps,
+           nanoLogSingleton.numDoorbellTimeouts,
+           nanoLogSingleton.numDoorbellRings.load());
+    out << buffer;
+
+    snprintf(buffer, 1024,
+           "The log file was rotated %u times\r\n",
+           nanoLogSingleton.numLogFileRotations);
+    out << buffer;
+
+    if (nanoLogSingleton.config.outputSink != nullptr) {
+        snprintf(buffer, 1024,
+               "The output sink received %lu bytes and failed %u times\r\n",
+               nanoLogSingleton.sinkBytesWritten,
+               nanoLogSingleton.numSinkWriteFailures);
+        out << buffer;
+    }
+
     double secondsAwake =
             PerfUtils::Cycles::toSeconds(nanoLogSingleton.cyclesActive);
     double secondsThreadHasBeenAlive = PerfUtils::Cycles::toSeconds(
@@ -228,6 +472,73 @@ RuntimeLogger::getStats() {
            nanoLogSingleton.padBytesWritten);
     out << buffer;
 
+    uint64_t logsDropped = nanoLogSingleton.logsDroppedByExitedThreads;
+    for (uint32_t i = 0; i < MAX_CPU_STAGING_BUFFERS; ++i) {
+        CpuStagingBuffer *cb = nanoLogSingleton.cpuStagingBuffers[i].load();
+        if (cb != nullptr)
+            logsDropped += cb->numLogsDropped;
+    }
+
+    uint32_t numStagingBuffers = 0;
+    uint64_t stagingBytes = 0;
+    {
+        ThreadBuffersReader reader(nanoLogSingleton);
+        for (StagingBuffer *sb = nanoLogSingleton.threadBuffers.load();
+                sb != nullptr; sb = sb->nextThreadBuffer.load()) {
+            logsDropped += sb->numLogsDropped;
+            stagingBytes += sb->capacity;
+            ++numStagingBuffers;
+        }
+    }
+
+    if (numStagingBuffers > 0) {
+        snprintf(buffer, 1024, "%u StagingBuffers hold %0.2lf MB of staging "
+                               "space\r\n",
+                 numStagingBuffers, static_cast<double>(stagingBytes)/1.0e6);
+        out << buffer;
+    }
+
+    uint32_t spillSegmentsAllocated = nanoLogSingleton.numSpillSegments;
+    if (spillSegmentsAllocated > 0) {
+        snprintf(buffer, 1024, "%u overflow segments (%0.2lf MB) were "
+                               "allocated for full StagingBuffers\r\n",
+                 spillSegmentsAllocated,
+                 spillSegmentsAllocated*NanoLogConfig::SPILL_SEGMENT_SIZE/1.0e6);
+        out << buffer;
+    }
+
+    if (nanoLogSingleton.logsCompressedByProducers > 0) {
+        snprintf(buffer, 1024, "%lu log messages were compressed by logging "
+                               "threads waiting on the background thread\r\n",
+                 nanoLogSingleton.logsCompressedByProducers.load());
+        out << buffer;
+    }
+
+    if (!nanoLogSingleton.compressionWorkers.empty()) {
+        snprintf(buffer, 1024, "%lu log messages were compressed by the %lu "
+                               "compression workers, which slept on their "
+                               "doorbell %lu times\r\n",
+                 nanoLogSingleton.logsCompressedByWorkers.load(),
+                 nanoLogSingleton.compressionWorkers.size(),
+                 nanoLogSingleton.numWorkerDoorbellSleeps.load());
+        out << buffer;
+    }
+
+    if (nanoLogSingleton.bufferPoolHits > 0) {
+        snprintf(buffer, 1024, "%lu of %lu StagingBuffers were reused from "
+                               "exited threads\r\n",
+                 nanoLogSingleton.bufferPoolHits.load(),
+                 nanoLogSingleton.bufferPoolHits.load()
+                        + nanoLogSingleton.bufferPoolMisses.load());
+        out << buffer;
+    }
+
+    if (logsDropped > 0) {
+        snprintf(buffer, 1024, "%lu log messages were dropped due to full "
+                               "StagingBuffers\r\n", logsDropped);
+        out << buffer;
+    }
+
     return out.str();
 }
 
@@ -260,18 +571,26 @@ RuntimeLogger::getHistograms()
     }
 
     {
-        std::unique_lock<std::mutex> lock(nanoLogSingleton.bufferMutex);
-        for (size_t i = 0; i < nanoLogSingleton.threadBuffers.size(); ++i) {
-            StagingBuffer *sb = nanoLogSingleton.threadBuffers.at(i);
+        ThreadBuffersReader reader(nanoLogSingleton);
+        for (StagingBuffer *sb = nanoLogSingleton.threadBuffers.load();
+                sb != nullptr; sb = sb->nextThreadBuffer.load()) {
             if (sb) {
                 snprintf(buffer, 1024, "Thread %u:\r\n", sb->getId());
                 out << buffer;
 
                 snprintf(buffer, 1024,
                                  "\tAllocations   : %lu\r\n"
-                                 "\tTimes Blocked : %u\r\n",
+                                 "\tTimes Blocked : %u\r\n"
+                                 "\tTimes Spilled : %u\r\n"
+                                 "\tTimes Assisted: %u\r\n"
+                                 "\tTimes Resized : %u\r\n"
+                                 "\tTimes Dropped : %lu\r\n",
                          sb->numAllocations,
-                         sb->numTimesProducerBlocked);
+                         sb->numTimesProducerBlocked,
+                         sb->numTimesSpilled,
+                         sb->numTimesAssisted,
+                         sb->numTimesResized,
+                         sb->numLogsDropped);
                 out << buffer;
 
 #ifdef RECORD_PRODUCER_STATS
@@ -307,327 +626,2072 @@ RuntimeLogger::getHistograms()
 
 // See documentation in NanoLog.h
 void
-RuntimeLogger::preallocate() {
-    nanoLogSingleton.ensureStagingBufferAllocated();
-    // I wonder if it'll be a good idea to update minFreeSpace as well since
-    // the user is already willing to invoke this up front cost.
-}
-
-/**
-* Internal helper function to wait for AIO completion.
-*/
-void
-RuntimeLogger::waitForAIO() {
-    if (hasOutstandingOperation) {
-        if (aio_error(&aioCb) == EINPROGRESS) {
-            const struct aiocb *const aiocb_list[] = {&aioCb};
-            int err = aio_suspend(aiocb_list, 1, NULL);
+RuntimeLogger::init(const NanoLog::Config &config) {
+    const char *error = checkConfig(config);
+    if (error != nullptr)
+        throw std::invalid_argument(error);
 
-            if (err != 0)
-                perror("LogCompressor's Posix AIO suspend operation failed");
+    RuntimeLogger &logger = nanoLogSingleton;
+    {
+        std::lock_guard<std::mutex> lock(logger.initMutex);
+        const NanoLog::Config &current = logger.config;
+        if (!logger.initialized) {
+            logger.config = config;
+            logger.config.logFile = nullptr;
+        } else if (config.stagingBufferSize != current.stagingBufferSize ||
+                config.initialStagingBufferSize !=
+                                        current.initialStagingBufferSize ||
+                config.outputBufferSize != current.outputBufferSize ||
+                config.numOutputBuffers != current.numOutputBuffers ||
+                config.releaseThreshold != current.releaseThreshold ||
+                config.pollIntervalNoWorkUs != current.pollIntervalNoWorkUs ||
+                config.pollIntervalDuringIoUs !=
+                                        current.pollIntervalDuringIoUs ||
+                config.wakeupPolicy != current.wakeupPolicy ||
+                config.backoffSpinUs != current.backoffSpinUs ||
+                config.backoffPauseUs != current.backoffPauseUs ||
+                config.compressionThreadCore !=
+                                        current.compressionThreadCore ||
+                config.numCompressionWorkers !=
+                                        current.numCompressionWorkers ||
+                config.flushMinBytes != current.flushMinBytes ||
+                config.flushMaxDelayUs != current.flushMaxDelayUs ||
+                config.flushLogLevel != current.flushLogLevel ||
+                config.flushLogLevelMaxDelayUs !=
+                                        current.flushLogLevelMaxDelayUs ||
+                config.fileFlags != current.fileFlags ||
+                config.ioBackend != current.ioBackend ||
+                config.durabilityMode != current.durabilityMode ||
+                config.syncIntervalMs != current.syncIntervalMs ||
+                config.syncIntervalBytes != current.syncIntervalBytes ||
+                config.fallocateChunkSize != current.fallocateChunkSize ||
+                config.rotateMaxBytes != current.rotateMaxBytes ||
+                config.rotateMaxAgeSec != current.rotateMaxAgeSec ||
+                config.rotateKeep != current.rotateKeep ||
+                config.rotatedCallback != current.rotatedCallback ||
+                config.outputSink != current.outputSink) {
+            throw std::invalid_argument("NanoLog is already initialized with "
+                    "different buffer sizes, poll intervals, wakeup policy, "
+                    "compression workers, flush policy, file flags, I/O "
+                    "backend, durability, rotation or output sink settings");
         }
+    }
 
-        int err = aio_error(&aioCb);
-        ssize_t ret = aio_return(&aioCb);
-
-        if (err != 0) {
-            fprintf(stderr, "LogCompressor's POSIX AIO failed with %d: %s\r\n",
-                    err, strerror(err));
-        } else if (ret < 0) {
-            perror("LogCompressor's Posix AIO Write operation failed");
-        }
-        ++numAioWritesCompleted;
-        hasOutstandingOperation = false;
+    setLogLevel(config.logLevel);
+    setOverflowPolicy(config.overflowPolicy);
 
-        if (syncStatus == WAITING_ON_AIO) {
-            syncStatus = SYNC_COMPLETED;
-            hintSyncCompleted.notify_one();
-        }
-    }
+    if (config.logFile != nullptr)
+        setLogFile(config.logFile);
+    else
+        logger.ensureInitialized();
 }
 
 /**
-* Main compression thread that handles scanning through the StagingBuffers,
-* compressing log entries, and outputting a compressed log file.
+* Checks the settings of a Config against each other and against the options
+* in Config.h that remain fixed at compile time. These are the same rules that
+* Config.h enforces for the defaults with static_asserts.
+*
+* \param config
+*      Config to check
+*
+* \return
+*      nullptr if the Config is valid; otherwise a description of the problem
 */
-void
-RuntimeLogger::compressionThreadMain() {
-    // Index of the last StagingBuffer checked for uncompressed log messages
-    size_t lastStagingBufferChecked = 0;
+const char *
+RuntimeLogger::checkConfig(const NanoLog::Config &config) {
+    uint32_t stagingBufferSize = config.stagingBufferSize;
+    if (stagingBufferSize == 0 ||
+            (stagingBufferSize & (stagingBufferSize - 1)) != 0)
+        return "stagingBufferSize must be a power of 2";
 
-    // Marks when the thread wakes up. This value should be used to calculate
-    // the number of cyclesActive right before blocking/sleeping and then updated
-    // to the latest rdtsc() when the thread re-awakens.
-    uint64_t cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
-    cycleAtThreadStart = cyclesAwakeStart;
+    if (config.initialStagingBufferSize == 0 ||
+            config.initialStagingBufferSize > stagingBufferSize)
+        return "initialStagingBufferSize must be non-zero and may not exceed "
+               "stagingBufferSize";
 
-    // Manages the state associated with compressing log messages
-    Log::Encoder encoder(compressingBuffer, NanoLogConfig::OUTPUT_BUFFER_SIZE);
+    if (NanoLogConfig::SPILL_SEGMENT_SIZE > stagingBufferSize)
+        return "stagingBufferSize must be greater than or equal to "
+               "NanoLogConfig::SPILL_SEGMENT_SIZE";
 
-    // Indicates whether a compression operation failed or not due
-    // to insufficient space in the outputBuffer
-    bool outputBufferFull = false;
+    if (config.outputBufferSize < stagingBufferSize)
+        return "outputBufferSize must be greater than or equal to "
+               "stagingBufferSize";
 
-    // Indicates that in scanning the StagingBuffers, we have passed the
-    // zero-th index, but have not yet encoded that in he compressed output
-    bool wrapAround = false;
+    if (config.outputBufferSize < NanoLogConfig::ASSIST_BUFFER_SIZE)
+        return "outputBufferSize must be greater than or equal to "
+               "NanoLogConfig::ASSIST_BUFFER_SIZE";
 
-    // Keeps a shadow mapping of the log identifiers to static information
-    // to allow the logging threads to register in parallel with compression
-    // lookup
-    std::vector<StaticLogInfo> shadowStaticInfo;
+    if (config.numOutputBuffers < 2)
+        return "numOutputBuffers must be at least 2";
 
-    // Each iteration of this loop scans for uncompressed log messages in the
-    // thread buffers, compresses as much as possible, and outputs it to a file.
-    // The loop will run so long as it's not shutdown or there's outstanding I/O
-    while (!compressionThreadShouldExit || encoder.getEncodedBytes() > 0
-                                        || hasOutstandingOperation)
-    {
-        coreId = sched_getcpu();
+    if (config.releaseThreshold > stagingBufferSize)
+        return "releaseThreshold may not exceed stagingBufferSize";
 
-        // Indicates how many bytes we have consumed from the StagingBuffers
-        // in a single iteration of the while above. A value of 0 means we
-        // were unable to consume anymore data any of the stagingBuffers
-        // (either due to empty stagingBuffers or a full output encoder)
-        uint64_t bytesConsumedThisIteration = 0;
+    if (config.wakeupPolicy > NanoLog::BUSY_POLL)
+        return "wakeupPolicy is not a valid WakeupPolicy";
 
-        uint64_t start = PerfUtils::Cycles::rdtsc();
-        // Step 1: Find buffers with entries and compress them
-        {
-            std::unique_lock<std::mutex> lock(bufferMutex);
-            size_t i = lastStagingBufferChecked;
+    if (config.compressionThreadCore >= CPU_SETSIZE)
+        return "compressionThreadCore exceeds CPU_SETSIZE";
 
-            // Output new dictionary entries, if necessary
-            if (nextInvocationIndexToBePersisted < invocationSites.size())
-            {
-                std::unique_lock<std::mutex> lock (registrationMutex);
-                encoder.encodeNewDictionaryEntries(
-                                               nextInvocationIndexToBePersisted,
-                                               invocationSites);
-
-                // update our shadow copy
-                for (uint64_t i = shadowStaticInfo.size();
-                                    i < nextInvocationIndexToBePersisted; ++i)
-                {
-                    shadowStaticInfo.push_back(invocationSites.at(i));
-                }
-            }
+    if (config.numCompressionWorkers >= CPU_SETSIZE)
+        return "numCompressionWorkers exceeds CPU_SETSIZE";
 
-            // Scan through the threadBuffers looking for log messages to
-            // compress while the output buffer is not full.
-            while (!outputBufferFull && !threadBuffers.empty())
-            {
-                uint64_t peekBytes = 0;
-                StagingBuffer *sb = threadBuffers[i];
-                char *peekPosition = sb->peek(&peekBytes);
+    if (config.numCompressionWorkers > 0 &&
+            NanoLogConfig::ASSIST_BUFFER_SIZE == 0)
+        return "numCompressionWorkers requires a non-zero "
+               "NanoLogConfig::ASSIST_BUFFER_SIZE";
 
-                // If there's work, unlock to perform it
-                if (peekBytes > 0) {
-                    uint64_t start = PerfUtils::Cycles::rdtsc();
-                    lock.unlock();
+    if (config.numCompressionWorkers > 0 && NanoLogConfig::COMPRESSION_DAEMON)
+        return "numCompressionWorkers doesn't apply to "
+               "NanoLogConfig::COMPRESSION_DAEMON";
 
-                    // Record metrics on the peek size
-                    size_t sizeOfDist = Util::arraySize(stagingBufferPeekDist);
-                    size_t distIndex = (sizeOfDist*peekBytes)/
-                                            NanoLogConfig::STAGING_BUFFER_SIZE;
-                    ++(stagingBufferPeekDist[distIndex]);
+    if (config.flushLogLevel >= NUM_LOG_LEVELS)
+        return "flushLogLevel is not a valid LogLevel";
 
+    if ((config.fileFlags & O_ACCMODE) == O_RDONLY)
+        return "fileFlags must allow writing to the log file";
 
-                    // Encode the data in RELEASE_THRESHOLD chunks
-                    uint32_t remaining = downCast<uint32_t>(peekBytes);
-                    while (remaining > 0) {
-                        long bytesToEncode = std::min(
-                                NanoLogConfig::RELEASE_THRESHOLD,
-                                remaining);
-#ifdef PREPROCESSOR_NANOLOG
-                        long bytesRead = encoder.encodeLogMsgs(
-                                peekPosition + (peekBytes - remaining),
-                                bytesToEncode,
-                                sb->getId(),
-                                wrapAround,
-                                &logsProcessed);
-#else
-                        long bytesRead = encoder.encodeLogMsgs(
-                                peekPosition + (peekBytes - remaining),
-                                bytesToEncode,
-                                sb->getId(),
-                                wrapAround,
-                                shadowStaticInfo,
-                                &logsProcessed);
-#endif
+    if (config.durabilityMode > NanoLog::DIRECT_IO)
+        return "durabilityMode is not a valid DurabilityMode";
 
+    if (config.durabilityMode == NanoLog::DIRECT_IO &&
+            config.outputBufferSize % 512 != 0)
+        return "outputBufferSize must be a multiple of 512 bytes for the "
+               "DIRECT_IO durability mode";
 
-                        if (bytesRead == 0) {
-                            lastStagingBufferChecked = i;
-                            outputBufferFull = true;
-                            break;
-                        }
+    if ((config.rotateMaxBytes > 0 || config.rotateMaxAgeSec > 0) &&
+            config.rotateKeep == 0)
+        return "rotateKeep must be at least 1 if the log file is rotated";
 
-                        wrapAround = false;
-                        remaining -= downCast<uint32_t>(bytesRead);
-                        sb->consume(bytesRead);
-                        totalBytesRead += bytesRead;
-                        bytesConsumedThisIteration += bytesRead;
-                    }
-                    cyclesCompressing += PerfUtils::Cycles::rdtsc() - start;
-                    lock.lock();
-                } else {
-                    // If there's no work, check if we're supposed to delete
-                    // the stagingBuffer
-                    if (sb->checkCanDelete()) {
-                        delete sb;
+    return nullptr;
+}
 
-                        threadBuffers.erase(threadBuffers.begin() + i);
-                        if (threadBuffers.empty()) {
-                            lastStagingBufferChecked = i = 0;
-                            wrapAround = true;
-                            break;
-                        }
+// See documentation in NanoLog.h
+void
+RuntimeLogger::preallocate() {
+    if (NanoLogConfig::PER_CPU_STAGING_BUFFERS) {
+        if (cpuThreadId == 0) {
+            nanoLogSingleton.ensureInitialized();
+            cpuThreadId = nanoLogSingleton.nextBufferId++;
+        }
 
-                        // Back up the indexes so that we ensure we wont skip
-                        // a buffer in our pass (and it's okay to redo one)
-                        if (lastStagingBufferChecked >= i &&
-                            lastStagingBufferChecked > 0) {
-                            --lastStagingBufferChecked;
-                        }
-                        --i;
-                    }
-                }
+        nanoLogSingleton.getCpuStagingBuffer();
+        return;
+    }
 
-                i = (i + 1) % threadBuffers.size();
+    nanoLogSingleton.ensureStagingBufferAllocated();
+    // I wonder if it'll be a good idea to update minFreeSpace as well since
+    // the user is already willing to invoke this up front cost.
+}
 
-                if (i == 0)
-                    wrapAround = true;
+// See documentation in NanoLog.h
+void
+RuntimeLogger::preallocate(size_t bytes) {
+    if (NanoLogConfig::PER_CPU_STAGING_BUFFERS || bytes == 0) {
+        preallocate();
+        return;
+    }
 
-                // Completed a full pass through the buffers
-                if (i == lastStagingBufferChecked)
-                    break;
-            }
+    uint32_t capacity = StagingBuffer::roundUpCapacity(bytes);
+    if (stagingBuffer == nullptr && NanoLogConfig::COMPRESSION_DAEMON)
+        stagingBuffer = nanoLogSingleton.reuseDrainedStagingBuffer();
 
-            cyclesScanningAndCompressing += PerfUtils::Cycles::rdtsc() - start;
+    if (stagingBuffer == nullptr) {
+        stagingBuffer = nanoLogSingleton.allocStagingBuffer(capacity);
+        nanoLogSingleton.registerStagingBuffer(stagingBuffer);
+    }
+
+    // If a resize is already in progress, the next one will take care of it
+    stagingBuffer->minCapacity = std::max(stagingBuffer->minCapacity, capacity);
+    if (stagingBuffer->resizedStorage == nullptr &&
+            stagingBuffer->capacity < capacity)
+        stagingBuffer->resize(capacity);
+}
+
+/**
+* Waits for the oldest write of the compression thread to complete (if it
+* hasn't already) and retires it, which frees its output buffer. Once all the
+* writes are done, a sync() waiting on them is woken up.
+*/
+void
+RuntimeLogger::completeOutputWrite() {
+    ssize_t ret = ioBackend->waitForWrite();
+    if (ret < 0) {
+        fprintf(stderr, "LogCompressor's %s write failed with %d: %s\r\n",
+                ioBackend->getName(), static_cast<int>(-ret),
+                strerror(static_cast<int>(-ret)));
+    } else {
+        completedFileOffset += ret;
+    }
+    ++numAioWritesCompleted;
+
+    if (ioBackend->getNumOutstanding() > 0)
+        return;
+
+    // All the output buffers but the one being filled are now in the log
+    // file; recovering them again would be harmless, but not after the log
+    // file was rotated or replaced.
+    if (NanoLogConfig::CRASH_RECOVERY_BUFFERS) {
+        for (char *buffer : outputBuffers) {
+            if (buffer != compressingBuffer)
+                Recovery::getHeader(buffer)->state = Recovery::FREE;
         }
+    }
 
-        // If there's no data to output, go to sleep.
-        if (encoder.getEncodedBytes() == 0) {
-            std::unique_lock<std::mutex> lock(condMutex);
+    // The disk was busy since the first of the writes was submitted
+    cyclesDiskIO_upperBound += PerfUtils::Cycles::rdtsc() -
+                                                    cyclesAtLastAIOStart;
 
-            // If a sync was requested, we should make at least 1 more
-            // pass to make sure we got everything up to the sync point.
-            if (syncStatus == SYNC_REQUESTED) {
-                syncStatus = PERFORMING_SECOND_PASS;
-                continue;
-            }
+    // We've completed all the writes, check if we need to notify
+    if (syncPhase == WAITING_ON_AIO) {
+        std::unique_lock<std::mutex> lock(condMutex);
+        completeSync(lock);
+    }
+}
 
-            if (syncStatus == PERFORMING_SECOND_PASS) {
-                syncStatus = (hasOutstandingOperation) ? WAITING_ON_AIO
-                                                      : SYNC_COMPLETED;
-            }
+/**
+* Completes the sync() operation that the compression thread is working on,
+* i.e. all the ones up to syncInProgress: the threads waiting on them are
+* woken up and the callbacks of syncAsync() are invoked. The callbacks run
+* without condMutex held so that they can request the next sync.
+*
+* \param lock
+*      Lock on condMutex, which is released while the callbacks run
+*/
+void
+RuntimeLogger::completeSync(std::unique_lock<std::mutex> &lock) {
+    if (syncCompleted < syncInProgress) {
+        syncCompleted = syncInProgress;
+        ++numSyncFlushes;
+    }
+    syncPhase = SYNC_IDLE;
+    hintSyncCompleted.notify_all();
+
+    std::vector<std::function<void()>> callbacks;
+    size_t numCompleted = 0;
+    while (numCompleted < syncCallbacks.size() &&
+            syncCallbacks[numCompleted].first <= syncCompleted) {
+        callbacks.push_back(std::move(syncCallbacks[numCompleted].second));
+        ++numCompleted;
+    }
 
-            if (syncStatus == SYNC_COMPLETED) {
-                hintSyncCompleted.notify_one();
-            }
+    if (numCompleted == 0)
+        return;
 
-            cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
-            workAdded.wait_for(lock, std::chrono::microseconds(
-                    NanoLogConfig::POLL_INTERVAL_NO_WORK_US));
+    syncCallbacks.erase(syncCallbacks.begin(),
+                        syncCallbacks.begin() + numCompleted);
+    lock.unlock();
+    for (std::function<void()> &callback : callbacks)
+        callback();
+    lock.lock();
+}
 
-            cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+/**
+* Returns the flags that log files are opened with, i.e. config.fileFlags plus
+* the ones that config.durabilityMode requires.
+*/
+int
+RuntimeLogger::getOpenFlags() const {
+    switch (config.durabilityMode) {
+        case NanoLog::DSYNC:
+            return config.fileFlags | O_DSYNC;
+        case NanoLog::DIRECT_IO:
+            return config.fileFlags | O_DSYNC | O_DIRECT;
+        default:
+            return config.fileFlags;
+    }
+}
+
+/**
+* Determines the offset at which the output to a newly opened log file starts,
+* which is its end. In the DIRECT_IO durability mode the end is first padded
+* to a multiple of 512 bytes, since O_DIRECT writes must be aligned; the
+* decompressor skips the zero bytes.
+*
+* \param fd
+*      Log file to prepare
+*
+* \return
+*      Offset in fd that the first write goes to
+*/
+off_t
+RuntimeLogger::prepareOutputFile(int fd) {
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end < 0)
+        return 0;
+
+    off_t bytesOver = end % 512;
+    if ((getOpenFlags() & O_DIRECT) && bytesOver != 0) {
+        if (ftruncate(fd, end + 512 - bytesOver) == 0) {
+            end += 512 - bytesOver;
+            padBytesWritten += (512 - bytesOver);
+        } else {
+            perror("NanoLog could not pad the log file for O_DIRECT");
         }
+    }
 
-        if (hasOutstandingOperation) {
-            if (aio_error(&aioCb) == EINPROGRESS) {
-                const struct aiocb *const aiocb_list[] = {&aioCb};
-                if (outputBufferFull) {
-                    // If the output buffer is full and we're not done,
-                    // wait for completion
-                    cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
-                    int err = aio_suspend(aiocb_list, 1, NULL);
-                    cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
-                    if (err != 0)
-                        perror("LogCompressor's Posix AIO "
-                                       "suspend operation failed");
-                } else {
-                    // If there's no new data, go to sleep.
-                    if (bytesConsumedThisIteration == 0 &&
-                        NanoLogConfig::POLL_INTERVAL_DURING_IO_US > 0)
-                    {
-                        std::unique_lock<std::mutex> lock(condMutex);
-                        cyclesActive += PerfUtils::Cycles::rdtsc() -
-                                       cyclesAwakeStart;
-                        workAdded.wait_for(lock, std::chrono::microseconds(
-                                NanoLogConfig::POLL_INTERVAL_DURING_IO_US));
-                        cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
-                    }
+    return end;
+}
 
-                    if (aio_error(&aioCb) == EINPROGRESS)
-                        continue;
+/**
+* Reserves space for the log file with fallocate() in chunks of
+* config.fallocateChunkSize bytes, so that the writes extending it don't
+* have to allocate blocks (and update the file system metadata) every time.
+* The space is reserved without changing the size of the file, which the
+* writes append to. Gives up on the first failure, e.g. when the file system
+* doesn't support it.
+*
+* \param end
+*      Offset in outputFd up to which the next write extends the log file
+* \param[in,out] reservedEnd
+*      Offset up to which space was reserved so far; updated to the new
+*      one, or to the maximum off_t if fallocate() failed
+*/
+void
+RuntimeLogger::reserveOutputFileSpace(off_t end, off_t *reservedEnd) {
+    if (config.fallocateChunkSize == 0 || end <= *reservedEnd)
+        return;
+
+    off_t chunk = config.fallocateChunkSize;
+    off_t bytes = (end - *reservedEnd + chunk - 1) / chunk * chunk;
+    if (fallocate(outputFd, FALLOC_FL_KEEP_SIZE, *reservedEnd, bytes) != 0) {
+        *reservedEnd = std::numeric_limits<off_t>::max();
+        return;
+    }
+
+    *reservedEnd += bytes;
+    ++numFallocates;
+    bytesFallocated += bytes;
+}
+
+/**
+* Gives the space that reserveOutputFileSpace() reserved past the end of the
+* log file back to the file system. Must be invoked once the last write to
+* outputFd has completed, since the file is truncated at outputFileOffset.
+*/
+void
+RuntimeLogger::releaseOutputFileSpace() {
+    if (config.fallocateChunkSize == 0 || NanoLogConfig::COMPRESSION_DAEMON)
+        return;
+
+    if (ftruncate(outputFd, outputFileOffset) != 0)
+        perror("NanoLog could not release the space reserved for the log "
+               "file");
+}
+
+/**
+* Rotates the log file on behalf of the compressionThread: the rotated log
+* files are shifted to the next suffix (dropping the oldest one beyond
+* config.rotateKeep), the log file is renamed to <outputFileName>.1 and a new
+* log file is opened in its place. The outstanding writes are waited for
+* first, so this must be invoked between writes; the logging threads are not
+* held up. The dictionary is output to the new log file anew, and the caller
+* has to start it with a Checkpoint. config.rotatedCallback is invoked last.
+*
+* \return
+*      True if the log file was rotated; false if it couldn't be renamed or
+*      the new one couldn't be opened, in which case the output continues in
+*      the old one
+*/
+bool
+RuntimeLogger::rotateLogFile() {
+    while (ioBackend->getNumOutstanding() > 0)
+        completeOutputWrite();
+
+    // Nothing more will be written to the rotated file
+    releaseOutputFileSpace();
+
+    if (config.durabilityMode == NanoLog::PERIODIC_FDATASYNC &&
+            fdatasync(outputFd) != 0)
+        perror("NanoLog could not sync the rotated log file");
+
+    // The rotated files may not all exist, so failures are ignored
+    for (uint32_t i = config.rotateKeep; i > 1; --i) {
+        std::string from = outputFileName + "." + std::to_string(i - 1);
+        std::string to = outputFileName + "." + std::to_string(i);
+        rename(from.c_str(), to.c_str());
+    }
+
+    std::string rotatedFile = outputFileName + ".1";
+    if (rename(outputFileName.c_str(), rotatedFile.c_str()) != 0) {
+        perror("NanoLog could not rotate the log file");
+        return false;
+    }
+
+    int newFd = open(outputFileName.c_str(), getOpenFlags(), 0666);
+    if (newFd < 0) {
+        perror("NanoLog could not open a new log file after rotating it");
+        if (rename(rotatedFile.c_str(), outputFileName.c_str()) != 0)
+            perror("NanoLog could not restore the rotated log file");
+        return false;
+    }
+
+    close(outputFd);
+    outputFd = newFd;
+    outputFileOffset = completedFileOffset = prepareOutputFile(newFd);
+    nextInvocationIndexToBePersisted.store(0, std::memory_order_release);
+    ++numLogFileRotations;
+
+    if (config.rotatedCallback != nullptr)
+        config.rotatedCallback(rotatedFile.c_str());
+
+    return true;
+}
+
+/**
+* Marks the compressingBuffer as being filled for the log file offset that
+* it will be written to, so that its contents can be recovered after a crash
+* (see NanoLogConfig::CRASH_RECOVERY_BUFFERS).
+*
+* \param encodedBytes
+*      Number of bytes already encoded into it (i.e. a Checkpoint)
+*/
+void
+RuntimeLogger::startRecoverableOutputBuffer(size_t encodedBytes) {
+    if (!NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+        return;
+
+    Recovery::BufferHeader *header = Recovery::getHeader(compressingBuffer);
+    header->state = Recovery::FREE;
+    header->fileOffset = outputFileOffset;
+    header->bytes = encodedBytes;
+    header->sequence = ++outputBufferSequence;
+    header->state = Recovery::FILLING;
+}
+
+/**
+* Returns a printable name for a NanoLog::DurabilityMode.
+*/
+const char *
+RuntimeLogger::getDurabilityModeName(NanoLog::DurabilityMode mode) {
+    switch (mode) {
+        case NanoLog::PAGE_CACHE:
+            return "PAGE_CACHE";
+        case NanoLog::PERIODIC_FDATASYNC:
+            return "PERIODIC_FDATASYNC";
+        case NanoLog::PERIODIC_SYNC_FILE_RANGE:
+            return "PERIODIC_SYNC_FILE_RANGE";
+        case NanoLog::DSYNC:
+            return "DSYNC";
+        case NanoLog::DIRECT_IO:
+            return "DIRECT_IO";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+* Returns the name of a WakeupPolicy, for printing.
+*
+* \param policy
+*      WakeupPolicy to name
+*/
+const char *
+RuntimeLogger::getWakeupPolicyName(NanoLog::WakeupPolicy policy) {
+    switch (policy) {
+        case NanoLog::POLL:
+            return "POLL";
+        case NanoLog::ADAPTIVE_BACKOFF:
+            return "ADAPTIVE_BACKOFF";
+        case NanoLog::BUSY_POLL:
+            return "BUSY_POLL";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+* Takes a SpillSegment from the global pool, allocating a new one if none
+* are free and the SPILL_MEMORY_LIMIT has not been reached yet. This function
+* is lock-free and may be invoked by any number of logging threads at once.
+*
+* \return
+*      An empty SpillSegment or nullptr if the memory limit has been reached
+*/
+RuntimeLogger::SpillSegment *
+RuntimeLogger::allocSpillSegment() {
+    uint64_t head = spillFreeList.load(std::memory_order_acquire);
+    while ((head & 0xFFFFFFFF) != 0) {
+        SpillSegment *segment = spillSegments[(head & 0xFFFFFFFF) - 1];
+
+        // The counter in the upper bits changes with every pop, so the
+        // exchange fails if the segment was popped (and pushed back) since
+        // nextFree was read.
+        uint64_t newHead = (((head >> 32) + 1) << 32) | segment->nextFree;
+        if (spillFreeList.compare_exchange_weak(head, newHead,
+                                                std::memory_order_acq_rel)) {
+            segment->end = nullptr;
+            segment->next = nullptr;
+            return segment;
+        }
+    }
+
+    if (numSpillSegments.load(std::memory_order_relaxed) >= MAX_SPILL_SEGMENTS)
+        return nullptr;
+
+    uint32_t index = numSpillSegments.fetch_add(1);
+    if (index >= MAX_SPILL_SEGMENTS) {
+        numSpillSegments.fetch_sub(1);
+        return nullptr;
+    }
+
+    SpillSegment *segment = new SpillSegment(index);
+    spillSegments[index] = segment;
+    return segment;
+}
+
+/**
+* Returns a SpillSegment that has been completely consumed back to the
+* global pool for reuse.
+*
+* \param segment
+*      SpillSegment to return
+*/
+void
+RuntimeLogger::freeSpillSegment(SpillSegment *segment) {
+    uint64_t head = spillFreeList.load(std::memory_order_relaxed);
+    uint64_t newHead;
+    do {
+        segment->nextFree = downCast<uint32_t>(head & 0xFFFFFFFF);
+        newHead = (head & ~0xFFFFFFFFUL) | (segment->index + 1);
+    } while (!spillFreeList.compare_exchange_weak(head, newHead,
+                                                  std::memory_order_release));
+}
+
+/**
+* Allocates the chunk of the invocation site table that holds the entries of
+* a range of identifiers. Threads that race to allocate the same chunk agree
+* on the first one installed.
+*
+* \param chunkIndex
+*      Index of the chunk in invocationSites
+*
+* \return
+*      The chunk installed at chunkIndex
+*/
+RuntimeLogger::InvocationSiteChunk *
+RuntimeLogger::allocInvocationSiteChunk(uint32_t chunkIndex) {
+    if (chunkIndex >= MAX_INVOCATION_SITE_CHUNKS) {
+        fprintf(stderr, "NanoLog Error: Too many log invocation sites "
+                        "registered (limit=%u)\r\n",
+                        MAX_INVOCATION_SITE_CHUNKS*INVOCATION_SITES_PER_CHUNK);
+        std::exit(-1);
+    }
+
+    InvocationSiteChunk *chunk = new InvocationSiteChunk();
+    InvocationSiteChunk *expected = nullptr;
+    if (!invocationSites[chunkIndex].compare_exchange_strong(expected, chunk,
+                                                std::memory_order_acq_rel)) {
+        delete chunk;
+        chunk = expected;
+    }
+
+    return chunk;
+}
+
+/**
+* Appends the log invocation sites that have been registered since the last
+* invocation to a private copy of the table. Copying stops at the first entry
+* that's still being registered, so the copy never has gaps. Each entry is
+* claimed by the one thread that registers its site, which publishes it right
+* after, so the copying is only held up briefly.
+*
+* \param dictionary
+*      Copy of the invocation site table to extend; its size indicates the
+*      next identifier to copy
+* \param limit
+*      Identifier at which to stop copying
+*/
+void
+RuntimeLogger::copyNewInvocationSites(std::vector<StaticLogInfo> &dictionary,
+                                      uint32_t limit)
+{
+    uint32_t end = std::min(limit, numInvocationSites.load());
+    for (uint32_t id = downCast<uint32_t>(dictionary.size()); id < end; ++id) {
+        uint32_t chunkIndex = id/INVOCATION_SITES_PER_CHUNK;
+        uint32_t slot = id%INVOCATION_SITES_PER_CHUNK;
+
+        if (chunkIndex >= MAX_INVOCATION_SITE_CHUNKS)
+            break;
+
+        InvocationSiteChunk *chunk =
+                invocationSites[chunkIndex].load(std::memory_order_acquire);
+        if (chunk == nullptr ||
+                !chunk->published[slot].load(std::memory_order_acquire))
+            break;
+
+        dictionary.push_back(chunk->at(slot));
+    }
+}
+
+/**
+* Assigns identifiers to the log invocation sites linked into the nanolog_sites
+* section in the order in which they appear. This gives every site in the
+* executable a deterministic identifier before it's first logged to and keeps
+* registration off the logging threads' critical path.
+*/
+void
+RuntimeLogger::registerLinkedInvocationSites() {
+    for (const LinkedInvocationSite *site = __start_nanolog_sites;
+                                        site < __stop_nanolog_sites; ++site)
+        registerInvocationSite_internal(*site->logId, *site->info);
+}
+
+/**
+* Hands a StagingBuffer that was just marked active to the compression thread,
+* which will check it on every pass until it's found empty again.
+*
+* \param sb
+*      StagingBuffer to add; it must not already be in readyBuffers
+*/
+void
+RuntimeLogger::pushReadyBuffer(StagingBuffer *sb) {
+    StagingBuffer *head = readyBuffers.load(std::memory_order_relaxed);
+    do {
+        sb->nextReady = head;
+    } while (!readyBuffers.compare_exchange_weak(head, sb));
+
+    // This is where the StagingBuffers go from empty to non-empty as far as
+    // the compression thread is concerned, so it's the only place where the
+    // logging threads ring the doorbell. The compression thread publishes
+    // that it's parked before it checks readyBuffers a last time, so one of
+    // the two sees the other.
+    if (config.wakeupPolicy == NanoLog::ADAPTIVE_BACKOFF &&
+            compressionThreadParked.load())
+        ringDoorbell();
+}
+
+/**
+* Adds a newly allocated StagingBuffer to threadBuffers and hands it to the
+* compression thread. This never blocks, so registering a thread doesn't
+* contend with the compression thread or other registering threads.
+*
+* \param sb
+*      StagingBuffer to register
+*/
+void
+RuntimeLogger::registerStagingBuffer(StagingBuffer *sb) {
+    StagingBuffer *head = threadBuffers.load(std::memory_order_relaxed);
+    do {
+        sb->nextThreadBuffer.store(head, std::memory_order_relaxed);
+    } while (!threadBuffers.compare_exchange_weak(head, sb,
+                                                  std::memory_order_release));
+
+    // New StagingBuffers start out active; let the compression
+    // thread know about it.
+    pushReadyBuffer(sb);
+}
+
+/**
+* Allocates one of the large buffers used by NanoLog (i.e. the output buffers
+* and the storage of StagingBuffers) in the way prescribed by the
+* USE_HUGE_PAGES, PREFAULT_BUFFERS and LOCK_BUFFERS options, or from a file
+* that survives a crash if CRASH_RECOVERY_BUFFERS is set (in which case
+* USE_HUGE_PAGES and numaNode don't apply). Exits the program if the memory
+* can't be allocated.
+*
+* \param bytes
+*      Size of the buffer
+* \param numaNode
+*      NUMA node to place the buffer on, or -1 for the default policy
+*
+* \return
+*      The buffer, to be released with freeBuffer()
+*/
+char *
+RuntimeLogger::allocBuffer(size_t bytes, int numaNode) {
+    void *buffer;
+    if (NanoLogConfig::CRASH_RECOVERY_BUFFERS) {
+        buffer = Recovery::mapBuffer(bytes, NanoLogConfig::PREFAULT_BUFFERS,
+                                     NanoLogConfig::LOCK_BUFFERS);
+    } else {
+        buffer = Util::allocBuffer(bytes,
+                                   NanoLogConfig::USE_HUGE_PAGES,
+                                   NanoLogConfig::PREFAULT_BUFFERS,
+                                   NanoLogConfig::LOCK_BUFFERS,
+                                   numaNode);
+    }
+
+    if (buffer == nullptr) {
+        perror("The NanoLog system was not able to allocate enough memory "
+                       "to support its operations. Quitting...\r\n");
+        std::exit(-1);
+    }
+
+    return static_cast<char*>(buffer);
+}
+
+/**
+* Releases a buffer allocated with allocBuffer().
+*
+* \param buffer
+*      Buffer to release; nullptr is ignored
+* \param bytes
+*      Size the buffer was allocated with
+*/
+void
+RuntimeLogger::freeBuffer(char *buffer, size_t bytes) {
+    if (NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+        Recovery::unmapBuffer(buffer, bytes);
+    else
+        Util::freeBuffer(buffer, bytes, NanoLogConfig::USE_HUGE_PAGES);
+}
+
+/**
+* Allocates the StagingBuffer for a new thread. It's taken from the bufferPool
+* if possible, which saves the new thread from allocating and faulting in the
+* StagingBuffer's storage. The caller must register it afterwards. Since this
+* is the first thing a thread does when it logs, it also initializes the
+* RuntimeLogger if necessary.
+*
+* \param capacity
+*      Minimum byte size of the StagingBuffer's storage
+*
+* \return
+*      A StagingBuffer owned by the calling thread
+*/
+RuntimeLogger::StagingBuffer *
+RuntimeLogger::allocStagingBuffer(uint32_t capacity) {
+    ensureInitialized();
+
+    StagingBuffer *sb = nullptr;
+    if (NanoLogConfig::STAGING_BUFFER_POOL_SIZE > 0) {
+        // The StagingBuffer at the head can't be recycled and pushed back
+        // while we're in here (see bufferPool).
+        ThreadBuffersReader reader(*this);
+        sb = bufferPool.load(std::memory_order_acquire);
+        while (sb != nullptr && !bufferPool.compare_exchange_weak(sb,
+                                sb->nextPooled, std::memory_order_acq_rel)) {
+        }
+    }
+
+    if (sb == nullptr) {
+        ++bufferPoolMisses;
+        return new StagingBuffer(nextBufferId++, capacity);
+    }
+
+    --numPooledBuffers;
+    ++bufferPoolHits;
+
+    // Log messages of the new thread must not be attributed to the old one
+    sb->id = nextBufferId++;
+    sb->initRecoveryHeader();
+    sbc.stagingBufferCreated();
+
+    // The StagingBuffer may come from a thread that ran on another node
+    if (NanoLogConfig::NUMA_LOCAL_STAGING_BUFFERS) {
+        int numaNode = Util::getNumaNode();
+        if (numaNode != sb->numaNode) {
+            Util::bindToNumaNode(sb->storage, sb->capacity, numaNode, true);
+            sb->numaNode = numaNode;
+        }
+    }
+
+    if (sb->capacity < capacity)
+        sb->resize(StagingBuffer::roundUpCapacity(capacity));
+
+    return sb;
+}
+
+/**
+* Invoked by the compression thread on a StagingBuffer of an exited thread
+* once it's drained and no ThreadBuffersReader can reach it anymore. The
+* StagingBuffer is kept in the bufferPool for a new thread, unless the pool
+* is full, in which case it's deleted.
+*
+* \param sb
+*      StagingBuffer to recycle
+*/
+void
+RuntimeLogger::recycleStagingBuffer(StagingBuffer *sb) {
+    // Only the compression thread pushes, so the count can only go down
+    // while we're in here.
+    if (numPooledBuffers.load() >= NanoLogConfig::STAGING_BUFFER_POOL_SIZE) {
+        delete sb;
+        return;
+    }
+
+    sb->recycle();
+    ++numPooledBuffers;
+
+    StagingBuffer *head = bufferPool.load(std::memory_order_relaxed);
+    do {
+        sb->nextPooled = head;
+    } while (!bufferPool.compare_exchange_weak(head, sb,
+                                               std::memory_order_release));
+}
+
+/**
+* Hands the StagingBuffer of an exited thread that the nanologd has drained to
+* the calling thread (see COMPRESSION_DAEMON). Without a compression thread to
+* retire StagingBuffers into the bufferPool, they remain in threadBuffers,
+* where the nanologd keeps them mapped, and are reused in place.
+*
+* \return
+*      A StagingBuffer owned by the calling thread, which is already
+*      registered; nullptr if there's none to reuse
+*/
+RuntimeLogger::StagingBuffer *
+RuntimeLogger::reuseDrainedStagingBuffer() {
+    ThreadBuffersReader reader(*this);
+    StagingBuffer *sb = threadBuffers.load(std::memory_order_acquire);
+    for (; sb != nullptr; sb = sb->nextThreadBuffer.load()) {
+        // The consumerMutex keeps two threads from claiming the same one
+        std::unique_lock<std::mutex> claim(sb->consumerMutex,
+                                           std::try_to_lock);
+        if (!claim.owns_lock() || !sb->shouldDeallocate)
+            continue;
+
+        Recovery::BufferHeader *header = Recovery::getHeader(sb->storage);
+        if (header->consumerOffset != header->producerOffset)
+            continue;
+
+        // Log messages of the new thread must not be attributed to the old
+        // one; the new id is published along with the reset positions.
+        logsDroppedByExitedThreads += sb->numLogsDropped;
+        sb->id = nextBufferId++;
+        sb->recycle();
+        sbc.stagingBufferCreated();
+        ++bufferPoolHits;
+        return sb;
+    }
+
+    return nullptr;
+}
+
+/**
+* Waits for the nanologd to compress the log messages that are in the
+* StagingBuffers at the time of the invocation (see COMPRESSION_DAEMON).
+*
+* \param timeoutMs
+*      Maximum number of milliseconds to wait; negative means no limit
+*
+* \return
+*      true if the log messages were compressed; false on a timeout
+*/
+bool
+RuntimeLogger::waitForDaemon(int timeoutMs) {
+    uint64_t deadline = ~0UL;
+    if (timeoutMs >= 0)
+        deadline = PerfUtils::Cycles::rdtsc() + PerfUtils::Cycles::fromSeconds(
+                                                        timeoutMs/1000.0);
+
+    ThreadBuffersReader reader(*this);
+    StagingBuffer *sb = threadBuffers.load(std::memory_order_acquire);
+    for (; sb != nullptr; sb = sb->nextThreadBuffer.load()) {
+        Recovery::BufferHeader *header = Recovery::getHeader(sb->storage);
+        uint32_t version = header->version;
+        uint64_t startConsumer = header->consumerOffset;
+        uint64_t startProducer = header->producerOffset;
+
+        // Done once the consumer has passed the producer's starting point,
+        // taking into account that either may have wrapped around since, or
+        // once the StagingBuffer was reused by another thread.
+        while (header->version == version) {
+            uint64_t consumer = header->consumerOffset;
+            if (consumer == header->producerOffset)
+                break;
+
+            if (startProducer >= startConsumer) {
+                if (consumer >= startProducer || consumer < startConsumer)
+                    break;
+            } else if (consumer >= startProducer &&
+                       consumer < startConsumer) {
+                break;
+            }
+
+            if (PerfUtils::Cycles::rdtsc() > deadline)
+                return false;
+
+            usleep(config.pollIntervalNoWorkUs);
+        }
+    }
+
+    return true;
+}
+
+/**
+* Unlinks the StagingBuffers that the compression thread has retired from
+* threadBuffers and queues them for deletion. Since the compression thread is
+* the only one to unlink StagingBuffers, it only has to synchronize with
+* producers pushing new StagingBuffers on the front of the list.
+*/
+void
+RuntimeLogger::unlinkRetiredBuffers() {
+    StagingBuffer *prev = nullptr;
+    StagingBuffer *sb = threadBuffers.load(std::memory_order_acquire);
+    while (sb != nullptr) {
+        StagingBuffer *next = sb->nextThreadBuffer.load(
+                                                std::memory_order_relaxed);
+        if (!sb->retired) {
+            prev = sb;
+            sb = next;
+            continue;
+        }
+
+        // Concurrent readers may still be at sb, so its link is left intact
+        if (prev == nullptr) {
+            StagingBuffer *head = sb;
+            if (!threadBuffers.compare_exchange_strong(head, next)) {
+                // New StagingBuffers were pushed in front of it
+                prev = head;
+                while (prev->nextThreadBuffer.load() != sb)
+                    prev = prev->nextThreadBuffer.load();
+            }
+        }
+
+        if (prev != nullptr)
+            prev->nextThreadBuffer.store(next, std::memory_order_release);
+
+        logsDroppedByExitedThreads += sb->numLogsDropped;
+        retiredBuffers.push_back(sb);
+        sb = next;
+    }
+}
+
+/**
+* Deletes the unlinked StagingBuffers once no ThreadBuffersReader can still
+* be accessing them. This is invoked by the compression thread on every pass
+* and never blocks; it takes at least two invocations to delete a
+* StagingBuffer.
+*/
+void
+RuntimeLogger::reclaimRetiredBuffers() {
+    if (!reclaimingBuffers.empty()) {
+        // Readers that entered before the epoch advanced may still be around
+        if (threadBuffersReaders[reclaimEpoch & 1].load() != 0)
+            return;
+
+        for (StagingBuffer *sb : reclaimingBuffers)
+            recycleStagingBuffer(sb);
+        reclaimingBuffers.clear();
+    }
+
+    // Readers that enter after this point can't reach the retiredBuffers
+    if (!retiredBuffers.empty()) {
+        reclaimEpoch = threadBuffersEpoch.fetch_add(1);
+        reclaimingBuffers.swap(retiredBuffers);
+    }
+}
+
+/**
+* Allocates the per-CPU StagingBuffer at an index in cpuStagingBuffers. Threads
+* that race to allocate the same one agree on the first one installed.
+*
+* \param index
+*      Index of the StagingBuffer in cpuStagingBuffers
+*
+* \return
+*      The StagingBuffer installed at index
+*/
+RuntimeLogger::CpuStagingBuffer *
+RuntimeLogger::allocCpuStagingBuffer(uint32_t index) {
+    CpuStagingBuffer *cb = new CpuStagingBuffer(index,
+                                                config.stagingBufferSize);
+    CpuStagingBuffer *expected = nullptr;
+    if (!cpuStagingBuffers[index].compare_exchange_strong(expected, cb,
+                                                std::memory_order_acq_rel)) {
+        delete cb;
+        return expected;
+    }
+
+    uint32_t end = numCpuStagingBuffers.load();
+    while (end <= index &&
+            !numCpuStagingBuffers.compare_exchange_weak(end, index + 1));
+
+    return cb;
+}
+
+/**
+* Slow path of reserveCpuAlloc() for when the per-CPU StagingBuffer is full or
+* the thread has dropped log messages that are yet to be reported. The log
+* message is dropped under DROP_ON_FULL, otherwise the thread yields to the
+* compression thread until there's enough space in the StagingBuffer of
+* whichever CPU it's running on.
+*
+* \param nbytes
+*      Number of bytes to allocate
+* \param fmtId
+*      Log identifier of the message to be stored; used to attribute the
+*      message to its invocation site should it be dropped
+*
+* \return
+*      Pointer to the allocated space or nullptr if the message was dropped
+*/
+char *
+RuntimeLogger::reserveCpuAllocSlow(size_t nbytes, uint32_t fmtId) {
+    while (true) {
+        CpuStagingBuffer *cb = getCpuStagingBuffer();
+        char *writePos = nullptr;
+        if (insertCpuDroppedLogs(cb, nbytes))
+            writePos = cb->reserveProducerSpace(nbytes, cpuThreadId,
+                                                &cpuReservation);
+
+        if (writePos != nullptr)
+            return writePos;
+
+        // Log messages that could never fit are dropped rather than blocking
+        // the thread forever.
+        if (overflowPolicy == DROP_ON_FULL ||
+                CpuStagingBuffer::getRecordSize(nbytes) > cb->capacity) {
+            recordCpuDroppedLog(cb, fmtId);
+            return nullptr;
+        }
+
+        std::this_thread::yield();
+    }
+}
+
+/**
+* Inserts a DroppedLogs record for the log messages that the calling thread
+* dropped (see cpuDroppedLogs) into a per-CPU StagingBuffer, ahead of its next
+* log message. As with the StagingBuffers of the threads, the record is only
+* inserted if the log message is likely to fit after it; otherwise a full
+* StagingBuffer could fill up with back-to-back records.
+*
+* \param cb
+*      StagingBuffer of the CPU that the thread is running on
+* \param nbytes
+*      Number of bytes of the log message that follows the record
+*
+* \return
+*      true if there are no more drops to report
+*/
+bool
+RuntimeLogger::insertCpuDroppedLogs(CpuStagingBuffer *cb, size_t nbytes) {
+    CpuDroppedLogs &drops = cpuDroppedLogs;
+    if (drops.numDropped == 0)
+        return true;
+
+    size_t recordBytes = sizeof(Log::UncompressedEntry)
+                            + sizeof(Log::DroppedLogs)
+                            + drops.numSites*sizeof(Log::DroppedLogSite);
+
+    uint64_t used = cb->producerPos.load(std::memory_order_relaxed) -
+                    cb->consumerPos.load(std::memory_order_acquire);
+    if (used + CpuStagingBuffer::getRecordSize(recordBytes) +
+            CpuStagingBuffer::getRecordSize(nbytes) > cb->capacity)
+        return false;
+
+    char *reservation;
+    char *writePos = cb->reserveProducerSpace(recordBytes, cpuThreadId,
+                                              &reservation);
+    if (writePos == nullptr)
+        return false;
+
+    auto *entry = reinterpret_cast<Log::UncompressedEntry*>(writePos);
+    entry->fmtId = Log::DROPPED_LOGS_ID;
+    entry->entrySize = downCast<uint32_t>(recordBytes);
+    entry->timestamp = drops.firstDropTimestamp;
+
+    auto *droppedLogs = reinterpret_cast<Log::DroppedLogs*>(entry->argData);
+    droppedLogs->numDropped = drops.numDropped;
+    droppedLogs->numSites = drops.numSites;
+    memcpy(droppedLogs->sites, drops.sites,
+           drops.numSites*sizeof(Log::DroppedLogSite));
+
+    CpuStagingBuffer::finishReservation(reservation, recordBytes);
+    drops.numDropped = 0;
+    drops.numSites = 0;
+    return true;
+}
+
+/**
+* Accounts for a log message that the calling thread dropped because there
+* was not enough space for it in a per-CPU StagingBuffer. The drop is reported
+* in the log by the thread's next reservation that succeeds (see
+* insertCpuDroppedLogs()).
+*
+* \param cb
+*      StagingBuffer that the log message didn't fit into
+* \param fmtId
+*      Log identifier of the message dropped
+*/
+void
+RuntimeLogger::recordCpuDroppedLog(CpuStagingBuffer *cb, uint32_t fmtId) {
+    CpuDroppedLogs &drops = cpuDroppedLogs;
+    if (drops.numDropped == 0) {
+        drops.firstDropTimestamp = PerfUtils::Cycles::rdtsc();
+        drops.numSites = 0;
+    }
+
+    ++drops.numDropped;
+    cb->numLogsDropped.fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t i = 0;
+    while (i < drops.numSites && drops.sites[i].logId != fmtId)
+        ++i;
+
+    if (i < drops.numSites) {
+        ++drops.sites[i].count;
+    } else if (drops.numSites < Util::arraySize(drops.sites)) {
+        drops.sites[i].logId = fmtId;
+        drops.sites[i].count = 1;
+        ++drops.numSites;
+    }
+}
+
+/**
+* Frees the space before a position in the queue back to the producers. This
+* may only be invoked by the consumer and only once all the records before pos
+* have been consumed.
+*
+* \param pos
+*      Position in the queue up to which the records were consumed
+*/
+void
+RuntimeLogger::CpuStagingBuffer::release(uint64_t pos) {
+    uint64_t start = consumerPos.load(std::memory_order_relaxed);
+    while (start < pos) {
+        uint64_t offset = start & (capacity - 1);
+        uint64_t length = std::min<uint64_t>(pos - start, capacity - offset);
+        memset(storage + offset, 0, length);
+        start += length;
+    }
+
+    consumerPos.store(pos, std::memory_order_release);
+}
+
+/**
+* Compresses the committed log messages in the per-CPU StagingBuffers, making
+* at most one pass through them that resumes where the last one left off. The
+* consecutive log messages of each thread are encoded as one BufferExtent with
+* the thread's id, so the compressed log looks the same as with per-thread
+* StagingBuffers. A BufferExtent never spans two StagingBuffers.
+*
+* \param encoder
+*      Encoder to compress the log messages with
+* \param dictionary
+*      Static log information of the log invocation sites registered thus far
+* \param[in/out] wrapAround
+*      Indicates that the next BufferExtent encoded starts a new pass through
+*      the StagingBuffers; it's cleared once one is encoded
+* \param[out] outputBufferFull
+*      Set to true if the encoder ran out of space
+* \param[out] foundUnfinishedRecord
+*      Set to true if a StagingBuffer had log messages left over behind a
+*      record that's still being written by its producer
+*
+* \return
+*      Number of bytes of log messages consumed
+*/
+uint64_t
+RuntimeLogger::compressCpuStagingBuffers(Log::Encoder &encoder,
+                                const std::vector<StaticLogInfo> &dictionary,
+                                bool *wrapAround,
+                                bool *outputBufferFull,
+                                bool *foundUnfinishedRecord)
+{
+    typedef CpuStagingBuffer::RecordHeader RecordHeader;
+    uint64_t bytesConsumed = 0;
+    uint32_t numBuffers = numCpuStagingBuffers.load();
+
+    for (uint32_t n = 0; n < numBuffers && !*outputBufferFull; ++n) {
+        CpuStagingBuffer *cb = cpuStagingBuffers[nextCpuStagingBuffer].load(
+                                                    std::memory_order_acquire);
+        uint64_t pos = 0;
+        uint64_t endPos = 0;
+        if (cb != nullptr) {
+            pos = cb->consumerPos.load(std::memory_order_relaxed);
+            endPos = cb->producerPos.load(std::memory_order_relaxed);
+        }
+
+        while (pos < endPos) {
+            // Gather the consecutive log messages of one thread
+            uint32_t threadId = CpuStagingBuffer::PADDING_THREAD_ID;
+            uint32_t runBytes = 0;
+            uint64_t scanPos = pos;
+            while (scanPos < endPos) {
+                RecordHeader *header = cb->getRecord(scanPos);
+                uint32_t size = header->size.load(std::memory_order_acquire);
+                if (size == 0)
+                    break;
+
+                if (header->threadId == CpuStagingBuffer::PADDING_THREAD_ID) {
+                    scanPos += size;
+                    if (runBytes == 0)
+                        pos = scanPos;
+                    continue;
+                }
+
+                if (runBytes > 0 && header->threadId != threadId)
+                    break;
+
+                auto *entry = reinterpret_cast<Log::UncompressedEntry*>(
+                                                                header + 1);
+                memcpy(cpuStagingScratch + runBytes, entry, entry->entrySize);
+                runBytes += entry->entrySize;
+                threadId = header->threadId;
+                scanPos += size;
+            }
+
+            if (runBytes == 0) {
+                if (scanPos != endPos)
+                    *foundUnfinishedRecord = true;
+                break;
+            }
+
+            uint32_t bytesEncoded = 0;
+            while (bytesEncoded < runBytes) {
+#ifdef PREPROCESSOR_NANOLOG
+                long bytesRead = encoder.encodeLogMsgs(
+                                        cpuStagingScratch + bytesEncoded,
+                                        runBytes - bytesEncoded,
+                                        threadId,
+                                        *wrapAround,
+                                        &logsProcessed);
+#else
+                long bytesRead = encoder.encodeLogMsgs(
+                                        cpuStagingScratch + bytesEncoded,
+                                        runBytes - bytesEncoded,
+                                        threadId,
+                                        *wrapAround,
+                                        dictionary,
+                                        &logsProcessed);
+#endif
+                if (bytesRead == 0) {
+                    *outputBufferFull = true;
+                    break;
+                }
+
+                *wrapAround = false;
+                bytesEncoded += downCast<uint32_t>(bytesRead);
+            }
+
+            totalBytesRead += bytesEncoded;
+            bytesConsumed += bytesEncoded;
+
+            if (bytesEncoded == runBytes) {
+                pos = scanPos;
+                continue;
+            }
+
+            // Only release the records that were encoded
+            uint32_t bytesLeft = bytesEncoded;
+            while (bytesLeft > 0) {
+                RecordHeader *header = cb->getRecord(pos);
+                if (header->threadId != CpuStagingBuffer::PADDING_THREAD_ID)
+                    bytesLeft -= reinterpret_cast<Log::UncompressedEntry*>(
+                                                    header + 1)->entrySize;
+                pos += header->size.load(std::memory_order_relaxed);
+            }
+            break;
+        }
+
+        if (cb != nullptr)
+            cb->release(pos);
+
+        // A thread's log messages in the next StagingBuffer may predate the
+        // ones just encoded (i.e. it migrated between CPUs), so they must go
+        // into a separate BufferExtent for the decompressor to sort them.
+        encoder.endExtent();
+
+        if (*outputBufferFull)
+            break;
+
+        nextCpuStagingBuffer = (nextCpuStagingBuffer + 1) % numBuffers;
+        if (nextCpuStagingBuffer == 0)
+            *wrapAround = true;
+    }
+
+    return bytesConsumed;
+}
+
+/**
+* Main compression thread that handles scanning through the StagingBuffers,
+* compressing log entries, and outputting a compressed log file.
+*/
+void
+RuntimeLogger::compressionThreadMain() {
+    // Index of the last StagingBuffer checked for uncompressed log messages
+    size_t lastStagingBufferChecked = 0;
+
+    // Marks when the thread wakes up. This value should be used to calculate
+    // the number of cyclesActive right before blocking/sleeping and then updated
+    // to the latest rdtsc() when the thread re-awakens.
+    uint64_t cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+    cycleAtThreadStart = cyclesAwakeStart;
+
+    // A sync() that the previous compression thread left unfinished is
+    // started over
+    syncPhase = SYNC_IDLE;
+
+    if (config.compressionThreadCore >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(config.compressionThreadCore, &cpuset);
+        if (sched_setaffinity(0, sizeof(cpuset), &cpuset) != 0)
+            perror("NanoLog could not pin the compression thread");
+    }
+
+    // Marks the rdtsc() of the last pass that found log messages, which the
+    // ADAPTIVE_BACKOFF wakeup policy backs off from
+    uint64_t cyclesAtLastWork = cyclesAwakeStart;
+
+    // Writing to an output sink whose reader went away should fail with
+    // EPIPE rather than raise a SIGPIPE that terminates the application.
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, nullptr);
+
+    // Manages the state associated with compressing log messages
+    Log::Encoder encoder(compressingBuffer, config.outputBufferSize, false,
+                         false, config.stagingBufferSize/2);
+    startRecoverableOutputBuffer(encoder.getEncodedBytes());
+    const uint32_t releaseThreshold = (config.releaseThreshold > 0)
+                                            ? config.releaseThreshold
+                                            : config.stagingBufferSize/2;
+
+    // Indicates whether a compression operation failed or not due
+    // to insufficient space in the outputBuffer
+    bool outputBufferFull = false;
+
+    // Indicates that in scanning the StagingBuffers, we have passed the
+    // zero-th index, but have not yet encoded that in he compressed output
+    bool wrapAround = false;
+
+    // Keeps a shadow mapping of the log identifiers to static information
+    // to allow the logging threads to register in parallel with compression
+    // lookup
+    std::vector<StaticLogInfo> shadowStaticInfo;
+
+    // Indicates that the idle StagingBuffers must be checked on the next pass
+    // since a sync() is in progress.
+    bool checkIdleBuffers = false;
+
+    const uint64_t cyclesBetweenIdleScans = PerfUtils::Cycles::fromNanoseconds(
+                        1000UL*NanoLogConfig::IDLE_BUFFER_SCAN_INTERVAL_US);
+
+    // Marks the rdtsc() when the output buffer went from empty to holding
+    // log messages that are waiting to be flushed; 0 means it's empty.
+    uint64_t cyclesAtFirstPendingOutput = 0;
+
+    const uint64_t cyclesMaxFlushDelay = PerfUtils::Cycles::fromNanoseconds(
+                        1000UL*config.flushMaxDelayUs);
+    const uint64_t cyclesSevereFlushDelay = PerfUtils::Cycles::fromNanoseconds(
+                        1000UL*config.flushLogLevelMaxDelayUs);
+
+    // Most severe LogLevel among the log messages that were appended to the
+    // output buffer from the StagingBuffers' assistBuffers (the encoder only
+    // tracks the ones it compressed itself)
+    uint8_t appendedLogLevel = NUM_LOG_LEVELS;
+
+    // State of the PERIODIC_* durability modes: the number of bytes submitted
+    // since the last fdatasync(), the rdtsc() of the last sync and the offset
+    // up to which sync_file_range() started the writeback.
+    uint64_t bytesSinceLastSync = 0;
+    uint64_t cyclesAtLastSync = PerfUtils::Cycles::rdtsc();
+    off_t syncedFileOffset = completedFileOffset;
+
+    const uint64_t cyclesSyncInterval = PerfUtils::Cycles::fromNanoseconds(
+                        1000000UL*config.syncIntervalMs);
+
+    // Offset in the log file up to which fallocate() reserved space
+    off_t reservedFileOffset = outputFileOffset;
+
+    // The log file is rotated once a write reaches rotateAtFileOffset (if
+    // config.rotateMaxBytes is set) or once it's been written to for
+    // config.rotateMaxAgeSec since cyclesAtLogFileStart (if that's set), but
+    // only if log messages were written to it, i.e. logsProcessed advanced
+    // past logsAtLogFileStart. Otherwise the Checkpoint that starts the new
+    // log file could trigger another rotation.
+    off_t rotateAtFileOffset = config.rotateMaxBytes;
+    uint64_t cyclesAtLogFileStart = PerfUtils::Cycles::rdtsc();
+    uint64_t logsAtLogFileStart = logsProcessed;
+
+    const uint64_t cyclesRotateMaxAge = PerfUtils::Cycles::fromSeconds(
+                        config.rotateMaxAgeSec);
+
+    // Each iteration of this loop scans for uncompressed log messages in the
+    // thread buffers, compresses as much as possible, and outputs it to a file.
+    // The loop will run so long as it's not shutdown or there's outstanding I/O
+    while (!compressionThreadShouldExit || encoder.getEncodedBytes() > 0
+                                        || ioBackend->getNumOutstanding() > 0)
+    {
+        coreId = sched_getcpu();
+
+        // Indicates how many bytes we have consumed from the StagingBuffers
+        // in a single iteration of the while above. A value of 0 means we
+        // were unable to consume anymore data any of the stagingBuffers
+        // (either due to empty stagingBuffers or a full output encoder)
+        uint64_t bytesConsumedThisIteration = 0;
+
+        // Indicates that a StagingBuffer was skipped in this iteration because
+        // its producer or a compression worker was working on it.
+        bool skippedClaimedBuffer = false;
+
+        // A log message at config.flushLogLevel or above was logged; its
+        // StagingBuffer may have been marked idle just before.
+        if (severeLogPending.load(std::memory_order_relaxed) &&
+                severeLogPending.exchange(false))
+            checkIdleBuffers = true;
+
+        uint64_t start = PerfUtils::Cycles::rdtsc();
+        // Step 1: Find buffers with entries and compress them
+        {
+            // Indicates that StagingBuffers were retired in this pass and need
+            // to be unlinked from threadBuffers.
+            bool buffersRetired = false;
+
+            // Pick up the StagingBuffers that were marked active since the
+            // last pass.
+            size_t numActiveBuffers = activeBuffers.size();
+            StagingBuffer *ready = readyBuffers.exchange(nullptr);
+            while (ready != nullptr) {
+                activeBuffers.push_back(ready);
+                addToShard(ready);
+                ready = ready->nextReady;
+            }
+
+            // The producers only notify us when they find their StagingBuffer
+            // marked idle, which can race with it being marked idle. So every
+            // once in a while (and before completing a sync) the idle
+            // StagingBuffers are checked for log messages we may have missed.
+            if (checkIdleBuffers ||
+                    start - cyclesAtLastIdleScan >= cyclesBetweenIdleScans) {
+                for (StagingBuffer *sb = threadBuffers.load(); sb != nullptr;
+                                        sb = sb->nextThreadBuffer.load()) {
+                    if (!sb->active.load(std::memory_order_relaxed)
+                            && sb->mayHaveWork() && sb->tryMarkActive()) {
+                        activeBuffers.push_back(sb);
+                        addToShard(sb);
+                    }
+                }
+
+                cyclesAtLastIdleScan = start;
+                checkIdleBuffers = false;
+            }
+
+            // The compression workers only go to sleep once their shards
+            // are empty, so they're only woken up for new active buffers.
+            if (activeBuffers.size() > numActiveBuffers &&
+                    config.wakeupPolicy == NanoLog::ADAPTIVE_BACKOFF)
+                ringWorkerDoorbell();
+
+            size_t i = lastStagingBufferChecked;
+
+            // Number of activeBuffers left to check in this pass. It's
+            // counted rather than inferred from i since activeBuffers
+            // shrinks during the pass.
+            size_t buffersLeftToCheck = activeBuffers.size();
+
+            // Output new dictionary entries, if necessary
+            copyNewInvocationSites(shadowStaticInfo, UINT32_MAX);
+            uint32_t nextToPersist = nextInvocationIndexToBePersisted.load(
+                                                    std::memory_order_relaxed);
+            if (nextToPersist < shadowStaticInfo.size())
+            {
+                encoder.encodeNewDictionaryEntries(nextToPersist,
+                                                   shadowStaticInfo);
+                nextInvocationIndexToBePersisted.store(nextToPersist,
+                                                    std::memory_order_release);
+            }
+
+            // Scan through the activeBuffers looking for log messages to
+            // compress while the output buffer is not full.
+            while (!outputBufferFull && buffersLeftToCheck > 0)
+            {
+                uint64_t peekBytes = 0;
+                char *peekPosition = nullptr;
+                StagingBuffer *sb = activeBuffers[i];
+
+                // If the producer is compressing its own backlog, skip it
+                std::unique_lock<std::mutex> claim(sb->consumerMutex,
+                                                   std::try_to_lock);
+                if (claim.owns_lock()) {
+                    // Whatever the producer or a compression worker has
+                    // compressed precedes what's left in the StagingBuffer,
+                    // so output it first.
+                    size_t assistBytes = (sb->assistEncoder == nullptr) ? 0 :
+                                        sb->assistEncoder->getEncodedBytes();
+                    if (assistBytes > 0) {
+                        if (!encoder.appendExtents(sb->assistBuffer,
+                                                   assistBytes)) {
+                            lastStagingBufferChecked = i;
+                            outputBufferFull = true;
+                            break;
+                        }
+
+                        appendedLogLevel = std::min(appendedLogLevel,
+                                sb->assistEncoder->getMostSevereLogLevel());
+                        sb->assistEncoder->swapBuffer(sb->assistBuffer,
+                                                      sb->assistBufferSize);
+                        logsProcessed += sb->assistLogsPending;
+                        totalBytesRead += sb->assistBytesPending;
+                        bytesConsumedThisIteration += sb->assistBytesPending;
+                        sb->assistLogsPending = 0;
+                        sb->assistBytesPending = 0;
+                    }
+
+                    peekPosition = sb->peek(&peekBytes);
+                    sb->trimAssistBuffer();
+                } else {
+                    skippedClaimedBuffer = true;
+                }
+
+                // If there's work, perform it
+                if (peekBytes > 0) {
+                    uint64_t start = PerfUtils::Cycles::rdtsc();
+
+                    // Record metrics on the peek size
+                    size_t sizeOfDist = Util::arraySize(stagingBufferPeekDist);
+                    size_t distIndex = (sizeOfDist*peekBytes)/
+                                                    config.stagingBufferSize;
+                    ++(stagingBufferPeekDist[distIndex]);
+
+
+                    // Encode the data in RELEASE_THRESHOLD chunks
+                    uint32_t remaining = downCast<uint32_t>(peekBytes);
+                    while (remaining > 0) {
+                        long bytesToEncode = std::min(releaseThreshold,
+                                                      remaining);
+#ifdef PREPROCESSOR_NANOLOG
+                        long bytesRead = encoder.encodeLogMsgs(
+                                peekPosition + (peekBytes - remaining),
+                                bytesToEncode,
+                                sb->getId(),
+                                wrapAround,
+                                &logsProcessed);
+#else
+                        long bytesRead = encoder.encodeLogMsgs(
+                                peekPosition + (peekBytes - remaining),
+                                bytesToEncode,
+                                sb->getId(),
+                                wrapAround,
+                                shadowStaticInfo,
+                                &logsProcessed);
+#endif
+
+
+                        if (bytesRead == 0) {
+                            lastStagingBufferChecked = i;
+                            outputBufferFull = true;
+                            break;
+                        }
+
+                        wrapAround = false;
+                        remaining -= downCast<uint32_t>(bytesRead);
+
+                        // The log messages must be recoverable from the
+                        // output buffer before they're released
+                        if (NanoLogConfig::CRASH_RECOVERY_BUFFERS) {
+                            Fence::sfence();
+                            Recovery::getHeader(compressingBuffer)->bytes =
+                                                encoder.getEncodedBytes();
+                        }
+
+                        sb->consume(bytesRead);
+                        totalBytesRead += bytesRead;
+                        bytesConsumedThisIteration += bytesRead;
+                    }
+                    cyclesCompressing += PerfUtils::Cycles::rdtsc() - start;
+                } else if (claim.owns_lock()) {
+                    // If there's no work, check if we're supposed to delete
+                    // the stagingBuffer. Otherwise, mark it idle so that we
+                    // stop checking it until its producer logs again.
+                    bool stillActive = false;
+                    if (sb->checkCanDelete()) {
+                        sb->retired = true;
+                        buffersRetired = true;
+                    } else {
+                        // The producer may have logged before it could see
+                        // the flag cleared, so check again. If it did, and
+                        // it didn't notify us, the buffer stays active.
+                        sb->idleSince = PerfUtils::Cycles::rdtsc();
+                        sb->active = false;
+                        sb->peek(&peekBytes);
+                        stillActive = (peekBytes > 0 && sb->tryMarkActive());
+                    }
+
+                    if (!stillActive) {
+                        activeBuffers.erase(activeBuffers.begin() + i);
+                        removeFromShard(sb);
+                        if (activeBuffers.empty()) {
+                            lastStagingBufferChecked = i = 0;
+                            wrapAround = true;
+                            break;
+                        }
+
+                        // Back up the index so that we don't skip the buffer
+                        // that took its place
+                        --i;
+                    }
                 }
+
+                i = (i + 1) % activeBuffers.size();
+
+                if (i == 0)
+                    wrapAround = true;
+
+                // Completed a full pass through the buffers; the next one
+                // resumes where this one left off.
+                if (--buffersLeftToCheck == 0 && !outputBufferFull)
+                    lastStagingBufferChecked = i;
+            }
+
+            // A record that's still being written holds up the ones behind
+            // it in a per-CPU StagingBuffer, so it's treated like a claimed
+            // StagingBuffer.
+            if (NanoLogConfig::PER_CPU_STAGING_BUFFERS && !outputBufferFull) {
+                uint64_t start = PerfUtils::Cycles::rdtsc();
+                bytesConsumedThisIteration += compressCpuStagingBuffers(
+                                                    encoder,
+                                                    shadowStaticInfo,
+                                                    &wrapAround,
+                                                    &outputBufferFull,
+                                                    &skippedClaimedBuffer);
+                cyclesCompressing += PerfUtils::Cycles::rdtsc() - start;
             }
 
-            // Finishing up the IO
-            int err = aio_error(&aioCb);
-            ssize_t ret = aio_return(&aioCb);
+            if (buffersRetired)
+                unlinkRetiredBuffers();
+            reclaimRetiredBuffers();
+
+            cyclesScanningAndCompressing += PerfUtils::Cycles::rdtsc() - start;
+        }
+
+        if (bytesConsumedThisIteration > 0)
+            cyclesAtLastWork = start;
+
+        // If there's no data to output, go to sleep.
+        if (encoder.getEncodedBytes() == 0) {
+            std::unique_lock<std::mutex> lock(condMutex);
 
-            if (err != 0) {
-                fprintf(stderr, "LogCompressor's POSIX AIO failed"
-                        " with %d: %s\r\n", err, strerror(err));
-            } else if (ret < 0) {
-                perror("LogCompressor's Posix AIO Write failed");
+            // If a sync was requested, we should make at least 1 more
+            // pass to make sure we got everything up to the sync point. The
+            // ones requested later have to wait for the next pass.
+            if (syncPhase == SYNC_IDLE && syncRequested > syncCompleted) {
+                syncInProgress = syncRequested;
+                syncPhase = PERFORMING_SECOND_PASS;
+                checkIdleBuffers = true;
+                continue;
             }
-            ++numAioWritesCompleted;
-            hasOutstandingOperation = false;
-            cyclesDiskIO_upperBound += (start - cyclesAtLastAIOStart);
-
-            // We've completed an AIO, check if we need to notify
-            if (syncStatus == WAITING_ON_AIO) {
-                std::unique_lock<std::mutex> lock(nanoLogSingleton.condMutex);
-                if (syncStatus == WAITING_ON_AIO) {
-                    syncStatus = SYNC_COMPLETED;
-                    hintSyncCompleted.notify_one();
-                }
+
+            // A skipped buffer may still hold log messages from before the
+            // sync point, so the second pass has to be redone.
+            if (syncPhase == PERFORMING_SECOND_PASS && skippedClaimedBuffer) {
+                checkIdleBuffers = true;
+                continue;
+            }
+
+            if (syncPhase == PERFORMING_SECOND_PASS) {
+                if (ioBackend->getNumOutstanding() > 0)
+                    syncPhase = WAITING_ON_AIO;
+                else
+                    completeSync(lock);
+            }
+
+            // What the compression workers compress stays in active
+            // StagingBuffers until it's output, so they don't need watching.
+            bool mayPark = activeBuffers.empty() &&
+                    ioBackend->getNumOutstanding() == 0 &&
+                    syncPhase == SYNC_IDLE &&
+                    !NanoLogConfig::PER_CPU_STAGING_BUFFERS;
+            waitForWork(lock, PerfUtils::Cycles::rdtsc() - cyclesAtLastWork,
+                        mayPark, &cyclesAwakeStart);
+        }
+
+        // Retire the writes that have completed, freeing their buffers
+        while (ioBackend->isWriteComplete())
+            completeOutputWrite();
+
+        // PERIODIC_SYNC_FILE_RANGE starts the writeback of what the completed
+        // writes left in the page cache once it's due. PERIODIC_FDATASYNC
+        // links its fdatasync() to the next write (see below), or to an empty
+        // one if no output comes in time.
+        uint64_t cyclesSinceLastSync = PerfUtils::Cycles::rdtsc() -
+                                                            cyclesAtLastSync;
+        if (config.durabilityMode == NanoLog::PERIODIC_SYNC_FILE_RANGE) {
+            off_t unsyncedBytes = completedFileOffset - syncedFileOffset;
+            if (unsyncedBytes > 0 &&
+                    (unsyncedBytes >= config.syncIntervalBytes ||
+                     cyclesSinceLastSync >= cyclesSyncInterval)) {
+                if (sync_file_range(outputFd, syncedFileOffset, unsyncedBytes,
+                                    SYNC_FILE_RANGE_WRITE) != 0)
+                    perror("LogCompressor's sync_file_range failed");
+
+                syncedFileOffset = completedFileOffset;
+                cyclesAtLastSync = PerfUtils::Cycles::rdtsc();
+                ++numPeriodicSyncs;
+            }
+        } else if (config.durabilityMode == NanoLog::PERIODIC_FDATASYNC &&
+                bytesSinceLastSync > 0 &&
+                cyclesSinceLastSync >= cyclesSyncInterval &&
+                ioBackend->getNumOutstanding() <
+                                            ioBackend->getMaxOutstanding()) {
+            if (ioBackend->getNumOutstanding() == 0)
+                cyclesAtLastAIOStart = PerfUtils::Cycles::rdtsc();
+            if (ioBackend->submitWrite(outputFd, compressingBuffer, 0,
+                                       outputFileOffset, true)) {
+                bytesSinceLastSync = 0;
+                cyclesAtLastSync = PerfUtils::Cycles::rdtsc();
+                ++numPeriodicSyncs;
             }
         }
 
-        // If we reach this point in the code, it means that all AIO operations
-        // have completed and the double buffer is now free. We'll check if
-        // we need to start a new AIO.
+        // Output holding a log message at config.flushLogLevel, or one that a
+        // sync() waits on, is needed right away.
         ssize_t bytesToWrite = encoder.getEncodedBytes();
+        uint64_t now = PerfUtils::Cycles::rdtsc();
+        if (bytesToWrite > 0 && cyclesAtFirstPendingOutput == 0)
+            cyclesAtFirstPendingOutput = now;
+
+        uint8_t mostSevereLogLevel = std::min(appendedLogLevel,
+                                            encoder.getMostSevereLogLevel());
+        bool severityFlush = bytesToWrite > 0 &&
+                mostSevereLogLevel <= config.flushLogLevel &&
+                now - cyclesAtFirstPendingOutput >= cyclesSevereFlushDelay;
+        bool syncFlush = bytesToWrite > 0 &&
+                (syncPhase != SYNC_IDLE || syncRequested > syncCompleted);
+
+        // While the disk is busy, keep batching log messages into the current
+        // output buffer until it's full, unless they're needed right away and
+        // there's a free output buffer to continue in.
+        bool urgentFlush = (severityFlush || syncFlush) &&
+                ioBackend->getNumOutstanding() < ioBackend->getMaxOutstanding();
+        if (ioBackend->getNumOutstanding() > 0 && !outputBufferFull &&
+                !urgentFlush) {
+            // If there's no new data, go to sleep.
+            if (bytesConsumedThisIteration == 0 &&
+                config.pollIntervalDuringIoUs > 0 &&
+                config.wakeupPolicy != NanoLog::BUSY_POLL)
+            {
+                std::unique_lock<std::mutex> lock(condMutex);
+                if (!severeLogPending.load(std::memory_order_relaxed)) {
+                    cyclesActive += PerfUtils::Cycles::rdtsc() -
+                                                            cyclesAwakeStart;
+                    workAdded.wait_for(lock, std::chrono::microseconds(
+                            config.pollIntervalDuringIoUs));
+                    cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+                }
+            }
+
+            while (ioBackend->isWriteComplete())
+                completeOutputWrite();
+
+            if (ioBackend->getNumOutstanding() > 0)
+                continue;
+        }
+
+        // If we reach this point in the code, the output buffer should be
+        // handed off to the disk. That requires a free buffer to continue in,
+        // so if all the others are in flight, wait for the oldest write.
         if (bytesToWrite == 0)
             continue;
 
+        // Coalesce small outputs into fewer, larger writes unless the output
+        // is needed right away.
+        bool flushNow = outputBufferFull
+                || static_cast<size_t>(bytesToWrite) >= config.flushMinBytes
+                || now - cyclesAtFirstPendingOutput >= cyclesMaxFlushDelay
+                || severityFlush
+                || syncFlush
+                || compressionThreadShouldExit;
+        if (!flushNow) {
+            if (bytesConsumedThisIteration == 0 &&
+                    config.wakeupPolicy != NanoLog::BUSY_POLL) {
+                std::unique_lock<std::mutex> lock(condMutex);
+                if (!severeLogPending.load(std::memory_order_relaxed)) {
+                    cyclesActive += now - cyclesAwakeStart;
+                    workAdded.wait_for(lock, std::chrono::microseconds(
+                            config.pollIntervalNoWorkUs));
+                    cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+                }
+            }
+
+            continue;
+        }
+
+        if (ioBackend->getNumOutstanding() == ioBackend->getMaxOutstanding()) {
+            cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
+            completeOutputWrite();
+            cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+        }
+
         // Pad the output if necessary
-        if (NanoLogConfig::FILE_PARAMS & O_DIRECT) {
+        if (getOpenFlags() & O_DIRECT) {
             ssize_t bytesOver = bytesToWrite % 512;
 
             if (bytesOver != 0) {
-                memset(compressingBuffer, 0, 512 - bytesOver);
+                memset(compressingBuffer + bytesToWrite, 0, 512 - bytesOver);
                 bytesToWrite = bytesToWrite + 512 - bytesOver;
                 padBytesWritten += (512 - bytesOver);
             }
         }
 
-        aioCb.aio_fildes = outputFd;
-        aioCb.aio_buf = compressingBuffer;
-        aioCb.aio_nbytes = bytesToWrite;
         totalBytesWritten += bytesToWrite;
+        reserveOutputFileSpace(outputFileOffset + bytesToWrite,
+                               &reservedFileOffset);
+
+        if (severityFlush)
+            ++numSeverityFlushes;
+
+        // Severe log messages are made durable right away
+        bool datasync = false;
+        if (config.durabilityMode == NanoLog::PERIODIC_FDATASYNC) {
+            bytesSinceLastSync += bytesToWrite;
+            datasync = severityFlush ||
+                    bytesSinceLastSync >= config.syncIntervalBytes ||
+                    PerfUtils::Cycles::rdtsc() - cyclesAtLastSync >=
+                                                        cyclesSyncInterval;
+        }
 
-        cyclesAtLastAIOStart = PerfUtils::Cycles::rdtsc();
-        if (aio_write(&aioCb) == -1)
-            fprintf(stderr, "Error at aio_write(): %s\n", strerror(errno));
+        if (NanoLogConfig::CRASH_RECOVERY_BUFFERS) {
+            Recovery::BufferHeader *header =
+                                    Recovery::getHeader(compressingBuffer);
+            header->bytes = bytesToWrite;
+            header->state = Recovery::WRITING;
+        }
+
+        if (ioBackend->getNumOutstanding() == 0)
+            cyclesAtLastAIOStart = PerfUtils::Cycles::rdtsc();
+        if (ioBackend->submitWrite(outputFd, compressingBuffer, bytesToWrite,
+                                   outputFileOffset, datasync)) {
+            outputFileOffset += bytesToWrite;
+            if (datasync) {
+                bytesSinceLastSync = 0;
+                cyclesAtLastSync = PerfUtils::Cycles::rdtsc();
+                ++numPeriodicSyncs;
+            }
+        } else {
+            fprintf(stderr, "Error at %s write submission: %s\n",
+                    ioBackend->getName(), strerror(errno));
+        }
 
-        hasOutstandingOperation = true;
+        // The output sink consumes the buffer while the write is in flight
+        if (config.outputSink != nullptr) {
+            if (!config.outputSink->write(compressingBuffer, bytesToWrite))
+                ++numSinkWriteFailures;
+            sinkBytesWritten += bytesToWrite;
+        }
 
-        // Swap buffers
-        encoder.swapBuffer(outputDoubleBuffer,
-                           NanoLogConfig::OUTPUT_BUFFER_SIZE);
-        std::swap(outputDoubleBuffer, compressingBuffer);
+        // Continue in the next buffer of the ring; it's free since the
+        // writes are retired in order and at most numOutputBuffers - 1 of
+        // them are in flight.
+        compressingBufferIndex = (compressingBufferIndex + 1) %
+                                                    config.numOutputBuffers;
+        compressingBuffer = outputBuffers[compressingBufferIndex];
+        encoder.swapBuffer(compressingBuffer, config.outputBufferSize);
+        startRecoverableOutputBuffer(0);
         outputBufferFull = false;
+        cyclesAtFirstPendingOutput = 0;
+        appendedLogLevel = NUM_LOG_LEVELS;
+
+        // Rotate the log file at this buffer boundary if it's due. Nothing
+        // has been encoded for the new log file yet, so it can start with a
+        // fresh Checkpoint, and the next pass outputs the dictionary again.
+        bool rotateNow = logsProcessed > logsAtLogFileStart &&
+                ((config.rotateMaxBytes > 0 &&
+                        outputFileOffset >= rotateAtFileOffset) ||
+                 (config.rotateMaxAgeSec > 0 &&
+                        PerfUtils::Cycles::rdtsc() - cyclesAtLogFileStart >=
+                                                        cyclesRotateMaxAge));
+        if (rotateNow) {
+            cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
+            if (rotateLogFile()) {
+                encoder = Log::Encoder(compressingBuffer,
+                                       config.outputBufferSize, false, false,
+                                       config.stagingBufferSize/2);
+                startRecoverableOutputBuffer(encoder.getEncodedBytes());
+                bytesSinceLastSync = 0;
+                syncedFileOffset = completedFileOffset;
+                reservedFileOffset = outputFileOffset;
+            }
+            cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+
+            // A failed rotation is only retried once it's due again
+            rotateAtFileOffset = outputFileOffset + config.rotateMaxBytes;
+            cyclesAtLogFileStart = cyclesAwakeStart;
+            logsAtLogFileStart = logsProcessed;
+        }
     }
 
     cycleAtThreadStart = 0;
     cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
 }
 
+/**
+* Main loop of a compression worker, which offloads the compression of log
+* messages from the compressionThread (see compressShard()). It runs until
+* compressionWorkersShouldExit is set.
+*
+* \param workerId
+*      Identifies the shard of StagingBuffers the worker is responsible for
+*/
+void
+RuntimeLogger::compressionWorkerMain(uint32_t workerId) {
+    uint64_t cyclesAtLastWork = PerfUtils::Cycles::rdtsc();
+    uint32_t pauses = 1;
+    while (!compressionWorkersShouldExit) {
+        uint64_t bytesConsumed = compressShard(workerId);
+
+        uint64_t now = PerfUtils::Cycles::rdtsc();
+        if (bytesConsumed > 0)
+            cyclesAtLastWork = now;
+        else
+            waitForShardWork(now - cyclesAtLastWork, &pauses);
+    }
+}
+
+/**
+* Makes one pass through a compression worker's WorkerShard and compresses the
+* backlog of its StagingBuffers into their assist space, from where the
+* compressionThread outputs it. If there was nothing to compress in the shard,
+* the worker steals work from the other shards instead, one at a time.
+* Buffers that are being worked on by someone else are skipped.
+*
+* \param workerId
+*      Index of the worker and its shard in workerShards
+*
+* \return
+*      Number of bytes consumed from the StagingBuffers
+*/
+uint64_t
+RuntimeLogger::compressShard(uint32_t workerId) {
+    uint64_t bytesConsumed = 0;
+    uint64_t logsCompressed = 0;
+    std::vector<StagingBuffer*> &snapshot = workerShards[workerId]->snapshot;
+
+    // The StagingBuffers in the snapshot can't be deleted until the reader
+    // exits, even if they're retired and removed from their shard meanwhile.
+    ThreadBuffersReader reader(*this);
+    for (size_t n = 0; n < workerShards.size() && bytesConsumed == 0; ++n) {
+        WorkerShard *shard = workerShards[(workerId + n) % workerShards.size()];
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            snapshot = shard->buffers;
+        }
+
+        for (StagingBuffer *sb : snapshot) {
+            // Idle buffers are empty (see compressionThreadMain)
+            if (!sb->active.load(std::memory_order_relaxed))
+                continue;
+
+            std::unique_lock<std::mutex> claim(sb->consumerMutex,
+                                               std::try_to_lock);
+            if (!claim.owns_lock())
+                continue;
+
+            bytesConsumed += sb->compressBacklog(&logsCompressed);
+        }
+    }
+
+    logsCompressedByWorkers += logsCompressed;
+    return bytesConsumed;
+}
+
+/**
+* Adds a StagingBuffer that the compression thread added to activeBuffers to
+* the WorkerShard its id maps to (if there are compression workers).
+*
+* \param sb
+*      StagingBuffer to add; it must not already be in a shard
+*/
+void
+RuntimeLogger::addToShard(StagingBuffer *sb) {
+    if (workerShards.empty())
+        return;
+
+    WorkerShard *shard = workerShards[sb->getId() % workerShards.size()];
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    shard->buffers.push_back(sb);
+}
+
+/**
+* Removes a StagingBuffer that the compression thread removed from
+* activeBuffers from its WorkerShard (if there are compression workers).
+*
+* \param sb
+*      StagingBuffer to remove
+*/
+void
+RuntimeLogger::removeFromShard(StagingBuffer *sb) {
+    if (workerShards.empty())
+        return;
+
+    WorkerShard *shard = workerShards[sb->getId() % workerShards.size()];
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    std::vector<StagingBuffer*> &buffers = shard->buffers;
+    buffers.erase(std::remove(buffers.begin(), buffers.end(), sb),
+                  buffers.end());
+}
+
+/**
+* Returns true if none of the WorkerShards holds a StagingBuffer, i.e. none
+* of them may have work for the compression workers.
+*/
+bool
+RuntimeLogger::shardsEmpty() {
+    for (WorkerShard *shard : workerShards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        if (!shard->buffers.empty())
+            return false;
+    }
+
+    return true;
+}
+
+/**
+* Wakes up the compression workers that are asleep on the workerDoorbell (see
+* waitForShardWork()). Bumping the doorbell also makes the ones about to fall
+* asleep skip the sleep.
+*/
+void
+RuntimeLogger::ringWorkerDoorbell() {
+    workerDoorbell.fetch_add(1);
+    if (numWorkersParked.load() > 0) {
+        syscall(SYS_futex, &workerDoorbell, FUTEX_WAKE_PRIVATE, INT_MAX,
+                nullptr, nullptr, 0);
+    }
+}
+
+/**
+* Invoked by a compression worker when a pass through the WorkerShards found
+* nothing to compress, to wait for more the way config.wakeupPolicy says.
+* With ADAPTIVE_BACKOFF, the worker sleeps on the workerDoorbell once all the
+* shards are empty (for up to NanoLogConfig::BACKOFF_MAX_SLEEP_US); until
+* then, log messages can show up in the StagingBuffers in them at any time,
+* so it waits like with POLL.
+*
+* \param cyclesIdle
+*      How long the worker has found nothing to compress for
+* \param[in/out] pauses
+*      The worker's state for backOff()
+*/
+void
+RuntimeLogger::waitForShardWork(uint64_t cyclesIdle, uint32_t *pauses) {
+    if (config.wakeupPolicy == NanoLog::BUSY_POLL)
+        return;
+
+    if (config.wakeupPolicy == NanoLog::ADAPTIVE_BACKOFF) {
+        if (backOff(cyclesIdle, pauses))
+            return;
+
+        // The doorbell is read before the shards are checked, so a
+        // StagingBuffer added after the check also bumps it past the ticket.
+        uint32_t ticket = workerDoorbell.load();
+        numWorkersParked.fetch_add(1);
+        bool sleep = !compressionWorkersShouldExit && shardsEmpty();
+        if (sleep) {
+            struct timespec timeout;
+            timeout.tv_sec = NanoLogConfig::BACKOFF_MAX_SLEEP_US/1000000;
+            timeout.tv_nsec = 1000L*(NanoLogConfig::BACKOFF_MAX_SLEEP_US
+                                                                % 1000000);
+            ++numWorkerDoorbellSleeps;
+            syscall(SYS_futex, &workerDoorbell, FUTEX_WAIT_PRIVATE, ticket,
+                    &timeout, nullptr, 0);
+        }
+        numWorkersParked.fetch_sub(1);
+
+        if (sleep)
+            return;
+    }
+
+    std::this_thread::sleep_for(std::chrono::microseconds(
+            config.pollIntervalNoWorkUs));
+}
+
 // Documentation in NanoLog.h
 void
 RuntimeLogger::setLogFile_internal(const char *filename) {
@@ -639,7 +2703,7 @@ RuntimeLogger::setLogFile_internal(const char *filename) {
     }
 
     // Try to open the file
-    int newFd = open(filename, NanoLogConfig::FILE_PARAMS, 0666);
+    int newFd = open(filename, getOpenFlags(), 0666);
     if (newFd < 0) {
         std::string err = "Unable to open file new log file: '";
         err.append(filename);
@@ -648,84 +2712,380 @@ RuntimeLogger::setLogFile_internal(const char *filename) {
         throw std::ios_base::failure(err);
     }
 
-    // Everything seems okay, stop the background thread and change files
-    sync();
+    // Nothing was logged yet, so start right away with the new file
+    if (initialize(newFd, filename))
+        return;
+
+    // Everything seems okay, stop the background thread and change files
+    std::lock_guard<std::mutex> initLock(initMutex);
+    sync();
+
+    // The nanologd switches files once it sees the new one recorded
+    if (NanoLogConfig::COMPRESSION_DAEMON) {
+        if (outputFd > 0)
+            close(outputFd);
+        outputFd = newFd;
+        outputFileName = filename;
+        Recovery::recordLogFile(filename);
+        return;
+    }
+
+    // Stop the compression thread completely
+    {
+        std::lock_guard<std::mutex> lock(nanoLogSingleton.condMutex);
+        compressionThreadShouldExit = true;
+        wakeCompressionThread();
+    }
+
+    if (compressionThread.joinable())
+        compressionThread.join();
+
+    if (outputFd > 0) {
+        releaseOutputFileSpace();
+        close(outputFd);
+    }
+    outputFd = newFd;
+    outputFileName = filename;
+    outputFileOffset = completedFileOffset = prepareOutputFile(newFd);
+    if (NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+        Recovery::recordLogFile(filename);
+
+    // Relaunch thread
+    nextInvocationIndexToBePersisted = 0; // Reset the dictionary
+    compressionThreadShouldExit = false;
+#ifndef BENCHMARK_DISCARD_ENTRIES_AT_STAGINGBUFFER
+    compressionThread = std::thread(&RuntimeLogger::compressionThreadMain, this);
+#endif
+}
+
+/**
+* Set where the NanoLog should output its compressed log. If a previous
+* log file was specified, NanoLog will attempt to sync() the remaining log
+* entries before swapping files. For best practices, the output file shall
+* be set before the first invocation to log by the main thread as this
+* function is *not* thread safe.
+*
+* By default, the NanoLog will output to NanoLogConfig::DEFAULT_LOG_FILE,
+* which is only opened if no other file was set before the first log message.
+*
+* \param filename
+*      File for NanoLog to output the compress log
+*
+* \throw is_base::failure
+*      if the file cannot be opened or crated
+*/
+void
+RuntimeLogger::setLogFile(const char *filename) {
+    nanoLogSingleton.setLogFile_internal(filename);
+}
+
+/**
+* Sets the minimum log level new NANO_LOG messages will have to meet before
+* they are saved. Anything lower will be dropped.
+*
+* \param logLevel
+*      LogLevel enum that specifies the minimum log level.
+*/
+void
+RuntimeLogger::setLogLevel(LogLevel logLevel) {
+    if (logLevel < 0)
+        logLevel = static_cast<LogLevel>(0);
+    else if (logLevel >= NUM_LOG_LEVELS)
+        logLevel = static_cast<LogLevel>(NUM_LOG_LEVELS - 1);
+    nanoLogSingleton.currentLogLevel = logLevel;
+}
+
+/**
+* Sets whether threads logging to a full StagingBuffer should block until
+* space frees up or drop the log message (see OverflowPolicy in NanoLog.h).
+*
+* \param policy
+*      OverflowPolicy enum that specifies the new behavior
+*/
+void
+RuntimeLogger::setOverflowPolicy(OverflowPolicy policy) {
+    nanoLogSingleton.overflowPolicy = policy;
+}
+
+/**
+* Blocks until the NanoLog system is able to persist to disk the
+* pending log messages that occurred before this invocation. Note that this
+* operation has similar behavior to a "non-quiescent checkpoint" in a
+* database which means log messages occurring after this point this
+* invocation may also be persisted in a multi-threaded system.
+*/
+void
+RuntimeLogger::sync() {
+    nanoLogSingleton.waitForSync(-1);
+}
+
+/**
+* Like sync(), but gives up waiting after a timeout. The log messages are
+* still persisted after it returns.
+*
+* \param timeoutMs
+*      Maximum time to wait for in milliseconds
+*
+* \return
+*      True if the log messages were persisted; false if the time ran out
+*/
+bool
+RuntimeLogger::syncFor(uint32_t timeoutMs) {
+    return nanoLogSingleton.waitForSync(static_cast<int>(
+                        std::min<uint32_t>(timeoutMs, INT32_MAX)));
+}
+
+/**
+* Requests a sync() without waiting for it. The callback is invoked by the
+* compression thread once the log messages that occurred before this
+* invocation are persisted, so it should return quickly and must not wait
+* for another sync(). It's invoked right away if nothing could have been
+* logged yet.
+*
+* \param callback
+*      Invoked once the sync completes
+*/
+void
+RuntimeLogger::syncAsync(std::function<void()> callback) {
+#ifdef BENCHMARK_DISCARD_ENTRIES_AT_STAGINGBUFFER
+    callback();
+    return;
+#endif
+
+    if (!nanoLogSingleton.initialized.load(std::memory_order_acquire)) {
+        callback();
+        return;
+    }
+
+    // There's no compression thread to invoke the callback, so a thread of
+    // its own waits for the nanologd instead.
+    if (NanoLogConfig::COMPRESSION_DAEMON) {
+        std::thread([callback]() {
+            nanoLogSingleton.waitForDaemon(-1);
+            callback();
+        }).detach();
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(nanoLogSingleton.condMutex);
+    uint64_t sequence = ++nanoLogSingleton.syncRequested;
+    nanoLogSingleton.syncCallbacks.emplace_back(sequence, std::move(callback));
+    nanoLogSingleton.wakeCompressionThread();
+}
+
+/**
+* Requests a sync() without waiting for it (see syncAsync(callback)).
+*
+* \return
+*      A future that becomes ready once the sync completes
+*/
+std::future<void>
+RuntimeLogger::syncAsync() {
+    std::shared_ptr<std::promise<void>> promise =
+                                    std::make_shared<std::promise<void>>();
+    std::future<void> future = promise->get_future();
+    syncAsync([promise]() { promise->set_value(); });
+    return future;
+}
+
+/**
+* Requests a sync() and waits for it to complete, i.e. until the compression
+* thread made its second pass after the request and the writes are done.
+* The waiting threads are all woken up at once, and each checks whether its
+* own request was completed, so none can miss its wakeup.
+*
+* \param timeoutMs
+*      Maximum time to wait for in milliseconds; -1 to wait for as long as
+*      it takes
+*
+* \return
+*      True if the sync completed; false if the time ran out
+*/
+bool
+RuntimeLogger::waitForSync(int timeoutMs) {
+#ifdef BENCHMARK_DISCARD_ENTRIES_AT_STAGINGBUFFER
+    return true;
+#endif
+
+    // Nothing could have been logged yet
+    if (!initialized.load(std::memory_order_acquire))
+        return true;
 
-    // Stop the compression thread completely
-    {
-        std::lock_guard<std::mutex> lock(nanoLogSingleton.condMutex);
-        compressionThreadShouldExit = true;
-        workAdded.notify_all();
+    if (NanoLogConfig::COMPRESSION_DAEMON)
+        return waitForDaemon(timeoutMs);
+
+    std::unique_lock<std::mutex> lock(condMutex);
+    uint64_t sequence = ++syncRequested;
+    wakeCompressionThread();
+
+    auto completed = [this, sequence]() { return syncCompleted >= sequence; };
+    if (timeoutMs < 0) {
+        hintSyncCompleted.wait(lock, completed);
+        return true;
     }
 
-    if (compressionThread.joinable())
-        compressionThread.join();
+    return hintSyncCompleted.wait_for(lock,
+                            std::chrono::milliseconds(timeoutMs), completed);
+}
 
-    if (outputFd > 0)
-        close(outputFd);
-    outputFd = newFd;
+/**
+* Wakes up the compression thread to flush a log message at
+* config.flushLogLevel or above that was just logged. Only the first one
+* since the compression thread last looked pays for the notification.
+*/
+void
+RuntimeLogger::hintSevereLog() {
+    if (severeLogPending.load(std::memory_order_relaxed) ||
+            severeLogPending.exchange(true))
+        return;
+
+    // Notifying with condMutex held ensures the compression thread either
+    // sees severeLogPending before it sleeps or is woken up.
+    std::lock_guard<std::mutex> lock(condMutex);
+    wakeCompressionThread();
+}
 
-    // Relaunch thread
-    nextInvocationIndexToBePersisted = 0; // Reset the dictionary
-    compressionThreadShouldExit = false;
-#ifndef BENCHMARK_DISCARD_ENTRIES_AT_STAGINGBUFFER
-    compressionThread = std::thread(&RuntimeLogger::compressionThreadMain, this);
-#endif
+/**
+* Wakes up the compression thread from whichever way it's waiting for work
+* to check the state that was just changed under condMutex (which must be
+* held), e.g. a sync() request or compressionThreadShouldExit.
+*/
+void
+RuntimeLogger::wakeCompressionThread() {
+    workAdded.notify_all();
+    if (config.wakeupPolicy == NanoLog::ADAPTIVE_BACKOFF)
+        ringDoorbell();
 }
 
 /**
-* Set where the NanoLog should output its compressed log. If a previous
-* log file was specified, NanoLog will attempt to sync() the remaining log
-* entries before swapping files. For best practices, the output file shall
-* be set before the first invocation to log by the main thread as this
-* function is *not* thread safe.
-*
-* By default, the NanoLog will output to /tmp/compressedLog
-*
-* \param filename
-*      File for NanoLog to output the compress log
-*
-* \throw is_base::failure
-*      if the file cannot be opened or crated
+* Wakes up the compression thread if it's asleep on the doorbell (see
+* parkCompressionThread()). Bumping the doorbell also makes it skip the
+* sleep it's about to start.
 */
 void
-RuntimeLogger::setLogFile(const char *filename) {
-    nanoLogSingleton.setLogFile_internal(filename);
+RuntimeLogger::ringDoorbell() {
+    doorbell.fetch_add(1);
+    if (compressionThreadParked.load()) {
+        syscall(SYS_futex, &doorbell, FUTEX_WAKE_PRIVATE, 1, nullptr,
+                nullptr, 0);
+        ++numDoorbellRings;
+    }
 }
 
 /**
-* Sets the minimum log level new NANO_LOG messages will have to meet before
-* they are saved. Anything lower will be dropped.
+* Puts the compression thread to sleep on the doorbell until a logging thread
+* rings it or NanoLogConfig::BACKOFF_MAX_SLEEP_US pass. It's only invoked
+* when the compression thread has no active StagingBuffers, no output and no
+* writes in flight, so the log messages it has to wake up for all start with
+* a StagingBuffer being pushed onto readyBuffers.
 *
-* \param logLevel
-*      LogLevel enum that specifies the minimum log level.
+* \param lock
+*      Lock on condMutex, which is released during the sleep
 */
 void
-RuntimeLogger::setLogLevel(LogLevel logLevel) {
-    if (logLevel < 0)
-        logLevel = static_cast<LogLevel>(0);
-    else if (logLevel >= NUM_LOG_LEVELS)
-        logLevel = static_cast<LogLevel>(NUM_LOG_LEVELS - 1);
-    nanoLogSingleton.currentLogLevel = logLevel;
+RuntimeLogger::parkCompressionThread(std::unique_lock<std::mutex> &lock) {
+    // The doorbell is read with condMutex held, so every request made under
+    // condMutex afterwards either rings it or was seen before the sleep.
+    uint32_t ticket = doorbell.load();
+    compressionThreadParked.store(true);
+    lock.unlock();
+
+    if (readyBuffers.load() == nullptr && !severeLogPending.load() &&
+            syncRequested.load() == syncCompleted &&
+            !compressionThreadShouldExit) {
+        struct timespec timeout;
+        timeout.tv_sec = NanoLogConfig::BACKOFF_MAX_SLEEP_US/1000000;
+        timeout.tv_nsec = 1000L*(NanoLogConfig::BACKOFF_MAX_SLEEP_US%1000000);
+        ++numDoorbellSleeps;
+        if (syscall(SYS_futex, &doorbell, FUTEX_WAIT_PRIVATE, ticket,
+                    &timeout, nullptr, 0) != 0 && errno == ETIMEDOUT)
+            ++numDoorbellTimeouts;
+    }
+
+    compressionThreadParked.store(false, std::memory_order_relaxed);
+    lock.lock();
 }
 
 /**
-* Blocks until the NanoLog system is able to persist to disk the
-* pending log messages that occurred before this invocation. Note that this
-* operation has similar behavior to a "non-quiescent checkpoint" in a
-* database which means log messages occurring after this point this
-* invocation may also be persisted in a multi-threaded system.
+* Implements the first two stages of the ADAPTIVE_BACKOFF wakeup policy for
+* the compression thread and workers: for config.backoffSpinUs they check for
+* work again right away, and for config.backoffPauseUs after an exponentially
+* growing number of PAUSE instructions.
+*
+* \param cyclesIdle
+*      How long the caller has found nothing to do for
+* \param[in/out] pauses
+*      Number of PAUSE instructions to execute next; the caller's state
+*
+* \return
+*      true if the caller is to check for work again; false once it's time
+*      to sleep
+*/
+bool
+RuntimeLogger::backOff(uint64_t cyclesIdle, uint32_t *pauses) {
+    uint64_t cyclesSpin = PerfUtils::Cycles::fromNanoseconds(
+                                        1000UL*config.backoffSpinUs);
+    uint64_t cyclesPause = PerfUtils::Cycles::fromNanoseconds(
+                                        1000UL*config.backoffPauseUs);
+    if (cyclesIdle < cyclesSpin) {
+        *pauses = 1;
+        return true;
+    }
+
+    if (cyclesIdle < cyclesSpin + cyclesPause) {
+        for (uint32_t i = 0; i < *pauses; ++i)
+            __builtin_ia32_pause();
+        *pauses = std::min(2*(*pauses),
+                                  NanoLogConfig::BACKOFF_MAX_PAUSES);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+* Invoked by the compression thread when a pass through the StagingBuffers
+* found nothing to do, to wait for more the way config.wakeupPolicy says.
+*
+* \param lock
+*      Lock on condMutex, which is released while the thread waits
+* \param cyclesIdle
+*      How long the passes have found nothing to compress for
+* \param mayPark
+*      Whether the compression thread may sleep until the doorbell rings,
+*      which it can't while it has to keep an eye on active StagingBuffers
+*      or writes in flight; it waits like with POLL then.
+* \param[in/out] cyclesAwakeStart
+*      rdtsc() of when the thread last woke up, which is updated if it
+*      sleeps (the spinning is counted as active)
 */
 void
-RuntimeLogger::sync() {
-#ifdef BENCHMARK_DISCARD_ENTRIES_AT_STAGINGBUFFER
-    return;
-#endif
+RuntimeLogger::waitForWork(std::unique_lock<std::mutex> &lock,
+                           uint64_t cyclesIdle, bool mayPark,
+                           uint64_t *cyclesAwakeStart) {
+    if (severeLogPending.load(std::memory_order_relaxed) ||
+            config.wakeupPolicy == NanoLog::BUSY_POLL)
+        return;
+
+    if (config.wakeupPolicy == NanoLog::ADAPTIVE_BACKOFF) {
+        lock.unlock();
+        bool checkAgain = backOff(cyclesIdle, &backoffPauses);
+        lock.lock();
+        if (checkAgain)
+            return;
+
+        if (mayPark) {
+            cyclesActive += PerfUtils::Cycles::rdtsc() - *cyclesAwakeStart;
+            parkCompressionThread(lock);
+            *cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+            return;
+        }
+    }
 
-    std::unique_lock<std::mutex> lock(nanoLogSingleton.condMutex);
-    nanoLogSingleton.syncStatus = SYNC_REQUESTED;
-    nanoLogSingleton.workAdded.notify_all();
-    nanoLogSingleton.hintSyncCompleted.wait(lock);
+    cyclesActive += PerfUtils::Cycles::rdtsc() - *cyclesAwakeStart;
+    workAdded.wait_for(lock, std::chrono::microseconds(
+            config.pollIntervalNoWorkUs));
+    *cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
 }
 
 /**
@@ -750,7 +3110,13 @@ RuntimeLogger::sync() {
 */
 char *
 RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking) {
-    const char *endOfBuffer = storage + NanoLogConfig::STAGING_BUFFER_SIZE;
+    if (spillTail != nullptr)
+        return reserveSpillSpace(nbytes, blocking);
+
+    if (resizedStorage != nullptr)
+        return reserveResizedSpace(nbytes, blocking);
+
+    const char *endOfBuffer = storage + capacity;
 
 #ifdef RECORD_PRODUCER_STATS
     uint64_t start = PerfUtils::Cycles::rdtsc();
@@ -763,8 +3129,12 @@ RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking)
     // Doing this check here ensures that == means completely empty.
     while (minFreeSpace <= nbytes) {
         // Since consumerPos can be updated in a different thread, we
-        // save a consistent copy of it here to do calculations on
+        // save a consistent copy of it here to do calculations on. The
+        // nanologd publishes it in the header of storage[] instead.
         char *cachedConsumerPos = consumerPos;
+        if (NanoLogConfig::COMPRESSION_DAEMON)
+            cachedConsumerPos = storage +
+                                Recovery::getHeader(storage)->consumerOffset;
 
         if (cachedConsumerPos <= producerPos) {
             minFreeSpace = endOfBuffer - producerPos;
@@ -774,6 +3144,9 @@ RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking)
 
             // Not enough space at the end of the buffer; wrap around
             endOfRecordedSpace = producerPos;
+            if (NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+                Recovery::getHeader(storage)->endOffset =
+                                                endOfRecordedSpace - storage;
 
             // Prevent the roll over if it overlaps the two positions because
             // that would imply the buffer is completely empty when it's not.
@@ -793,9 +3166,18 @@ RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking)
         minFreeSpace = endOfBuffer - storage;
 #endif
 
+        // Rather than waiting on the consumer, continue in a larger storage[]
+        // or, once it's as large as it gets, in a SpillSegment
+        if (minFreeSpace <= nbytes && (grow(nbytes) || startSpill(nbytes)))
+            return producerPos;
+
         // Needed to prevent infinite loops in tests
         if (!blocking && minFreeSpace <= nbytes)
             return nullptr;
+
+        // Rather than spinning on the consumer, help it make progress
+        if (minFreeSpace <= nbytes)
+            compressOwnBacklog();
     }
 
 #ifdef RECORD_PRODUCER_STATS
@@ -811,6 +3193,535 @@ RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking)
     return producerPos;
 }
 
+/**
+* Accounts for a log message that the producer dropped because there was not
+* enough space for it in storage[]. The drop is reported to the consumer via
+* a DroppedLogs record, which is inserted by the next reservation that
+* succeeds (see reserveSpaceAfterDroppedLogs).
+*
+* \param fmtId
+*      Log identifier of the message dropped
+*/
+void
+RuntimeLogger::StagingBuffer::recordDroppedLog(uint32_t fmtId) {
+    if (numDroppedPending == 0) {
+        firstDropTimestamp = PerfUtils::Cycles::rdtsc();
+        numDroppedSites = 0;
+    }
+
+    ++numDroppedPending;
+    ++numLogsDropped;
+
+    uint32_t i = 0;
+    while (i < numDroppedSites && droppedSites[i].logId != fmtId)
+        ++i;
+
+    if (i < numDroppedSites) {
+        ++droppedSites[i].count;
+    } else if (numDroppedSites < Util::arraySize(droppedSites)) {
+        droppedSites[i].logId = fmtId;
+        droppedSites[i].count = 1;
+        ++numDroppedSites;
+    }
+
+    // Force the next reservation through the slow path so that it inserts
+    // the DroppedLogs record (even if a smaller log message would fit).
+    minFreeSpace = 0;
+}
+
+/**
+* Slow path of reserveProducerSpace when log messages have been dropped since
+* the last reservation. It inserts a DroppedLogs record for the drops into
+* storage[] and then reserves space for the log message after it.
+*
+* The record is only inserted if the log message that follows it also fits;
+* otherwise a full buffer could fill up with back-to-back records.
+*
+* \param nbytes
+*      Number of contiguous bytes to reserve after the DroppedLogs record
+*
+* \param blocking
+*      Whether to wait for space (true) or to return nullptr (false) when
+*      the record and nbytes do not fit.
+*
+* \return
+*      A pointer into storage[] that can be written to by the producer for
+*      at least nbytes or nullptr if there was not enough space.
+*/
+char *
+RuntimeLogger::StagingBuffer::reserveSpaceAfterDroppedLogs(size_t nbytes,
+                                                           bool blocking)
+{
+    size_t recordBytes = sizeof(Log::UncompressedEntry)
+                            + sizeof(Log::DroppedLogs)
+                            + numDroppedSites*sizeof(Log::DroppedLogSite);
+
+    char *writePos = reserveSpaceInternal(recordBytes + nbytes, blocking);
+    if (writePos == nullptr)
+        return nullptr;
+
+    auto *entry = reinterpret_cast<Log::UncompressedEntry*>(writePos);
+    entry->fmtId = Log::DROPPED_LOGS_ID;
+    entry->entrySize = downCast<uint32_t>(recordBytes);
+    entry->timestamp = firstDropTimestamp;
+
+    auto *droppedLogs = reinterpret_cast<Log::DroppedLogs*>(entry->argData);
+    droppedLogs->numDropped = numDroppedPending;
+    droppedLogs->numSites = numDroppedSites;
+    memcpy(droppedLogs->sites, droppedSites,
+           numDroppedSites*sizeof(Log::DroppedLogSite));
+
+    finishReservation(recordBytes);
+    numDroppedPending = 0;
+    numDroppedSites = 0;
+
+    return producerPos;
+}
+
+/**
+* Moves the producer from storage[] onto a new chain of SpillSegments when
+* storage[] is full. The data in storage[] up to the current producerPos is
+* consumed before the chain.
+*
+* \param nbytes
+*      Number of contiguous bytes the producer is trying to reserve
+*
+* \return
+*      true if the producer now writes to a SpillSegment with at least nbytes
+*      of free space; false if the consumer has yet to pick up the last chain,
+*      the allocation is too large, or the SPILL_MEMORY_LIMIT was reached.
+*/
+bool
+RuntimeLogger::StagingBuffer::startSpill(size_t nbytes) {
+    // The nanologd can't reach the SpillSegments
+    if (NanoLogConfig::COMPRESSION_DAEMON)
+        return false;
+
+    if (nbytes >= NanoLogConfig::SPILL_SEGMENT_SIZE || spillHead != nullptr)
+        return false;
+
+    SpillSegment *segment = nanoLogSingleton.allocSpillSegment();
+    if (segment == nullptr)
+        return false;
+
+    // The order of these stores matters; the consumer reads spillHead
+    // before spillRingEnd and producerPos before spillHead.
+    spillRingEnd = producerPos;
+    Fence::sfence();
+    spillHead = segment;
+    Fence::sfence();
+
+    spillTail = segment;
+    producerPos = segment->storage;
+    minFreeSpace = NanoLogConfig::SPILL_SEGMENT_SIZE;
+    ++numTimesSpilled;
+    return true;
+}
+
+/**
+* Slow path of reserveProducerSpace while the producer is spilling and the
+* current SpillSegment is out of space. The producer returns to storage[] as
+* soon as the consumer has caught up to spillRingEnd, otherwise it continues
+* in another SpillSegment.
+*
+* \param nbytes
+*      Number of contiguous bytes to reserve.
+*
+* \param blocking
+*      Whether to wait (true) or to return nullptr (false) when neither
+*      storage[] nor the spill pool can take the allocation.
+*
+* \return
+*      A pointer that can be written to by the producer for at least nbytes
+*      or nullptr if there's not enough space.
+*/
+char *
+RuntimeLogger::StagingBuffer::reserveSpillSpace(size_t nbytes, bool blocking) {
+    while (true) {
+        // The consumer has drained storage[] and is (or will next be) working
+        // through the SpillSegments, so anything placed into storage[] from
+        // now on will be consumed after them.
+        if (consumerPos == spillRingEnd) {
+            closeSpillSegment(nullptr);
+            producerPos = spillRingEnd;
+            minFreeSpace = 0;
+            return reserveSpaceInternal(nbytes, blocking);
+        }
+
+        if (nbytes < NanoLogConfig::SPILL_SEGMENT_SIZE) {
+            SpillSegment *segment = nanoLogSingleton.allocSpillSegment();
+            if (segment != nullptr) {
+                closeSpillSegment(segment);
+                producerPos = segment->storage;
+                minFreeSpace = NanoLogConfig::SPILL_SEGMENT_SIZE;
+                return producerPos;
+            }
+        }
+
+        if (!blocking)
+            return nullptr;
+
+        compressOwnBacklog();
+    }
+}
+
+/**
+* Marks the end of the SpillSegment the producer is currently writing to and
+* links it to the next place the producer will write to. The caller must
+* update producerPos after this function returns.
+*
+* \param next
+*      SpillSegment the producer continues in; nullptr indicates it returns
+*      to storage[]
+*/
+void
+RuntimeLogger::StagingBuffer::closeSpillSegment(SpillSegment *next) {
+    spillTail->next = next;
+    Fence::sfence();
+    spillTail->end = producerPos;
+    Fence::sfence(); // The consumer reads producerPos before end
+    spillTail = next;
+}
+
+/**
+* Moves the producer onto a storage[] twice as large (or larger if needed
+* for nbytes) when the current one is full, rather than waiting on the
+* consumer.
+*
+* \param nbytes
+*      Number of contiguous bytes the producer is trying to reserve
+*
+* \return
+*      true if the producer now writes to a new storage[] with at least nbytes
+*      of free space; false if storage[] is already STAGING_BUFFER_SIZE large
+*      or the previous resize has yet to be picked up by the consumer.
+*/
+bool
+RuntimeLogger::StagingBuffer::grow(size_t nbytes) {
+    if (capacity >= nanoLogSingleton.config.stagingBufferSize)
+        return false;
+
+    uint32_t newCapacity = roundUpCapacity(std::max<size_t>(2*capacity,
+                                                            nbytes + 1));
+    if (newCapacity <= nbytes)
+        return false;
+
+    return resize(newCapacity);
+}
+
+/**
+* Moves the producer from storage[] onto a newly allocated one of a different
+* size. The data in the old storage[] up to the current producerPos is
+* consumed before the new one, after which the consumer frees the old one.
+* Until then, the producer writes to the new storage[] without wrapping
+* around (see reserveResizedSpace()).
+*
+* \param newCapacity
+*      Byte size of the new storage[]
+*
+* \return
+*      true if the producer now writes to the new storage[]; false if the
+*      producer is spilling or the previous resize has yet to be picked up.
+*/
+bool
+RuntimeLogger::StagingBuffer::resize(uint32_t newCapacity) {
+    if (resizedStorage != nullptr || spillTail != nullptr
+            || spillHead != nullptr)
+        return false;
+
+    if (NanoLogConfig::NUMA_LOCAL_STAGING_BUFFERS)
+        numaNode = Util::getNumaNode();
+
+    char *newStorage = RuntimeLogger::allocBuffer(newCapacity, numaNode);
+
+    // The order of these stores matters; the consumer reads producerPos
+    // before resizedStorage and resizedStorage before resizeRingEnd.
+    resizeRingEnd = producerPos;
+    resizedCapacity = newCapacity;
+    Fence::sfence();
+    resizedStorage = newStorage;
+    Fence::sfence();
+
+    producerPos = newStorage;
+    minFreeSpace = newCapacity;
+    ++numTimesResized;
+    return true;
+}
+
+/**
+* Slow path of reserveProducerSpace while the consumer has yet to move onto
+* the storage[] that the producer resized the StagingBuffer to. The producer
+* can't wrap around in it until then, so it waits on the consumer (or
+* compresses its own backlog) once it reaches the end.
+*
+* \param nbytes
+*      Number of contiguous bytes to reserve.
+*
+* \param blocking
+*      Whether to wait (true) or to return nullptr (false) when there's not
+*      enough space.
+*
+* \return
+*      A pointer that can be written to by the producer for at least nbytes
+*      or nullptr if there's not enough space.
+*/
+char *
+RuntimeLogger::StagingBuffer::reserveResizedSpace(size_t nbytes, bool blocking) {
+    while (true) {
+        char *cachedResizedStorage = resizedStorage;
+
+        // The consumer has moved onto the new storage[] and may have already
+        // consumed from it, so the usual wrap around logic applies again.
+        if (cachedResizedStorage == nullptr) {
+            minFreeSpace = 0;
+            return reserveSpaceInternal(nbytes, blocking);
+        }
+
+        minFreeSpace = cachedResizedStorage + resizedCapacity - producerPos;
+        if (minFreeSpace > nbytes)
+            return producerPos;
+
+        if (!blocking)
+            return nullptr;
+
+        compressOwnBacklog();
+    }
+}
+
+/**
+* Resets the state of a drained StagingBuffer of an exited thread so that it
+* can be handed to a new thread from the bufferPool (or in place, see
+* reuseDrainedStagingBuffer(), which is why its link in threadBuffers is left
+* alone). Its storage[] is kept and fully faulted in, so that the new thread
+* doesn't incur the page faults, whereas the assist space is given back until
+* the new thread needs it.
+*/
+void
+RuntimeLogger::StagingBuffer::recycle() {
+    // The producer exited while spilling, so the segment was never closed.
+    if (consumerSegment != nullptr)
+        nanoLogSingleton.freeSpillSegment(consumerSegment);
+
+    releaseAssistBuffer();
+    if (!NanoLogConfig::PREFAULT_BUFFERS && prefaultedStorage != storage) {
+        memset(storage, 0, capacity);
+        prefaultedStorage = storage;
+    }
+
+    producerPos = storage;
+    endOfRecordedSpace = storage + capacity;
+    minFreeSpace = capacity;
+    cyclesProducerBlocked = 0;
+    numTimesProducerBlocked = 0;
+    numAllocations = 0;
+    for (size_t i = 0; i < Util::arraySize(cyclesProducerBlockedDist); ++i)
+        cyclesProducerBlockedDist[i] = 0;
+
+    numDroppedPending = 0;
+    firstDropTimestamp = 0;
+    numDroppedSites = 0;
+    numLogsDropped = 0;
+    spillTail = nullptr;
+    spillHead = nullptr;
+    spillRingEnd = nullptr;
+    numTimesSpilled = 0;
+    numTimesAssisted = 0;
+    numTimesResized = 0;
+    minCapacity = roundUpCapacity(0);
+    idleSince = 0;
+    active = true;
+    nextReady = nullptr;
+    nextPooled = nullptr;
+    consumerPos = storage;
+    consumerSegment = nullptr;
+    spillReadPos = nullptr;
+    shouldDeallocate = false;
+    retired = false;
+    initRecoveryHeader();
+}
+
+/**
+* Invoked by the producer when it has logged to a StagingBuffer that the
+* compression thread has marked idle, so that the compression thread resumes
+* checking it. This is kept out of line since it's only invoked on the first
+* log message after an idle period, which also makes it the place to give
+* back the memory of a buffer that was grown for a burst long ago.
+*/
+void
+RuntimeLogger::StagingBuffer::markActive() {
+    if (!tryMarkActive())
+        return;
+
+    static const uint64_t shrinkIdleCycles = PerfUtils::Cycles::fromNanoseconds(
+            1000UL*NanoLogConfig::STAGING_BUFFER_SHRINK_IDLE_US);
+    if (!shouldDeallocate && resizedStorage == nullptr &&
+            capacity > minCapacity &&
+            PerfUtils::Cycles::rdtsc() - idleSince >= shrinkIdleCycles)
+        resize(std::max(capacity/2, minCapacity));
+
+    nanoLogSingleton.pushReadyBuffer(this);
+}
+
+/**
+* Invoked by the producer when it would otherwise spin waiting on the
+* background thread to free up space. If the background thread isn't working
+* on this StagingBuffer at the moment, the producer takes over as its consumer
+* and compresses its own backlog into assistBuffer. The background thread
+* then only has to copy the result into its output on its next visit, which
+* keeps a saturated background thread from stalling every logging thread.
+*
+* \return
+*      true if space was freed up in the StagingBuffer
+*/
+bool
+RuntimeLogger::StagingBuffer::compressOwnBacklog() {
+    // The nanologd is the only consumer
+    if (NanoLogConfig::COMPRESSION_DAEMON)
+        return false;
+
+    std::unique_lock<std::mutex> claim(consumerMutex, std::try_to_lock);
+    if (!claim.owns_lock())
+        return false;
+
+    uint64_t logsCompressed = 0;
+    if (compressBacklog(&logsCompressed) == 0)
+        return false;
+
+    ++numTimesAssisted;
+    nanoLogSingleton.logsCompressedByProducers += logsCompressed;
+    return true;
+}
+
+/**
+* Compresses as much of the StagingBuffer's contents as possible into
+* assistBuffer and consumes it. The compressed data is output later by the
+* background thread. The caller must hold consumerMutex.
+*
+* \param[out] numEventsCompressed
+*      adds the number of log messages compressed in this invocation
+*
+* \return
+*      Number of bytes consumed from the StagingBuffer
+*/
+uint64_t
+RuntimeLogger::StagingBuffer::compressBacklog(uint64_t *numEventsCompressed) {
+    if (!allocAssistBuffer())
+        return 0;
+
+#ifndef PREPROCESSOR_NANOLOG
+    nanoLogSingleton.copyNewInvocationSites(assistDictionary,
+            nanoLogSingleton.nextInvocationIndexToBePersisted.load(
+                                                    std::memory_order_acquire));
+#endif
+
+    uint64_t bytesConsumed = 0;
+    uint64_t logsCompressed = 0;
+    while (true) {
+        uint64_t peekBytes = 0;
+        char *peekPosition = peek(&peekBytes);
+        if (peekBytes == 0)
+            break;
+
+#ifdef PREPROCESSOR_NANOLOG
+        long bytesRead = assistEncoder->encodeLogMsgs(peekPosition,
+                                                      peekBytes,
+                                                      id,
+                                                      false,
+                                                      &logsCompressed);
+#else
+        long bytesRead = assistEncoder->encodeLogMsgs(peekPosition,
+                                                      peekBytes,
+                                                      id,
+                                                      false,
+                                                      assistDictionary,
+                                                      &logsCompressed);
+#endif
+
+        consume(bytesRead);
+        bytesConsumed += bytesRead;
+
+        // Out of scratch space or the rest needs the background thread
+        if (static_cast<uint64_t>(bytesRead) < peekBytes)
+            break;
+    }
+
+    assistBytesPending += bytesConsumed;
+    assistLogsPending += logsCompressed;
+    *numEventsCompressed += logsCompressed;
+    return bytesConsumed;
+}
+
+/**
+* Ensures that assistBuffer is allocated for compressBacklog(). It's sized
+* after storage[] (up to ASSIST_BUFFER_SIZE) since the backlog can't be any
+* larger, which keeps small StagingBuffers from carrying a large assist space.
+* If storage[] has grown since, the assistBuffer is replaced once the
+* background thread has output its contents. The caller must hold
+* consumerMutex.
+*
+* \return
+*      false if producer-assisted compression is disabled or the memory
+*      couldn't be allocated
+*/
+bool
+RuntimeLogger::StagingBuffer::allocAssistBuffer() {
+    uint32_t bytes = std::min(capacity, NanoLogConfig::ASSIST_BUFFER_SIZE);
+    if (bytes == 0)
+        return false;
+
+    if (assistBuffer != nullptr) {
+        if (assistBufferSize >= bytes || assistEncoder->getEncodedBytes() > 0)
+            return true;
+
+        releaseAssistBuffer();
+    }
+
+    // Not allocated via RuntimeLogger::allocBuffer() since the assist space
+    // is only scratch space that's not worth recovering after a crash and the
+    // blocked producer is better off spinning than exiting on failure.
+    void *buffer = Util::allocBuffer(bytes,
+                                     NanoLogConfig::USE_HUGE_PAGES,
+                                     NanoLogConfig::PREFAULT_BUFFERS,
+                                     NanoLogConfig::LOCK_BUFFERS,
+                                     numaNode);
+    if (buffer == nullptr)
+        return false;
+
+    assistBuffer = static_cast<char*>(buffer);
+    assistBufferSize = bytes;
+    assistEncoder = new Log::Encoder(assistBuffer, assistBufferSize, true,
+                                false,
+                                nanoLogSingleton.config.stagingBufferSize/2);
+    return true;
+}
+
+/**
+* Frees assistBuffer (if allocated). The caller must hold consumerMutex (or
+* be the last one with access to the StagingBuffer) and have output whatever
+* was compressed into it.
+*/
+void
+RuntimeLogger::StagingBuffer::releaseAssistBuffer() {
+    delete assistEncoder;
+    assistEncoder = nullptr;
+    Util::freeBuffer(assistBuffer, assistBufferSize,
+                     NanoLogConfig::USE_HUGE_PAGES);
+    assistBuffer = nullptr;
+    assistBufferSize = 0;
+}
+
+/**
+* Invoked by the background thread after it has output the contents of
+* assistBuffer to free it when it's larger than storage[] warrants, i.e. after
+* the StagingBuffer was shrunk. The caller must hold consumerMutex.
+*/
+void
+RuntimeLogger::StagingBuffer::trimAssistBuffer() {
+    if (assistBuffer != nullptr && assistBufferSize > capacity &&
+            assistEncoder->getEncodedBytes() == 0)
+        releaseAssistBuffer();
+}
+
 /**
 * Peek at the data available for consumption within the stagingBuffer.
 * The consumer should also invoke consume() to release space back
@@ -825,9 +3736,43 @@ RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking)
 */
 char *
 RuntimeLogger::StagingBuffer::peek(uint64_t *bytesAvailable) {
+    // Drain the SpillSegments (if any) before returning to storage[]
+    while (consumerSegment != nullptr) {
+        char *cachedProducerPos = producerPos;
+        Fence::lfence(); // The producer sets end before moving producerPos
+        char *end = consumerSegment->end;
+
+        if (end == nullptr) {
+            *bytesAvailable = cachedProducerPos - spillReadPos;
+            return spillReadPos;
+        }
+
+        *bytesAvailable = end - spillReadPos;
+        if (*bytesAvailable > 0)
+            return spillReadPos;
+
+        SpillSegment *next = consumerSegment->next;
+        nanoLogSingleton.freeSpillSegment(consumerSegment);
+        consumerSegment = next;
+        spillReadPos = (next) ? next->storage : nullptr;
+    }
+
     // Save a consistent copy of producerPos
     char *cachedProducerPos = producerPos;
 
+    // If the producer is spilling or has moved onto a resized storage[], the
+    // current storage[] ends at spillRingEnd or resizeRingEnd respectively
+    Fence::lfence();
+    SpillSegment *cachedSpillHead = spillHead;
+    char *cachedResizedStorage = resizedStorage;
+    if (cachedSpillHead != nullptr) {
+        Fence::lfence();
+        cachedProducerPos = spillRingEnd;
+    } else if (cachedResizedStorage != nullptr) {
+        Fence::lfence();
+        cachedProducerPos = resizeRingEnd;
+    }
+
     if (cachedProducerPos < consumerPos) {
         Fence::lfence(); // Prevent reading new producerPos but old endOf...
         *bytesAvailable = endOfRecordedSpace - consumerPos;
@@ -837,9 +3782,32 @@ RuntimeLogger::StagingBuffer::peek(uint64_t *bytesAvailable) {
 
         // Roll over
         consumerPos = storage;
+        if (NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+            Recovery::getHeader(storage)->consumerOffset = 0;
     }
 
     *bytesAvailable = cachedProducerPos - consumerPos;
+
+    // Done with storage[] up to the spill; move on to the SpillSegments
+    if (*bytesAvailable == 0 && cachedSpillHead != nullptr) {
+        consumerSegment = cachedSpillHead;
+        spillReadPos = cachedSpillHead->storage;
+        spillHead = nullptr;
+        return peek(bytesAvailable);
+    }
+
+    // Done with the old storage[]; free it and move on to the resized one
+    if (*bytesAvailable == 0 && cachedResizedStorage != nullptr) {
+        RuntimeLogger::freeBuffer(storage, capacity);
+        storage = cachedResizedStorage;
+        capacity = resizedCapacity;
+        endOfRecordedSpace = storage + capacity;
+        consumerPos = storage;
+        Fence::sfence(); // The producer reads the above after resizedStorage
+        resizedStorage = nullptr;
+        return peek(bytesAvailable);
+    }
+
     return consumerPos;
 }
 
@@ -16,13 +16,19 @@
 #ifndef RUNTIME_NANOLOG_H
 #define RUNTIME_NANOLOG_H
 
-#include <aio.h>
+#include <sched.h>
 #include <cassert>
 
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <functional>
+#include <future>
 #include <mutex>
+#include <new>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
 #include "Config.h"
@@ -30,11 +36,65 @@
 #include "Fence.h"
 #include "Log.h"
 #include "NanoLog.h"
+#include "Recovery.h"
 #include "Util.h"
 
+// glibc (2.35+) registers every thread's rseq area with the kernel, which
+// keeps the id of the CPU the thread is running on up to date in it.
+#if defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define NANOLOG_HAS_RSEQ
+#endif
+#endif
+
+/**
+ * Links the static information of a log invocation site and the logId that it
+ * should be assigned into the nanolog_sites section, which allows the
+ * RuntimeLogger to assign the identifiers of all the sites in the executable
+ * at startup instead of on their first log message. A site may be linked
+ * multiple times (i.e. once per copy of the code that logs to it).
+ *
+ * The entries are emitted with inline assembly since GCC doesn't reliably
+ * honor section attributes on the static variables of inline functions and
+ * templates. The variables can't be referenced this way in position
+ * independent code that's not an executable, so sites in shared libraries are
+ * registered on their first log message instead.
+ */
+#if !defined(__PIC__) || defined(__PIE__)
+#define NANOLOG_LINK_INVOCATION_SITE(info, logId) \
+    __asm__ __volatile__(".pushsection nanolog_sites,\"aw\"\n\t" \
+                         ".balign 8\n\t" \
+                         ".quad %c0, %c1\n\t" \
+                         ".popsection" :: "i"(&(info)), "i"(&(logId)))
+#else
+#define NANOLOG_LINK_INVOCATION_SITE(info, logId)
+#endif
+
 namespace NanoLogInternal {
 using namespace NanoLog;
 
+// Performs the RuntimeLogger's output (see IoBackend.h)
+class IoBackend;
+
+/**
+ * Entry in the nanolog_sites section (see NANOLOG_LINK_INVOCATION_SITE).
+ */
+struct LinkedInvocationSite {
+    // Static log information of the log invocation site
+    const StaticLogInfo *info;
+
+    // Identifier to assign to the log invocation site
+    int *logId;
+};
+
+// Bounds of the nanolog_sites section of the executable, which are defined by
+// the linker. They're null if no log invocation sites were linked.
+extern "C" const LinkedInvocationSite __start_nanolog_sites[]
+                                __attribute__((weak, visibility("hidden")));
+extern "C" const LinkedInvocationSite __stop_nanolog_sites[]
+                                __attribute__((weak, visibility("hidden")));
+
 /**
  * RuntimeLogger provides runtime support to the C++ code generated by the
  * Preprocessor component.
@@ -50,15 +110,34 @@ using namespace NanoLog;
          */
         inline void
         registerInvocationSite_internal(int &logId, StaticLogInfo info) {
-            // TODO(syang0) Make this into a spin lock
-            std::lock_guard<std::mutex>
-                                    lock(nanoLogSingleton.registrationMutex);
-
-            if (logId != UNASSIGNED_LOGID)
+            // Only the thread that claims the site adds it to the dictionary;
+            // threads racing with it wait for the logId it assigns.
+            int expected = UNASSIGNED_LOGID;
+            if (!__atomic_compare_exchange_n(&logId, &expected, PENDING_LOGID,
+                        false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                while (expected == PENDING_LOGID) {
+                    std::this_thread::yield();
+                    expected = __atomic_load_n(&logId, __ATOMIC_ACQUIRE);
+                }
                 return;
+            }
+
+            uint32_t id = numInvocationSites.fetch_add(1);
+            uint32_t chunkIndex = id/INVOCATION_SITES_PER_CHUNK;
+            uint32_t slot = id%INVOCATION_SITES_PER_CHUNK;
 
-            logId = static_cast<int32_t>(invocationSites.size());
-            invocationSites.push_back(info);
+            InvocationSiteChunk *chunk = nullptr;
+            if (chunkIndex < MAX_INVOCATION_SITE_CHUNKS)
+                chunk = invocationSites[chunkIndex].load(
+                                                    std::memory_order_acquire);
+            if (chunk == nullptr)
+                chunk = allocInvocationSiteChunk(chunkIndex);
+
+            new (&chunk->sites[slot]) StaticLogInfo(info);
+            chunk->published[slot].store(true, std::memory_order_release);
+
+            __atomic_store_n(&logId, static_cast<int32_t>(id),
+                             __ATOMIC_RELEASE);
 
 #ifdef ENABLE_DEBUG_PRINTING
             printf("Registered '%s' as id=%d\r\n", info.formatString, logId);
@@ -78,8 +157,8 @@ using namespace NanoLog;
          *
          * \param[in/out] logId
          *       Unique log identifier to be assigned. A value other than -1
-         *       indicates that the id has already been assigned and this
-         *       function becomes a no-op.
+         *       (UNASSIGNED_LOGID) or PENDING_LOGID indicates that the id has
+         *       already been assigned and this function becomes a no-op.
          */
         static inline void
         registerInvocationSite(StaticLogInfo info, int &logId) {
@@ -93,21 +172,35 @@ using namespace NanoLog;
          * to the compression thread and this function shall not be invoked
          * again until the corresponding finishAlloc() is invoked first.
          *
-         * Note this will block of the buffer is full.
+         * Note this will block if the buffer is full, unless the overflow
+         * policy is DROP_ON_FULL, in which case the log message is counted as
+         * dropped and nullptr is returned. The caller shall not invoke
+         * finishAlloc() in that case.
          *
          * \param nbytes
          *      number of bytes to allocate in the
+         * \param fmtId
+         *      log identifier of the message to be stored; used to attribute
+         *      the message to its invocation site should it be dropped
          *
          * \return
-         *      pointer to the allocated space
+         *      pointer to the allocated space or nullptr if the message
+         *      was dropped
          */
         static inline char *
-        reserveAlloc(size_t nbytes) {
+        reserveAlloc(size_t nbytes, uint32_t fmtId) {
+            if (NanoLogConfig::PER_CPU_STAGING_BUFFERS)
+                return reserveCpuAlloc(nbytes, fmtId);
+
             if (stagingBuffer == nullptr)
                 nanoLogSingleton.ensureStagingBufferAllocated();
 
             // NOLINTNEXTLINE(clang-analyzer-core.CallAndMessage)
-            return stagingBuffer->reserveProducerSpace(nbytes);
+            char *writePos = stagingBuffer->reserveProducerSpace(nbytes);
+            if (writePos == nullptr)
+                stagingBuffer->recordDroppedLog(fmtId);
+
+            return writePos;
         }
 
         /**
@@ -116,31 +209,63 @@ using namespace NanoLog;
          *
          * \param nbytes
          *      Number of bytes to make visible
+         * \param level
+         *      LogLevel of the log message; the compression thread is woken
+         *      up to flush it if it's at Config::flushLogLevel or above
          */
         static inline void
-        finishAlloc(size_t nbytes) {
-            stagingBuffer->finishReservation(nbytes);
+        finishAlloc(size_t nbytes, LogLevel level = NUM_LOG_LEVELS) {
+            if (NanoLogConfig::PER_CPU_STAGING_BUFFERS)
+                CpuStagingBuffer::finishReservation(cpuReservation, nbytes);
+            else
+                stagingBuffer->finishReservation(nbytes);
+
+            if (level <= nanoLogSingleton.config.flushLogLevel &&
+                    !NanoLogConfig::COMPRESSION_DAEMON)
+                nanoLogSingleton.hintSevereLog();
         }
 
         static std::string getStats();
         static std::string getHistograms();
+        static void init(const NanoLog::Config &config = NanoLog::Config());
         static void preallocate();
+        static void preallocate(size_t bytes);
         static void setLogFile(const char *filename);
         static void setLogLevel(LogLevel logLevel);
+        static void setOverflowPolicy(OverflowPolicy policy);
         static void sync();
+        static bool syncFor(uint32_t timeoutMs);
+        static void syncAsync(std::function<void()> callback);
+        static std::future<void> syncAsync();
 
         static inline LogLevel getLogLevel() {
             return nanoLogSingleton.currentLogLevel;
         }
 
+        static inline OverflowPolicy getOverflowPolicy() {
+            return nanoLogSingleton.overflowPolicy;
+        }
+
         static inline int getCoreIdOfBackgroundThread() {
             return nanoLogSingleton.coreId;
         }
+
+        static inline const NanoLog::Config &getConfig() {
+            return nanoLogSingleton.config;
+        }
+
+        static const char *getDurabilityModeName(NanoLog::DurabilityMode mode);
+        static const char *getWakeupPolicyName(NanoLog::WakeupPolicy policy);
     PRIVATE:
 
         // Forward Declarations
         class StagingBuffer;
+        class CpuStagingBuffer;
         class StagingBufferDestroyer;
+        class ThreadBuffersReader;
+        struct InvocationSiteChunk;
+        struct SpillSegment;
+        struct WorkerShard;
 
         // Storage for staging uncompressed log statements for compression
         static __thread StagingBuffer *stagingBuffer;
@@ -149,6 +274,36 @@ using namespace NanoLog;
         // is synchronized with thread death
         static thread_local StagingBufferDestroyer sbc;
 
+        // Identifies the thread's log messages in the per-CPU StagingBuffers;
+        // 0 means that it hasn't been assigned yet.
+        static __thread uint32_t cpuThreadId;
+
+        // Record reserved by the thread in a per-CPU StagingBuffer that's
+        // waiting on its finishAlloc()
+        static __thread char *cpuReservation;
+
+        /**
+         * Log messages that a thread dropped since it last logged to a per-CPU
+         * StagingBuffer. They're reported with a DroppedLogs record that's
+         * inserted ahead of the thread's next log message, the same way that
+         * the StagingBuffers of the threads do it (see reserveCpuAllocSlow()).
+         */
+        struct CpuDroppedLogs {
+            // Number of log messages dropped; a non-zero value sends the
+            // thread's next reservation through reserveCpuAllocSlow().
+            uint32_t numDropped;
+
+            // rdtsc() of the first drop counted in numDropped
+            uint64_t firstDropTimestamp;
+
+            // Number of valid entries in sites
+            uint32_t numSites;
+
+            // Per invocation site breakdown of numDropped
+            Log::DroppedLogSite sites[NanoLogConfig::MAX_DROPPED_LOG_SITES];
+        };
+        static __thread CpuDroppedLogs cpuDroppedLogs;
+
         // Singleton RuntimeLogger that manages the thread-local structures and
         // background output thread.
         static RuntimeLogger nanoLogSingleton;
@@ -157,11 +312,184 @@ using namespace NanoLog;
 
         ~RuntimeLogger();
 
+        static const char *checkConfig(const NanoLog::Config &config);
+
+        bool initialize(int fd = -1,
+                        const char *filename = NanoLogConfig::DEFAULT_LOG_FILE);
+
+        /**
+         * Opens the log file, allocates the output buffers and starts the
+         * background threads if that hasn't been done yet. Nothing is set up
+         * at static initialization time, so that programs that never log
+         * don't pay for it.
+         */
+        inline void
+        ensureInitialized() {
+            if (!initialized.load(std::memory_order_acquire))
+                initialize();
+        }
+
         void compressionThreadMain();
 
+        void compressionWorkerMain(uint32_t workerId);
+
+        uint64_t compressShard(uint32_t workerId);
+
+        void addToShard(StagingBuffer *sb);
+
+        void removeFromShard(StagingBuffer *sb);
+
+        bool shardsEmpty();
+
+        void ringWorkerDoorbell();
+
+        void waitForShardWork(uint64_t cyclesIdle, uint32_t *pauses);
+
         void setLogFile_internal(const char *filename);
 
-        void waitForAIO();
+        void completeOutputWrite();
+
+        bool waitForSync(int timeoutMs);
+
+        void hintSevereLog();
+
+        void wakeCompressionThread();
+
+        void ringDoorbell();
+
+        void parkCompressionThread(std::unique_lock<std::mutex> &lock);
+
+        bool backOff(uint64_t cyclesIdle, uint32_t *pauses);
+
+        void waitForWork(std::unique_lock<std::mutex> &lock,
+                         uint64_t cyclesIdle, bool mayPark,
+                         uint64_t *cyclesAwakeStart);
+
+        void completeSync(std::unique_lock<std::mutex> &lock);
+
+        int getOpenFlags() const;
+
+        off_t prepareOutputFile(int fd);
+
+        void reserveOutputFileSpace(off_t end, off_t *reservedEnd);
+
+        void releaseOutputFileSpace();
+
+        bool rotateLogFile();
+
+        void startRecoverableOutputBuffer(size_t encodedBytes);
+
+        SpillSegment *allocSpillSegment();
+
+        void freeSpillSegment(SpillSegment *segment);
+
+        void pushReadyBuffer(StagingBuffer *sb);
+
+        void registerLinkedInvocationSites();
+
+        InvocationSiteChunk *allocInvocationSiteChunk(uint32_t chunkIndex);
+
+        void copyNewInvocationSites(std::vector<StaticLogInfo> &dictionary,
+                                    uint32_t limit);
+
+        void registerStagingBuffer(StagingBuffer *sb);
+
+        StagingBuffer *allocStagingBuffer(uint32_t capacity = 0);
+
+        void recycleStagingBuffer(StagingBuffer *sb);
+
+        StagingBuffer *reuseDrainedStagingBuffer();
+
+        bool waitForDaemon(int timeoutMs);
+
+        static char *allocBuffer(size_t bytes, int numaNode = -1);
+
+        static void freeBuffer(char *buffer, size_t bytes);
+
+        CpuStagingBuffer *allocCpuStagingBuffer(uint32_t index);
+
+        char *reserveCpuAllocSlow(size_t nbytes, uint32_t fmtId);
+
+        bool insertCpuDroppedLogs(CpuStagingBuffer *cb, size_t nbytes);
+
+        void recordCpuDroppedLog(CpuStagingBuffer *cb, uint32_t fmtId);
+
+        uint64_t compressCpuStagingBuffers(Log::Encoder &encoder,
+                                    const std::vector<StaticLogInfo> &dictionary,
+                                    bool *wrapAround,
+                                    bool *outputBufferFull,
+                                    bool *foundUnfinishedRecord);
+
+        /**
+         * Returns the id of the CPU that the calling thread is running on.
+         * The thread may be migrated to another CPU at any time after.
+         */
+        static inline uint32_t
+        getCurrentCpu() {
+#ifdef NANOLOG_HAS_RSEQ
+            if (__rseq_size > 0) {
+                int32_t cpu = reinterpret_cast<volatile struct rseq*>(
+                            static_cast<char*>(__builtin_thread_pointer())
+                                                    + __rseq_offset)->cpu_id;
+                if (cpu >= 0)
+                    return static_cast<uint32_t>(cpu);
+            }
+#endif
+            int cpu = sched_getcpu();
+            return (cpu < 0) ? 0 : static_cast<uint32_t>(cpu);
+        }
+
+        /**
+         * Returns the per-CPU StagingBuffer of the CPU that the calling thread
+         * is running on, allocating it if necessary.
+         */
+        inline CpuStagingBuffer *
+        getCpuStagingBuffer() {
+            uint32_t index = getCurrentCpu() & (MAX_CPU_STAGING_BUFFERS - 1);
+            CpuStagingBuffer *cb =
+                    cpuStagingBuffers[index].load(std::memory_order_acquire);
+            if (cb == nullptr)
+                cb = allocCpuStagingBuffer(index);
+
+            return cb;
+        }
+
+        /**
+         * Per-CPU StagingBuffer counterpart to reserveAlloc().
+         *
+         * \param nbytes
+         *      number of bytes to allocate
+         * \param fmtId
+         *      log identifier of the message to be stored
+         *
+         * \return
+         *      pointer to the allocated space or nullptr if the message
+         *      was dropped
+         */
+        static inline char *
+        reserveCpuAlloc(size_t nbytes, uint32_t fmtId) {
+            if (cpuThreadId == 0) {
+                nanoLogSingleton.ensureInitialized();
+                cpuThreadId = nanoLogSingleton.nextBufferId++;
+            }
+
+            // Earlier drops have to be reported before the log message
+            char *writePos = nullptr;
+            if (cpuDroppedLogs.numDropped == 0) {
+                CpuStagingBuffer *cb = nanoLogSingleton.getCpuStagingBuffer();
+                writePos = cb->reserveProducerSpace(nbytes, cpuThreadId,
+                                                    &cpuReservation);
+            }
+
+            if (writePos == nullptr)
+                writePos = nanoLogSingleton.reserveCpuAllocSlow(nbytes, fmtId);
+
+            return writePos;
+        }
+
+        void unlinkRetiredBuffers();
+
+        void reclaimRetiredBuffers();
 
         /**
          * Allocates thread-local structures if they weren't already allocated.
@@ -172,49 +500,190 @@ using namespace NanoLog;
         inline void
         ensureStagingBufferAllocated() {
             if (stagingBuffer == nullptr) {
-                std::unique_lock<std::mutex> guard(bufferMutex);
-                uint32_t bufferId = nextBufferId++;
+                if (NanoLogConfig::COMPRESSION_DAEMON)
+                    stagingBuffer = reuseDrainedStagingBuffer();
 
-                // Unlocked for the expensive StagingBuffer allocation
-                guard.unlock();
-                stagingBuffer = new StagingBuffer(bufferId);
-                guard.lock();
-
-                threadBuffers.push_back(stagingBuffer);
+                if (stagingBuffer == nullptr) {
+                    stagingBuffer = allocStagingBuffer();
+                    registerStagingBuffer(stagingBuffer);
+                }
             }
         }
 
-        // Globally the thread-local stagingBuffers
-        std::vector<StagingBuffer *> threadBuffers;
+        // Head of the lock-free list (linked via
+        // StagingBuffer::nextThreadBuffer) of all the thread-local
+        // stagingBuffers. New StagingBuffers are pushed on the front by their
+        // producers and only the compression thread unlinks them. Other threads
+        // must traverse it within a ThreadBuffersReader, which keeps the
+        // unlinked StagingBuffers from being deleted underneath them.
+        std::atomic<StagingBuffer*> threadBuffers;
 
         // Stores the id for the next StagingBuffer to be allocated. The ids are
-        // unique for this execution for each StagingBuffer allocation.
-        uint32_t nextBufferId = 1;
-
-        // Protects reads and writes to threadBuffers
-        std::mutex bufferMutex;
+        // unique for this execution for each StagingBuffer allocation. With
+        // PER_CPU_STAGING_BUFFERS, they're assigned to the logging threads.
+        std::atomic<uint32_t> nextBufferId;
+
+        // Maximum number of per-CPU StagingBuffers; CPUs with higher ids share
+        // them. It must be a power of 2.
+        static constexpr uint32_t MAX_CPU_STAGING_BUFFERS = 1024;
+
+        // Per-CPU StagingBuffers indexed by CPU id; nullptr until a thread
+        // first logs on the CPU. Only used with PER_CPU_STAGING_BUFFERS.
+        std::atomic<CpuStagingBuffer*> cpuStagingBuffers[MAX_CPU_STAGING_BUFFERS];
+
+        // One past the highest index in cpuStagingBuffers that was allocated
+        std::atomic<uint32_t> numCpuStagingBuffers;
+
+        // Index in cpuStagingBuffers to resume compression from
+        uint32_t nextCpuStagingBuffer;
+
+        // Space in which the compression thread gathers the consecutive log
+        // messages of a thread in a per-CPU StagingBuffer for encoding
+        char *cpuStagingScratch;
+
+        // Incremented by the compression thread whenever it has unlinked
+        // StagingBuffers from threadBuffers that are waiting to be deleted.
+        std::atomic<uint64_t> threadBuffersEpoch;
+
+        // Number of ThreadBuffersReaders that entered during an even and
+        // an odd threadBuffersEpoch respectively. StagingBuffers unlinked
+        // before the epoch was incremented can be deleted once the count for
+        // the previous epoch drops to zero.
+        std::atomic<uint32_t> threadBuffersReaders[2];
+
+        // StagingBuffers that have been unlinked from threadBuffers, but
+        // whose deletion hasn't been scheduled yet. Only accessed by the
+        // compression thread.
+        std::vector<StagingBuffer*> retiredBuffers;
+
+        // StagingBuffers that will be deleted (or recycled) once all the
+        // ThreadBuffersReaders that entered during reclaimEpoch have exited.
+        // Only accessed by the compression thread.
+        std::vector<StagingBuffer*> reclaimingBuffers;
+
+        // Value of threadBuffersEpoch before the reclaimingBuffers were
+        // scheduled for deletion.
+        uint64_t reclaimEpoch;
+
+        // Lock-free stack (linked via StagingBuffer::nextPooled) of drained
+        // StagingBuffers of exited threads that are kept for reuse by new
+        // threads (see STAGING_BUFFER_POOL_SIZE). It's only pushed to by the
+        // compression thread once no ThreadBuffersReader can reach the
+        // StagingBuffer, so pops done within a ThreadBuffersReader can't see
+        // a StagingBuffer that was popped and pushed back in the meantime.
+        std::atomic<StagingBuffer*> bufferPool;
+
+        // Number of StagingBuffers in the bufferPool
+        std::atomic<uint32_t> numPooledBuffers;
+
+        // Metric: Number of StagingBuffers that were taken from the
+        // bufferPool and allocated anew respectively
+        std::atomic<uint64_t> bufferPoolHits;
+        std::atomic<uint64_t> bufferPoolMisses;
+
+        // Lock-free stack (linked via StagingBuffer::nextReady) of the
+        // StagingBuffers that were marked active since the compression thread
+        // last checked. It's drained by the compression thread.
+        std::atomic<StagingBuffer*> readyBuffers;
+
+        // StagingBuffers that the compression thread visits on every pass.
+        // Buffers are removed once they're empty and (re-)added when they're
+        // marked active, so idle threads don't cost anything. Only accessed by
+        // the compression thread.
+        std::vector<StagingBuffer*> activeBuffers;
+
+        // rdtsc() of when the compression thread last checked the idle
+        // StagingBuffers (see IDLE_BUFFER_SCAN_INTERVAL_US)
+        uint64_t cyclesAtLastIdleScan;
+
+        // Set once initialize() has opened the log file, allocated the output
+        // buffers and started the background threads.
+        std::atomic<bool> initialized;
+
+        // Settings that NanoLog was initialized with (see NanoLog::init()).
+        // They may only change before initialized is set. The log file, log
+        // level and overflow policy are kept elsewhere.
+        NanoLog::Config config;
+
+        // Serializes initialize() and setLogFile() calls
+        std::mutex initMutex;
 
         // Background thread that polls the various staging buffers, compresses
         // the staged log messages, and outputs it to a file.
         std::thread compressionThread;
 
-        // Indicates there's an operation in aioCb that should be waited on
-        bool hasOutstandingOperation;
-
         // Flag signaling the compressionThread to stop running. This is
         // typically only set in testing or when the application is exiting.
         bool compressionThreadShouldExit;
 
+        // Additional threads that compress the StagingBuffers' contents in
+        // parallel with the compressionThread (see numCompressionWorkers)
+        std::vector<std::thread> compressionWorkers;
+
+        // Flag signaling the compressionWorkers to stop running. It's separate
+        // from compressionThreadShouldExit since the workers keep running
+        // while the compressionThread is restarted to change log files.
+        volatile bool compressionWorkersShouldExit;
+
+        // The activeBuffers divided among the compressionWorkers by id, one
+        // WorkerShard per worker. Created before the threads are started and
+        // deleted after they're stopped.
+        std::vector<WorkerShard*> workerShards;
+
+        // Futex word that the compressionWorkers sleep on with the
+        // ADAPTIVE_BACKOFF wakeup policy once the WorkerShards are empty. The
+        // compression thread bumps it when it adds StagingBuffers to them.
+        std::atomic<uint32_t> workerDoorbell;
+
+        // Number of compressionWorkers that are (about to be) asleep on the
+        // workerDoorbell, so that it's only rung then
+        std::atomic<uint32_t> numWorkersParked;
+
+        // Sync requests are numbered in the order that they're made. Every
+        // sync requested by the time the background thread starts the second
+        // pass through the staging buffers is completed along with it, so
+        // concurrent requests are batched into one flush. Both are protected
+        // by condMutex; syncRequested is also polled without it to flush
+        // right away.
+        std::atomic<uint64_t> syncRequested;
+        uint64_t syncCompleted;
+
+        // Sequence number of the sync that the background thread is
+        // currently completing
+        uint64_t syncInProgress;
+
         // Marks the progress of flushing all log messages to disk after a user
         // invokes the sync() API. To complete the operation, the background
         // thread has to make two passes through the staging buffers and wait
-        // on the AIO to complete before waking up the user thread.
+        // on the AIO to complete before waking up the user threads. Only
+        // accessed by the background thread.
         enum {
-            SYNC_REQUESTED,         // User invoked a sync() operation
+            SYNC_IDLE,              // No sync() operation in progress
             PERFORMING_SECOND_PASS, // Background thread is making a second pass
-            WAITING_ON_AIO,         // Background thread is waiting on AIO
-            SYNC_COMPLETED          // Operation complete/no requests
-        } syncStatus;
+            WAITING_ON_AIO          // Background thread is waiting on AIO
+        } syncPhase;
+
+        // Callbacks of syncAsync() that are invoked by the background thread
+        // once the sync with the sequence number they're paired with is
+        // completed; in sequence order and protected by condMutex.
+        std::vector<std::pair<uint64_t, std::function<void()>>> syncCallbacks;
+
+        // Set by the logging threads when they log a message at
+        // config.flushLogLevel or above, which the compression thread is to
+        // flush without delay; cleared once it starts the pass that finds it.
+        std::atomic<bool> severeLogPending;
+
+        // Futex word that the compression thread sleeps on with the
+        // ADAPTIVE_BACKOFF wakeup policy; it's bumped to wake it up.
+        std::atomic<uint32_t> doorbell;
+
+        // Set while the compression thread is (about to be) asleep on the
+        // doorbell, so that the doorbell is only rung then
+        std::atomic<bool> compressionThreadParked;
+
+        // Number of PAUSE instructions that the compression thread executes
+        // between its checks for work while backing off; doubles each time.
+        uint32_t backoffPauses;
 
         // Protects the condition variables below
         std::mutex condMutex;
@@ -223,36 +692,58 @@ using namespace NanoLog;
         std::condition_variable workAdded;
 
         // Signaled when the background thread completes a sync() operation and
-        // the user thread should wake up.
+        // the user threads waiting on syncCompleted should wake up.
         std::condition_variable hintSyncCompleted;
 
-        // File handle for the output file; should only be opened once at the
-        // construction of the LogCompressor
+        // File handle for the output file; opened by initialize() and
+        // replaced by setLogFile() and rotateLogFile()
         int outputFd;
 
-        // POSIX AIO structure used to communicate async IO requests
-        struct aiocb aioCb;
+        // Name of the output file, which the rotated log files are named
+        // after. Only changes while the compressionThread isn't running.
+        std::string outputFileName;
+
+        // Performs the asynchronous writes to outputFd with the mechanism
+        // selected by config.ioBackend; created by initialize()
+        IoBackend *ioBackend;
 
-        // Used to stage the compressed log messages before passing it on to the
-        // POSIX AIO library.
+        // Offset in outputFd that the next write goes to
+        off_t outputFileOffset;
 
-        // Dynamically allocated buffer to stage compressed log message before
-        // handing it over to the POSIX AIO library for output.
+        // Offset in outputFd up to which the writes have completed
+        off_t completedFileOffset;
+
+        // Ring of config.numOutputBuffers dynamically allocated buffers to
+        // stage the compressed log messages in before handing them over to
+        // the ioBackend for output. They are filled in order; the ones
+        // preceding the compressingBuffer may still be in flight.
+        std::vector<char*> outputBuffers;
+
+        // Index in outputBuffers of the compressingBuffer
+        uint32_t compressingBufferIndex;
+
+        // Output buffer that the compressionThread is currently compressing
+        // log messages into
         char *compressingBuffer;
 
-        // Dynamically allocated double buffer that is swapped with the
-        // compressingBuffer when the latter is passed to the POSIX AIO library.
-        char *outputDoubleBuffer;
+        // Number of times an output buffer started to be filled; orders the
+        // output buffers for recovery (see Recovery::BufferHeader::sequence)
+        uint64_t outputBufferSequence;
 
         // Minimum log level that RuntimeLogger will accept. Anything lower will
         // be dropped.
         LogLevel currentLogLevel;
 
+        // Determines whether logging threads block or drop log messages when
+        // their StagingBuffer is full.
+        OverflowPolicy overflowPolicy;
+
         // Marks the rdtsc() when the current compression thread first started
         // running. A value of 0 indicates the compression thread is not running
         uint64_t cycleAtThreadStart;
 
-        // Marks the rdtsc() when the last I/O operation started
+        // Marks the rdtsc() when the disk last became busy, i.e. when a write
+        // was submitted while no others were outstanding
         uint64_t cyclesAtLastAIOStart;
 
         // Metric: Number of cycles compression thread is doing work
@@ -287,22 +778,196 @@ using namespace NanoLog;
         // Metric: Number of log statements compressed and outputted.
         uint64_t logsProcessed;
 
-        // Metric: Number of times an AIO write was completed.
+        // Metric: Number of log statements dropped by threads whose
+        // StagingBuffers have since been deallocated.
+        uint64_t logsDroppedByExitedThreads;
+
+        // Metric: Number of log statements that were compressed by blocked
+        // logging threads on behalf of the background thread (this is a
+        // subset of logsProcessed).
+        std::atomic<uint64_t> logsCompressedByProducers;
+
+        // Metric: Number of log statements that were compressed by the
+        // compressionWorkers (also a subset of logsProcessed).
+        std::atomic<uint64_t> logsCompressedByWorkers;
+
+        // Metric: Number of times an asynchronous write was completed.
         uint32_t numAioWritesCompleted;
 
+        // Metric: Number of times the log file was synced by the PERIODIC_*
+        // durability modes
+        uint32_t numPeriodicSyncs;
+
+        // Metric: Number of flushes that the background thread completed the
+        // sync() operations in (the number of operations is syncRequested)
+        uint32_t numSyncFlushes;
+
+        // Metric: Number of flushes due to log messages at
+        // config.flushLogLevel or above
+        uint32_t numSeverityFlushes;
+
+        // Metric: Number of times the compression thread slept on the
+        // doorbell, how many of those sleeps timed out, and the number of
+        // times it was rung while the compression thread was asleep
+        uint64_t numDoorbellSleeps;
+        uint64_t numDoorbellTimeouts;
+        std::atomic<uint64_t> numDoorbellRings;
+
+        // Metric: Number of times the compressionWorkers slept on the
+        // workerDoorbell
+        std::atomic<uint64_t> numWorkerDoorbellSleeps;
+
+        // Metric: Number of fallocate() invocations that reserved space for
+        // the log file and the number of bytes they reserved
+        uint32_t numFallocates;
+        uint64_t bytesFallocated;
+
+        // Metric: Number of times the log file was rotated
+        uint32_t numLogFileRotations;
+
+        // Metric: Number of bytes handed to config.outputSink and the number
+        // of times it failed to consume them
+        uint64_t sinkBytesWritten;
+        uint32_t numSinkWriteFailures;
+
         // Stores the last coreId that the background thread ran in.
         int coreId;
 
-        // Used to control access to invocationSites
-        std::mutex registrationMutex;
+        // Number of log invocation sites per InvocationSiteChunk
+        static constexpr uint32_t INVOCATION_SITES_PER_CHUNK = 256;
+
+        // Maximum number of InvocationSiteChunks, which bounds the number of
+        // distinct log invocation sites in an execution
+        static constexpr uint32_t MAX_INVOCATION_SITE_CHUNKS = 4096;
+
+        /**
+         * Fixed-size, append-only portion of the table of log invocation
+         * sites. Chunks are allocated on demand and never freed or moved, so
+         * published entries can be read without synchronization.
+         */
+        struct InvocationSiteChunk {
+            InvocationSiteChunk()
+                : published()
+                , sites()
+            {}
+
+            // Indicates that the entry in the corresponding slot of sites[]
+            // has been completely written.
+            std::atomic<bool> published[INVOCATION_SITES_PER_CHUNK];
+
+            // Raw storage for the entries since StaticLogInfo can't be
+            // default constructed.
+            std::aligned_storage<sizeof(StaticLogInfo),
+                                 alignof(StaticLogInfo)>::type
+                                            sites[INVOCATION_SITES_PER_CHUNK];
+
+            const StaticLogInfo &
+            at(uint32_t slot) {
+                return *reinterpret_cast<StaticLogInfo*>(&sites[slot]);
+            }
+
+            DISALLOW_COPY_AND_ASSIGN(InvocationSiteChunk);
+        };
 
         // Maps unique identifiers to log invocation sites encountered thus far
-        // by the non-preprocessor version of NanoLog
-        std::vector<StaticLogInfo> invocationSites;
+        // by the non-preprocessor version of NanoLog. Identifiers are claimed
+        // by incrementing numInvocationSites and the entry becomes visible to
+        // the compression thread once it's published in its chunk.
+        std::atomic<InvocationSiteChunk*>
+                                    invocationSites[MAX_INVOCATION_SITE_CHUNKS];
+
+        // Number of log invocation site identifiers assigned thus far. The
+        // most recently claimed entries may not be published yet.
+        std::atomic<uint32_t> numInvocationSites;
 
         // Indicates the index of the next invocationSite that needs to be
-        // persisted to disk.
-        uint32_t nextInvocationIndexToBePersisted;
+        // persisted to disk. The entries before it are published and are
+        // copied by producers that compress their own backlog.
+        std::atomic<uint32_t> nextInvocationIndexToBePersisted;
+
+        // Maximum number of SpillSegments that fit in the SPILL_MEMORY_LIMIT
+        static constexpr uint32_t MAX_SPILL_SEGMENTS =
+                NanoLogConfig::SPILL_MEMORY_LIMIT/
+                                        NanoLogConfig::SPILL_SEGMENT_SIZE;
+
+        // Every SpillSegment allocated thus far, indexed by SpillSegment::index.
+        // It's sized once at construction so that entries can be read without
+        // synchronization after they have been published.
+        std::vector<SpillSegment *> spillSegments;
+
+        // Number of SpillSegments allocated thus far (i.e. valid entries in
+        // spillSegments). Segments are never freed back to the OS.
+        std::atomic<uint32_t> numSpillSegments;
+
+        // Head of the lock-free stack of unused SpillSegments. The lower 32
+        // bits store the index + 1 of the top segment (0 means empty) and the
+        // upper 32 bits a counter that is incremented on every pop to
+        // prevent the ABA problem.
+        std::atomic<uint64_t> spillFreeList;
+
+        /**
+         * A compression worker's share of the activeBuffers (see
+         * compressShard()). The compression thread adds and removes the
+         * StagingBuffers along with activeBuffers, so the workers only ever
+         * look at StagingBuffers that have log messages or recently had.
+         */
+        struct WorkerShard {
+            WorkerShard()
+                : mutex()
+                , buffers()
+                , snapshot()
+            {}
+
+            // Protects buffers
+            std::mutex mutex;
+
+            // The activeBuffers whose id maps to this shard
+            std::vector<StagingBuffer*> buffers;
+
+            // Copy of the buffers of this shard (or of the one the worker
+            // steals from) that the worker compresses from, so that mutex is
+            // not held meanwhile. Only accessed by the shard's worker.
+            std::vector<StagingBuffer*> snapshot;
+
+            DISALLOW_COPY_AND_ASSIGN(WorkerShard);
+        };
+
+        /**
+         * Overflow space that the producer of a StagingBuffer continues in
+         * when the StagingBuffer's storage[] is full. A StagingBuffer may
+         * chain several segments and the consumer drains them (after the data
+         * in storage[] that precedes them) before returning to storage[], so
+         * the per-thread order of log messages is retained. Segments are
+         * recycled through a global pool that is capped at SPILL_MEMORY_LIMIT.
+         */
+        struct SpillSegment {
+            explicit SpillSegment(uint32_t index)
+                : end(nullptr)
+                , next(nullptr)
+                , index(index)
+                , nextFree(0)
+            {}
+
+            // Marks the end of valid data in storage[]. It's set by the
+            // producer once it moves on from the segment and is nullptr while
+            // the producer may still append to it.
+            char* volatile end;
+
+            // Segment the producer moved on to after this one; nullptr means
+            // it returned to the StagingBuffer. Only valid once end is set.
+            SpillSegment *next;
+
+            // Position of this segment in spillSegments
+            uint32_t index;
+
+            // Index + 1 of the segment below this one in the spillFreeList
+            uint32_t nextFree;
+
+            // Backing store for the log messages
+            char storage[NanoLogConfig::SPILL_SEGMENT_SIZE];
+
+            DISALLOW_COPY_AND_ASSIGN(SpillSegment);
+        };
 
         /**
          * Implements a circular FIFO producer/consumer byte queue that is used
@@ -322,13 +987,15 @@ using namespace NanoLog;
              * This mechanism is in place to allow the producer to initialize
              * the contents of the reservation before exposing it to the
              * consumer. This function will block behind the consumer if
-             * there's not enough space.
+             * there's not enough space, unless the overflow policy is
+             * DROP_ON_FULL.
              *
              * \param nbytes
              *      Number of bytes to allocate
              *
              * \return
-             *      Pointer to at least nbytes of contiguous space
+             *      Pointer to at least nbytes of contiguous space or nullptr
+             *      if there's not enough space and the policy is DROP_ON_FULL
              */
             inline char *
             reserveProducerSpace(size_t nbytes) {
@@ -338,8 +1005,13 @@ using namespace NanoLog;
                 if (nbytes < minFreeSpace)
                     return producerPos;
 
-                // Slow allocation
-                return reserveSpaceInternal(nbytes);
+                // Slow allocation (or out of space in a SpillSegment)
+                bool blocking =
+                        (nanoLogSingleton.overflowPolicy == BLOCK_ON_FULL);
+                if (numDroppedPending > 0)
+                    return reserveSpaceAfterDroppedLogs(nbytes, blocking);
+
+                return reserveSpaceInternal(nbytes, blocking);
             }
 
             /**
@@ -352,14 +1024,25 @@ using namespace NanoLog;
             inline void
             finishReservation(size_t nbytes) {
                 assert(nbytes < minFreeSpace);
-                assert(producerPos + nbytes <
-                       storage + NanoLogConfig::STAGING_BUFFER_SIZE);
 
                 Fence::sfence(); // Ensures producer finishes writes before bump
                 minFreeSpace -= nbytes;
                 producerPos += nbytes;
+
+                // The data in a SpillSegment isn't recoverable
+                if (NanoLogConfig::CRASH_RECOVERY_BUFFERS &&
+                        spillTail == nullptr)
+                    Recovery::getHeader(storage)->producerOffset =
+                                                        producerPos - storage;
+
+                // Hand the StagingBuffer back to the compression thread if it
+                // was marked idle
+                if (!active.load(std::memory_order_relaxed))
+                    markActive();
             }
 
+            void recordDroppedLog(uint32_t fmtId);
+
             char *peek(uint64_t *bytesAvailable);
 
             /**
@@ -373,7 +1056,36 @@ using namespace NanoLog;
             inline void
             consume(uint64_t nbytes) {
                 Fence::lfence(); // Make sure consumer reads finish before bump
-                consumerPos += nbytes;
+                if (consumerSegment != nullptr) {
+                    spillReadPos += nbytes;
+                } else {
+                    consumerPos += nbytes;
+                    if (NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+                        Recovery::getHeader(storage)->consumerOffset =
+                                                        consumerPos - storage;
+                }
+            }
+
+            /**
+             * Publishes the state of the StagingBuffer in the header of its
+             * storage[] when it's (re)assigned to a thread (see
+             * NanoLogConfig::CRASH_RECOVERY_BUFFERS).
+             */
+            void
+            initRecoveryHeader() {
+                if (!NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+                    return;
+
+                Recovery::BufferHeader *header = Recovery::getHeader(storage);
+                header->version = header->version + 1;
+                Fence::sfence();
+                header->bufferId = id;
+                header->producerOffset = producerPos - storage;
+                header->consumerOffset = consumerPos - storage;
+                header->endOffset = endOfRecordedSpace - storage;
+                header->type = Recovery::STAGING_BUFFER;
+                Fence::sfence();
+                header->version = header->version + 1;
             }
 
             /**
@@ -385,29 +1097,121 @@ using namespace NanoLog;
              */
             bool
             checkCanDelete() {
-                return shouldDeallocate && consumerPos == producerPos;
+                if (!shouldDeallocate)
+                    return false;
+
+                // The producer may have exited in the middle of a spill
+                if (consumerSegment != nullptr)
+                    return spillReadPos == producerPos;
+
+                return spillHead == nullptr && consumerPos == producerPos;
+            }
+
+            /**
+             * Returns true if the StagingBuffer may have work for the consumer
+             * or may be ready to be deleted. This is only a hint used to pick
+             * out the idle StagingBuffers worth looking at, since it's read
+             * without holding the consumerMutex.
+             */
+            bool
+            mayHaveWork() {
+                return shouldDeallocate
+                        || producerPos != consumerPos
+                        || spillHead != nullptr
+                        || consumerSegment != nullptr
+                        || assistBytesPending > 0;
             }
 
+            /**
+             * Marks the StagingBuffer active, unless it already was.
+             *
+             * \return
+             *      true if the StagingBuffer was idle before the invocation
+             */
+            bool
+            tryMarkActive() {
+                bool expected = false;
+                return active.compare_exchange_strong(expected, true);
+            }
 
             uint32_t getId() {
                 return id;
             }
 
-            StagingBuffer(uint32_t bufferId)
-                    : producerPos(storage)
-                    , endOfRecordedSpace(storage
-                                           + NanoLogConfig::STAGING_BUFFER_SIZE)
-                    , minFreeSpace(NanoLogConfig::STAGING_BUFFER_SIZE)
+            /**
+             * Returns the smallest size a StagingBuffer can grow to that
+             * holds at least nbytes (see INITIAL_STAGING_BUFFER_SIZE).
+             *
+             * \param nbytes
+             *      Number of bytes of storage desired
+             */
+            static uint32_t
+            roundUpCapacity(size_t nbytes) {
+                const NanoLog::Config &config = nanoLogSingleton.config;
+
+                // The recovery buffers don't move, since the header of the
+                // storage[] must describe all the data in it
+                if (NanoLogConfig::CRASH_RECOVERY_BUFFERS)
+                    return config.stagingBufferSize;
+
+                uint32_t capacity = config.initialStagingBufferSize;
+                while (capacity < nbytes &&
+                        capacity < config.stagingBufferSize)
+                    capacity *= 2;
+
+                return std::min(capacity, config.stagingBufferSize);
+            }
+
+            explicit StagingBuffer(uint32_t bufferId,
+                                   uint32_t initialCapacity = 0)
+                    : capacity(roundUpCapacity(initialCapacity))
+                    , numaNode(NanoLogConfig::NUMA_LOCAL_STAGING_BUFFERS
+                                            ? Util::getNumaNode() : -1)
+                    , storage(allocBuffer(capacity, numaNode))
+                    , producerPos(storage)
+                    , endOfRecordedSpace(storage + capacity)
+                    , minFreeSpace(capacity)
                     , cyclesProducerBlocked(0)
                     , numTimesProducerBlocked(0)
                     , numAllocations(0)
                     , cyclesProducerBlockedDist()
                     , cyclesIn10Ns(PerfUtils::Cycles::fromNanoseconds(10))
+                    , numDroppedPending(0)
+                    , firstDropTimestamp(0)
+                    , numDroppedSites(0)
+                    , droppedSites()
+                    , numLogsDropped(0)
+                    , spillTail(nullptr)
+                    , spillHead(nullptr)
+                    , spillRingEnd(nullptr)
+                    , numTimesSpilled(0)
+                    , numTimesAssisted(0)
+                    , numTimesResized(0)
+                    , resizedCapacity(0)
+                    , resizedStorage(nullptr)
+                    , resizeRingEnd(nullptr)
+                    , minCapacity(capacity)
+                    , idleSince(0)
+                    , active(true)
+                    , nextReady(nullptr)
+                    , nextPooled(nullptr)
+                    , prefaultedStorage(nullptr)
+                    , nextThreadBuffer(nullptr)
                     , cacheLineSpacer()
                     , consumerPos(storage)
+                    , consumerSegment(nullptr)
+                    , spillReadPos(nullptr)
+                    , consumerMutex()
+                    , assistBuffer(nullptr)
+                    , assistBufferSize(0)
+                    , assistEncoder(nullptr)
+                    , assistLogsPending(0)
+                    , assistBytesPending(0)
+                    , assistDictionary()
                     , shouldDeallocate(false)
+                    , retired(false)
                     , id(bufferId)
-                    , storage() {
+            {
                 // Empty function, but causes the C++ runtime to instantiate the
                 // sbc thread_local (see documentation in function).
                 sbc.stagingBufferCreated();
@@ -417,14 +1221,52 @@ using namespace NanoLog;
                 {
                     cyclesProducerBlockedDist[i] = 0;
                 }
+
+                initRecoveryHeader();
             }
 
             ~StagingBuffer() {
+                // The producer exited while spilling, so the segment was
+                // never closed.
+                if (consumerSegment != nullptr)
+                    nanoLogSingleton.freeSpillSegment(consumerSegment);
+
+                releaseAssistBuffer();
+                freeBuffer(resizedStorage, resizedCapacity);
+                freeBuffer(storage, capacity);
             }
 
         PRIVATE:
 
             char *reserveSpaceInternal(size_t nbytes, bool blocking = true);
+            char *reserveSpaceAfterDroppedLogs(size_t nbytes, bool blocking);
+            bool startSpill(size_t nbytes);
+            char *reserveSpillSpace(size_t nbytes, bool blocking);
+            void closeSpillSegment(SpillSegment *next);
+            bool grow(size_t nbytes);
+            bool resize(uint32_t newCapacity);
+            char *reserveResizedSpace(size_t nbytes, bool blocking);
+            bool compressOwnBacklog();
+            void markActive();
+            void recycle();
+            uint64_t compressBacklog(uint64_t *numEventsCompressed);
+            bool allocAssistBuffer();
+            void releaseAssistBuffer();
+            void trimAssistBuffer();
+
+            // Byte size of storage[]. It's only changed by the consumer when
+            // it moves onto resizedStorage, so the producer may only rely on
+            // it while resizedStorage is nullptr.
+            uint32_t capacity;
+
+            // NUMA node that storage[] was placed on, or -1 if it wasn't
+            // placed on any in particular (see NUMA_LOCAL_STAGING_BUFFERS)
+            int numaNode;
+
+            // Backing store used to implement the circular queue. It starts
+            // out at INITIAL_STAGING_BUFFER_SIZE and is replaced with a
+            // larger one when the producer runs out of space (see grow()).
+            char *storage;
 
             // Position within storage[] where the producer may place new data
             char *producerPos;
@@ -458,6 +1300,94 @@ using namespace NanoLog;
             // cyclesProducerBlockedDist distribution.
             uint64_t cyclesIn10Ns;
 
+            // Number of log messages dropped since the last DroppedLogs record
+            // was inserted into storage[]. A non-zero value causes the next
+            // reservation to insert a new record before the log message.
+            uint32_t numDroppedPending;
+
+            // rdtsc() of the first drop counted in numDroppedPending
+            uint64_t firstDropTimestamp;
+
+            // Number of valid entries in droppedSites
+            uint32_t numDroppedSites;
+
+            // Per invocation site breakdown of numDroppedPending
+            Log::DroppedLogSite droppedSites[
+                                        NanoLogConfig::MAX_DROPPED_LOG_SITES];
+
+            // Metric: Total number of log messages dropped due to lack of space
+            uint64_t numLogsDropped;
+
+            // SpillSegment that producerPos currently points into; nullptr
+            // indicates the producer is writing to storage[].
+            SpillSegment *spillTail;
+
+            // First SpillSegment of a chain started by the producer that the
+            // consumer has yet to move onto. It's set by the producer and
+            // cleared by the consumer once it's done with storage[] up to
+            // spillRingEnd. The producer only starts a new chain once the
+            // previous one has been picked up.
+            SpillSegment* volatile spillHead;
+
+            // Position of the producer in storage[] when it started spilling
+            // to spillHead. The data in storage[] up to this point precedes
+            // the SpillSegments.
+            char* volatile spillRingEnd;
+
+            // Metric: Number of times the producer started spilling
+            uint32_t numTimesSpilled;
+
+            // Metric: Number of times the producer compressed its own backlog
+            // rather than waiting on the background thread
+            uint32_t numTimesAssisted;
+
+            // Metric: Number of times the producer moved onto a resized
+            // storage[]
+            uint32_t numTimesResized;
+
+            // Byte size of resizedStorage
+            uint32_t resizedCapacity;
+
+            // Replacement for storage[] that the producer has moved onto
+            // after resizing the StagingBuffer; nullptr if there's none. The
+            // consumer drains storage[] up to resizeRingEnd, frees it and then
+            // continues in resizedStorage, clearing this to let the producer
+            // know that it may wrap around in the new storage[].
+            char* volatile resizedStorage;
+
+            // Position of the producer in storage[] when it moved onto
+            // resizedStorage
+            char* volatile resizeRingEnd;
+
+            // Size below which the StagingBuffer won't shrink when it's idle,
+            // as requested by NanoLog::preallocate(size_t)
+            uint32_t minCapacity;
+
+            // rdtsc() of when the compression thread last marked this
+            // StagingBuffer idle. Used by the producer to tell if it has been
+            // idle for long enough to shrink.
+            uint64_t idleSince;
+
+            // Indicates that the compression thread visits this StagingBuffer
+            // on every pass (i.e. it's in activeBuffers or readyBuffers). It's
+            // cleared by the compression thread when it finds the buffer empty
+            // and set again by the producer on its next finishReservation().
+            // StagingBuffers start out active since they are handed to the
+            // compression thread on registration.
+            std::atomic<bool> active;
+
+            // Next StagingBuffer in the readyBuffers stack
+            StagingBuffer *nextReady;
+
+            // Next StagingBuffer in the bufferPool stack
+            StagingBuffer *nextPooled;
+
+            // The storage[] whose pages have all been faulted in by recycle()
+            char *prefaultedStorage;
+
+            // Next StagingBuffer in the threadBuffers list
+            std::atomic<StagingBuffer*> nextThreadBuffer;
+
             // An extra cache-line to separate the variables that are primarily
             // updated/read by the producer (above) from the ones by the
             // consumer(below)
@@ -467,25 +1397,281 @@ using namespace NanoLog;
             // the next bytes from. This value is only updated by the consumer.
             char* volatile consumerPos;
 
+            // SpillSegment that the consumer is currently draining; nullptr
+            // indicates it's consuming from storage[]. Only used by the
+            // consumer.
+            SpillSegment *consumerSegment;
+
+            // Position within consumerSegment where the consumer will consume
+            // the next bytes from.
+            char *spillReadPos;
+
+            // Held by whoever is acting as the consumer of this StagingBuffer
+            // (i.e. invoking peek()/consume()). This is normally the
+            // background thread, but a compression worker or a blocked
+            // producer may take it over to compress the backlog (see
+            // compressBacklog()). No one waits on it; the work is skipped if
+            // it's already held.
+            std::mutex consumerMutex;
+
+            // Scratch space the producer compresses its own backlog into. It's
+            // allocated on the first assist, sized after storage[] (see
+            // allocAssistBuffer()) and protected by consumerMutex.
+            char *assistBuffer;
+
+            // Byte size of assistBuffer; 0 if it's not allocated
+            uint32_t assistBufferSize;
+
+            // Encodes into assistBuffer. The background thread appends the
+            // encoded BufferExtents to its output and resets it.
+            Log::Encoder *assistEncoder;
+
+            // Number of log messages encoded into assistBuffer that have yet
+            // to be handed off to the background thread
+            uint64_t assistLogsPending;
+
+            // Number of bytes consumed from this StagingBuffer to produce
+            // the contents of assistBuffer
+            uint64_t assistBytesPending;
+
+            // Copy of the log invocation sites that have been persisted by the
+            // background thread. Only these may be compressed by the producer
+            // since the dictionary entries must precede their log messages in
+            // the output. Unused in the preprocessor version of NanoLog.
+            std::vector<StaticLogInfo> assistDictionary;
+
             // Indicates that the thread owning this StagingBuffer has been
             // destructed (i.e. no more messages will be logged to it) and thus
             // should be cleaned up once the buffer has been emptied by the
             // compression thread.
             bool shouldDeallocate;
 
+            // Indicates that the compression thread is done with this
+            // StagingBuffer and will unlink it from threadBuffers. Only
+            // accessed by the compression thread.
+            bool retired;
+
             // Uniquely identifies this StagingBuffer for this execution. It's
             // similar to ThreadId, but is only assigned to threads that NANO_LOG).
             uint32_t id;
 
-            // Backing store used to implement the circular queue
-            char storage[NanoLogConfig::STAGING_BUFFER_SIZE];
-
             friend RuntimeLogger;
             friend StagingBufferDestroyer;
 
             DISALLOW_COPY_AND_ASSIGN(StagingBuffer);
         };
 
+        /**
+         * StagingBuffer shared by all the logging threads running on a CPU
+         * (see NanoLogConfig::PER_CPU_STAGING_BUFFERS). It's a circular queue
+         * of records, each holding the log message of one thread. Since the
+         * threads may be preempted or migrated to another CPU at any time,
+         * they reserve records with an atomic compare-and-swap and then
+         * commit them individually. The consumer stops at the first record
+         * that hasn't been committed yet.
+         *
+         * Consequently, a thread that is preempted between reserving its
+         * record and committing it (i.e. in the middle of a NANO_LOG() call)
+         * holds up the consumption of the records after it until it runs
+         * again. Only the one CpuStagingBuffer is held up and none of its
+         * records are lost, but it may fill up in the meantime, in which case
+         * the other threads on the CPU block or drop their log messages per
+         * the OverflowPolicy.
+         */
+        class CpuStagingBuffer {
+        public:
+            /**
+             * Reserves space for a log message in a new record. The record
+             * is invisible to the consumer until it's committed with
+             * finishReservation().
+             *
+             * \param nbytes
+             *      Number of bytes to reserve for the log message
+             * \param threadId
+             *      Identifies the logging thread in the compressed log
+             * \param[out] reservation
+             *      Set to the record reserved, to pass to finishReservation()
+             *
+             * \return
+             *      Pointer to the space reserved or nullptr if there isn't
+             *      enough free space
+             */
+            inline char *
+            reserveProducerSpace(size_t nbytes, uint32_t threadId,
+                                 char **reservation)
+            {
+                uint64_t size = getRecordSize(nbytes);
+                uint64_t pos = producerPos.load(std::memory_order_relaxed);
+                uint64_t padding, newProducerPos;
+                do {
+                    // Records don't wrap around; the unusable space at the
+                    // end of storage is reserved as a padding record.
+                    uint64_t offset = pos & (capacity - 1);
+                    padding = 0;
+                    if (offset + size > capacity)
+                        padding = capacity - offset;
+
+                    newProducerPos = pos + padding + size;
+                    if (newProducerPos - consumerPos.load(
+                                    std::memory_order_acquire) > capacity)
+                        return nullptr;
+                } while (!producerPos.compare_exchange_weak(pos,
+                                    newProducerPos, std::memory_order_relaxed));
+
+                if (padding > 0) {
+                    RecordHeader *header = getRecord(pos);
+                    header->threadId = PADDING_THREAD_ID;
+                    header->size.store(downCast<uint32_t>(padding),
+                                       std::memory_order_release);
+                }
+
+                RecordHeader *header = getRecord(pos + padding);
+                header->threadId = threadId;
+                *reservation = reinterpret_cast<char*>(header);
+                return reinterpret_cast<char*>(header + 1);
+            }
+
+            /**
+             * Makes a record reserved with reserveProducerSpace() visible
+             * to the consumer.
+             *
+             * \param reservation
+             *      Record returned by reserveProducerSpace()
+             * \param nbytes
+             *      Number of bytes reserved for the log message
+             */
+            static inline void
+            finishReservation(char *reservation, size_t nbytes) {
+                reinterpret_cast<RecordHeader*>(reservation)->size.store(
+                                    downCast<uint32_t>(getRecordSize(nbytes)),
+                                    std::memory_order_release);
+            }
+
+        PRIVATE:
+            /**
+             * Precedes every log message in storage.
+             */
+            struct RecordHeader {
+                // Byte size of the record including this header; 0 means the
+                // record hasn't been committed by its producer yet.
+                std::atomic<uint32_t> size;
+
+                // Id of the thread that logged the record's message or
+                // PADDING_THREAD_ID if it's padding at the end of storage
+                uint32_t threadId;
+            };
+
+            // threadId of the records that only pad out storage
+            static constexpr uint32_t PADDING_THREAD_ID = 0;
+
+            CpuStagingBuffer(uint32_t cpu, uint32_t capacity)
+                : cpu(cpu)
+                , capacity(capacity)
+                , storage(allocBuffer(capacity))
+                , producerPos(0)
+                , cacheLineSpacer()
+                , consumerPos(0)
+                , numLogsDropped(0)
+            {
+            }
+
+            ~CpuStagingBuffer() {
+                freeBuffer(storage, capacity);
+            }
+
+            /**
+             * Returns the number of bytes taken by the record of a log message.
+             * Records are kept aligned for their headers.
+             *
+             * \param nbytes
+             *      Size of the log message
+             */
+            static inline uint64_t
+            getRecordSize(size_t nbytes) {
+                return (sizeof(RecordHeader) + nbytes + 7) & ~7UL;
+            }
+
+            /**
+             * Returns the record at a position in the queue.
+             *
+             * \param pos
+             *      Number of bytes that were reserved before the record
+             */
+            inline RecordHeader *
+            getRecord(uint64_t pos) {
+                return reinterpret_cast<RecordHeader*>(storage +
+                                                    (pos & (capacity - 1)));
+            }
+
+            void release(uint64_t pos);
+
+            // CPU that the StagingBuffer was allocated for
+            const uint32_t cpu;
+
+            // Byte size of storage; a power of 2
+            const uint32_t capacity;
+
+            // Backing store for the records (allocated with allocBuffer()).
+            // Released space is zeroed so that the headers of new records
+            // read as uncommitted.
+            char *const storage;
+
+            // Total number of bytes reserved by the producers
+            std::atomic<uint64_t> producerPos;
+
+            // An extra cache-line to separate the producer and consumer
+            // variables to prevent false sharing.
+            char cacheLineSpacer[2*Util::BYTES_PER_CACHE_LINE];
+
+            // Total number of bytes released by the consumer. The records
+            // between it and producerPos may not all be committed yet.
+            std::atomic<uint64_t> consumerPos;
+
+            // Number of log messages that were dropped because the
+            // StagingBuffer was full
+            std::atomic<uint64_t> numLogsDropped;
+
+            friend RuntimeLogger;
+
+            DISALLOW_COPY_AND_ASSIGN(CpuStagingBuffer);
+        };
+
+        // Allows a thread other than the compression thread to traverse the
+        // threadBuffers and access the StagingBuffers in it for the lifetime
+        // of the object. The compression thread won't delete any StagingBuffer
+        // it has unlinked from threadBuffers until all the readers that could
+        // have seen it are destroyed. Readers don't block each other or the
+        // compression thread, but they should be short-lived since they hold
+        // up the reclamation of StagingBuffers.
+        class ThreadBuffersReader {
+        public:
+            explicit ThreadBuffersReader(RuntimeLogger &logger)
+                : readers(nullptr)
+            {
+                // Retry if the epoch advanced before we were counted, since
+                // the compression thread may not be waiting on us then.
+                while (true) {
+                    uint64_t epoch = logger.threadBuffersEpoch.load();
+                    readers = &logger.threadBuffersReaders[epoch & 1];
+                    readers->fetch_add(1);
+                    if (logger.threadBuffersEpoch.load() == epoch)
+                        break;
+
+                    readers->fetch_sub(1);
+                }
+            }
+
+            ~ThreadBuffersReader() {
+                readers->fetch_sub(1);
+            }
+
+        PRIVATE:
+            // Counter in threadBuffersReaders this reader is accounted in
+            std::atomic<uint32_t> *readers;
+
+            DISALLOW_COPY_AND_ASSIGN(ThreadBuffersReader);
+        };
+
         // This class is intended to be instantiated as a C++ thread_local to
         // synchronize marking the thread local stagingBuffer for deletion with
         // thread death.
@@ -511,7 +1697,15 @@ using namespace NanoLog;
 
             virtual ~StagingBufferDestroyer() {
                 if (stagingBuffer != nullptr) {
+                    // Best effort attempt to report the last drops (if any)
+                    if (stagingBuffer->numDroppedPending > 0)
+                        stagingBuffer->reserveSpaceAfterDroppedLogs(0, false);
+
+                    // The compression thread may retire the StagingBuffer
+                    // as soon as it's marked for deallocation.
+                    ThreadBuffersReader reader(nanoLogSingleton);
                     stagingBuffer->shouldDeallocate = true;
+                    stagingBuffer->markActive();
                     stagingBuffer = nullptr;
                 }
             }
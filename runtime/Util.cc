@@ -16,8 +16,11 @@
 #include <sstream>
 
 #include "Util.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <string>
 
 #include "Portability.h"
@@ -114,6 +117,149 @@ hexDump(const void *buf, uint64_t bytes)
     return output.str();
 }
 
+/**
+ * Returns the number of bytes allocBuffer() maps for a buffer of the given
+ * size, i.e. the size rounded up to a whole number of pages.
+ */
+static size_t
+getMappingSize(size_t bytes, bool hugePages)
+{
+    size_t pageSize = (hugePages && bytes >= HUGE_PAGE_SIZE) ? HUGE_PAGE_SIZE
+                                                             : 4096;
+    return (bytes + pageSize - 1) & ~(pageSize - 1);
+}
+
+/**
+ * Allocates page-aligned memory for one of NanoLog's large buffers directly
+ * from the kernel, which gives control over how it's backed. The memory
+ * must be released with freeBuffer() and is zero-filled.
+ *
+ * \param bytes
+ *      Size of the buffer
+ * \param hugePages
+ *      Back the buffer with 2 MB huge pages to reduce TLB misses. Buffers of
+ *      at least HUGE_PAGE_SIZE are rounded up to a multiple of it and placed
+ *      in explicit huge pages (MAP_HUGETLB) if the system has any reserved;
+ *      otherwise transparent huge pages are requested with madvise().
+ * \param prefault
+ *      Fault in all the pages of the buffer before returning, so that the
+ *      first writes to it don't take page faults.
+ * \param lock
+ *      Lock the buffer in memory so that it's never paged out. This is best
+ *      effort; a failure (e.g. due to RLIMIT_MEMLOCK) is reported once.
+ * \param numaNode
+ *      NUMA node to place the buffer's pages on, or -1 for the default
+ *      (first touch) policy.
+ *
+ * \return
+ *      The buffer, or nullptr if the memory could not be mapped.
+ */
+void *
+allocBuffer(size_t bytes, bool hugePages, bool prefault, bool lock,
+            int numaNode)
+{
+    size_t length = getMappingSize(bytes, hugePages);
+    void *buffer = MAP_FAILED;
+
+    if (hugePages && bytes >= HUGE_PAGE_SIZE)
+        buffer = mmap(nullptr, length, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+
+    if (buffer == MAP_FAILED) {
+        buffer = mmap(nullptr, length, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+            return nullptr;
+
+        if (hugePages)
+            madvise(buffer, length, MADV_HUGEPAGE);
+    }
+
+    // The policy has to be set before the pages are faulted in
+    if (numaNode >= 0)
+        bindToNumaNode(buffer, length, numaNode);
+
+    if (prefault) {
+        char *pages = static_cast<char*>(buffer);
+        for (size_t offset = 0; offset < length; offset += 4096)
+            pages[offset] = 0;
+    }
+
+    if (lock && mlock(buffer, length) != 0) {
+        static bool warned = false;
+        if (!warned) {
+            warned = true;
+            fprintf(stderr, "NanoLog could not lock its buffers in memory "
+                            "(%s); continuing without.\r\n", strerror(errno));
+        }
+    }
+
+    return buffer;
+}
+
+/**
+ * Releases a buffer allocated with allocBuffer().
+ *
+ * \param buffer
+ *      Buffer returned by allocBuffer(); nullptr is ignored
+ * \param bytes
+ *      Size the buffer was allocated with
+ * \param hugePages
+ *      Value of hugePages the buffer was allocated with
+ */
+void
+freeBuffer(void *buffer, size_t bytes, bool hugePages)
+{
+    if (buffer != nullptr)
+        munmap(buffer, getMappingSize(bytes, hugePages));
+}
+
+/**
+ * Sets the NUMA memory policy of a page-aligned range of memory so that its
+ * pages are preferably placed on the given node. This uses the mbind system
+ * call directly rather than depending on libnuma, and does nothing on
+ * systems without NUMA support.
+ *
+ * \param buffer
+ *      Start of the range; must be page-aligned
+ * \param bytes
+ *      Length of the range
+ * \param numaNode
+ *      Node to place the pages on
+ * \param move
+ *      Also migrate the pages of the range that were already faulted in on
+ *      other nodes
+ */
+void
+bindToNumaNode(void *buffer, size_t bytes, int numaNode, bool move)
+{
+    // Values from <numaif.h>
+    const int MPOL_PREFERRED = 1;
+    const unsigned MPOL_MF_MOVE = 1 << 1;
+
+    unsigned long nodeMask[16] = {};
+    const int bitsPerWord = 8*sizeof(nodeMask[0]);
+    if (numaNode < 0 || numaNode >= 16*bitsPerWord)
+        return;
+
+    nodeMask[numaNode/bitsPerWord] = 1UL << (numaNode % bitsPerWord);
+    syscall(SYS_mbind, buffer, bytes, MPOL_PREFERRED, nodeMask,
+            16*bitsPerWord, move ? MPOL_MF_MOVE : 0);
+}
+
+/**
+ * Returns the NUMA node of the CPU that the calling thread is running on,
+ * or -1 if it can't be determined.
+ */
+int
+getNumaNode()
+{
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+        return -1;
+
+    return static_cast<int>(node);
+}
 
 } // namespace Util
 } // namespace NanoLogInternal
@@ -41,6 +41,16 @@ namespace Util {
 
 std::string hexDump(const void *buffer, uint64_t bytes);
 
+// Size of the huge pages that allocBuffer() backs large buffers with
+static const size_t HUGE_PAGE_SIZE = 2*1024*1024;
+
+void *allocBuffer(size_t bytes, bool hugePages = false, bool prefault = false,
+                  bool lock = false, int numaNode = -1);
+void freeBuffer(void *buffer, size_t bytes, bool hugePages = false);
+void bindToNumaNode(void *buffer, size_t bytes, int numaNode,
+                    bool move = false);
+int getNumaNode();
+
 /* Doxygen is stupid and cannot distinguish between attributes and arguments. */
 #define FORCE_INLINE NANOLOG_ALWAYS_INLINE
 